@@ -0,0 +1,816 @@
+//////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// File: CPUSilhouetteFinding.cpp
+//
+// Author: Ren Yifei, yfren@cs.hku.hk
+//
+// Desc: Multithreaded CPU backend for machines without a CUDA device
+//
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "CPUSilhouetteFinding.h"
+#include "CUDADataStructure.h"
+#include "SilhouetteCommon.h"
+#include "TriangleBVH.h"
+#include "SIMDSilhouetteClassifier.h"
+#include "CPUTaskQueue.h"
+
+//Ranges handed to one thread at a time by the compaction
+const int g_COMPACT_CHUNK_SIZE = 64;
+
+int	h_cpuMaxFlagNum = 0;
+int h_cpuMaxEdgeNum = 0;
+int h_cpuMaxRangeNum = 0;
+int h_cpuMaxChunkNum = 0;
+int h_cpuMaxObjNum = 0;
+int h_cpuMaxVertexNum = 0;
+
+int h_cpuObjNum = 0;
+
+//Objects of the current batch, used in place
+BatchObject*	h_cpuObjects = NULL;
+
+//First scene edge of every object, the numbering the packed list hands out
+int*			h_cpuEdgeBase = NULL;
+
+//Vertex cache of the frame: every vertex of every object in view space, transformed once at the
+//start of a pass. Object after object, objNum + 1 starts.
+D3DXVECTOR3*	h_cpuViewVertex = NULL;
+int*			h_cpuObjVertexStart = NULL;
+
+//Per object starts, objNum + 1 each: tracked silhouettes, candidates in the cull input, visible strokes
+int*			h_cpuObjTrackedStart = NULL;
+int*			h_cpuObjSilStart = NULL;
+int*			h_cpuObjStrokeStart = NULL;
+
+//Copies of the submitted ranges and tracked edges, the caller may reuse its own right away
+EdgeRange*		h_cpuEdgeRanges = NULL;
+TrackedEdge*	h_cpuTrackedEdges = NULL;
+
+//Last task of each kind, the next one of that kind refills its staging
+StageTicket		h_cpuLastPass = 0;
+StageTicket		h_cpuLastStage = 0;
+
+SilhouetteISA	h_cpuISA = SIL_ISA_SCALAR;
+bool			h_cpuISADetected = false;
+
+D3DXMATRIX		h_cpuMatrixProj;
+
+//Scene depth of the frame, for the objects using the depth buffer visibility mode
+HiZPyramid		h_cpuHiZ;
+
+//Instance hierarchy of the frame, no nodes when the objects only hide their own strokes. The
+//matrices and eyes of all objects side by side for the scene wide test.
+InstanceBVH		h_cpuInstanceBVH;
+D3DXMATRIX*		h_cpuViewWorld = NULL;
+D3DXVECTOR3*	h_cpuEyePos = NULL;
+
+//Cull input: detected and tracked silhouettes of every object together, object after object.
+//The view space end points come out of the vertex cache.
+D3DXVECTOR3*	h_cpuCandidateSilhouetteVertex = NULL;
+D3DXVECTOR3*	h_cpuCandidateSilhouetteNormal = NULL;
+D3DXVECTOR3*	h_cpuCandidateSilhouetteViewVertex = NULL;
+
+//Scene edge of every candidate, the key of the amortized ray test
+int*			h_cpuCandidateEdge = NULL;
+
+//Amortized ray test: the result per scene edge, and the marks per scene vertex of the last pass and
+//of this one, the two halves taking turns, with the pass each half was written in. A pass number is
+//skipped whenever the scene edges or the refresh period change, which leaves no result and no marks
+//current.
+EdgeVisibility*	h_cpuEdgeVisibility = NULL;
+int*			h_cpuVertexMark = NULL;
+int				h_cpuVertexMarkPass[2] = { -1, -1 };
+int				h_cpuVisibilityPass = 1;
+int				h_cpuRefreshPeriod = 1;
+int				h_cpuRetestLimit = 0;
+
+//What every candidate gets in the pass, see chooseVisibilityTests, and the candidates per priority
+int*			h_cpuVisibilityTest = NULL;
+int*			h_cpuPriorityNum = NULL;
+int				h_cpuMaxPriorityNum = 0;
+MeshEdge**		h_cpuObjEdges = NULL;
+
+//Same double role as d_isSilhouette: silhouette flags per range slot, then visibility per silhouette
+bool*			h_cpuIsSilhouette = NULL;
+
+//Packed detection result, one bit per range slot
+unsigned int*	h_cpuSilhouetteMask = NULL;
+
+//Silhouettes found in each chunk of ranges, then where the chunk starts in the packed list
+int*			h_cpuChunkOffsets = NULL;
+
+//Packed silhouette list, same layout as on the device
+D3DXVECTOR3*	h_cpuSilVertex = NULL;
+D3DXVECTOR3*	h_cpuSilNormal = NULL;
+int*			h_cpuSilEdgeIdx = NULL;
+int*			h_cpuSilObj = NULL;
+
+//Where every visible candidate goes in the stroke list
+int*			h_cpuStrokeIdx = NULL;
+
+//Visible strokes, object after object: end points, normals and projected end points
+D3DXVECTOR3*	h_cpuStrokeVertex = NULL;
+D3DXVECTOR3*	h_cpuStrokeNormal = NULL;
+D3DXVECTOR3*	h_cpuStrokeProj = NULL;
+
+bool cpuInitialization( int flagNum )
+{
+	if(!h_cpuISADetected)
+	{
+		h_cpuISA = detectSilhouetteISA();
+		h_cpuISADetected = true;
+	}
+
+	if(flagNum > h_cpuMaxFlagNum)
+	{
+		h_cpuMaxFlagNum = flagNum;
+
+		delete [] h_cpuIsSilhouette;
+		delete [] h_cpuSilhouetteMask;
+
+		h_cpuIsSilhouette = new bool[flagNum];
+		h_cpuSilhouetteMask = new unsigned int[(flagNum + 31) / 32];
+	}
+
+	return true;
+}
+
+bool cpuCompactInit( int edgeNum, int maxRangeNum )
+{
+	if(edgeNum > h_cpuMaxEdgeNum)
+	{
+		h_cpuMaxEdgeNum = edgeNum;
+
+		delete [] h_cpuSilVertex;
+		delete [] h_cpuSilNormal;
+		delete [] h_cpuSilEdgeIdx;
+		delete [] h_cpuSilObj;
+		delete [] h_cpuTrackedEdges;
+		delete [] h_cpuCandidateSilhouetteVertex;
+		delete [] h_cpuCandidateSilhouetteNormal;
+		delete [] h_cpuCandidateSilhouetteViewVertex;
+		delete [] h_cpuCandidateEdge;
+		delete [] h_cpuEdgeVisibility;
+		delete [] h_cpuVisibilityTest;
+		delete [] h_cpuStrokeIdx;
+		delete [] h_cpuStrokeVertex;
+		delete [] h_cpuStrokeNormal;
+		delete [] h_cpuStrokeProj;
+
+		//none of the silhouette lists ever outgrows the edge table
+		h_cpuSilVertex	= new D3DXVECTOR3[edgeNum * 2];
+		h_cpuSilNormal	= new D3DXVECTOR3[edgeNum * 2];
+		h_cpuSilEdgeIdx	= new int[edgeNum];
+		h_cpuSilObj		= new int[edgeNum];
+
+		h_cpuTrackedEdges = new TrackedEdge[edgeNum];
+
+		h_cpuCandidateSilhouetteVertex = new D3DXVECTOR3[edgeNum * 2];
+		h_cpuCandidateSilhouetteNormal = new D3DXVECTOR3[edgeNum * 2];
+		h_cpuCandidateSilhouetteViewVertex = new D3DXVECTOR3[edgeNum * 2];
+		h_cpuCandidateEdge = new int[edgeNum];
+
+		//No pass is -1, nothing cached yet
+		h_cpuEdgeVisibility = new EdgeVisibility[edgeNum];
+		memset(h_cpuEdgeVisibility, 0xFF, edgeNum * sizeof(EdgeVisibility));
+
+		h_cpuVisibilityTest = new int[edgeNum];
+
+		h_cpuStrokeIdx		= new int[edgeNum];
+		h_cpuStrokeVertex	= new D3DXVECTOR3[edgeNum * 2];
+		h_cpuStrokeNormal	= new D3DXVECTOR3[edgeNum * 2];
+		h_cpuStrokeProj		= new D3DXVECTOR3[edgeNum * 2];
+	}
+
+	if(maxRangeNum > h_cpuMaxRangeNum)
+	{
+		h_cpuMaxRangeNum = maxRangeNum;
+
+		delete [] h_cpuEdgeRanges;
+
+		h_cpuEdgeRanges = new EdgeRange[maxRangeNum];
+	}
+
+	int chunkNum = (maxRangeNum + g_COMPACT_CHUNK_SIZE - 1) / g_COMPACT_CHUNK_SIZE;
+
+	if(chunkNum > h_cpuMaxChunkNum)
+	{
+		h_cpuMaxChunkNum = chunkNum;
+
+		delete [] h_cpuChunkOffsets;
+
+		h_cpuChunkOffsets = new int[chunkNum];
+	}
+
+	return true;
+}
+
+bool cpuObjectInit( int objNum )
+{
+	if(objNum > h_cpuMaxObjNum)
+	{
+		h_cpuMaxObjNum = objNum;
+
+		delete [] h_cpuEdgeBase;
+		delete [] h_cpuObjTrackedStart;
+		delete [] h_cpuObjSilStart;
+		delete [] h_cpuObjStrokeStart;
+		delete [] h_cpuObjVertexStart;
+		delete [] h_cpuViewWorld;
+		delete [] h_cpuEyePos;
+		delete [] h_cpuObjEdges;
+
+		h_cpuEdgeBase			= new int[objNum];
+		h_cpuObjTrackedStart	= new int[objNum + 1];
+		h_cpuObjSilStart		= new int[objNum + 1];
+		h_cpuObjStrokeStart		= new int[objNum + 1];
+		h_cpuObjVertexStart		= new int[objNum + 1];
+
+		h_cpuViewWorld	= new D3DXMATRIX[objNum];
+		h_cpuEyePos		= new D3DXVECTOR3[objNum];
+
+		h_cpuObjEdges = new MeshEdge*[objNum];
+		memset(h_cpuObjEdges, 0, objNum * sizeof(MeshEdge*));
+	}
+
+	return true;
+}
+
+bool cpuVertexCacheInit( int vertexNum )
+{
+	if(vertexNum > h_cpuMaxVertexNum)
+	{
+		h_cpuMaxVertexNum = vertexNum;
+
+		delete [] h_cpuViewVertex;
+		delete [] h_cpuVertexMark;
+
+		h_cpuViewVertex = new D3DXVECTOR3[vertexNum];
+
+		h_cpuVertexMark = new int[vertexNum * 2];
+		memset(h_cpuVertexMark, 0, vertexNum * 2 * sizeof(int));
+	}
+
+	return true;
+}
+
+bool cpuPassData( BatchObject* h_objects, int objNum, D3DXMATRIX* h_matrixProj, const HiZPyramid* h_hiz, const InstanceBVH* h_instanceBVH,
+				  int visibilityRefreshPeriod, int visibilityRetestLimit )
+{
+	//The buffers below may be reallocated, nothing can be running on them
+	cpuWaitTask(h_cpuLastStage);
+
+	if(!cpuObjectInit(objNum))
+		return false;
+
+	int edgeNum = 0;
+	int maxRangeNum = 0;
+
+	int vertexNum = 0;
+
+	for(int i=0; i<objNum; ++i)
+	{
+		h_cpuEdgeBase[i] = edgeNum;
+		h_cpuObjVertexStart[i] = vertexNum;
+
+		edgeNum		+= h_objects[i].edgeNum;
+		maxRangeNum	+= h_objects[i].maxRangeNum;
+		vertexNum	+= h_objects[i].vertexNum;
+	}
+
+	h_cpuObjVertexStart[objNum] = vertexNum;
+
+	if(!cpuInitialization(maxRangeNum * g_EDGE_CLUSTER_SIZE))
+		return false;
+
+	if(!cpuCompactInit(edgeNum, maxRangeNum))
+		return false;
+
+	if(!cpuVertexCacheInit(vertexNum))
+		return false;
+
+	//Cached ray tests stay valid as long as the scene edges keep their numbers
+	bool isSameScene = objNum == h_cpuObjNum && visibilityRefreshPeriod == h_cpuRefreshPeriod;
+
+	for(int i=0; i<objNum; ++i)
+	{
+		isSameScene = isSameScene && h_cpuObjEdges[i] == h_objects[i].edges;
+
+		h_cpuObjEdges[i] = h_objects[i].edges;
+	}
+
+	if(!isSameScene)
+		++h_cpuVisibilityPass;
+
+	h_cpuRefreshPeriod = visibilityRefreshPeriod;
+	h_cpuRetestLimit = visibilityRetestLimit;
+
+	int priorityNum = visibilityPriorityNum(visibilityRefreshPeriod);
+
+	if(priorityNum > h_cpuMaxPriorityNum)
+	{
+		h_cpuMaxPriorityNum = priorityNum;
+
+		delete [] h_cpuPriorityNum;
+
+		h_cpuPriorityNum = new int[priorityNum];
+	}
+
+	h_cpuObjects	= h_objects;
+	h_cpuObjNum		= objNum;
+
+	h_cpuMatrixProj = *h_matrixProj;
+
+	if(h_hiz)
+		h_cpuHiZ = *h_hiz;
+	else
+		memset(&h_cpuHiZ, 0, sizeof(HiZPyramid));
+
+	if(h_instanceBVH)
+		h_cpuInstanceBVH = *h_instanceBVH;
+	else
+		memset(&h_cpuInstanceBVH, 0, sizeof(InstanceBVH));
+
+	for(int i=0; i<objNum; ++i)
+	{
+		h_cpuViewWorld[i]	= h_objects[i].viewWorld;
+		h_cpuEyePos[i]		= h_objects[i].eyePos;
+	}
+
+	return true;
+}
+
+//Kernels, run on the worker thread
+
+//Marks of the amortized ray test written in this pass
+static int* currentVertexMark()
+{
+	return h_cpuVertexMark + (h_cpuVisibilityPass & 1) * h_cpuMaxVertexNum;
+}
+
+//Marks of the last pass, NULL unless they were written in it: after a skipped pass number the half
+//holds marks from before, maybe of other vertex numbers
+static const int* lastVertexMark()
+{
+	int half = (h_cpuVisibilityPass + 1) & 1;
+
+	if(h_cpuVertexMarkPass[half] != h_cpuVisibilityPass - 1)
+		return NULL;
+
+	return h_cpuVertexMark + half * h_cpuMaxVertexNum;
+}
+
+//Fills the vertex cache, every vertex transformed a single time for all the stages after it. The
+//marks of the pass are cleared on the way.
+static void transformVertices()
+{
+	int* vertexMark = h_cpuRefreshPeriod > 1 ? currentVertexMark() : NULL;
+
+	if(vertexMark)
+		h_cpuVertexMarkPass[h_cpuVisibilityPass & 1] = h_cpuVisibilityPass;
+
+	#pragma omp parallel
+	for(int i=0; i<h_cpuObjNum; ++i)
+	{
+		const BatchObject& obj = h_cpuObjects[i];
+		D3DXVECTOR3* viewVertex = h_cpuViewVertex + h_cpuObjVertexStart[i];
+
+		#pragma omp for schedule(static) nowait
+		for(int v=0; v<obj.vertexNum; ++v)
+		{
+			viewVertex[v] = viewTransformElement(obj.vertices[v], &obj.worldView);
+
+			if(vertexMark)
+				vertexMark[h_cpuObjVertexStart[i] + v] = 0;
+		}
+	}
+}
+
+static void detectSilhouettes( int rangeNum )
+{
+	//A range slot spans a whole number of mask words, so threads never share one
+	const int maskWordNum = g_EDGE_CLUSTER_SIZE / 32;
+
+	#pragma omp parallel for schedule(static)
+	for(int rangeIdx=0; rangeIdx<rangeNum; ++rangeIdx)
+	{
+		const EdgeRange& range = h_cpuEdgeRanges[rangeIdx];
+
+		unsigned int* mask = h_cpuSilhouetteMask + rangeIdx * maskWordNum;
+
+		//classifySilhouettes does not touch the words past the end of a short range
+		for(int word=0; word<maskWordNum; ++word)
+			mask[word] = 0;
+
+		const BatchObject& obj = h_cpuObjects[range.objIdx];
+
+		classifySilhouettes(h_cpuISA, obj.soa, obj.eyePos, mask, range.firstEdge, range.edgeNum);
+	}
+}
+
+static int bitCount(unsigned int bits)
+{
+	bits = bits - ((bits >> 1) & 0x55555555);
+	bits = (bits & 0x33333333) + ((bits >> 2) & 0x33333333);
+
+	return (((bits + (bits >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+}
+
+static int compactSilhouettes( int rangeNum )
+{
+	const int maskWordNum = g_EDGE_CLUSTER_SIZE / 32;
+
+	int chunkNum = (rangeNum + g_COMPACT_CHUNK_SIZE - 1) / g_COMPACT_CHUNK_SIZE;
+
+	//Count per chunk, scan the (few) chunk totals, then let every chunk write its own part
+	#pragma omp parallel for schedule(static)
+	for(int chunk=0; chunk<chunkNum; ++chunk)
+	{
+		int wordEnd = min((chunk + 1) * g_COMPACT_CHUNK_SIZE, rangeNum) * maskWordNum;
+		int count = 0;
+
+		for(int word=chunk * g_COMPACT_CHUNK_SIZE * maskWordNum; word<wordEnd; ++word)
+			count += bitCount(h_cpuSilhouetteMask[word]);
+
+		h_cpuChunkOffsets[chunk] = count;
+	}
+
+	int silNum = 0;
+
+	for(int chunk=0; chunk<chunkNum; ++chunk)
+	{
+		int count = h_cpuChunkOffsets[chunk];
+		h_cpuChunkOffsets[chunk] = silNum;
+		silNum += count;
+	}
+
+	#pragma omp parallel for schedule(static)
+	for(int chunk=0; chunk<chunkNum; ++chunk)
+	{
+		int silIdx = h_cpuChunkOffsets[chunk];
+		int rangeEnd = min((chunk + 1) * g_COMPACT_CHUNK_SIZE, rangeNum);
+
+		for(int rangeIdx=chunk * g_COMPACT_CHUNK_SIZE; rangeIdx<rangeEnd; ++rangeIdx)
+		{
+			const EdgeRange& range = h_cpuEdgeRanges[rangeIdx];
+			const BatchObject& obj = h_cpuObjects[range.objIdx];
+			const unsigned int* mask = h_cpuSilhouetteMask + rangeIdx * maskWordNum;
+
+			for(int idx=0; idx<range.edgeNum; ++idx)
+			{
+				if(!((mask[idx / 32] >> (idx % 32)) & 1))
+					continue;
+
+				int edgeIdx = range.firstEdge + idx;
+				const MeshEdge& edge = obj.edges[edgeIdx];
+
+				h_cpuSilVertex[2 * silIdx]		= obj.vertices[edge.v0].position;
+				h_cpuSilVertex[2 * silIdx + 1]	= obj.vertices[edge.v1].position;
+				h_cpuSilNormal[2 * silIdx]		= obj.vertices[edge.v0].normal;
+				h_cpuSilNormal[2 * silIdx + 1]	= obj.vertices[edge.v1].normal;
+				h_cpuSilEdgeIdx[silIdx]			= h_cpuEdgeBase[range.objIdx] + edgeIdx;
+				h_cpuSilObj[silIdx]				= range.objIdx;
+
+				++silIdx;
+			}
+		}
+	}
+
+	return silNum;
+}
+
+//Detected silhouettes of every object, then its tracked ones, into the cull input
+static int gatherCandidates( int detectedNum )
+{
+	//The ranges go object after object, so does the detected list
+	int detectedIdx = 0;
+
+	for(int i=0; i<h_cpuObjNum; ++i)
+	{
+		const BatchObject& obj = h_cpuObjects[i];
+
+		int firstDetected = detectedIdx;
+
+		while(detectedIdx < detectedNum && h_cpuSilObj[detectedIdx] == i)
+			++detectedIdx;
+
+		int silIdx = firstDetected + h_cpuObjTrackedStart[i];
+		int silNum = detectedIdx - firstDetected;
+
+		h_cpuObjSilStart[i] = silIdx;
+
+		const D3DXVECTOR3* viewVertex = h_cpuViewVertex + h_cpuObjVertexStart[i];
+
+		memcpy(h_cpuCandidateSilhouetteVertex + 2 * silIdx, h_cpuSilVertex + 2 * firstDetected, silNum * 2 * sizeof(D3DXVECTOR3));
+		memcpy(h_cpuCandidateSilhouetteNormal + 2 * silIdx, h_cpuSilNormal + 2 * firstDetected, silNum * 2 * sizeof(D3DXVECTOR3));
+
+		for(int detected=firstDetected; detected<detectedIdx; ++detected)
+		{
+			const MeshEdge& edge = obj.edges[h_cpuSilEdgeIdx[detected] - h_cpuEdgeBase[i]];
+
+			h_cpuCandidateSilhouetteViewVertex[2 * silIdx]		= viewVertex[edge.v0];
+			h_cpuCandidateSilhouetteViewVertex[2 * silIdx + 1]	= viewVertex[edge.v1];
+			h_cpuCandidateEdge[silIdx] = h_cpuSilEdgeIdx[detected];
+
+			++silIdx;
+		}
+
+		for(int trackedIdx=h_cpuObjTrackedStart[i]; trackedIdx<h_cpuObjTrackedStart[i + 1]; ++trackedIdx)
+		{
+			const MeshEdge& edge = obj.edges[h_cpuTrackedEdges[trackedIdx].edge];
+
+			h_cpuCandidateSilhouetteVertex[2 * silIdx]		= obj.vertices[edge.v0].position;
+			h_cpuCandidateSilhouetteVertex[2 * silIdx + 1]	= obj.vertices[edge.v1].position;
+			h_cpuCandidateSilhouetteNormal[2 * silIdx]		= obj.vertices[edge.v0].normal;
+			h_cpuCandidateSilhouetteNormal[2 * silIdx + 1]	= obj.vertices[edge.v1].normal;
+			h_cpuCandidateSilhouetteViewVertex[2 * silIdx]		= viewVertex[edge.v0];
+			h_cpuCandidateSilhouetteViewVertex[2 * silIdx + 1]	= viewVertex[edge.v1];
+			h_cpuCandidateEdge[silIdx] = h_cpuEdgeBase[i] + h_cpuTrackedEdges[trackedIdx].edge;
+
+			++silIdx;
+		}
+	}
+
+	h_cpuObjSilStart[h_cpuObjNum] = detectedNum + h_cpuObjTrackedStart[h_cpuObjNum];
+
+	return h_cpuObjSilStart[h_cpuObjNum];
+}
+
+//Ray test of one candidate, against the scene or its own object
+static bool isSilhouetteHidden( int silIdx, int objIdx )
+{
+	const BatchObject& obj = h_cpuObjects[objIdx];
+
+	if(h_cpuInstanceBVH.nodeNum > 0)
+	{
+		return cullSilhouetteSceneElement(silIdx, objIdx, h_cpuObjects, h_cpuInstanceBVH.nodes, h_cpuInstanceBVH.nodeNum,
+										  h_cpuInstanceBVH.instances, h_cpuCandidateSilhouetteVertex,
+										  h_cpuCandidateSilhouetteViewVertex, h_cpuViewVertex, h_cpuObjVertexStart,
+										  h_cpuViewWorld, h_cpuEyePos);
+	}
+
+	//Only the triangles of its own object may hide a silhouette
+	return cullSilhouetteElement(silIdx, obj.bvhNodes, obj.bvhNodeNum, obj.bvhTriangles,
+								 h_cpuViewVertex + h_cpuObjVertexStart[objIdx], obj.indices,
+								 h_cpuCandidateSilhouetteVertex, h_cpuCandidateSilhouetteViewVertex, obj.eyePos);
+}
+
+//Scene vertices at the ends of a candidate, numbered as in the vertex cache
+static void candidateVertices( int silIdx, int objIdx, int* v0, int* v1 )
+{
+	const MeshEdge& edge = h_cpuObjects[objIdx].edges[h_cpuCandidateEdge[silIdx] - h_cpuEdgeBase[objIdx]];
+
+	*v0 = h_cpuObjVertexStart[objIdx] + edge.v0;
+	*v1 = h_cpuObjVertexStart[objIdx] + edge.v1;
+}
+
+//What the candidates of the amortized objects get in this pass. Past the retest limit the ray tests
+//go by priority, then in candidate order, the same whichever thread gets to a candidate first.
+static void chooseVisibilityTests( int silNum, const int* lastMark )
+{
+	int priorityCount = visibilityPriorityNum(h_cpuRefreshPeriod);
+
+	#pragma omp parallel for schedule(static)
+	for(int silIdx=0; silIdx<silNum; ++silIdx)
+	{
+		int objIdx = findBatchObject(h_cpuObjSilStart, h_cpuObjNum, silIdx);
+
+		if(h_cpuObjects[objIdx].visibility != VISIBILITY_EXACT)
+		{
+			h_cpuVisibilityTest[silIdx] = -1;
+			continue;
+		}
+
+		int v0, v1;
+		candidateVertices(silIdx, objIdx, &v0, &v1);
+
+		int sceneEdge = h_cpuCandidateEdge[silIdx];
+
+		h_cpuVisibilityTest[silIdx] = visibilityTestPriority(h_cpuEdgeVisibility[sceneEdge], h_cpuVisibilityPass, sceneEdge, h_cpuRefreshPeriod,
+															 lastMark ? lastMark[v0] : 0, lastMark ? lastMark[v1] : 0);
+	}
+
+	//Without a limit every one that asks gets it
+	int lastPriority = priorityCount;
+	int lastNum = 0;
+
+	if(h_cpuRetestLimit > 0)
+	{
+		memset(h_cpuPriorityNum, 0, priorityCount * sizeof(int));
+
+		for(int silIdx=0; silIdx<silNum; ++silIdx)
+		{
+			if(h_cpuVisibilityTest[silIdx] >= 0)
+				++h_cpuPriorityNum[h_cpuVisibilityTest[silIdx]];
+		}
+
+		splitRetestLimit(h_cpuPriorityNum, priorityCount, h_cpuRetestLimit, &lastPriority, &lastNum);
+	}
+
+	for(int silIdx=0; silIdx<silNum; ++silIdx)
+	{
+		int priority = h_cpuVisibilityTest[silIdx];
+
+		if(priority < 0)
+			h_cpuVisibilityTest[silIdx] = g_VISIBILITY_CACHED;
+		else if(priority < lastPriority || (priority == lastPriority && lastNum-- > 0))
+			h_cpuVisibilityTest[silIdx] = g_VISIBILITY_RAY_TEST;
+		else
+			h_cpuVisibilityTest[silIdx] = g_VISIBILITY_DEFERRED;
+	}
+}
+
+static void cullSilhouettes( int silNum )
+{
+	bool isAmortized = h_cpuRefreshPeriod > 1;
+
+	const int* lastMark = lastVertexMark();
+	int* vertexMark = currentVertexMark();
+
+	if(isAmortized)
+		chooseVisibilityTests(silNum, lastMark);
+
+	//One silhouette per iteration: unlike a kernel thread it may stop at the first occluder,
+	//which makes the cost per iteration uneven, hence the dynamic schedule.
+	#pragma omp parallel for schedule(dynamic, 16)
+	for(int silIdx=0; silIdx<silNum; ++silIdx)
+	{
+		int objIdx = findBatchObject(h_cpuObjSilStart, h_cpuObjNum, silIdx);
+
+		const BatchObject& obj = h_cpuObjects[objIdx];
+
+		if(obj.visibility == VISIBILITY_QUANTITATIVE)
+		{
+			//Kept for the propagation along its chains, done by the caller
+			h_cpuIsSilhouette[silIdx] = true;
+			continue;
+		}
+
+		if(obj.visibility == VISIBILITY_DEPTH_BUFFER)
+		{
+			h_cpuIsSilhouette[silIdx] = !cullSilhouetteDepthElement(silIdx, h_cpuCandidateSilhouetteVertex, h_cpuCandidateSilhouetteNormal,
+																	h_cpuCandidateSilhouetteViewVertex, &h_cpuMatrixProj, h_cpuHiZ);
+			continue;
+		}
+
+		if(!isAmortized)
+		{
+			h_cpuIsSilhouette[silIdx] = !isSilhouetteHidden(silIdx, objIdx);
+			continue;
+		}
+
+		//The ray test carries over from pass to pass, only some of the silhouettes get it again
+		int v0, v1;
+		candidateVertices(silIdx, objIdx, &v0, &v1);
+
+		EdgeVisibility& cached = h_cpuEdgeVisibility[h_cpuCandidateEdge[silIdx]];
+
+		bool isVisible = true;
+		bool isKnown = true;
+
+		int test = h_cpuVisibilityTest[silIdx];
+
+		if(test == g_VISIBILITY_CACHED)
+			isVisible = cached.isVisible != 0;
+		else if(test == g_VISIBILITY_RAY_TEST)
+			isVisible = !isSilhouetteHidden(silIdx, objIdx);
+		else
+			isKnown = reuseEdgeVisibility(cached, h_cpuVisibilityPass, lastMark ? lastMark[v0] : 0, lastMark ? lastMark[v1] : 0, &isVisible);
+
+		h_cpuIsSilhouette[silIdx] = isVisible;
+
+		if(!isKnown)
+			continue;
+
+		int mark = updateEdgeVisibility(&cached, h_cpuVisibilityPass, isVisible);
+
+		#pragma omp atomic
+		vertexMark[v0] |= mark;
+
+		#pragma omp atomic
+		vertexMark[v1] |= mark;
+	}
+}
+
+//Visible candidates into the stroke list, projected on the way
+static void compactStrokes( int silNum )
+{
+	int strokeNum = 0;
+
+	for(int i=0; i<h_cpuObjNum; ++i)
+	{
+		h_cpuObjStrokeStart[i] = strokeNum;
+
+		for(int silIdx=h_cpuObjSilStart[i]; silIdx<h_cpuObjSilStart[i + 1]; ++silIdx)
+			h_cpuStrokeIdx[silIdx] = h_cpuIsSilhouette[silIdx] ? strokeNum++ : -1;
+	}
+
+	h_cpuObjStrokeStart[h_cpuObjNum] = strokeNum;
+
+	#pragma omp parallel for schedule(static)
+	for(int silIdx=0; silIdx<silNum; ++silIdx)
+	{
+		int strokeIdx = h_cpuStrokeIdx[silIdx];
+
+		if(strokeIdx < 0)
+			continue;
+
+		for(int end=0; end<2; ++end)
+		{
+			h_cpuStrokeVertex[2 * strokeIdx + end]	= h_cpuCandidateSilhouetteVertex[2 * silIdx + end];
+			h_cpuStrokeNormal[2 * strokeIdx + end]	= h_cpuCandidateSilhouetteNormal[2 * silIdx + end];
+			h_cpuStrokeProj[2 * strokeIdx + end]	= projTransformElement(h_cpuCandidateSilhouetteViewVertex[2 * silIdx + end], &h_cpuMatrixProj);
+		}
+	}
+}
+
+//Tasks: kernels plus the copy of their results to where the submission asked for them
+
+static void passTask( const CpuTask& task )
+{
+	int rangeNum = task.arg[0];
+
+	++h_cpuVisibilityPass;
+
+	transformVertices();
+	detectSilhouettes(rangeNum);
+
+	int detectedNum = compactSilhouettes(rangeNum);
+	int silNum = gatherCandidates(detectedNum);
+
+	cullSilhouettes(silNum);
+	compactStrokes(silNum);
+
+	*(int*)task.ptr[0] = detectedNum;
+
+	memcpy(task.ptr[1], h_cpuObjStrokeStart, (h_cpuObjNum + 1) * sizeof(int));
+}
+
+static void readbackTask( const CpuTask& task )
+{
+	int strokeNum	= task.arg[0];
+	int detectedNum	= task.arg[1];
+
+	memcpy(task.ptr[0], h_cpuStrokeVertex, strokeNum * 2 * sizeof(D3DXVECTOR3));
+	memcpy(task.ptr[1], h_cpuStrokeNormal, strokeNum * 2 * sizeof(D3DXVECTOR3));
+	memcpy(task.ptr[2], h_cpuStrokeProj, strokeNum * 2 * sizeof(D3DXVECTOR3));
+	memcpy(task.ptr[3], h_cpuSilEdgeIdx, detectedNum * sizeof(int));
+}
+
+bool cpuSubmitSilhouettePass( EdgeRange* h_edgeRanges, int rangeNum,
+							  TrackedEdge* h_trackedEdges, int trackedNum, const int* h_objTrackedNum,
+							  int* h_detectedNum, int* h_objStrokeStart, StageTicket* ticket )
+{
+	cpuWaitTask(h_cpuLastPass);
+
+	memcpy(h_cpuEdgeRanges, h_edgeRanges, rangeNum * sizeof(EdgeRange));
+	memcpy(h_cpuTrackedEdges, h_trackedEdges, trackedNum * sizeof(TrackedEdge));
+
+	h_cpuObjTrackedStart[0] = 0;
+
+	for(int i=0; i<h_cpuObjNum; ++i)
+		h_cpuObjTrackedStart[i + 1] = h_cpuObjTrackedStart[i] + h_objTrackedNum[i];
+
+	CpuTask task = { passTask, { h_detectedNum, h_objStrokeStart }, { rangeNum } };
+
+	if(!cpuSubmitTask(task, ticket))
+		return false;
+
+	h_cpuLastStage = h_cpuLastPass = *ticket;
+
+	return true;
+}
+
+bool cpuSubmitStrokeReadback( D3DXVECTOR3* h_strokeVertex, D3DXVECTOR3* h_strokeNormal, D3DXVECTOR3* h_strokeProj, int strokeNum,
+							  int* h_silEdgeIdx, int detectedNum, StageTicket* ticket )
+{
+	CpuTask task = { readbackTask, { h_strokeVertex, h_strokeNormal, h_strokeProj, h_silEdgeIdx }, { strokeNum, detectedNum } };
+
+	if(!cpuSubmitTask(task, ticket))
+		return false;
+
+	h_cpuLastStage = *ticket;
+
+	return true;
+}
+
+bool cpuWaitStage( StageTicket ticket )
+{
+	return cpuWaitTask(ticket);
+}
+
+bool cpuStageDone( StageTicket ticket )
+{
+	return cpuTaskDone(ticket);
+}
+
+bool cpuStageTimes( StageTicket ticket, LONGLONG* start, LONGLONG* finish )
+{
+	return cpuTaskTimes(ticket, start, finish);
+}
+
+const D3DXVECTOR3* cpuViewVertices( int objIdx )
+{
+	return h_cpuViewVertex + h_cpuObjVertexStart[objIdx];
+}
@@ -0,0 +1,46 @@
+#ifndef CPU_SILHOUETTE_FINDING_H_
+#define CPU_SILHOUETTE_FINDING_H_
+
+#include "StdHeader.h"
+#include "CUDADataStructure.h"
+
+struct InstanceBVH;
+
+// Host mirror of the cuda* API in CUDASilhouetteFinding.h. Every stage runs the
+// same per-element routines as the kernels, spread over all cores with OpenMP, on the
+// worker thread of the task queue while the caller goes on.
+
+// The objects and their buffers are referenced, not copied: they must stay locked
+// until the frame's stages are done. So are the HiZ pyramid, NULL when no object uses it, and
+// the instance hierarchy, NULL when objects only hide their own silhouettes. With a refresh period
+// above 1 the ray test of a silhouette is amortized over that many passes, see visibilityTestPriority,
+// and a retest limit above 0 caps the ray tests of a pass, see splitRetestLimit.
+bool cpuPassData( BatchObject* h_objects, int objNum, D3DXMATRIX* h_matrixProj,
+				  const HiZPyramid* h_hiz, const InstanceBVH* h_instanceBVH,
+				  int visibilityRefreshPeriod, int visibilityRetestLimit );
+
+// Inputs are copied on submission, the caller may reuse its buffers right away. Outputs
+// are written by the time the wait on the ticket returns, not to be touched before.
+
+// Detection, tracked silhouettes, culling, compaction of the visible ones and projection in
+// one task, see cudaSubmitSilhouettePass
+bool cpuSubmitSilhouettePass( EdgeRange* h_edgeRanges, int rangeNum,
+							  TrackedEdge* h_trackedEdges, int trackedNum, const int* h_objTrackedNum,
+							  int* h_detectedNum, int* h_objStrokeStart, StageTicket* ticket );
+
+bool cpuSubmitStrokeReadback( D3DXVECTOR3* h_strokeVertex, D3DXVECTOR3* h_strokeNormal, D3DXVECTOR3* h_strokeProj, int strokeNum,
+							  int* h_silEdgeIdx, int detectedNum, StageTicket* ticket );
+
+bool cpuWaitStage( StageTicket ticket );
+
+// Whether the stage has finished, without blocking
+bool cpuStageDone( StageTicket ticket );
+
+// When the stage ran on the worker thread, in QueryPerformanceCounter ticks, see cpuTaskTimes
+bool cpuStageTimes( StageTicket ticket, LONGLONG* start, LONGLONG* finish );
+
+// The vertices of an object in view space, as the last silhouette pass cached them. Valid from
+// the wait on that pass until the next one is submitted.
+const D3DXVECTOR3* cpuViewVertices( int objIdx );
+
+#endif
@@ -0,0 +1,184 @@
+//////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// File: CPUTaskQueue.cpp
+//
+// Author: Ren Yifei, yfren@cs.hku.hk
+//
+// Desc: In order task queue on a worker thread, the CPU backend's counterpart of a CUDA stream
+//
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "CPUTaskQueue.h"
+
+HANDLE				h_cpuWorker = NULL;
+
+//Auto reset: the worker is the only one waiting for work, the submitting thread the only one waiting for results
+HANDLE				h_cpuTaskReady = NULL;
+HANDLE				h_cpuTaskDone = NULL;
+
+CRITICAL_SECTION	h_cpuTaskLock;
+
+CpuTask				h_cpuTasks[g_MAX_STAGES_IN_FLIGHT];
+
+//When the worker picked up and finished the task in every slot, for measuring what overlapped it
+LONGLONG			h_cpuTaskStartTime[g_MAX_STAGES_IN_FLIGHT];
+LONGLONG			h_cpuTaskFinishTime[g_MAX_STAGES_IN_FLIGHT];
+
+//Tickets count up from 1: last one submitted, picked up by the worker, finished
+StageTicket			h_cpuSubmittedTask = 0;
+StageTicket			h_cpuStartedTask = 0;
+StageTicket			h_cpuFinishedTask = 0;
+
+bool				h_cpuQuitWorker = false;
+
+static DWORD WINAPI workerMain(void*)
+{
+	while(true)
+	{
+		EnterCriticalSection(&h_cpuTaskLock);
+
+		while(h_cpuStartedTask == h_cpuSubmittedTask && !h_cpuQuitWorker)
+		{
+			LeaveCriticalSection(&h_cpuTaskLock);
+			WaitForSingleObject(h_cpuTaskReady, INFINITE);
+			EnterCriticalSection(&h_cpuTaskLock);
+		}
+
+		if(h_cpuStartedTask == h_cpuSubmittedTask)
+		{
+			LeaveCriticalSection(&h_cpuTaskLock);
+			break;
+		}
+
+		StageTicket ticket = ++h_cpuStartedTask;
+		CpuTask task = h_cpuTasks[ticket % g_MAX_STAGES_IN_FLIGHT];
+
+		LeaveCriticalSection(&h_cpuTaskLock);
+
+		LARGE_INTEGER startTime, finishTime;
+
+		QueryPerformanceCounter(&startTime);
+		task.run(task);
+		QueryPerformanceCounter(&finishTime);
+
+		EnterCriticalSection(&h_cpuTaskLock);
+		h_cpuTaskStartTime[ticket % g_MAX_STAGES_IN_FLIGHT] = startTime.QuadPart;
+		h_cpuTaskFinishTime[ticket % g_MAX_STAGES_IN_FLIGHT] = finishTime.QuadPart;
+		h_cpuFinishedTask = ticket;
+		LeaveCriticalSection(&h_cpuTaskLock);
+
+		SetEvent(h_cpuTaskDone);
+	}
+
+	return 0;
+}
+
+static bool startWorker()
+{
+	if(h_cpuWorker)
+		return true;
+
+	InitializeCriticalSection(&h_cpuTaskLock);
+
+	h_cpuTaskReady	= CreateEvent(NULL, FALSE, FALSE, NULL);
+	h_cpuTaskDone	= CreateEvent(NULL, FALSE, FALSE, NULL);
+
+	h_cpuQuitWorker = false;
+	h_cpuWorker = CreateThread(NULL, 0, workerMain, NULL, 0, NULL);
+
+	return h_cpuWorker != NULL;
+}
+
+bool cpuSubmitTask( const CpuTask& task, StageTicket* ticket )
+{
+	if(!startWorker())
+		return false;
+
+	//The ring is full, the slot of the oldest task gets reused
+	if(h_cpuSubmittedTask - g_MAX_STAGES_IN_FLIGHT >= 0)
+		cpuWaitTask(h_cpuSubmittedTask + 1 - g_MAX_STAGES_IN_FLIGHT);
+
+	EnterCriticalSection(&h_cpuTaskLock);
+
+	*ticket = ++h_cpuSubmittedTask;
+	h_cpuTasks[*ticket % g_MAX_STAGES_IN_FLIGHT] = task;
+
+	LeaveCriticalSection(&h_cpuTaskLock);
+
+	SetEvent(h_cpuTaskReady);
+
+	return true;
+}
+
+bool cpuWaitTask( StageTicket ticket )
+{
+	if(!h_cpuWorker)
+		return true;
+
+	EnterCriticalSection(&h_cpuTaskLock);
+
+	while(h_cpuFinishedTask < ticket)
+	{
+		LeaveCriticalSection(&h_cpuTaskLock);
+		WaitForSingleObject(h_cpuTaskDone, INFINITE);
+		EnterCriticalSection(&h_cpuTaskLock);
+	}
+
+	LeaveCriticalSection(&h_cpuTaskLock);
+
+	return true;
+}
+
+bool cpuTaskDone( StageTicket ticket )
+{
+	if(!h_cpuWorker)
+		return true;
+
+	EnterCriticalSection(&h_cpuTaskLock);
+	bool done = h_cpuFinishedTask >= ticket;
+	LeaveCriticalSection(&h_cpuTaskLock);
+
+	return done;
+}
+
+bool cpuTaskTimes( StageTicket ticket, LONGLONG* start, LONGLONG* finish )
+{
+	if(!h_cpuWorker || ticket <= 0)
+		return false;
+
+	EnterCriticalSection(&h_cpuTaskLock);
+
+	//Finished, and no later task has taken its slot yet
+	bool known = ticket <= h_cpuFinishedTask && ticket > h_cpuSubmittedTask - g_MAX_STAGES_IN_FLIGHT;
+
+	if(known)
+	{
+		*start	= h_cpuTaskStartTime[ticket % g_MAX_STAGES_IN_FLIGHT];
+		*finish	= h_cpuTaskFinishTime[ticket % g_MAX_STAGES_IN_FLIGHT];
+	}
+
+	LeaveCriticalSection(&h_cpuTaskLock);
+
+	return known;
+}
+
+void cpuReleaseTaskQueue()
+{
+	if(!h_cpuWorker)
+		return;
+
+	EnterCriticalSection(&h_cpuTaskLock);
+	h_cpuQuitWorker = true;
+	LeaveCriticalSection(&h_cpuTaskLock);
+
+	SetEvent(h_cpuTaskReady);
+	WaitForSingleObject(h_cpuWorker, INFINITE);
+
+	CloseHandle(h_cpuWorker);
+	CloseHandle(h_cpuTaskReady);
+	CloseHandle(h_cpuTaskDone);
+
+	DeleteCriticalSection(&h_cpuTaskLock);
+
+	h_cpuWorker = NULL;
+}
@@ -0,0 +1,34 @@
+#ifndef CPU_TASK_QUEUE_H_
+#define CPU_TASK_QUEUE_H_
+
+#include "StdHeader.h"
+#include "CUDADataStructure.h"
+
+// One unit of work for the worker thread. The payload is copied on submission, so
+// whatever it points to has to stay valid until the task's ticket has been waited on.
+struct CpuTask
+{
+	void	(*run)(const CpuTask& task);
+
+	void*	ptr[4];
+	int		arg[3];
+};
+
+// Runs the task on the worker thread after every task submitted before it. Starts the
+// worker on first use.
+bool cpuSubmitTask(const CpuTask& task, StageTicket* ticket);
+
+// Blocks until the task and every task before it has finished.
+bool cpuWaitTask(StageTicket ticket);
+
+// Whether the task has finished, without blocking.
+bool cpuTaskDone(StageTicket ticket);
+
+// When the worker started and finished the task, in QueryPerformanceCounter ticks. Known once
+// it has finished, until its slot is reused g_MAX_STAGES_IN_FLIGHT tasks later.
+bool cpuTaskTimes(StageTicket ticket, LONGLONG* start, LONGLONG* finish);
+
+// Waits for what is still queued and stops the worker.
+void cpuReleaseTaskQueue();
+
+#endif
@@ -13,6 +13,15 @@ struct EdgeVertex
 	D3DXVECTOR2 texCoord;
 };
 
+// One stroke quad as an instance, the 4 EdgeVertex corners folded into its two ends: corners
+// on either side of an end share all but the sign of the width and the v coordinate
+struct StrokeInstance // 40 BYTEs
+{
+	D3DXVECTOR3	position[2];
+	DWORD		normal[2];		// 8 bit unsigned normalized per component, the alpha of the end in w
+	D3DXFLOAT16	width[2];		// on the positive side
+	D3DXFLOAT16	texCoord[2];	// u, v is 0 on the negative side and 1 on the positive one
+};
 
 struct MeshVertex // 24 BYTEs
 {
@@ -20,6 +29,175 @@ struct MeshVertex // 24 BYTEs
 	D3DXVECTOR3 normal;
 };
 
+// One geometric edge of a mesh, built once from the adjacency buffer so that
+// each edge is tested and emitted a single time instead of once per half-edge.
+struct MeshEdge // 16 BYTEs
+{
+	DWORD v0;		// end points, in the winding order of face0
+	DWORD v1;
+	int	  face0;	// triangle owning the edge
+	int	  face1;	// adjacent triangle, -1 on a boundary
+};
+
+//Most edges in one cluster of the edge hierarchy, and so in one EdgeRange
+const int g_EDGE_CLUSTER_SIZE = 64;
+
+// Contiguous run of the edge table of one object handed to the silhouette detection. The
+// flag of edge firstEdge + k of range r lands in slot r * g_EDGE_CLUSTER_SIZE + k.
+struct EdgeRange
+{
+	int firstEdge;	// in the edge table of the object
+	int edgeNum;
+	int objIdx;		// object of the batch
+};
+
+// One silhouette edge handed over by the tracker of an object instead of being detected.
+// A pass takes them object after object, in the order the trackers hold them.
+struct TrackedEdge
+{
+	int edge;		// in the edge table of the object
+	int objIdx;
+};
+
+//Most triangles in one leaf of a TriangleBVH
+const int g_BVH_LEAF_SIZE = 4;
+
+// Node of a triangle hierarchy, object space. Nodes are stored depth first, so the left child
+// is the next node and skipNode is the first node after the subtree: no stack to walk it.
+struct BVHNode // 36 BYTEs
+{
+	D3DXVECTOR3	boxMin;
+	D3DXVECTOR3	boxMax;
+
+	int			firstTriangle;	// in the leaf order of the hierarchy
+	int			triangleNum;
+	int			skipNode;
+};
+
+// How the silhouettes of an object are tested for occlusion
+enum VisibilityMode
+{
+	VISIBILITY_EXACT = 0,		// segment to the eye against the object's triangles, through its BVH
+	VISIBILITY_DEPTH_BUFFER,	// samples along the projected segment against the scene's software depth buffer
+	VISIBILITY_QUANTITATIVE		// one ray cast per chain of silhouettes, counted on through the crossings on the screen
+};
+
+// Result of the ray test of one scene edge kept from pass to pass, so that a silhouette does not
+// have to be tested again every frame. See visibilityTestPriority.
+struct EdgeVisibility
+{
+	int		pass;		// last pass the edge was a silhouette in
+	int		isVisible;
+};
+
+//Vertex marks of the amortized ray test: the silhouettes at a vertex in the last pass were visible,
+//hidden, or both, which makes it a visibility transition
+const int g_VERTEX_MARK_VISIBLE = 1;
+const int g_VERTEX_MARK_HIDDEN = 2;
+
+//What a silhouette of an amortized object gets in a pass: the result cached for its edge, a result
+//reused past the retest limit of the pass (see reuseEdgeVisibility) or the ray test
+const int g_VISIBILITY_CACHED = -1;
+const int g_VISIBILITY_DEFERRED = 0;
+const int g_VISIBILITY_RAY_TEST = 1;
+
+//Software depth buffer of the depth buffer visibility mode, pixels and tiles of the rasterizer
+const int g_DEPTH_BUFFER_WIDTH = 320;
+const int g_DEPTH_BUFFER_HEIGHT = 240;
+const int g_DEPTH_TILE_SIZE = 8;
+
+//Levels of the HiZ pyramid at most, down to 1x1 for the buffer above
+const int g_HIZ_MAX_LEVELS = 12;
+
+// Hierarchical Z over the software depth buffer. Level 0 holds the nearest depth (z / w) of
+// every pixel, each level above the farthest of the 2x2 cells under it. All levels one after
+// the other in depth, row by row.
+struct HiZPyramid
+{
+	float*	depth;
+	int		depthNum;
+
+	int		levelOffset[g_HIZ_MAX_LEVELS];
+	int		levelWidth[g_HIZ_MAX_LEVELS];
+	int		levelHeight[g_HIZ_MAX_LEVELS];
+	int		levelNum;
+};
+
+struct SilhouetteSoA;
+
+// Geometry of one mesh kept on the compute device from frame to frame. Owned by the
+// CelSilhouette and only uploaded again when the mesh was (re)built since.
+struct ResidentMesh
+{
+	MeshVertex*		vertices;		// device memory
+	DWORD*			indices;
+	MeshEdge*		edges;
+	D3DXVECTOR4*	facePlanes;
+	BVHNode*		bvhNodes;
+	int*			bvhTriangles;
+
+	int				vertexNum;		// as allocated
+	int				indicesNum;
+	int				edgeNum;
+	int				bvhNodeNum;
+
+	bool			dirty;			// host copy changed since the last upload
+};
+
+// One object of a batched silhouette pass as handed to the backends. The buffers are
+// referenced, not copied: they must stay valid until the frame's read backs are done.
+struct BatchObject
+{
+	MeshVertex*		vertices;
+	DWORD*			indices;
+	MeshEdge*		edges;
+	D3DXVECTOR4*	facePlanes;
+	SilhouetteSoA*	soa;
+	ResidentMesh*	resident;
+
+	BVHNode*		bvhNodes;		// triangle hierarchy, leaf order of the faces in bvhTriangles
+	int*			bvhTriangles;
+	int				bvhNodeNum;
+
+	int*			vertexFaceStart;	// faces around every vertex, host only
+	int*			vertexFaces;
+
+	D3DXMATRIX		worldView;
+	D3DXMATRIX		viewWorld;	// its inverse
+	D3DXVECTOR3		eyePos;		// object space
+
+	int				visibility;	// VisibilityMode
+
+	int				vertexNum;
+	int				indicesNum;
+	int				edgeNum;
+	int				maxRangeNum;
+};
+
+// One object of a batch on the device: its resident mesh, indices local to it. Scene
+// edge ids number the edges of all objects one after the other, in batch order.
+struct SceneObject
+{
+	MeshVertex*		vertices;
+	DWORD*			indices;
+	MeshEdge*		edges;
+	D3DXVECTOR4*	facePlanes;
+	BVHNode*		bvhNodes;
+	int*			bvhTriangles;
+
+	int				faceNum;
+	int				bvhNodeNum;
+	int				firstEdge;		// scene edge id of its first edge
+	int				visibility;		// VisibilityMode
+};
+
+// Handle of a stage submitted to a backend. Stages run in submission order: once the
+// wait on a ticket returns, that stage and every one before it are done, outputs written.
+typedef int StageTicket;
+
+//Stages a backend keeps in flight at most, submitting another one waits on the oldest
+const int g_MAX_STAGES_IN_FLIGHT = 16;
+
 struct SegmentGroup
 {
 	int groupIdx;
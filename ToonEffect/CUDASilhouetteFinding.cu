@@ -10,116 +10,624 @@
 
 #include "CUDASilhouetteFinding.h"
 #include "CUDADataStructure.h"
+#include "SilhouetteCommon.h"
+#include "TriangleBVH.h"
 
-int	h_curMaxIndiceNum = 0;
+int h_curMaxEdgeNum = 0;
+int h_curMaxRangeNum = 0;
+int h_curMaxObjNum = 0;
 int h_curMaxVertexNum = 0;
-int h_curMaxSilNum = 0;
+int h_curMaxPriorityNum = 0;
 
-__device__ MeshVertex* 	d_meshVertex = NULL;
-__device__ WORD*		d_indices = NULL;
-__device__ DWORD*		d_adjBuffer = NULL;
-__device__ int*			d_maxIndiceNum = NULL;
-__device__ int*			d_silNum = NULL;
+int h_objNum = 0;
+int h_vertexNum = 0;
+
+//Every stage goes into this one stream in order, the host only blocks in cudaWaitStage
+cudaStream_t	h_stream = NULL;
+
+//Copy out of pinned staging into the caller's memory, done when the stage is waited on
+struct HostCopy
+{
+	void*		dst;
+	const void*	src;
+	size_t		size;
+};
+
+struct StageRecord
+{
+	cudaEvent_t	event;		//recorded behind the last command of the stage
+	HostCopy	copies[4];
+	int			copyNum;
+};
+
+StageRecord		h_stages[g_MAX_STAGES_IN_FLIGHT];
+StageTicket		h_submittedStage = 0;
+StageTicket		h_finishedStage = 0;
+
+//Last stage of each kind, the next one of that kind refills its staging
+StageTicket		h_lastPassStage = 0;
+StageTicket		h_lastReadbackStage = 0;
+StageTicket		h_lastViewVertexStage = 0;
+
+//Host side copies of the per object tables, the object table only goes up when it changed
+SceneObject*	h_sceneObjects = NULL;
+
+//Per object bound on its candidates, sizes the grids of a pass
+int*			h_objCandidateBound = NULL;
+
+//First vertex of every object in the vertex cache, objNum + 1 of them, goes up with the object table
+int*			h_objVertexStart = NULL;
+
+//Pinned staging, copies from pageable memory would not overlap with anything
+D3DXMATRIX*		h_sceneWorldView = NULL;
+D3DXMATRIX*		h_sceneViewWorld = NULL;
+D3DXVECTOR3*	h_sceneEyePos = NULL;
+BVHNode*		h_pinnedInstanceNodes = NULL;
+int*			h_pinnedInstances = NULL;
+int*			h_pinnedObjTrackedStart = NULL;
+int*			h_pinnedObjStrokeStart = NULL;
+EdgeRange*		h_pinnedEdgeRanges = NULL;
+TrackedEdge*	h_pinnedTrackedEdges = NULL;
+int*			h_pinnedCounts = NULL;		//range, slot and tracked numbers up, detected number back
+D3DXVECTOR3*	h_pinnedStrokeVertex = NULL;
+D3DXVECTOR3*	h_pinnedStrokeNormal = NULL;
+D3DXVECTOR3*	h_pinnedStrokeProj = NULL;
+int*			h_pinnedSilEdgeIdx = NULL;
+
+//Vertex cache as read back for the quantitative invisibility, the objects it reads only
+D3DXVECTOR3*	h_pinnedViewVertex = NULL;
+
+//Per object: resident mesh, object space eye, world view matrix
+__device__ SceneObject*	d_objects = NULL;
+__device__ D3DXVECTOR3*	d_eyePos = NULL;
+__device__ int*			d_objNum = NULL;
+
+//Per object starts, objNum + 1 each: detected and tracked silhouettes, candidates and visible
+//strokes. Only the tracked ones come from the host, the rest is worked out on the device.
+__device__ int*			d_objDetectedStart = NULL;
+__device__ int*			d_objTrackedStart = NULL;
+__device__ int*			d_objSilStart = NULL;
+__device__ int*			d_objStrokeStart = NULL;
+
+//Vertex cache of the frame: every vertex of every object in view space, filled once at the start
+//of a pass for the cull and the projection
+__device__ D3DXVECTOR3*	d_viewVertex = NULL;
+__device__ int*			d_objVertexStart = NULL;
+
+//Scene depth of the depth buffer visibility mode, same size every frame. h_deviceHiZ describes
+//the device copy and goes to the cull kernel as it is.
+float*				h_pinnedHiZ = NULL;
+__device__ float*	d_hizDepth = NULL;
+HiZPyramid			h_deviceHiZ;
+
+__device__ EdgeRange*	d_edgeRanges = NULL;
+__device__ int*			d_rangeNum = NULL;
+__device__ int*			d_slotNum = NULL;
+
+__device__ TrackedEdge*	d_trackedEdges = NULL;
+__device__ int*			d_trackedNum = NULL;
+
+//Compaction of a flag array, detection flags first and cull flags later: per slot offsets within
+//a block, then the offset of every block
+__device__ int*			d_silOffsets = NULL;
+__device__ int*			d_blockSums = NULL;
+__device__ int*			d_silCount = NULL;
+
+//Packed list of the detected silhouettes: two end points and normals, the edge id and the object
+//per silhouette. The ranges go object after object, so does the list.
+__device__ D3DXVECTOR3*	d_silVertex = NULL;
+__device__ D3DXVECTOR3*	d_silNormal = NULL;
+__device__ int*			d_silEdgeIdx = NULL;
+__device__ int*			d_silObj = NULL;
 
 __device__ D3DXMATRIX*		d_matrixWorldView  = NULL;
+__device__ D3DXMATRIX*		d_matrixViewWorld  = NULL;
+
+//Instance hierarchy of the frame, no nodes when the objects only hide their own strokes
+__device__ BVHNode*			d_instanceNodes = NULL;
+__device__ int*				d_instances = NULL;
+int							h_instanceNodeNum = 0;
 __device__ D3DXMATRIX*		d_matrixProj = NULL;
 
+//Cull input: detected and tracked silhouettes of every object together, object after object.
+//The view space end points come out of the vertex cache.
 __device__ D3DXVECTOR3*		d_candidateSilhouetteVertex = NULL;
+__device__ D3DXVECTOR3*		d_candidateSilhouetteNormal = NULL;
+__device__ D3DXVECTOR3*		d_candidateSilhouetteViewVertex = NULL;
+__device__ int*				d_candidateNum = NULL;
+
+//Scene edge of every candidate, the key of the amortized ray test
+__device__ int*				d_candidateEdge = NULL;
+
+//Amortized ray test: the result per scene edge, and the marks per scene vertex of the last pass and
+//of this one, the two halves taking turns, with the pass each half was written in. A pass number is
+//skipped whenever the scene edges or the refresh period change, which leaves no result and no marks
+//current.
+__device__ EdgeVisibility*	d_edgeVisibility = NULL;
+__device__ int*				d_vertexMark = NULL;
+int							h_vertexMarkPass[2] = { -1, -1 };
+int							h_visibilityPass = 1;
+int							h_refreshPeriod = 1;
+
+//What every candidate gets in the pass, see rankVisibilityTests, and the candidates per priority
+//under the retest limit, 0 for none
+__device__ int*				d_visibilityTest = NULL;
+__device__ int*				d_priorityNum = NULL;
+int							h_retestLimit = 0;
+
+//Visible strokes, object after object: end points, normals and projected end points
+__device__ D3DXVECTOR3*		d_strokeVertex = NULL;
+__device__ D3DXVECTOR3*		d_strokeNormal = NULL;
+__device__ D3DXVECTOR3*		d_strokeProj = NULL;
+__device__ int*				d_strokeNum = NULL;
 
 //ΣһαʾǷsil,СindiceNum/2,ڶξͱʾǷɼsil, СֻǰsilNum
 __device__ bool*			d_isSilhouette  = NULL; 
 
+//View space transformation of every vertex into the vertex cache
+__global__ void transformVertices(SceneObject* d_objects,
+								  int* d_objNum,
+								  int* d_objVertexStart,
+								  D3DXMATRIX* d_matrixWorldView,
+								  D3DXVECTOR3* d_viewVertex,
+								  int* d_vertexMark);
+
 //Silhouette detection
-__global__ void findSilhouette(MeshVertex* d_meshVertex,
-							   WORD* d_indices, 
-							   DWORD* d_adjBuffer, 
-							   D3DXMATRIX* d_matrixWorldView,
-							   D3DXMATRIX* d_matrixProj,
+__global__ void findSilhouette(SceneObject* d_objects,
+							   D3DXVECTOR3* d_eyePos,
+							   EdgeRange* d_edgeRanges,
 							   bool*	d_isSilhouette,
-							   int* d_maxIndiceNum);
+							   int* d_rangeNum);
+
+//Stream compaction of a flag array
+__global__ void scanSilhouetteFlags(bool* d_isSilhouette,
+									int* d_silOffsets,
+									int* d_blockSums,
+									int* d_flagNum);
+
+__global__ void scanBlockSums(int* d_blockSums,
+							  int* d_flagNum,
+							  int* d_silCount);
+
+__global__ void compactSilhouettes(SceneObject* d_objects,
+								   EdgeRange* d_edgeRanges,
+								   bool* d_isSilhouette,
+								   int* d_silOffsets,
+								   int* d_blockSums,
+								   int* d_rangeNum,
+								   D3DXVECTOR3* d_silVertex,
+								   D3DXVECTOR3* d_silNormal,
+								   int* d_silEdgeIdx,
+								   int* d_silObj);
+
+//Per object starts of the candidates
+__global__ void scanObjects(int* d_objNum,
+							int* d_silObj,
+							int* d_silCount,
+							int* d_objDetectedStart,
+							int* d_objTrackedStart,
+							int* d_objSilStart,
+							int* d_candidateNum);
+
+//Detected and tracked silhouettes into the cull input
+__global__ void scatterCandidates(SceneObject* d_objects,
+								  D3DXVECTOR3* d_silVertex,
+								  D3DXVECTOR3* d_silNormal,
+								  int* d_silEdgeIdx,
+								  int* d_silObj,
+								  int* d_silCount,
+								  TrackedEdge* d_trackedEdges,
+								  int* d_trackedNum,
+								  int* d_objDetectedStart,
+								  int* d_objTrackedStart,
+								  int* d_objSilStart,
+								  int* d_objVertexStart,
+								  D3DXVECTOR3* d_viewVertex,
+								  D3DXVECTOR3* d_candidateSilhouetteVertex,
+								  D3DXVECTOR3* d_candidateSilhouetteNormal,
+								  D3DXVECTOR3* d_candidateSilhouetteViewVertex,
+								  int* d_candidateEdge,
+								  bool* d_isSilhouette);
+
+//Ray tests of the amortized pass: priorities, then what every candidate gets under the retest limit
+__global__ void rankVisibilityTests(SceneObject* d_objects,
+									int* d_objNum,
+									int* d_objSilStart,
+									int* d_candidateNum,
+									int* d_objVertexStart,
+									int* d_candidateEdge,
+									EdgeVisibility* d_edgeVisibility,
+									int* d_lastVertexMark,
+									int visibilityPass,
+									int refreshPeriod,
+									int* d_priorityNum,
+									int* d_visibilityTest);
+
+__global__ void selectVisibilityTests(int* d_candidateNum,
+									  int* d_priorityNum,
+									  int priorityCount,
+									  int retestLimit,
+									  int* d_visibilityTest);
 
 //Invisible silhouette culling
-__global__ void cullSilouette(MeshVertex* d_meshVertex,
-							 WORD* d_indices,
-							 int* d_maxIndiceNum,
+__global__ void cullSilouette(SceneObject* d_objects,
+							 D3DXVECTOR3* d_eyePos,
+							 int* d_objNum,
+							 int* d_objSilStart,
+							 int* d_candidateNum,
 							 D3DXVECTOR3* d_candidateSilhouetteVertex,
-							 int* d_silNum,
+							 D3DXVECTOR3* d_candidateSilhouetteNormal,
+							 D3DXVECTOR3* d_candidateSilhouetteViewVertex,
 							 bool*	d_isSilhouette,
-							 D3DXMATRIX* d_matrixWorldView);
+							 int* d_objVertexStart,
+							 D3DXVECTOR3* d_viewVertex,
+							 D3DXMATRIX* d_matrixViewWorld,
+							 D3DXMATRIX* d_matrixProj,
+							 HiZPyramid d_hiz,
+							 BVHNode* d_instanceNodes,
+							 int instanceNodeNum,
+							 int* d_instances,
+							 int* d_candidateEdge,
+							 EdgeVisibility* d_edgeVisibility,
+							 int* d_lastVertexMark,
+							 int* d_vertexMark,
+							 int visibilityPass,
+							 int* d_visibilityTest);
+
+//Visible candidates into the stroke list, projected on the way from 3D to the 2D viewport
+__global__ void compactStrokes(bool* d_isSilhouette,
+							   int* d_silOffsets,
+							   int* d_blockSums,
+							   int* d_candidateNum,
+							   D3DXVECTOR3* d_candidateSilhouetteVertex,
+							   D3DXVECTOR3* d_candidateSilhouetteNormal,
+							   D3DXVECTOR3* d_candidateSilhouetteViewVertex,
+							   D3DXMATRIX* d_matrixProj,
+							   D3DXVECTOR3* d_strokeVertex,
+							   D3DXVECTOR3* d_strokeNormal,
+							   D3DXVECTOR3* d_strokeProj);
+
+__global__ void findObjectStrokes(int* d_objNum,
+								  int* d_objSilStart,
+								  int* d_silOffsets,
+								  int* d_blockSums,
+								  int* d_candidateNum,
+								  int* d_strokeNum,
+								  int* d_objStrokeStart);
+
+//Blocks for one thread per work item, capped at what the grid can hold; kernels loop over the rest
+static int gridSize(__int64 workNum)
+{
+	__int64 gridNum = (workNum + g_BLOCK_SIZE - 1) / g_BLOCK_SIZE;
 
+	return (int)(gridNum < g_MAX_GRID_SIZE ? gridNum : g_MAX_GRID_SIZE);
+}
 
-//Projection transform from 3D tO 2D viewport
-__global__ void projTransform(D3DXVECTOR3*  d_meshVertexProj,
-							  int*			d_silNum,
-							  D3DXMATRIX*	d_matrixWorldView,
-							  D3DXMATRIX*	d_matrixProj);
+//Whether a CUDA capable device is present at all
+bool cudaDeviceAvailable()
+{
+	int deviceNum = 0;
 
-//Segment / Triangle crossing testing
-__device__ bool segmentIntersectTriangle(const D3DXVECTOR3& orig, 
-										 const D3DXVECTOR3& des,
-										 const D3DXVECTOR3& v0, 
-										 const D3DXVECTOR3& v1, 
-										 const D3DXVECTOR3& v2);
+	if(cudaGetDeviceCount(&deviceNum) != cudaSuccess)
+		return false;
 
+	return deviceNum > 0;
+}
 
 //Init
-bool cudaInitialization(int indiceNum, int vertexNum)
+bool cudaInitialization(int edgeNum, int maxRangeNum, int objNum, int vertexNum)
 {	
 	cudaError err = cudaSuccess;
 
+	if(objNum > h_curMaxObjNum)
+	{
+		h_curMaxObjNum = objNum;
+
+		delete [] h_sceneObjects;
+		delete [] h_objCandidateBound;
+		delete [] h_objVertexStart;
+
+		h_sceneObjects = new SceneObject[objNum];
+		h_objCandidateBound = new int[objNum];
+		h_objVertexStart = new int[objNum + 1];
+
+		if(h_sceneWorldView)
+		{
+			cudaFreeHost(h_sceneWorldView);
+			cudaFreeHost(h_sceneViewWorld);
+			cudaFreeHost(h_sceneEyePos);
+			cudaFreeHost(h_pinnedInstanceNodes);
+			cudaFreeHost(h_pinnedInstances);
+			cudaFreeHost(h_pinnedObjTrackedStart);
+			cudaFreeHost(h_pinnedObjStrokeStart);
+		}
+
+		err = cudaHostAlloc((void**)&h_sceneWorldView, objNum * sizeof(D3DXMATRIX), cudaHostAllocDefault);
+
+		if(err != cudaSuccess)
+			return false;
+
+		err = cudaHostAlloc((void**)&h_sceneViewWorld, objNum * sizeof(D3DXMATRIX), cudaHostAllocDefault);
+
+		if(err != cudaSuccess)
+			return false;
+
+		err = cudaHostAlloc((void**)&h_sceneEyePos, objNum * sizeof(D3DXVECTOR3), cudaHostAllocDefault);
+
+		if(err != cudaSuccess)
+			return false;
+
+		err = cudaHostAlloc((void**)&h_pinnedInstanceNodes, (2 * objNum - 1) * sizeof(BVHNode), cudaHostAllocDefault);
+
+		if(err != cudaSuccess)
+			return false;
+
+		err = cudaHostAlloc((void**)&h_pinnedInstances, objNum * sizeof(int), cudaHostAllocDefault);
+
+		if(err != cudaSuccess)
+			return false;
+
+		err = cudaHostAlloc((void**)&h_pinnedObjTrackedStart, (objNum + 1) * sizeof(int), cudaHostAllocDefault);
+
+		if(err != cudaSuccess)
+			return false;
+
+		err = cudaHostAlloc((void**)&h_pinnedObjStrokeStart, (objNum + 1) * sizeof(int), cudaHostAllocDefault);
+
+		if(err != cudaSuccess)
+			return false;
+
+		if(d_objects)
+			cudaFree(d_objects);
+
+		err = cudaMalloc((void**)&d_objects, objNum * sizeof(SceneObject));
+
+		if(err != cudaSuccess)
+			return false;
+
+		if(d_eyePos)
+			cudaFree(d_eyePos);
+
+		err = cudaMalloc((void**)&d_eyePos, objNum * sizeof(D3DXVECTOR3));
+
+		if(err != cudaSuccess)
+			return false;
+
+		if(d_matrixWorldView)
+			cudaFree(d_matrixWorldView);
+
+		err = cudaMalloc((void**)&d_matrixWorldView, objNum * sizeof(D3DXMATRIX));
+
+		if(err != cudaSuccess)
+			return false;
+
+		if(d_matrixViewWorld)
+		{
+			cudaFree(d_matrixViewWorld);
+			cudaFree(d_instanceNodes);
+			cudaFree(d_instances);
+		}
+
+		err = cudaMalloc((void**)&d_matrixViewWorld, objNum * sizeof(D3DXMATRIX));
+
+		if(err != cudaSuccess)
+			return false;
+
+		err = cudaMalloc((void**)&d_instanceNodes, (2 * objNum - 1) * sizeof(BVHNode));
+
+		if(err != cudaSuccess)
+			return false;
+
+		err = cudaMalloc((void**)&d_instances, objNum * sizeof(int));
+
+		if(err != cudaSuccess)
+			return false;
+
+		if(d_objSilStart)
+		{
+			cudaFree(d_objDetectedStart);
+			cudaFree(d_objTrackedStart);
+			cudaFree(d_objSilStart);
+			cudaFree(d_objStrokeStart);
+			cudaFree(d_objVertexStart);
+		}
+
+		err = cudaMalloc((void**)&d_objDetectedStart, (objNum + 1) * sizeof(int));
+
+		if(err != cudaSuccess)
+			return false;
+
+		err = cudaMalloc((void**)&d_objTrackedStart, (objNum + 1) * sizeof(int));
+
+		if(err != cudaSuccess)
+			return false;
+
+		err = cudaMalloc((void**)&d_objSilStart, (objNum + 1) * sizeof(int));
+
+		if(err != cudaSuccess)
+			return false;
+
+		err = cudaMalloc((void**)&d_objStrokeStart, (objNum + 1) * sizeof(int));
+
+		if(err != cudaSuccess)
+			return false;
+
+		err = cudaMalloc((void**)&d_objVertexStart, (objNum + 1) * sizeof(int));
+
+		if(err != cudaSuccess)
+			return false;
+	}
+
 	if(vertexNum > h_curMaxVertexNum)
 	{
 		h_curMaxVertexNum = vertexNum;
 
-		if(d_meshVertex)
-			cudaFree(d_meshVertex);
-		
-		err = cudaMalloc((void**)&d_meshVertex, vertexNum * sizeof(MeshVertex));
+		if(d_viewVertex)
+			cudaFree(d_viewVertex);
+
+		err = cudaMalloc((void**)&d_viewVertex, vertexNum * sizeof(D3DXVECTOR3));
+
+		if(err != cudaSuccess)
+			return false;
+
+		if(h_pinnedViewVertex)
+			cudaFreeHost(h_pinnedViewVertex);
+
+		err = cudaHostAlloc((void**)&h_pinnedViewVertex, vertexNum * sizeof(D3DXVECTOR3), cudaHostAllocDefault);
+
+		if(err != cudaSuccess)
+			return false;
+
+		if(d_vertexMark)
+			cudaFree(d_vertexMark);
+
+		err = cudaMalloc((void**)&d_vertexMark, vertexNum * 2 * sizeof(int));
 
 		if(err != cudaSuccess)
 			return false;
+
+		cudaMemset(d_vertexMark, 0, vertexNum * 2 * sizeof(int));
 	}
-	
-	if(indiceNum > h_curMaxIndiceNum)
+
+	if(edgeNum > h_curMaxEdgeNum)
 	{
-		h_curMaxIndiceNum = indiceNum;
+		h_curMaxEdgeNum = edgeNum;
+
+		//none of the silhouette lists ever outgrows the edge table
+		if(d_silVertex)
+		{
+			cudaFree(d_silVertex);
+			cudaFree(d_silNormal);
+			cudaFree(d_silEdgeIdx);
+			cudaFree(d_silObj);
+			cudaFree(d_trackedEdges);
+			cudaFree(d_candidateSilhouetteVertex);
+			cudaFree(d_candidateSilhouetteNormal);
+			cudaFree(d_candidateSilhouetteViewVertex);
+			cudaFree(d_candidateEdge);
+			cudaFree(d_edgeVisibility);
+			cudaFree(d_visibilityTest);
+			cudaFree(d_strokeVertex);
+			cudaFree(d_strokeNormal);
+			cudaFree(d_strokeProj);
+		}
+
+		err = cudaMalloc((void**)&d_silVertex, edgeNum * 2 * sizeof(D3DXVECTOR3));
+
+		if(err != cudaSuccess)
+			return false;
 
-		if(d_indices)
-			cudaFree(d_indices);
-		
-		err = cudaMalloc((void**)&d_indices, indiceNum * sizeof(WORD));
+		err = cudaMalloc((void**)&d_silNormal, edgeNum * 2 * sizeof(D3DXVECTOR3));
 
 		if(err != cudaSuccess)
 			return false;
 
-		if(d_adjBuffer)
-			cudaFree(d_adjBuffer);
+		err = cudaMalloc((void**)&d_silEdgeIdx, edgeNum * sizeof(int));
 
-		err = cudaMalloc((void**)&d_adjBuffer, indiceNum * sizeof(DWORD));
+		if(err != cudaSuccess)
+			return false;
+
+		err = cudaMalloc((void**)&d_silObj, edgeNum * sizeof(int));
 
 		if(err != cudaSuccess)
 			return false;
 
-		if(d_maxIndiceNum)
-			cudaFree(d_maxIndiceNum);
+		err = cudaMalloc((void**)&d_trackedEdges, edgeNum * sizeof(TrackedEdge));
 
-		err = cudaMalloc((void**)&d_maxIndiceNum,		sizeof(int));
+		if(err != cudaSuccess)
+			return false;
+
+		err = cudaMalloc((void**)&d_candidateSilhouetteVertex, edgeNum * 2 * sizeof(D3DXVECTOR3));
 
 		if(err != cudaSuccess)
 			return false;
 
-		if(d_matrixWorldView)
-			cudaFree(d_matrixWorldView);
+		err = cudaMalloc((void**)&d_candidateSilhouetteNormal, edgeNum * 2 * sizeof(D3DXVECTOR3));
+
+		if(err != cudaSuccess)
+			return false;
+
+		err = cudaMalloc((void**)&d_candidateSilhouetteViewVertex, edgeNum * 2 * sizeof(D3DXVECTOR3));
+
+		if(err != cudaSuccess)
+			return false;
 
-		err = cudaMalloc((void**)&d_matrixWorldView,	sizeof(D3DXMATRIX));
+		err = cudaMalloc((void**)&d_candidateEdge, edgeNum * sizeof(int));
 
 		if(err != cudaSuccess)
 			return false;
 
-		if(d_matrixProj)
-			cudaFree(d_matrixProj);
+		err = cudaMalloc((void**)&d_edgeVisibility, edgeNum * sizeof(EdgeVisibility));
+
+		if(err != cudaSuccess)
+			return false;
+
+		//No pass is -1, nothing cached yet
+		cudaMemset(d_edgeVisibility, 0xFF, edgeNum * sizeof(EdgeVisibility));
+
+		err = cudaMalloc((void**)&d_visibilityTest, edgeNum * sizeof(int));
+
+		if(err != cudaSuccess)
+			return false;
 
-		err = cudaMalloc((void**)&d_matrixProj,	sizeof(D3DXMATRIX));
+		err = cudaMalloc((void**)&d_strokeVertex, edgeNum * 2 * sizeof(D3DXVECTOR3));
+
+		if(err != cudaSuccess)
+			return false;
+
+		err = cudaMalloc((void**)&d_strokeNormal, edgeNum * 2 * sizeof(D3DXVECTOR3));
+
+		if(err != cudaSuccess)
+			return false;
+
+		err = cudaMalloc((void**)&d_strokeProj, edgeNum * 2 * sizeof(D3DXVECTOR3));
+
+		if(err != cudaSuccess)
+			return false;
+
+		if(h_pinnedStrokeVertex)
+		{
+			cudaFreeHost(h_pinnedStrokeVertex);
+			cudaFreeHost(h_pinnedStrokeNormal);
+			cudaFreeHost(h_pinnedStrokeProj);
+			cudaFreeHost(h_pinnedSilEdgeIdx);
+			cudaFreeHost(h_pinnedTrackedEdges);
+		}
+
+		err = cudaHostAlloc((void**)&h_pinnedStrokeVertex, edgeNum * 2 * sizeof(D3DXVECTOR3), cudaHostAllocDefault);
+
+		if(err != cudaSuccess)
+			return false;
+
+		err = cudaHostAlloc((void**)&h_pinnedStrokeNormal, edgeNum * 2 * sizeof(D3DXVECTOR3), cudaHostAllocDefault);
+
+		if(err != cudaSuccess)
+			return false;
+
+		err = cudaHostAlloc((void**)&h_pinnedStrokeProj, edgeNum * 2 * sizeof(D3DXVECTOR3), cudaHostAllocDefault);
+
+		if(err != cudaSuccess)
+			return false;
+
+		err = cudaHostAlloc((void**)&h_pinnedSilEdgeIdx, edgeNum * sizeof(int), cudaHostAllocDefault);
+
+		if(err != cudaSuccess)
+			return false;
+
+		err = cudaHostAlloc((void**)&h_pinnedTrackedEdges, edgeNum * sizeof(TrackedEdge), cudaHostAllocDefault);
+
+		if(err != cudaSuccess)
+			return false;
+	}
+
+	if(maxRangeNum > h_curMaxRangeNum)
+	{
+		h_curMaxRangeNum = maxRangeNum;
+
+		if(d_edgeRanges)
+			cudaFree(d_edgeRanges);
+
+		err = cudaMalloc((void**)&d_edgeRanges, maxRangeNum * sizeof(EdgeRange));
 
 		if(err != cudaSuccess)
 			return false;
@@ -127,453 +635,1193 @@ bool cudaInitialization(int indiceNum, int vertexNum)
 		if(d_isSilhouette)
 			cudaFree(d_isSilhouette);
 
-		err = cudaMalloc((void**)&d_isSilhouette, indiceNum * sizeof(bool));
+		//one slot per range entry; the ranges cover every edge, so the cull flags fit in here as well
+		err = cudaMalloc((void**)&d_isSilhouette, maxRangeNum * g_EDGE_CLUSTER_SIZE * sizeof(bool));
+
+		if(err != cudaSuccess)
+			return false;
+
+		if(d_silOffsets)
+			cudaFree(d_silOffsets);
+
+		err = cudaMalloc((void**)&d_silOffsets, maxRangeNum * g_EDGE_CLUSTER_SIZE * sizeof(int));
+
+		if(err != cudaSuccess)
+			return false;
+
+		if(d_blockSums)
+			cudaFree(d_blockSums);
+
+		err = cudaMalloc((void**)&d_blockSums, (maxRangeNum * g_EDGE_CLUSTER_SIZE / g_BLOCK_SIZE + 1) * sizeof(int));
+
+		if(err != cudaSuccess)
+			return false;
+
+		if(h_pinnedEdgeRanges)
+			cudaFreeHost(h_pinnedEdgeRanges);
+
+		err = cudaHostAlloc((void**)&h_pinnedEdgeRanges, maxRangeNum * sizeof(EdgeRange), cudaHostAllocDefault);
 
 		if(err != cudaSuccess)
 			return false;
 	}
 
+	if(d_rangeNum == NULL)
+	{
+		err = cudaMalloc((void**)&d_rangeNum, sizeof(int));
+
+		if(err != cudaSuccess)
+			return false;
+
+		err = cudaMalloc((void**)&d_slotNum, sizeof(int));
+
+		if(err != cudaSuccess)
+			return false;
+
+		err = cudaMalloc((void**)&d_trackedNum, sizeof(int));
+
+		if(err != cudaSuccess)
+			return false;
+
+		err = cudaMalloc((void**)&d_silCount, sizeof(int));
+
+		if(err != cudaSuccess)
+			return false;
+
+		err = cudaMalloc((void**)&d_candidateNum, sizeof(int));
+
+		if(err != cudaSuccess)
+			return false;
+
+		err = cudaMalloc((void**)&d_strokeNum, sizeof(int));
+
+		if(err != cudaSuccess)
+			return false;
+
+		err = cudaMalloc((void**)&d_objNum, sizeof(int));
+
+		if(err != cudaSuccess)
+			return false;
+
+		err = cudaMalloc((void**)&d_matrixProj, sizeof(D3DXMATRIX));
+
+		if(err != cudaSuccess)
+			return false;
+
+		err = cudaHostAlloc((void**)&h_pinnedCounts, 4 * sizeof(int), cudaHostAllocDefault);
+
+		if(err != cudaSuccess)
+			return false;
+
+		err = cudaStreamCreate(&h_stream);
+
+		if(err != cudaSuccess)
+			return false;
+
+		for(int i=0; i<g_MAX_STAGES_IN_FLIGHT; ++i)
+		{
+			err = cudaEventCreate(&h_stages[i].event);
+
+			if(err != cudaSuccess)
+				return false;
+		}
+	}
+
 	return true;
 }
 
-bool cudaProjInit( int silNum )
+//Allocates the device copy on first use or when the mesh grew, copies only what was marked dirty
+static bool uploadResidentMesh( ResidentMesh* mesh, const BatchObject& obj )
 {
+	if(!mesh->dirty)
+		return true;
+
 	cudaError err = cudaSuccess;
 
-	if(silNum > h_curMaxSilNum)
+	if(obj.vertexNum > mesh->vertexNum)
 	{
-		h_curMaxSilNum = silNum;
+		if(mesh->vertices)
+			cudaFree(mesh->vertices);
 
-		if(d_candidateSilhouetteVertex)
-			cudaFree(d_candidateSilhouetteVertex);
+		err = cudaMalloc((void**)&mesh->vertices, obj.vertexNum * sizeof(MeshVertex));
 
-		err = cudaMalloc((void**)&d_candidateSilhouetteVertex, silNum * 2 * sizeof(D3DXVECTOR3));
+		if(err != cudaSuccess)
+			return false;
+
+		mesh->vertexNum = obj.vertexNum;
+	}
+
+	if(obj.indicesNum > mesh->indicesNum)
+	{
+		if(mesh->indices)
+			cudaFree(mesh->indices);
+
+		err = cudaMalloc((void**)&mesh->indices, obj.indicesNum * sizeof(DWORD));
 
 		if(err != cudaSuccess)
 			return false;
 
-		if(d_silNum)
-			cudaFree(d_silNum);
+		if(mesh->facePlanes)
+			cudaFree(mesh->facePlanes);
 
-		err = cudaMalloc((void**)&d_silNum, sizeof(int));
+		err = cudaMalloc((void**)&mesh->facePlanes, obj.indicesNum / 3 * sizeof(D3DXVECTOR4));
 
 		if(err != cudaSuccess)
 			return false;
+
+		if(mesh->bvhTriangles)
+			cudaFree(mesh->bvhTriangles);
+
+		err = cudaMalloc((void**)&mesh->bvhTriangles, obj.indicesNum / 3 * sizeof(int));
+
+		if(err != cudaSuccess)
+			return false;
+
+		mesh->indicesNum = obj.indicesNum;
 	}
 
-	return true;
-}
+	if(obj.edgeNum > mesh->edgeNum)
+	{
+		if(mesh->edges)
+			cudaFree(mesh->edges);
 
+		err = cudaMalloc((void**)&mesh->edges, obj.edgeNum * sizeof(MeshEdge));
 
+		if(err != cudaSuccess)
+			return false;
 
-bool cudaPassDataToGPU( MeshVertex* _meshVertex, WORD* _indices, DWORD* _adjBuffer, 
-						D3DXMATRIX* h_matrixWorldView, D3DXMATRIX* h_matrixProj, 
-						int h_indiceNum, int h_vertexNum )
-{
-	if(!cudaInitialization(h_indiceNum, h_vertexNum))
-		return false;
-	
-	cudaMemcpy(d_meshVertex, _meshVertex,		h_vertexNum * sizeof(MeshVertex),		cudaMemcpyHostToDevice);
-	cudaMemcpy(d_indices, _indices,				h_indiceNum * sizeof(WORD),				cudaMemcpyHostToDevice);
-	cudaMemcpy(d_adjBuffer, _adjBuffer,			h_indiceNum * sizeof(DWORD),			cudaMemcpyHostToDevice);
-	cudaMemcpy(d_maxIndiceNum, &h_indiceNum,					 sizeof(int),			cudaMemcpyHostToDevice);
-	cudaMemcpy(d_matrixWorldView, h_matrixWorldView,			 sizeof(D3DXMATRIX),	cudaMemcpyHostToDevice);
-	cudaMemcpy(d_matrixProj, h_matrixProj,						 sizeof(D3DXMATRIX),	cudaMemcpyHostToDevice);
+		mesh->edgeNum = obj.edgeNum;
+	}
 
-	return true;
-}
+	if(obj.bvhNodeNum > mesh->bvhNodeNum)
+	{
+		if(mesh->bvhNodes)
+			cudaFree(mesh->bvhNodes);
 
-bool cudaPassProjVerticesDataToGPU( D3DXVECTOR3* edgeVertices, int h_silNum )
-{
-	if(!cudaProjInit(h_silNum))
-		return false;
+		err = cudaMalloc((void**)&mesh->bvhNodes, obj.bvhNodeNum * sizeof(BVHNode));
 
-	cudaMemcpy(d_silNum, &h_silNum, sizeof(int), cudaMemcpyHostToDevice);
-	cudaMemcpy(d_candidateSilhouetteVertex, edgeVertices, h_silNum * 2 * sizeof(D3DXVECTOR3), cudaMemcpyHostToDevice);
+		if(err != cudaSuccess)
+			return false;
 
-	return true;
-}
+		mesh->bvhNodeNum = obj.bvhNodeNum;
+	}
+
+	cudaMemcpy(mesh->vertices, obj.vertices,		obj.vertexNum * sizeof(MeshVertex),			cudaMemcpyHostToDevice);
+	cudaMemcpy(mesh->indices, obj.indices,			obj.indicesNum * sizeof(DWORD),				cudaMemcpyHostToDevice);
+	cudaMemcpy(mesh->edges, obj.edges,				obj.edgeNum * sizeof(MeshEdge),				cudaMemcpyHostToDevice);
+	cudaMemcpy(mesh->facePlanes, obj.facePlanes,	obj.indicesNum / 3 * sizeof(D3DXVECTOR4),	cudaMemcpyHostToDevice);
+	cudaMemcpy(mesh->bvhNodes, obj.bvhNodes,		obj.bvhNodeNum * sizeof(BVHNode),			cudaMemcpyHostToDevice);
+	cudaMemcpy(mesh->bvhTriangles, obj.bvhTriangles,	obj.indicesNum / 3 * sizeof(int),			cudaMemcpyHostToDevice);
+
+	mesh->dirty = false;
 
-bool cudaGetDataFromGPU( bool* h_isSilhouette, int silSize )
-{
-	cudaMemcpy(h_isSilhouette, d_isSilhouette,	 silSize * sizeof(bool), cudaMemcpyDeviceToHost);
-	
 	return true;
 }
 
-bool cudaGetProjDataFromGPU( D3DXVECTOR3* h_meshProjVertices, int silSize )
+void cudaReleaseResidentMesh( ResidentMesh* mesh )
 {
-	cudaMemcpy(h_meshProjVertices, d_candidateSilhouetteVertex, silSize * 2 * sizeof(D3DXVECTOR3), cudaMemcpyDeviceToHost);
+	if(mesh->vertices)
+		cudaFree(mesh->vertices);
 
-	return true;
+	if(mesh->indices)
+		cudaFree(mesh->indices);
+
+	if(mesh->edges)
+		cudaFree(mesh->edges);
+
+	if(mesh->facePlanes)
+		cudaFree(mesh->facePlanes);
+
+	if(mesh->bvhNodes)
+		cudaFree(mesh->bvhNodes);
+
+	if(mesh->bvhTriangles)
+		cudaFree(mesh->bvhTriangles);
+
+	memset(mesh, 0, sizeof(ResidentMesh));
 }
 
-bool cudaRunKernel(int indiceNum)
+bool cudaPassDataToGPU( BatchObject* h_objects, int objNum, D3DXMATRIX* h_matrixProj, const HiZPyramid* h_hiz, const InstanceBVH* h_instanceBVH,
+						int visibilityRefreshPeriod, int visibilityRetestLimit )
 {
-	int gridNum = (indiceNum / g_BLOCK_SIZE);
-	
-	if(indiceNum % g_BLOCK_SIZE != 0)
-		++gridNum;
+	int edgeNum = 0;
+	int maxRangeNum = 0;
+	int vertexNum = 0;
 
+	for(int i=0; i<objNum; ++i)
+	{
+		edgeNum		+= h_objects[i].edgeNum;
+		maxRangeNum	+= h_objects[i].maxRangeNum;
+		vertexNum	+= h_objects[i].vertexNum;
+	}
 
-	findSilhouette<<< gridNum, g_BLOCK_SIZE>>> (d_meshVertex, d_indices, d_adjBuffer, 
-												d_matrixWorldView, d_matrixProj,
-												d_isSilhouette, d_maxIndiceNum);
+	//Staging and device buffers are reallocated and refilled below, whatever is left of the last
+	//frame has to be done with them
+	if(!cudaWaitStage(h_submittedStage))
+		return false;
 
-	cudaThreadSynchronize();
+	//A reallocated object table goes up whatever it holds
+	bool objectsDirty = objNum > h_curMaxObjNum || objNum != h_objNum;
 
-	return true;
-}
+	if(!cudaInitialization(edgeNum, maxRangeNum, objNum, vertexNum))
+		return false;
 
+	int firstEdge = 0;
+	int firstVertex = 0;
 
-bool cudaRunProjKernel(int silNum)
-{
-	int gridNum = (silNum * 2 / g_BLOCK_SIZE);
+	for(int i=0; i<objNum; ++i)
+	{
+		const BatchObject& obj = h_objects[i];
 
-	if( (silNum * 2) % g_BLOCK_SIZE != 0 )
-		++gridNum;
+		//Geometry stays on the device, only meshes built since the last frame go up
+		if(!uploadResidentMesh(obj.resident, obj))
+			return false;
 
-	projTransform<<< gridNum, g_BLOCK_SIZE>>> (d_candidateSilhouetteVertex, d_silNum, d_matrixWorldView, d_matrixProj);
+		//Zeroed first, the padding takes part in the comparison below
+		SceneObject sceneObj;
+		memset(&sceneObj, 0, sizeof(SceneObject));
+
+		sceneObj.vertices	= obj.resident->vertices;
+		sceneObj.indices	= obj.resident->indices;
+		sceneObj.edges		= obj.resident->edges;
+		sceneObj.facePlanes	= obj.resident->facePlanes;
+		sceneObj.bvhNodes		= obj.resident->bvhNodes;
+		sceneObj.bvhTriangles	= obj.resident->bvhTriangles;
+		sceneObj.faceNum	= obj.indicesNum / 3;
+		sceneObj.bvhNodeNum	= obj.bvhNodeNum;
+		sceneObj.firstEdge	= firstEdge;
+		sceneObj.visibility	= obj.visibility;
+
+		if(objectsDirty || memcmp(&sceneObj, &h_sceneObjects[i], sizeof(SceneObject)) != 0 || h_objVertexStart[i] != firstVertex)
+		{
+			h_sceneObjects[i] = sceneObj;
+			h_objVertexStart[i] = firstVertex;
+			objectsDirty = true;
+		}
+
+		firstEdge	+= obj.edgeNum;
+		firstVertex	+= obj.vertexNum;
+	}
 
-	cudaThreadSynchronize();
+	h_objVertexStart[objNum] = vertexNum;
 
-	return true;
-}
+	//Cached ray tests stay valid as long as the object table does
+	if(objectsDirty || visibilityRefreshPeriod != h_refreshPeriod)
+		++h_visibilityPass;
 
-bool cudaRunCullKernel(int silNum, int indiceNum)
-{
-	int maxTriangleNum = indiceNum / 3;
-	
-	int gridNum = (silNum * maxTriangleNum / g_BLOCK_SIZE);
+	h_refreshPeriod = visibilityRefreshPeriod;
+	h_retestLimit = visibilityRetestLimit;
+
+	int priorityNum = visibilityPriorityNum(visibilityRefreshPeriod);
+
+	if(priorityNum > h_curMaxPriorityNum)
+	{
+		h_curMaxPriorityNum = priorityNum;
+
+		if(d_priorityNum)
+			cudaFree(d_priorityNum);
+
+		if(cudaMalloc((void**)&d_priorityNum, priorityNum * sizeof(int)) != cudaSuccess)
+			return false;
+	}
+
+	h_objNum = objNum;
+	h_vertexNum = vertexNum;
+
+	for(int i=0; i<objNum; ++i)
+	{
+		h_sceneWorldView[i]	= h_objects[i].worldView;
+		h_sceneEyePos[i]	= h_objects[i].eyePos;
+	}
+
+	if(objectsDirty)
+	{
+		cudaMemcpy(d_objects, h_sceneObjects,			objNum * sizeof(SceneObject),	cudaMemcpyHostToDevice);
+		cudaMemcpy(d_objVertexStart, h_objVertexStart,	(objNum + 1) * sizeof(int),		cudaMemcpyHostToDevice);
+		cudaMemcpy(d_objNum, &objNum,					sizeof(int),					cudaMemcpyHostToDevice);
+	}
+
+	//What moves every frame: the matrices and the eye positions that follow from them
+	cudaMemcpyAsync(d_eyePos, h_sceneEyePos,			objNum * sizeof(D3DXVECTOR3),	cudaMemcpyHostToDevice, h_stream);
+	cudaMemcpyAsync(d_matrixWorldView, h_sceneWorldView,	objNum * sizeof(D3DXMATRIX),	cudaMemcpyHostToDevice, h_stream);
+	cudaMemcpyAsync(d_matrixProj, h_matrixProj,						sizeof(D3DXMATRIX),	cudaMemcpyHostToDevice, h_stream);
+
+	//The instance hierarchy is refit every frame, so it goes up with the matrices
+	h_instanceNodeNum = h_instanceBVH ? h_instanceBVH->nodeNum : 0;
 
-	if( (silNum * maxTriangleNum) % g_BLOCK_SIZE != 0 )
-		++gridNum;
+	if(h_instanceNodeNum > 0)
+	{
+		for(int i=0; i<objNum; ++i)
+			h_sceneViewWorld[i] = h_objects[i].viewWorld;
+
+		memcpy(h_pinnedInstanceNodes, h_instanceBVH->nodes, h_instanceNodeNum * sizeof(BVHNode));
+		memcpy(h_pinnedInstances, h_instanceBVH->instances, objNum * sizeof(int));
+
+		cudaMemcpyAsync(d_matrixViewWorld, h_sceneViewWorld,		objNum * sizeof(D3DXMATRIX),			cudaMemcpyHostToDevice, h_stream);
+		cudaMemcpyAsync(d_instanceNodes, h_pinnedInstanceNodes,	h_instanceNodeNum * sizeof(BVHNode),	cudaMemcpyHostToDevice, h_stream);
+		cudaMemcpyAsync(d_instances, h_pinnedInstances,			objNum * sizeof(int),					cudaMemcpyHostToDevice, h_stream);
+	}
+
+	//The pyramid only goes up on frames that have an object using it
+	if(h_hiz)
+	{
+		if(!d_hizDepth)
+		{
+			cudaError err = cudaHostAlloc((void**)&h_pinnedHiZ, h_hiz->depthNum * sizeof(float), cudaHostAllocDefault);
+
+			if(err != cudaSuccess)
+				return false;
+
+			err = cudaMalloc((void**)&d_hizDepth, h_hiz->depthNum * sizeof(float));
 
-	cudaMemset(d_isSilhouette, 1, sizeof(bool)*silNum);
+			if(err != cudaSuccess)
+				return false;
+		}
 
-	cullSilouette<<< gridNum, g_BLOCK_SIZE>>> (d_meshVertex, d_indices, d_maxIndiceNum, 
-											  d_candidateSilhouetteVertex, d_silNum, d_isSilhouette, 
-											  d_matrixWorldView);
-	cudaThreadSynchronize();
+		h_deviceHiZ = *h_hiz;
+		h_deviceHiZ.depth = d_hizDepth;
+
+		memcpy(h_pinnedHiZ, h_hiz->depth, h_hiz->depthNum * sizeof(float));
+
+		cudaMemcpyAsync(d_hizDepth, h_pinnedHiZ,	h_hiz->depthNum * sizeof(float),	cudaMemcpyHostToDevice, h_stream);
+	}
 
 	return true;
 }
 
-
-__device__  D3DXVECTOR3 crossProduct(const D3DXVECTOR3& m1, const D3DXVECTOR3& m2)
+//Takes the slot of the next stage, waiting on the stage that had it before
+static StageRecord& beginStage()
 {
-	D3DXVECTOR3 ret;
+	StageTicket ticket = h_submittedStage + 1;
 
-	ret.x = m1.y * m2.z - m1.z * m2.y;
-	ret.y = m1.z * m2.x - m1.x * m2.z;
-	ret.z = m1.x * m2.y - m1.y * m2.x;
+	if(ticket - g_MAX_STAGES_IN_FLIGHT > h_finishedStage)
+		cudaWaitStage(ticket - g_MAX_STAGES_IN_FLIGHT);
 
-	return ret;
+	StageRecord& stage = h_stages[ticket % g_MAX_STAGES_IN_FLIGHT];
+	stage.copyNum = 0;
+
+	return stage;
 }
 
-__device__ float dotProduct(const D3DXVECTOR3& m1, const D3DXVECTOR3& m2)
+static void addHostCopy(StageRecord& stage, void* dst, const void* src, size_t size)
 {
-	float ret = m1.x * m2.x + m1.y * m2.y + m1.z * m2.z;
+	HostCopy& copy = stage.copies[stage.copyNum++];
 
-	return ret;
+	copy.dst	= dst;
+	copy.src	= src;
+	copy.size	= size;
 }
 
-__device__ float length(const D3DXVECTOR3& vec)
+static StageTicket endStage(StageRecord& stage)
 {
-	return sqrt(vec.x*vec.x + vec.y*vec.y + vec.z*vec.z);
+	cudaEventRecord(stage.event, h_stream);
+
+	return ++h_submittedStage;
 }
 
-__device__ D3DXVECTOR3 normalize(const D3DXVECTOR3& vec)
+bool cudaWaitStage( StageTicket ticket )
 {
-	D3DXVECTOR3 ret = vec;
+	if(ticket > h_submittedStage)
+		return false;
 
-	float len = length(ret);
+	//In order: a stage is only done once every stage before it is
+	while(h_finishedStage < ticket)
+	{
+		StageRecord& stage = h_stages[(h_finishedStage + 1) % g_MAX_STAGES_IN_FLIGHT];
 
-	ret.x /= len;
-	ret.y /= len;
-	ret.z /= len;
+		if(cudaEventSynchronize(stage.event) != cudaSuccess)
+			return false;
+
+		for(int i=0; i<stage.copyNum; ++i)
+			memcpy(stage.copies[i].dst, stage.copies[i].src, stage.copies[i].size);
+
+		++h_finishedStage;
+	}
 
-	return ret;
+	return true;
 }
 
-__device__ D3DXVECTOR3 matrixPntMul(const D3DXVECTOR3& pnt, const D3DXMATRIX* mat)
+bool cudaStageDone( StageTicket ticket )
 {
-	
-	D3DXVECTOR3 ret;
-	
-	ret.x = mat->m[0][0] * pnt.x + mat->m[1][0] * pnt.y + mat->m[2][0] * pnt.z + mat->m[3][0];
-	ret.y = mat->m[0][1] * pnt.x + mat->m[1][1] * pnt.y + mat->m[2][1] * pnt.z + mat->m[3][1];
-	ret.z = mat->m[0][2] * pnt.x + mat->m[1][2] * pnt.y + mat->m[2][2] * pnt.z + mat->m[3][2];
-	
-	float w = mat->m[0][3] * pnt.x + mat->m[1][3] * pnt.y + mat->m[2][3] * pnt.z + mat->m[3][3];
-
-	ret.x /= w;
-	ret.y /= w;
-	ret.z /= w;
-
-	return ret;
+	if(ticket > h_submittedStage)
+		return false;
+
+	for(StageTicket i=h_finishedStage + 1; i<=ticket; ++i)
+	{
+		if(cudaEventQuery(h_stages[i % g_MAX_STAGES_IN_FLIGHT].event) != cudaSuccess)
+			return false;
+	}
+
+	//Every one of them is done, the wait only copies their outputs out of the staging
+	return cudaWaitStage(ticket);
 }
 
-__device__ D3DXVECTOR3 matrixVecMul(const D3DXVECTOR3& vec, const D3DXMATRIX* mat)
+bool cudaSubmitSilhouettePass( EdgeRange* h_edgeRanges, int rangeNum,
+							   TrackedEdge* h_trackedEdges, int trackedNum, const int* h_objTrackedNum,
+							   int* h_detectedNum, int* h_objStrokeStart, StageTicket* ticket )
 {
+	cudaWaitStage(h_lastPassStage);
 
-	D3DXVECTOR3 ret;
+	StageRecord& stage = beginStage();
 
-	ret.x = mat->m[0][0] * vec.x + mat->m[1][0] * vec.y + mat->m[2][0] * vec.z;
-	ret.y = mat->m[0][1] * vec.x + mat->m[1][1] * vec.y + mat->m[2][1] * vec.z;
-	ret.z = mat->m[0][2] * vec.x + mat->m[1][2] * vec.y + mat->m[2][2] * vec.z;
+	//Candidates of an object: what its ranges hold at most plus its tracked edges
+	for(int i=0; i<h_objNum; ++i)
+		h_objCandidateBound[i] = h_objTrackedNum[i];
 
-	return ret;
-}
+	for(int i=0; i<rangeNum; ++i)
+		h_objCandidateBound[h_edgeRanges[i].objIdx] += h_edgeRanges[i].edgeNum;
 
+	int candidateBound = 0;
 
-__global__ void findSilhouette(MeshVertex* d_meshVertex,
-							   WORD* d_indices, 
-							   DWORD* d_adjBuffer, 
-							   D3DXMATRIX* d_matrixWorldView,
-							   D3DXMATRIX* d_matrixProj,
-							   bool*	d_isSilhouette,
-							   int* d_maxIndiceNum)
-{
-	const int idx = blockIdx.x * g_BLOCK_SIZE + threadIdx.x;
+	h_pinnedObjTrackedStart[0] = 0;
 
-	if(idx >= *d_maxIndiceNum)
-		return;
-	
-	const int idxTriangle	  = idx / 3;
-	const int idxTriangleBase = idxTriangle * 3;
+	for(int i=0; i<h_objNum; ++i)
+	{
+		h_pinnedObjTrackedStart[i + 1] = h_pinnedObjTrackedStart[i] + h_objTrackedNum[i];
 
-	const int idxV0				= d_indices[idxTriangleBase];
-	const int idxV1				= d_indices[idxTriangleBase + 1];
-	const int idxV2				= d_indices[idxTriangleBase + 2];
+		candidateBound += h_objCandidateBound[i];
+	}
 
-	const D3DXVECTOR3& posV0	= d_meshVertex[idxV0].position;
-	const D3DXVECTOR3& posV1	= d_meshVertex[idxV1].position;
-	const D3DXVECTOR3& posV2	= d_meshVertex[idxV2].position;
+	h_pinnedCounts[0] = rangeNum;
+	h_pinnedCounts[1] = rangeNum * g_EDGE_CLUSTER_SIZE;
+	h_pinnedCounts[2] = trackedNum;
 
-	const D3DXVECTOR3 vecV0V1	= posV1 - posV0;
-	const D3DXVECTOR3 vecV0V2	= posV2 - posV0;
+	memcpy(h_pinnedEdgeRanges, h_edgeRanges, rangeNum * sizeof(EdgeRange));
+	memcpy(h_pinnedTrackedEdges, h_trackedEdges, trackedNum * sizeof(TrackedEdge));
 
-	D3DXVECTOR3 normal1	= crossProduct(vecV0V1, vecV0V2);
+	cudaMemcpyAsync(d_edgeRanges, h_pinnedEdgeRanges,				rangeNum * sizeof(EdgeRange),		cudaMemcpyHostToDevice, h_stream);
+	cudaMemcpyAsync(d_trackedEdges, h_pinnedTrackedEdges,			trackedNum * sizeof(TrackedEdge),	cudaMemcpyHostToDevice, h_stream);
+	cudaMemcpyAsync(d_objTrackedStart, h_pinnedObjTrackedStart,	(h_objNum + 1) * sizeof(int),		cudaMemcpyHostToDevice, h_stream);
+	cudaMemcpyAsync(d_rangeNum, h_pinnedCounts,								sizeof(int),		cudaMemcpyHostToDevice, h_stream);
+	cudaMemcpyAsync(d_slotNum, h_pinnedCounts + 1,							sizeof(int),		cudaMemcpyHostToDevice, h_stream);
+	cudaMemcpyAsync(d_trackedNum, h_pinnedCounts + 2,						sizeof(int),		cudaMemcpyHostToDevice, h_stream);
 
-	D3DXVECTOR3 normal2;
-	const int idxAdjTriangle = d_adjBuffer[idx];
-	
-	if(idxAdjTriangle != -1)
+	//Detection and compaction of the ranges
+	if(rangeNum > 0)
 	{
-		const int idxAdjTriangleBase = idxAdjTriangle * 3;
+		int gridNum = gridSize(rangeNum * g_EDGE_CLUSTER_SIZE);
 
-		const int idxAdjV0			= d_indices[idxAdjTriangleBase];
-		const int idxAdjV1			= d_indices[idxAdjTriangleBase + 1];
-		const int idxAdjV2			= d_indices[idxAdjTriangleBase + 2];
+		findSilhouette<<< gridNum, g_BLOCK_SIZE, 0, h_stream>>> (d_objects, d_eyePos, d_edgeRanges, d_isSilhouette, d_rangeNum);
 
-		const D3DXVECTOR3& posAdjV0	= d_meshVertex[idxAdjV0].position;
-		const D3DXVECTOR3& posAdjV1	= d_meshVertex[idxAdjV1].position;
-		const D3DXVECTOR3& posAdjV2	= d_meshVertex[idxAdjV2].position;
+		scanSilhouetteFlags<<< gridNum, g_BLOCK_SIZE, 0, h_stream>>> (d_isSilhouette, d_silOffsets, d_blockSums, d_slotNum);
 
-		const D3DXVECTOR3 vecAdjV0V1	= posAdjV1 - posAdjV0;
-		const D3DXVECTOR3 vecAdjV0V2	= posAdjV2 - posAdjV0;
+		scanBlockSums<<< 1, g_BLOCK_SIZE, 0, h_stream>>> (d_blockSums, d_slotNum, d_silCount);
 
-		normal2 = crossProduct(vecAdjV0V1, vecAdjV0V2);
+		compactSilhouettes<<< gridNum, g_BLOCK_SIZE, 0, h_stream>>> (d_objects, d_edgeRanges, d_isSilhouette,
+																	  d_silOffsets, d_blockSums, d_rangeNum,
+																	  d_silVertex, d_silNormal, d_silEdgeIdx, d_silObj);
 	}
 	else
 	{
-		normal2 = -normal1;
+		cudaMemsetAsync(d_silCount, 0, sizeof(int), h_stream);
 	}
 
-	D3DXVECTOR3 eyeToVertex = matrixPntMul(posV0, d_matrixWorldView);
+	//Detected and tracked silhouettes together, object after object, the counts never leave the device
+	scanObjects<<< 1, g_BLOCK_SIZE, 0, h_stream>>> (d_objNum, d_silObj, d_silCount,
+													d_objDetectedStart, d_objTrackedStart, 
+													d_objSilStart, d_candidateNum);
 
-	normal1 = matrixVecMul(normal1, d_matrixWorldView);
-	normal2 = matrixVecMul(normal2, d_matrixWorldView);
+	//Marks of the amortized ray test, this pass's half is cleared with the vertex cache. The last
+	//pass's half counts only when that pass wrote it, after a skipped pass number or a pass without
+	//candidates it holds marks from before, maybe of other vertex numbers.
+	++h_visibilityPass;
 
-	float dot1 = dotProduct(normal1, eyeToVertex);
-	float dot2 = dotProduct(normal2, eyeToVertex);
-	
-	if(dot1 * dot2 < 0.0f)
+	int* vertexMark		= d_vertexMark + (h_visibilityPass & 1) * h_curMaxVertexNum;
+	int* lastVertexMark	= d_vertexMark + ((h_visibilityPass + 1) & 1) * h_curMaxVertexNum;
+
+	if(h_refreshPeriod <= 1 || candidateBound <= 0)
 	{
-		//It's a silhouette
-		d_isSilhouette[idx] = true;
+		vertexMark = lastVertexMark = NULL;
 	}
 	else
 	{
-		d_isSilhouette[idx] = false;
+		if(h_vertexMarkPass[(h_visibilityPass + 1) & 1] != h_visibilityPass - 1)
+			lastVertexMark = NULL;
+
+		h_vertexMarkPass[h_visibilityPass & 1] = h_visibilityPass;
+	}
+
+	//Every vertex to view space once, whatever reads a view space position from here on takes it from the cache
+	if(candidateBound > 0)
+	{
+		transformVertices<<< gridSize(h_vertexNum), g_BLOCK_SIZE, 0, h_stream>>> (d_objects, d_objNum, d_objVertexStart,
+																				   d_matrixWorldView, d_viewVertex, vertexMark);
+
+		scatterCandidates<<< gridSize(candidateBound), g_BLOCK_SIZE, 0, h_stream>>> (d_objects, d_silVertex, d_silNormal, d_silEdgeIdx, d_silObj, d_silCount,
+																					  d_trackedEdges, d_trackedNum,
+																					  d_objDetectedStart, d_objTrackedStart, d_objSilStart,
+																					  d_objVertexStart, d_viewVertex,
+																					  d_candidateSilhouetteVertex, d_candidateSilhouetteNormal,
+																					  d_candidateSilhouetteViewVertex, d_candidateEdge, d_isSilhouette);
+	}
+
+	//Which candidates of the amortized objects get the ray test, decided before any of them runs so
+	//that the retest limit goes by priority and candidate order, not by the order of the threads
+	if(vertexMark)
+	{
+		int priorityCount = visibilityPriorityNum(h_refreshPeriod);
+
+		if(h_retestLimit > 0)
+			cudaMemsetAsync(d_priorityNum, 0, priorityCount * sizeof(int), h_stream);
+
+		rankVisibilityTests<<< gridSize(candidateBound), g_BLOCK_SIZE, 0, h_stream>>> (d_objects, d_objNum, d_objSilStart, d_candidateNum,
+																						d_objVertexStart, d_candidateEdge, d_edgeVisibility,
+																						lastVertexMark, h_visibilityPass, h_refreshPeriod,
+																						h_retestLimit > 0 ? d_priorityNum : NULL,
+																						d_visibilityTest);
+
+		if(h_retestLimit > 0)
+			selectVisibilityTests<<< 1, g_BLOCK_SIZE, 0, h_stream>>> (d_candidateNum, d_priorityNum, priorityCount, h_retestLimit, d_visibilityTest);
+	}
+
+	//One thread per candidate walking the triangle hierarchy of its object
+	if(candidateBound > 0)
+	{
+		cullSilouette<<< gridSize(candidateBound), g_BLOCK_SIZE, 0, h_stream>>> (d_objects, d_eyePos, d_objNum, d_objSilStart,
+																				 d_candidateNum, d_candidateSilhouetteVertex, d_candidateSilhouetteNormal,
+																				 d_candidateSilhouetteViewVertex, d_isSilhouette,
+																				 d_objVertexStart, d_viewVertex, d_matrixViewWorld, d_matrixProj, h_deviceHiZ,
+																				 d_instanceNodes, h_instanceNodeNum, d_instances,
+																				 d_candidateEdge, d_edgeVisibility, lastVertexMark, vertexMark,
+																				 h_visibilityPass, d_visibilityTest);
+	}
+
+	//Then the same compaction over the cull flags, projecting what survived
+	int gridNum = gridSize(candidateBound);
+
+	if(gridNum > 0)
+		scanSilhouetteFlags<<< gridNum, g_BLOCK_SIZE, 0, h_stream>>> (d_isSilhouette, d_silOffsets, d_blockSums, d_candidateNum);
+
+	scanBlockSums<<< 1, g_BLOCK_SIZE, 0, h_stream>>> (d_blockSums, d_candidateNum, d_strokeNum);
+
+	if(gridNum > 0)
+	{
+		compactStrokes<<< gridNum, g_BLOCK_SIZE, 0, h_stream>>> (d_isSilhouette, d_silOffsets, d_blockSums, d_candidateNum,
+																 d_candidateSilhouetteVertex, d_candidateSilhouetteNormal,
+																 d_candidateSilhouetteViewVertex, d_matrixProj,
+																 d_strokeVertex, d_strokeNormal, d_strokeProj);
 	}
+
+	findObjectStrokes<<< gridSize(h_objNum + 1), g_BLOCK_SIZE, 0, h_stream>>> (d_objNum, d_objSilStart, d_silOffsets, d_blockSums,
+																				d_candidateNum, d_strokeNum, d_objStrokeStart);
+
+	cudaMemcpyAsync(h_pinnedCounts + 3, d_silCount,					sizeof(int),					cudaMemcpyDeviceToHost, h_stream);
+	cudaMemcpyAsync(h_pinnedObjStrokeStart, d_objStrokeStart,		(h_objNum + 1) * sizeof(int),	cudaMemcpyDeviceToHost, h_stream);
+
+	addHostCopy(stage, h_detectedNum, h_pinnedCounts + 3,				sizeof(int));
+	addHostCopy(stage, h_objStrokeStart, h_pinnedObjStrokeStart,	(h_objNum + 1) * sizeof(int));
+
+	*ticket = h_lastPassStage = endStage(stage);
+
+	return true;
+}
+
+bool cudaSubmitStrokeReadback( D3DXVECTOR3* h_strokeVertex, D3DXVECTOR3* h_strokeNormal, D3DXVECTOR3* h_strokeProj, int strokeNum,
+							   int* h_silEdgeIdx, int detectedNum, StageTicket* ticket )
+{
+	cudaWaitStage(h_lastReadbackStage);
+
+	StageRecord& stage = beginStage();
+
+	size_t strokeSize = strokeNum * 2 * sizeof(D3DXVECTOR3);
+
+	cudaMemcpyAsync(h_pinnedStrokeVertex, d_strokeVertex,	strokeSize,					cudaMemcpyDeviceToHost, h_stream);
+	cudaMemcpyAsync(h_pinnedStrokeNormal, d_strokeNormal,	strokeSize,					cudaMemcpyDeviceToHost, h_stream);
+	cudaMemcpyAsync(h_pinnedStrokeProj, d_strokeProj,		strokeSize,					cudaMemcpyDeviceToHost, h_stream);
+	cudaMemcpyAsync(h_pinnedSilEdgeIdx, d_silEdgeIdx,		detectedNum * sizeof(int),	cudaMemcpyDeviceToHost, h_stream);
+
+	addHostCopy(stage, h_strokeVertex, h_pinnedStrokeVertex,	strokeSize);
+	addHostCopy(stage, h_strokeNormal, h_pinnedStrokeNormal,	strokeSize);
+	addHostCopy(stage, h_strokeProj, h_pinnedStrokeProj,		strokeSize);
+	addHostCopy(stage, h_silEdgeIdx, h_pinnedSilEdgeIdx,		detectedNum * sizeof(int));
+
+	*ticket = h_lastReadbackStage = endStage(stage);
+
+	return true;
 }
 
-__global__ void projTransform( D3DXVECTOR3* d_meshVertexProj,
-							   int*			d_silNum,
-							   D3DXMATRIX*	d_matrixWorldView,
-							   D3DXMATRIX*	d_matrixProj)
+bool cudaSubmitViewVertexReadback( StageTicket* ticket )
 {
-	const int idx = blockIdx.x * g_BLOCK_SIZE + threadIdx.x;
+	cudaWaitStage(h_lastViewVertexStage);
 
-	int silVerticesNum = (*d_silNum) * 2;
- 
-	if(idx >= silVerticesNum)
-		return;
+	StageRecord& stage = beginStage();
 
-	//Projection Transformation
-	d_meshVertexProj[idx] = matrixPntMul(d_meshVertexProj[idx], d_matrixWorldView);
-	d_meshVertexProj[idx] = matrixPntMul(d_meshVertexProj[idx], d_matrixProj);
+	//Runs of objects to read go back in one copy each, the whole cache when objects hide each other
+	int runStart = -1;
+
+	for(int i=0; i<=h_objNum; ++i)
+	{
+		bool isRead = i < h_objNum && (h_instanceNodeNum > 0 || h_sceneObjects[i].visibility == VISIBILITY_QUANTITATIVE);
+
+		if(isRead && runStart < 0)
+			runStart = i;
+
+		if(isRead || runStart < 0)
+			continue;
+
+		int firstVertex = h_objVertexStart[runStart];
+
+		cudaMemcpyAsync(h_pinnedViewVertex + firstVertex, d_viewVertex + firstVertex,
+						(h_objVertexStart[i] - firstVertex) * sizeof(D3DXVECTOR3), cudaMemcpyDeviceToHost, h_stream);
+
+		runStart = -1;
+	}
+
+	*ticket = h_lastViewVertexStage = endStage(stage);
+
+	return true;
 }
 
-__global__ void cullSilouette(MeshVertex* d_meshVertex,
-							 WORD* d_indices,
-							 int* d_maxIndiceNum,
-							 D3DXVECTOR3* d_candidateSilhouetteVertex,
-							 int*	d_silNum,
-							 bool*	d_isSilhouette,
-							 D3DXMATRIX* d_matrixWorldView)
+const D3DXVECTOR3* cudaViewVertices( int objIdx )
 {
-	const int idx = blockIdx.x * g_BLOCK_SIZE + threadIdx.x;
+	return h_pinnedViewVertex + h_objVertexStart[objIdx];
+}
 
-	int triangleNum = *d_maxIndiceNum / 3;
 
-	if(idx >= *d_silNum * triangleNum)
-		return;
+__global__ void transformVertices(SceneObject* d_objects,
+								  int* d_objNum,
+								  int* d_objVertexStart,
+								  D3DXMATRIX* d_matrixWorldView,
+								  D3DXVECTOR3* d_viewVertex,
+								  int* d_vertexMark)
+{
+	const int objNum = *d_objNum;
+	const int vertexNum = d_objVertexStart[objNum];
 
-	int silIdx = idx / triangleNum;
+	for(int idx = blockIdx.x * g_BLOCK_SIZE + threadIdx.x; idx < vertexNum; idx += gridDim.x * g_BLOCK_SIZE)
+	{
+		int objIdx = findBatchObject(d_objVertexStart, objNum, idx);
 
-	if(!d_isSilhouette[silIdx])
-		return;
+		d_viewVertex[idx] = viewTransformElement(d_objects[objIdx].vertices[idx - d_objVertexStart[objIdx]], &d_matrixWorldView[objIdx]);
 
-	int triangleIdx = idx % triangleNum;
+		if(d_vertexMark)
+			d_vertexMark[idx] = 0;
+	}
+}
 
-	D3DXVECTOR3 endPnt1 = matrixPntMul(d_candidateSilhouetteVertex[2*silIdx], d_matrixWorldView);
-	D3DXVECTOR3 endPnt2 = matrixPntMul(d_candidateSilhouetteVertex[2*silIdx+1], d_matrixWorldView);
+__global__ void findSilhouette(SceneObject* d_objects,
+							   D3DXVECTOR3* d_eyePos,
+							   EdgeRange* d_edgeRanges,
+							   bool*	d_isSilhouette,
+							   int* d_rangeNum)
+{
+	//One thread per range slot, slots past the end of a short range stay idle
+	const int slotNum = *d_rangeNum * g_EDGE_CLUSTER_SIZE;
 
-	D3DXVECTOR3 silMidPnt = (endPnt1 + endPnt2) / 2.0f;
+	for(int idx = blockIdx.x * g_BLOCK_SIZE + threadIdx.x; idx < slotNum; idx += gridDim.x * g_BLOCK_SIZE)
+	{
+		EdgeRange range = d_edgeRanges[idx / g_EDGE_CLUSTER_SIZE];
+		int edgeOffset = idx % g_EDGE_CLUSTER_SIZE;
+
+		//Idle slots are cleared so the compaction can scan every slot
+		if(edgeOffset >= range.edgeNum)
+		{
+			d_isSilhouette[idx] = false;
+		}
+		else
+		{
+			const SceneObject& obj = d_objects[range.objIdx];
+
+			d_isSilhouette[idx] = findSilhouetteElement(obj.edges[range.firstEdge + edgeOffset],
+														obj.facePlanes, d_eyePos[range.objIdx]);
+		}
+	}
+}
 
-	WORD triangleV0Idx = d_indices[3*triangleIdx];
-	WORD triangleV1Idx = d_indices[3*triangleIdx+1];
-	WORD triangleV2Idx = d_indices[3*triangleIdx+2];
+//Inclusive scan of one value per thread over the block in shared memory
+__device__ int blockInclusiveScan(int* s_scan, int value)
+{
+	s_scan[threadIdx.x] = value;
+	__syncthreads();
+
+	for(int stride=1; stride<g_BLOCK_SIZE; stride*=2)
+	{
+		int addend = threadIdx.x >= stride ? s_scan[threadIdx.x - stride] : 0;
+		__syncthreads();
+
+		s_scan[threadIdx.x] += addend;
+		__syncthreads();
+	}
 
-	D3DXVECTOR3 v0Pos = d_meshVertex[triangleV0Idx].position;
-	D3DXVECTOR3 v1Pos = d_meshVertex[triangleV1Idx].position;
-	D3DXVECTOR3 v2Pos = d_meshVertex[triangleV2Idx].position;
+	return s_scan[threadIdx.x];
+}
 
-	v0Pos = matrixPntMul(v0Pos, d_matrixWorldView);
-	v1Pos = matrixPntMul(v1Pos, d_matrixWorldView);
-	v2Pos = matrixPntMul(v2Pos, d_matrixWorldView);
+__global__ void scanSilhouetteFlags(bool* d_isSilhouette,
+									int* d_silOffsets,
+									int* d_blockSums,
+									int* d_flagNum)
+{
+	__shared__ int s_scan[g_BLOCK_SIZE];
 
-	D3DXVECTOR3 origin = D3DXVECTOR3(0,0,0);
-	bool isInvisible = segmentIntersectTriangle(origin, silMidPnt, v0Pos, v1Pos, v2Pos);
+	const int flagNum = *d_flagNum;
+	const int tileNum = (flagNum + g_BLOCK_SIZE - 1) / g_BLOCK_SIZE;
 
-	if(isInvisible)
+	//One tile of g_BLOCK_SIZE slots at a time, each tile gets its own total
+	for(int tile = blockIdx.x; tile < tileNum; tile += gridDim.x)
 	{
-		d_isSilhouette[silIdx] = false;
+		const int idx = tile * g_BLOCK_SIZE + threadIdx.x;
+
+		int flag = (idx < flagNum && d_isSilhouette[idx]) ? 1 : 0;
+		int total = blockInclusiveScan(s_scan, flag);
+
+		if(idx < flagNum)
+			d_silOffsets[idx] = total - flag;
+
+		if(threadIdx.x == g_BLOCK_SIZE - 1)
+			d_blockSums[tile] = total;
+
+		__syncthreads();
 	}
 }
 
-__device__ bool segmentIntersectTriangle(const D3DXVECTOR3& orig, 
-										 const D3DXVECTOR3& des,
-										 const D3DXVECTOR3& v0, 
-										 const D3DXVECTOR3& v1, 
-										 const D3DXVECTOR3& v2)
+//A single block walks over all block totals, turning them into block offsets
+__global__ void scanBlockSums(int* d_blockSums,
+							  int* d_flagNum,
+							  int* d_silCount)
 {
-	float t,u,v;
-	const D3DXVECTOR3 tmpDir = des - orig;
-	
-	D3DXVECTOR3 dir = normalize(tmpDir);
+	__shared__ int s_scan[g_BLOCK_SIZE];
+	__shared__ int s_carry;
 
-	// Find vectors for two edges sharing vert0
-	D3DXVECTOR3 edge1 = v1 - v0;
-	D3DXVECTOR3 edge2 = v2 - v0;
+	const int flagNum = *d_flagNum;
+	const int blockNum = (flagNum + g_BLOCK_SIZE - 1) / g_BLOCK_SIZE;
 
-	// Begin calculating determinant - also used to calculate U parameter
-	D3DXVECTOR3 pvec;
-	pvec = crossProduct(dir, edge2);
+	if(threadIdx.x == 0)
+		s_carry = 0;
 
-	// If determinant is near zero, ray lies in plane of triangle
-	float det = dotProduct(edge1, pvec);
+	__syncthreads();
 
-	D3DXVECTOR3 tvec;
-	if( det > 0 )
+	for(int first=0; first<blockNum; first+=g_BLOCK_SIZE)
 	{
-		tvec = orig - v0;
+		const int idx = first + threadIdx.x;
+
+		int value = idx < blockNum ? d_blockSums[idx] : 0;
+		int total = blockInclusiveScan(s_scan, value);
+
+		if(idx < blockNum)
+			d_blockSums[idx] = s_carry + total - value;
+
+		__syncthreads();
+
+		if(threadIdx.x == g_BLOCK_SIZE - 1)
+			s_carry += total;
+
+		__syncthreads();
 	}
-	else
+
+	if(threadIdx.x == 0)
+		*d_silCount = s_carry;
+}
+
+__global__ void compactSilhouettes(SceneObject* d_objects,
+								   EdgeRange* d_edgeRanges,
+								   bool* d_isSilhouette,
+								   int* d_silOffsets,
+								   int* d_blockSums,
+								   int* d_rangeNum,
+								   D3DXVECTOR3* d_silVertex,
+								   D3DXVECTOR3* d_silNormal,
+								   int* d_silEdgeIdx,
+								   int* d_silObj)
+{
+	const int slotNum = *d_rangeNum * g_EDGE_CLUSTER_SIZE;
+
+	for(int idx = blockIdx.x * g_BLOCK_SIZE + threadIdx.x; idx < slotNum; idx += gridDim.x * g_BLOCK_SIZE)
 	{
-		tvec = v0 - orig;
-		det = -det;
+		if(!d_isSilhouette[idx])
+			continue;
+
+		//d_blockSums holds the offset of every tile by now
+		int silIdx = d_blockSums[idx / g_BLOCK_SIZE] + d_silOffsets[idx];
+		EdgeRange range = d_edgeRanges[idx / g_EDGE_CLUSTER_SIZE];
+		const SceneObject& obj = d_objects[range.objIdx];
+		int edgeIdx = range.firstEdge + idx % g_EDGE_CLUSTER_SIZE;
+
+		MeshEdge edge = obj.edges[edgeIdx];
+
+		d_silVertex[2 * silIdx]		= obj.vertices[edge.v0].position;
+		d_silVertex[2 * silIdx + 1]	= obj.vertices[edge.v1].position;
+		d_silNormal[2 * silIdx]		= obj.vertices[edge.v0].normal;
+		d_silNormal[2 * silIdx + 1]	= obj.vertices[edge.v1].normal;
+		d_silEdgeIdx[silIdx]		= obj.firstEdge + edgeIdx;
+		d_silObj[silIdx]			= range.objIdx;
 	}
+}
 
-	if( det < 0.0001f )
-		return false;
+//First silhouette of object objIdx or a later one in the detected list, sorted by object
+__device__ int findFirstDetected(const int* d_silObj, int silNum, int objIdx)
+{
+	int low = 0;
+	int high = silNum;
 
-	// Calculate U parameter and test bounds
-	u = dotProduct(tvec, pvec);
+	while(low < high)
+	{
+		int mid = (low + high) / 2;
 
-	if( u < 0.0f || u > det )
-		return false;
+		if(d_silObj[mid] < objIdx)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
 
-	// Prepare to test V parameter
-	D3DXVECTOR3 qvec;
-	qvec = crossProduct(tvec, edge1);
+__global__ void scanObjects(int* d_objNum,
+							int* d_silObj,
+							int* d_silCount,
+							int* d_objDetectedStart,
+							int* d_objTrackedStart,
+							int* d_objSilStart,
+							int* d_candidateNum)
+{
+	const int objNum = *d_objNum;
 
-	// Calculate V parameter and test bounds
-	v = dotProduct(dir, qvec);
+	//A single block: the detected starts by search, the candidates of an object then follow from them
+	for(int objIdx = threadIdx.x; objIdx <= objNum; objIdx += g_BLOCK_SIZE)
+	{
+		int detectedStart = findFirstDetected(d_silObj, *d_silCount, objIdx);
 
-	if( v < 0.0f || u + v > det )
-		return false;
+		d_objDetectedStart[objIdx] = detectedStart;
+		d_objSilStart[objIdx] = detectedStart + d_objTrackedStart[objIdx];
+	}
 
-	// Calculate t, scale parameters, ray intersects triangle
-	t = dotProduct(edge2, qvec);
-	FLOAT fInvDet = 1.0f / det;
-	t *= fInvDet;
-	u *= fInvDet;
-	v *= fInvDet;
-	
-	if( length(orig + t * dir) > length(des - orig) )
-		return false;
-	else if( fabs(length(orig + t * dir) - length(des - orig)) < 0.0001 )
-		return false;
-		
-	return true;
+	__syncthreads();
+
+	if(threadIdx.x == 0)
+		*d_candidateNum = d_objSilStart[objNum];
 }
 
-bool cudaGetCulledDataFromGPU( bool* h_isSilhouette, int h_silNum )
+__global__ void scatterCandidates(SceneObject* d_objects,
+								  D3DXVECTOR3* d_silVertex,
+								  D3DXVECTOR3* d_silNormal,
+								  int* d_silEdgeIdx,
+								  int* d_silObj,
+								  int* d_silCount,
+								  TrackedEdge* d_trackedEdges,
+								  int* d_trackedNum,
+								  int* d_objDetectedStart,
+								  int* d_objTrackedStart,
+								  int* d_objSilStart,
+								  int* d_objVertexStart,
+								  D3DXVECTOR3* d_viewVertex,
+								  D3DXVECTOR3* d_candidateSilhouetteVertex,
+								  D3DXVECTOR3* d_candidateSilhouetteNormal,
+								  D3DXVECTOR3* d_candidateSilhouetteViewVertex,
+								  int* d_candidateEdge,
+								  bool* d_isSilhouette)
 {
-	cudaMemcpy(h_isSilhouette, d_isSilhouette,	 h_silNum * sizeof(bool), cudaMemcpyDeviceToHost);
+	const int detectedNum = *d_silCount;
+	const int candidateNum = detectedNum + *d_trackedNum;
 
-	return true;
+	for(int idx = blockIdx.x * g_BLOCK_SIZE + threadIdx.x; idx < candidateNum; idx += gridDim.x * g_BLOCK_SIZE)
+	{
+		int candidateIdx = 0;
+
+		//Detected silhouettes of an object come first, its tracked ones after them
+		if(idx < detectedNum)
+		{
+			int objIdx = d_silObj[idx];
+			const SceneObject& obj = d_objects[objIdx];
+
+			candidateIdx = d_objSilStart[objIdx] + idx - d_objDetectedStart[objIdx];
+
+			MeshEdge edge = obj.edges[d_silEdgeIdx[idx] - obj.firstEdge];
+			const D3DXVECTOR3* viewVertex = d_viewVertex + d_objVertexStart[objIdx];
+
+			d_candidateSilhouetteVertex[2 * candidateIdx]		= d_silVertex[2 * idx];
+			d_candidateSilhouetteVertex[2 * candidateIdx + 1]	= d_silVertex[2 * idx + 1];
+			d_candidateSilhouetteNormal[2 * candidateIdx]		= d_silNormal[2 * idx];
+			d_candidateSilhouetteNormal[2 * candidateIdx + 1]	= d_silNormal[2 * idx + 1];
+			d_candidateSilhouetteViewVertex[2 * candidateIdx]		= viewVertex[edge.v0];
+			d_candidateSilhouetteViewVertex[2 * candidateIdx + 1]	= viewVertex[edge.v1];
+			d_candidateEdge[candidateIdx] = d_silEdgeIdx[idx];
+		}
+		else
+		{
+			int trackedIdx = idx - detectedNum;
+			TrackedEdge tracked = d_trackedEdges[trackedIdx];
+			const SceneObject& obj = d_objects[tracked.objIdx];
+
+			int detectedNumOfObj = d_objDetectedStart[tracked.objIdx + 1] - d_objDetectedStart[tracked.objIdx];
+
+			candidateIdx = d_objSilStart[tracked.objIdx] + detectedNumOfObj + trackedIdx - d_objTrackedStart[tracked.objIdx];
+
+			MeshEdge edge = obj.edges[tracked.edge];
+			const D3DXVECTOR3* viewVertex = d_viewVertex + d_objVertexStart[tracked.objIdx];
+
+			d_candidateSilhouetteVertex[2 * candidateIdx]		= obj.vertices[edge.v0].position;
+			d_candidateSilhouetteVertex[2 * candidateIdx + 1]	= obj.vertices[edge.v1].position;
+			d_candidateSilhouetteNormal[2 * candidateIdx]		= obj.vertices[edge.v0].normal;
+			d_candidateSilhouetteNormal[2 * candidateIdx + 1]	= obj.vertices[edge.v1].normal;
+			d_candidateSilhouetteViewVertex[2 * candidateIdx]		= viewVertex[edge.v0];
+			d_candidateSilhouetteViewVertex[2 * candidateIdx + 1]	= viewVertex[edge.v1];
+			d_candidateEdge[candidateIdx] = obj.firstEdge + tracked.edge;
+		}
+
+		//Visible until the cull finds an occluder
+		d_isSilhouette[candidateIdx] = true;
+	}
 }
 
-bool cudaCullInit( int silNum )
+__global__ void compactStrokes(bool* d_isSilhouette,
+							   int* d_silOffsets,
+							   int* d_blockSums,
+							   int* d_candidateNum,
+							   D3DXVECTOR3* d_candidateSilhouetteVertex,
+							   D3DXVECTOR3* d_candidateSilhouetteNormal,
+							   D3DXVECTOR3* d_candidateSilhouetteViewVertex,
+							   D3DXMATRIX* d_matrixProj,
+							   D3DXVECTOR3* d_strokeVertex,
+							   D3DXVECTOR3* d_strokeNormal,
+							   D3DXVECTOR3* d_strokeProj)
 {
-	cudaError err = cudaSuccess;
+	const int candidateNum = *d_candidateNum;
 
-	if(silNum > h_curMaxSilNum)
+	for(int idx = blockIdx.x * g_BLOCK_SIZE + threadIdx.x; idx < candidateNum; idx += gridDim.x * g_BLOCK_SIZE)
 	{
-		h_curMaxSilNum = silNum;
+		if(!d_isSilhouette[idx])
+			continue;
 
-		if(d_candidateSilhouetteVertex)
-			cudaFree(d_candidateSilhouetteVertex);
+		int strokeIdx = d_blockSums[idx / g_BLOCK_SIZE] + d_silOffsets[idx];
 
-		err = cudaMalloc((void**)&d_candidateSilhouetteVertex, silNum * 2 * sizeof(D3DXVECTOR3));
+		for(int end=0; end<2; ++end)
+		{
+			d_strokeVertex[2 * strokeIdx + end]	= d_candidateSilhouetteVertex[2 * idx + end];
+			d_strokeNormal[2 * strokeIdx + end]	= d_candidateSilhouetteNormal[2 * idx + end];
 
-		if(err != cudaSuccess)
-			return false;
+			//Projection Transformation
+			d_strokeProj[2 * strokeIdx + end]	= projTransformElement(d_candidateSilhouetteViewVertex[2 * idx + end], d_matrixProj);
+		}
+	}
+}
 
-		if(d_silNum)
-			cudaFree(d_silNum);
+__global__ void findObjectStrokes(int* d_objNum,
+								  int* d_objSilStart,
+								  int* d_silOffsets,
+								  int* d_blockSums,
+								  int* d_candidateNum,
+								  int* d_strokeNum,
+								  int* d_objStrokeStart)
+{
+	const int objNum = *d_objNum;
+	const int candidateNum = *d_candidateNum;
 
-		err = cudaMalloc((void**)&d_silNum, sizeof(int));
+	//The strokes of an object start where the compaction put its first candidate
+	for(int objIdx = blockIdx.x * g_BLOCK_SIZE + threadIdx.x; objIdx <= objNum; objIdx += gridDim.x * g_BLOCK_SIZE)
+	{
+		int candidateIdx = d_objSilStart[objIdx];
 
-		if(err != cudaSuccess)
-			return false;
+		if(candidateIdx < candidateNum)
+			d_objStrokeStart[objIdx] = d_blockSums[candidateIdx / g_BLOCK_SIZE] + d_silOffsets[candidateIdx];
+		else
+			d_objStrokeStart[objIdx] = *d_strokeNum;
 	}
+}
 
-	return true;
+//Priority of every candidate of an exact object, -1 for none, see visibilityTestPriority, counted per
+//priority under a retest limit. Without one every candidate that asks gets the ray test right away.
+__global__ void rankVisibilityTests(SceneObject* d_objects,
+									int* d_objNum,
+									int* d_objSilStart,
+									int* d_candidateNum,
+									int* d_objVertexStart,
+									int* d_candidateEdge,
+									EdgeVisibility* d_edgeVisibility,
+									int* d_lastVertexMark,
+									int visibilityPass,
+									int refreshPeriod,
+									int* d_priorityNum,
+									int* d_visibilityTest)
+{
+	const int objNum = *d_objNum;
+	const int candidateNum = *d_candidateNum;
+
+	for(int silIdx = blockIdx.x * g_BLOCK_SIZE + threadIdx.x; silIdx < candidateNum; silIdx += gridDim.x * g_BLOCK_SIZE)
+	{
+		int objIdx = findBatchObject(d_objSilStart, objNum, silIdx);
+
+		const SceneObject& obj = d_objects[objIdx];
+
+		int priority = -1;
+
+		if(obj.visibility == VISIBILITY_EXACT)
+		{
+			int sceneEdge = d_candidateEdge[silIdx];
+
+			MeshEdge edge = obj.edges[sceneEdge - obj.firstEdge];
+
+			int mark0 = d_lastVertexMark ? d_lastVertexMark[d_objVertexStart[objIdx] + edge.v0] : 0;
+			int mark1 = d_lastVertexMark ? d_lastVertexMark[d_objVertexStart[objIdx] + edge.v1] : 0;
+
+			priority = visibilityTestPriority(d_edgeVisibility[sceneEdge], visibilityPass, sceneEdge, refreshPeriod, mark0, mark1);
+		}
+
+		if(!d_priorityNum)
+		{
+			d_visibilityTest[silIdx] = priority < 0 ? g_VISIBILITY_CACHED : g_VISIBILITY_RAY_TEST;
+			continue;
+		}
+
+		if(priority >= 0)
+			atomicAdd(&d_priorityNum[priority], 1);
+
+		d_visibilityTest[silIdx] = priority;
+	}
 }
 
-bool cudaPassCullDataToGPU( D3DXVECTOR3* h_meshVertexProj, int h_silNum )
+//A single block splits the retest limit over the priorities, then walks over the candidates in order:
+//all below the last priority get the ray test, and as many of the last one as the limit has left,
+//counted with a running scan like the one of scanBlockSums
+__global__ void selectVisibilityTests(int* d_candidateNum,
+									  int* d_priorityNum,
+									  int priorityCount,
+									  int retestLimit,
+									  int* d_visibilityTest)
 {
-	if(!cudaCullInit(h_silNum))
-		return false;
+	__shared__ int s_scan[g_BLOCK_SIZE];
+	__shared__ int s_carry;
+	__shared__ int s_lastPriority;
+	__shared__ int s_lastNum;
 
-	cudaMemcpy(d_silNum, &h_silNum, sizeof(int), cudaMemcpyHostToDevice);
-	cudaMemcpy(d_candidateSilhouetteVertex, h_meshVertexProj, h_silNum * 2 * sizeof(D3DXVECTOR3), cudaMemcpyHostToDevice);
+	const int candidateNum = *d_candidateNum;
 
-	return true;
-}
\ No newline at end of file
+	if(threadIdx.x == 0)
+	{
+		splitRetestLimit(d_priorityNum, priorityCount, retestLimit, &s_lastPriority, &s_lastNum);
+		s_carry = 0;
+	}
+
+	__syncthreads();
+
+	for(int first=0; first<candidateNum; first+=g_BLOCK_SIZE)
+	{
+		const int idx = first + threadIdx.x;
+
+		int priority = idx < candidateNum ? d_visibilityTest[idx] : -1;
+		int flag = priority == s_lastPriority ? 1 : 0;
+		int total = blockInclusiveScan(s_scan, flag);
+
+		if(idx < candidateNum)
+		{
+			int test = g_VISIBILITY_DEFERRED;
+
+			if(priority < 0)
+				test = g_VISIBILITY_CACHED;
+			else if(priority < s_lastPriority || (flag && s_carry + total - 1 < s_lastNum))
+				test = g_VISIBILITY_RAY_TEST;
+
+			d_visibilityTest[idx] = test;
+		}
+
+		__syncthreads();
+
+		if(threadIdx.x == g_BLOCK_SIZE - 1)
+			s_carry += total;
+
+		__syncthreads();
+	}
+}
+
+__global__ void cullSilouette(SceneObject* d_objects,
+							 D3DXVECTOR3* d_eyePos,
+							 int* d_objNum,
+							 int* d_objSilStart,
+							 int* d_candidateNum,
+							 D3DXVECTOR3* d_candidateSilhouetteVertex,
+							 D3DXVECTOR3* d_candidateSilhouetteNormal,
+							 D3DXVECTOR3* d_candidateSilhouetteViewVertex,
+							 bool*	d_isSilhouette,
+							 int* d_objVertexStart,
+							 D3DXVECTOR3* d_viewVertex,
+							 D3DXMATRIX* d_matrixViewWorld,
+							 D3DXMATRIX* d_matrixProj,
+							 HiZPyramid d_hiz,
+							 BVHNode* d_instanceNodes,
+							 int instanceNodeNum,
+							 int* d_instances,
+							 int* d_candidateEdge,
+							 EdgeVisibility* d_edgeVisibility,
+							 int* d_lastVertexMark,
+							 int* d_vertexMark,
+							 int visibilityPass,
+							 int* d_visibilityTest)
+{
+	const int objNum = *d_objNum;
+	const int candidateNum = *d_candidateNum;
+
+	for(int silIdx = blockIdx.x * g_BLOCK_SIZE + threadIdx.x; silIdx < candidateNum; silIdx += gridDim.x * g_BLOCK_SIZE)
+	{
+		int objIdx = findBatchObject(d_objSilStart, objNum, silIdx);
+
+		SceneObject obj = d_objects[objIdx];
+
+		bool isInvisible = false;
+		bool isKnown = true;
+
+		//The ray test carries over from pass to pass, only some of the silhouettes get it again
+		bool isAmortized = d_vertexMark && obj.visibility == VISIBILITY_EXACT;
+
+		int test = isAmortized ? d_visibilityTest[silIdx] : g_VISIBILITY_RAY_TEST;
+
+		int sceneEdge = d_candidateEdge[silIdx];
+		int v0 = 0;
+		int v1 = 0;
+
+		if(isAmortized)
+		{
+			MeshEdge edge = obj.edges[sceneEdge - obj.firstEdge];
+
+			v0 = d_objVertexStart[objIdx] + edge.v0;
+			v1 = d_objVertexStart[objIdx] + edge.v1;
+		}
+
+		//Kept for the propagation along its chains, done by the caller
+		if(obj.visibility == VISIBILITY_QUANTITATIVE)
+		{
+			isInvisible = false;
+		}
+		else if(obj.visibility == VISIBILITY_DEPTH_BUFFER)
+		{
+			isInvisible = cullSilhouetteDepthElement(silIdx, d_candidateSilhouetteVertex, d_candidateSilhouetteNormal,
+													 d_candidateSilhouetteViewVertex, d_matrixProj, d_hiz);
+		}
+		else if(test == g_VISIBILITY_CACHED)
+		{
+			isInvisible = d_edgeVisibility[sceneEdge].isVisible == 0;
+		}
+		else if(test == g_VISIBILITY_DEFERRED)
+		{
+			bool isVisible = true;
+
+			isKnown = reuseEdgeVisibility(d_edgeVisibility[sceneEdge], visibilityPass,
+										  d_lastVertexMark ? d_lastVertexMark[v0] : 0, d_lastVertexMark ? d_lastVertexMark[v1] : 0, &isVisible);
+			isInvisible = !isVisible;
+		}
+		else if(instanceNodeNum > 0)
+		{
+			isInvisible = cullSilhouetteSceneElement(silIdx, objIdx, d_objects, d_instanceNodes, instanceNodeNum, d_instances,
+													 d_candidateSilhouetteVertex, d_candidateSilhouetteViewVertex, d_viewVertex, d_objVertexStart,
+													 d_matrixViewWorld, d_eyePos);
+		}
+		else
+		{
+			//Only the triangles of its own object may hide a silhouette
+			isInvisible = cullSilhouetteElement(silIdx, obj.bvhNodes, obj.bvhNodeNum, obj.bvhTriangles,
+												d_viewVertex + d_objVertexStart[objIdx], obj.indices,
+												d_candidateSilhouetteVertex, d_candidateSilhouetteViewVertex, d_eyePos[objIdx]);
+		}
+
+		if(isAmortized && isKnown)
+		{
+			int mark = updateEdgeVisibility(&d_edgeVisibility[sceneEdge], visibilityPass, !isInvisible);
+
+			atomicOr(&d_vertexMark[v0], mark);
+			atomicOr(&d_vertexMark[v1], mark);
+		}
+
+		if(isInvisible)
+		{
+			d_isSilhouette[silIdx] = false;
+		}
+	}
+}
@@ -3,33 +3,62 @@
 
 #include <cuda.h>
 #include "StdHeader.h"
+#include "CUDADataStructure.h"
+
+struct InstanceBVH;
 
 const int g_BLOCK_SIZE = 256;
 
-struct MeshVertex;
+//Largest grid dimension on every device we run on, bigger jobs loop over the grid
+const int g_MAX_GRID_SIZE = 65535;
+
+bool cudaDeviceAvailable();
 
-bool cudaInitialization(int indiceNum, int vertexNum);
+bool cudaInitialization(int edgeNum, int maxRangeNum, int objNum, int vertexNum);
 
-bool cudaProjInit( int silNum );
+// Frees the device copy of a mesh, safe on one that was never uploaded
+void cudaReleaseResidentMesh( ResidentMesh* mesh );
 
-bool cudaCullInit( int silNum );
+// Uploads the meshes marked dirty to their resident device copies, then the matrices of
+// the frame, the instance hierarchy if objects hide each other and the HiZ pyramid if any
+// object uses the depth buffer. Waits for the stages still in flight, their staging is refilled.
+// With a refresh period above 1 the ray test of a silhouette is amortized over that many passes,
+// and a retest limit above 0 caps the ray tests of a pass.
+bool cudaPassDataToGPU( BatchObject* h_objects, int objNum, D3DXMATRIX* h_matrixProj,
+						const HiZPyramid* h_hiz, const InstanceBVH* h_instanceBVH,
+						int visibilityRefreshPeriod, int visibilityRetestLimit );
 
-bool cudaRunKernel( int indiceNum );
+// All stages below go into one stream and return at once. Inputs are copied to pinned
+// staging on submission, the caller may reuse its buffers right away. Outputs are
+// written by the time cudaWaitStage returns on the ticket, not to be touched before.
 
-bool cudaRunProjKernel( int silNum );
+// The whole silhouette pass of a frame on the device: detection over the ranges, the tracked
+// silhouettes of the other objects gathered in, occlusion culling, compaction of the visible
+// ones and their projection. Every vertex is transformed to view space once per pass into a
+// cache the cull and the projection read. Only counts come back: the number of detected silhouettes in
+// *h_detectedNum and where each object's strokes start in h_objStrokeStart, objNum + 1 entries.
+// h_objTrackedNum holds the tracked edges of every object.
+bool cudaSubmitSilhouettePass( EdgeRange* h_edgeRanges, int rangeNum,
+							   TrackedEdge* h_trackedEdges, int trackedNum, const int* h_objTrackedNum,
+							   int* h_detectedNum, int* h_objStrokeStart, StageTicket* ticket );
 
-bool cudaRunCullKernel(int silNum, int indiceNum);
+// The visible strokes of the last pass, object after object: end points, their normals and their
+// projections. Plus the scene edge ids of the detected silhouettes, the edges of the objects
+// numbered one after the other, detectedNum may be 0 when nobody needs them.
+bool cudaSubmitStrokeReadback( D3DXVECTOR3* h_strokeVertex, D3DXVECTOR3* h_strokeNormal, D3DXVECTOR3* h_strokeProj, int strokeNum,
+							   int* h_silEdgeIdx, int detectedNum, StageTicket* ticket );
 
-bool cudaPassDataToGPU( MeshVertex* _meshVertex, WORD* _indices, DWORD* _adjBuffer, 
-						D3DXMATRIX* h_matrixWorldView, D3DXMATRIX* h_matrixWorldPrj, 
-						int h_maxIndiceNum, int h_maxVertexNum );
+// The vertex cache of the last pass back to the host for the quantitative invisibility: the
+// objects using it, all of them when objects hide each other. See cudaViewVertices.
+bool cudaSubmitViewVertexReadback( StageTicket* ticket );
 
-bool cudaPassProjVerticesDataToGPU( D3DXVECTOR3* h_edgeVertices, int h_silNum );
+bool cudaWaitStage( StageTicket ticket );
 
-bool cudaPassCullDataToGPU( D3DXVECTOR3* h_meshVertexProj, int h_silNum );
+// Whether the stage has finished, without blocking. Its outputs are written once it has.
+bool cudaStageDone( StageTicket ticket );
 
-bool cudaGetDataFromGPU(bool* h_isSilhouette, int silSize);
-bool cudaGetCulledDataFromGPU(bool* h_isSilhouette, int h_silNum);
-bool cudaGetProjDataFromGPU(D3DXVECTOR3* h_meshProjVertices, int silSize);
+// The vertices of an object in view space, as the last view vertex readback brought them back.
+// Valid from the wait on it until the next one is submitted.
+const D3DXVECTOR3* cudaViewVertices( int objIdx );
 
 #endif
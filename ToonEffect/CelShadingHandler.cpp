@@ -11,169 +11,1263 @@
 #include "CelShadingHandler.h"
 #include "CUDADataStructure.h"
 #include "CUDASilhouetteFinding.h"
+#include "CPUSilhouetteFinding.h"
 #include "CelSilhouette.h"
 #include "d3dUtility.h"
 
+#include <float.h>
+#include <algorithm>
+
+//A chain by its length on the screen, for the stroke budget
+struct ChainRank
+{
+	float	length;		//pixels
+	int		chain;
+	int		quadNum;	//quads left after the simplification and the merging of short runs
+};
+
 extern bool g_randomWiggling;
 extern bool g_alphaTransition;
 extern bool g_widthTransition;
+extern bool g_useCPUBackend;
+extern bool g_useEdgeHierarchy;
+extern bool g_incrementalSilhouette;
+extern bool g_sceneOcclusion;
+extern int  g_fullRescanPeriod;
+extern int  g_visibilityRefreshPeriod;
+extern int  g_visibilityRetestLimit;
+extern bool g_pipelineFrames;
+extern bool g_topologyChaining;
+extern float g_strokeSimplifyPixels;
+extern float g_strokeMinPixels;
+extern float g_chainMinPixels;
+
+//Squared distance on the screen of two projected points
+static float screenDistance2(const D3DXVECTOR3& a, const D3DXVECTOR3& b)
+{
+	return (a.x - b.x) * (a.x - b.x) + (a.y - b.y) * (a.y - b.y);
+}
 
 float CelShadingHandler::s_ConnectDisThreshold = 0.03f;
 float CelShadingHandler::s_ConnectAngleThreshold = .90f;
 
 CelShadingHandler::CelShadingHandler(IDirect3DDevice9* device) : 
-m_isSilhouette(NULL),
 m_candidateSilhouetteVertex(NULL),
 m_candidateSilhouetteVertexNormal(NULL),
 m_segGroup(NULL),
 m_segGroupInfo(NULL),
-m_isSilhouetteSize(0),
+m_edgeRanges(NULL),
+m_edgeRangeNum(0),
+m_edgeRangeSize(0),
+m_silEdges(NULL),
+m_silEdgeNum(0),
+m_silEdgeSize(0),
+m_trackedEdges(NULL),
+m_trackedEdgeNum(0),
+m_batchObjects(NULL),
+m_objFrames(NULL),
+m_objTrackedNum(NULL),
+m_objStrokeStart(NULL),
+m_backStrokeStart(NULL),
+m_batchObjectSize(0),
+m_sceneSilVertex(NULL),
+m_sceneSilNormal(NULL),
+m_sceneSilProj(NULL),
+m_sceneSilNum(0),
+m_sceneSilSize(0),
+m_backSilVertex(NULL),
+m_backSilNormal(NULL),
+m_backSilProj(NULL),
+m_backSilNum(0),
+m_backSilSize(0),
+m_pendingSilhouettes(NULL),
+m_pendingNum(0),
+m_pendingReadEdges(false),
+m_pendingQuantitative(false),
+m_passOverlap(-1.0f),
 m_candidateSilhouetteVertexNum(0),
-m_indicesNum(0),
-m_vertexNum(0),
-m_silNum(0)
+m_endPntBucketStart(NULL),
+m_endPntBucketCount(NULL),
+m_endPntBucket(NULL),
+m_endPntSlot(NULL),
+m_endPntBucketNum(0),
+m_endPntBucketSize(0),
+m_endPntSize(0),
+m_endPntCellSize(0),
+m_strokeEndVertex(NULL),
+m_strokeEndNext(NULL),
+m_endPntPartner(NULL),
+m_endPntNearest(NULL),
+m_strokeEndSize(0),
+m_vertexEndHead(NULL),
+m_vertexEndNum(NULL),
+m_vertexEndSize(0),
+m_viewportWidth(0),
+m_viewportHeight(0),
+m_chainQuads(NULL),
+m_keptQuads(NULL),
+m_chainStrokes(NULL),
+m_chainStart(NULL),
+m_strokeEntry(NULL),
+m_polyline(NULL),
+m_keepPoint(NULL),
+m_simplifyStack(NULL),
+m_chainRanks(NULL),
+m_keepChain(NULL),
+m_simplifySize(0),
+m_edgeNum(0),
+m_silNum(0),
+m_lastStage(0)
 {
-
+	memset(&m_depthBuffer, 0, sizeof(DepthBuffer));
+	memset(&m_instanceBVH, 0, sizeof(InstanceBVH));
+	memset(&m_qiChains, 0, sizeof(QIChains));
+	memset(&m_strokeChains, 0, sizeof(StrokeChains));
 }
 
 CelShadingHandler::~CelShadingHandler()
 {
-	delete [] m_isSilhouette;
+	//A pipelined frame may still be reading back into the buffers freed below, its objects are
+	//not chained any more
+	this->waitStage(m_lastStage);
+
 	delete [] m_candidateSilhouetteVertex;
 	delete [] m_candidateSilhouetteVertexNormal;
 	delete [] m_segGroup;
 	delete [] m_segGroupInfo;
+	delete [] m_edgeRanges;
+	delete [] m_silEdges;
+	delete [] m_trackedEdges;
+	delete [] m_batchObjects;
+	delete [] m_objFrames;
+	delete [] m_objTrackedNum;
+	delete [] m_objStrokeStart;
+	delete [] m_backStrokeStart;
+	delete [] m_pendingSilhouettes;
+	delete [] m_sceneSilVertex;
+	delete [] m_sceneSilNormal;
+	delete [] m_sceneSilProj;
+	delete [] m_backSilVertex;
+	delete [] m_backSilNormal;
+	delete [] m_backSilProj;
+	delete [] m_endPntBucketStart;
+	delete [] m_endPntBucketCount;
+	delete [] m_endPntBucket;
+	delete [] m_endPntSlot;
+	delete [] m_strokeEndVertex;
+	delete [] m_strokeEndNext;
+	delete [] m_endPntPartner;
+	delete [] m_endPntNearest;
+	delete [] m_vertexEndHead;
+	delete [] m_vertexEndNum;
+	delete [] m_chainQuads;
+	delete [] m_keptQuads;
+	delete [] m_chainStrokes;
+	delete [] m_chainStart;
+	delete [] m_strokeEntry;
+	delete [] m_polyline;
+	delete [] m_keepPoint;
+	delete [] m_simplifyStack;
+	delete [] m_chainRanks;
+	delete [] m_keepChain;
+
+	releaseDepthBuffer(&m_depthBuffer);
+	releaseInstanceBVH(&m_instanceBVH);
+	releaseQIChains(&m_qiChains);
+	releaseStrokeChains(&m_strokeChains);
+}
+
+
+bool CelShadingHandler::passDataToGPU(BatchObject* h_objects, int objNum, D3DXMATRIX* h_matrixProj, 
+									  const HiZPyramid* h_hiz, const InstanceBVH* h_instanceBVH)
+{
+	if(g_useCPUBackend)
+		return cpuPassData(h_objects, objNum, h_matrixProj, h_hiz, h_instanceBVH, g_visibilityRefreshPeriod, g_visibilityRetestLimit);
+
+	return cudaPassDataToGPU(h_objects, objNum, h_matrixProj, h_hiz, h_instanceBVH, g_visibilityRefreshPeriod, g_visibilityRetestLimit);
+}
+
+bool CelShadingHandler::getDataFromGPU(bool readEdges, bool readViewVertices, StageTicket* ticket)
+{
+	bool result = false;
+
+	//Only the visible strokes come back, into the back set, plus the detected edges when the
+	//trackers or the quantitative invisibility need them
+	int detectedNum = readEdges ? m_silEdgeNum : 0;
+
+	if(g_useCPUBackend)
+		result = cpuSubmitStrokeReadback(m_backSilVertex, m_backSilNormal, m_backSilProj, m_backSilNum, m_silEdges, detectedNum, ticket);
+	else
+		result = cudaSubmitStrokeReadback(m_backSilVertex, m_backSilNormal, m_backSilProj, m_backSilNum, m_silEdges, detectedNum, ticket);
+
+	//The quantitative invisibility works on the vertex cache of the pass, the CPU backend keeps it
+	//on the host anyway. The later ticket covers both stages.
+	if(result && readViewVertices && !g_useCPUBackend)
+		result = cudaSubmitViewVertexReadback(ticket);
+
+	if(result)
+		m_lastStage = *ticket;
+
+	return result;
+}
+
+bool CelShadingHandler::runKernel(int objNum, StageTicket* ticket)
+{
+	bool result = false;
+
+	//Detection, culling, compaction and projection in one go. All of it stays on the backend
+	//but the number of detected silhouettes and where the strokes of each object start, in the
+	//back set like the strokes read back after it.
+	if(g_useCPUBackend)
+		result = cpuSubmitSilhouettePass(m_edgeRanges, m_edgeRangeNum, m_trackedEdges, m_trackedEdgeNum, m_objTrackedNum,
+										 &m_silEdgeNum, m_backStrokeStart, ticket);
+	else
+		result = cudaSubmitSilhouettePass(m_edgeRanges, m_edgeRangeNum, m_trackedEdges, m_trackedEdgeNum, m_objTrackedNum,
+										  &m_silEdgeNum, m_backStrokeStart, ticket);
+
+	if(result)
+		m_lastStage = *ticket;
+
+	return result;
+}
+
+bool CelShadingHandler::waitStage(StageTicket ticket)
+{
+	if(g_useCPUBackend)
+		return cpuWaitStage(ticket);
+
+	return cudaWaitStage(ticket);
+}
+
+bool CelShadingHandler::isStageDone(StageTicket ticket)
+{
+	if(g_useCPUBackend)
+		return cpuStageDone(ticket);
+
+	return cudaStageDone(ticket);
+}
+
+bool CelShadingHandler::readBackPass(StageTicket passTicket, int objNum, StageTicket* ticket)
+{
+	//The stroke counts decide how much comes back and how big the stroke buffers get
+	if( !this->waitStage(passTicket) )
+		return false;
+
+	m_backSilNum = m_backStrokeStart[objNum];
+
+	return this->getDataFromGPU(m_pendingReadEdges, m_pendingQuantitative, ticket);
+}
+
+//The strokes just read back become the ones the host works on
+void CelShadingHandler::swapSceneStrokes()
+{
+	std::swap(m_sceneSilVertex, m_backSilVertex);
+	std::swap(m_sceneSilNormal, m_backSilNormal);
+	std::swap(m_sceneSilProj, m_backSilProj);
+	std::swap(m_sceneSilNum, m_backSilNum);
+	std::swap(m_sceneSilSize, m_backSilSize);
+	std::swap(m_objStrokeStart, m_backStrokeStart);
+}
+
+bool CelShadingHandler::process(CelSilhouette* celSilhouette, D3DXMATRIX* worldViewMat, D3DXMATRIX* projMat)
+{
+	return this->processScene(&celSilhouette, worldViewMat, 1, projMat);
+}
+
+void CelShadingHandler::setViewport(int width, int height)
+{
+	m_viewportWidth = width;
+	m_viewportHeight = height;
+}
+
+bool CelShadingHandler::processScene(CelSilhouette** celSilhouettes, D3DXMATRIX* worldViewMats, int objNum, D3DXMATRIX* projMat)
+{
+	if(!celSilhouettes || objNum <= 0)
+		return false;
+
+	//The pipeline only goes on over the same objects, a frame it holds of others is chained first
+	if(m_pendingNum > 0 && (!g_pipelineFrames || !this->isPendingScene(celSilhouettes, objNum)))
+	{
+		if( !this->flushPendingFrame() )
+			return false;
+	}
+
+	//Nothing of the last frame may still be writing into the buffers resized below
+	if( !this->waitStage(m_lastStage) )
+		return false;
+
+	if( !this->initBatchBuffer(objNum) )
+		return false;
+
+	int lockedNum = this->lockScene(celSilhouettes, objNum);
+
+	bool result = lockedNum == objNum && this->processLockedScene(celSilhouettes, worldViewMats, objNum, projMat);
+
+	this->unlockScene(celSilhouettes, lockedNum, result);
+
+	return result;
+}
+
+bool CelShadingHandler::flushPendingFrame()
+{
+	int objNum = m_pendingNum;
+
+	if(objNum == 0)
+		return true;
+
+	//Gone whether it makes it or not
+	m_pendingNum = 0;
+
+	if( !this->waitStage(m_lastStage) )
+		return false;
+
+	int lockedNum = this->lockScene(m_pendingSilhouettes, objNum);
+
+	bool result = lockedNum == objNum &&
+				  this->finishFrame(m_pendingSilhouettes, objNum, &m_pendingProj, m_pendingReadEdges, m_pendingQuantitative) &&
+				  this->chainFrame(m_pendingSilhouettes, objNum, NULL, 0);
+
+	this->unlockScene(m_pendingSilhouettes, lockedNum, result);
+
+	return result;
+}
+
+float CelShadingHandler::lastPassOverlap() const
+{
+	return m_passOverlap;
+}
+
+int CelShadingHandler::lockScene(CelSilhouette** celSilhouettes, int objNum)
+{
+	int lockedNum = 0;
+
+	for(; lockedNum<objNum; ++lockedNum)
+	{
+		m_objFrames[lockedNum].strokeData = NULL;
+
+		if( FAILED(celSilhouettes[lockedNum]->m_mesh->LockVertexBuffer(0, (void**)&m_batchObjects[lockedNum].vertices)) )
+			break;
+	}
+
+	return lockedNum;
+}
+
+void CelShadingHandler::unlockScene(CelSilhouette** celSilhouettes, int lockedNum, bool succeeded)
+{
+	//A frame failing half way may have left a stage reading the meshes, and stroke buffers locked:
+	//those draw nothing this frame
+	if(!succeeded)
+		this->waitStage(m_lastStage);
+
+	for(int i=0; i<lockedNum; ++i)
+	{
+		if(m_objFrames[i].strokeData)
+		{
+			celSilhouettes[i]->m_silhouetteNum = 0;
+
+			unlockStrokeBuffer(&celSilhouettes[i]->m_strokes, 0);
+
+			m_objFrames[i].strokeData = NULL;
+		}
+
+		celSilhouettes[i]->m_mesh->UnlockVertexBuffer();
+	}
+}
+
+bool CelShadingHandler::isPendingScene(CelSilhouette** celSilhouettes, int objNum) const
+{
+	if(objNum != m_pendingNum)
+		return false;
+
+	for(int i=0; i<objNum; ++i)
+	{
+		if(celSilhouettes[i] != m_pendingSilhouettes[i])
+			return false;
+	}
+
+	return true;
+}
+
+bool CelShadingHandler::processLockedScene(CelSilhouette** celSilhouettes, D3DXMATRIX* worldViewMats, int objNum, D3DXMATRIX* projMat)
+{
+	//A frame the pipeline holds is of these same objects, processScene flushed it otherwise. What of
+	//it the setup below overwrites is used up here: only its chaining waits for this frame's pass.
+	int chainNum = m_pendingNum;
+
+	m_pendingNum = 0;
+	m_passOverlap = -1.0f;
+
+	if(chainNum > 0 && !this->finishFrame(celSilhouettes, chainNum, &m_pendingProj, m_pendingReadEdges, m_pendingQuantitative))
+		return false;
+
+	int maxRangeNum = 0;
+	bool useDepthBuffer = false;
+	bool useQuantitative = false;
+
+	m_edgeNum = 0;
+
+	for(int i=0; i<objNum; ++i)
+	{
+		CelSilhouette* celSilhouette = celSilhouettes[i];
+		BatchObject& obj = m_batchObjects[i];
+
+		//Widened copy made at init, the mesh index buffer may be 16 or 32 bit
+		obj.indices		= celSilhouette->m_indices;
+		obj.edges		= celSilhouette->m_edges;
+		obj.facePlanes	= celSilhouette->m_facePlanes;
+		obj.soa			= &celSilhouette->m_soa;
+		obj.resident	= &celSilhouette->m_resident;
+
+		obj.bvhNodes		= celSilhouette->m_bvh.nodes;
+		obj.bvhTriangles	= celSilhouette->m_bvh.triangles;
+		obj.bvhNodeNum		= celSilhouette->m_bvh.nodeNum;
+
+		obj.vertexFaceStart	= celSilhouette->m_vertexFaceStart;
+		obj.vertexFaces		= celSilhouette->m_vertexFaces;
+
+		obj.worldView	= worldViewMats[i];
+		obj.visibility	= celSilhouette->m_visibility;
+
+		useDepthBuffer = useDepthBuffer || obj.visibility == VISIBILITY_DEPTH_BUFFER;
+		useQuantitative = useQuantitative || obj.visibility == VISIBILITY_QUANTITATIVE;
+
+		//Bring the eye into object space once, the per-edge test then works on the cached face planes
+		D3DXMATRIX viewWorldMat;
+		D3DXMatrixInverse(&viewWorldMat, NULL, &worldViewMats[i]);
+
+		obj.viewWorld = viewWorldMat;
+		obj.eyePos = D3DXVECTOR3(viewWorldMat.m[3][0], viewWorldMat.m[3][1], viewWorldMat.m[3][2]);
+
+		obj.vertexNum	= celSilhouette->m_vertexNum;
+		obj.indicesNum	= celSilhouette->m_indicesNum;
+		obj.edgeNum		= celSilhouette->m_edgeNum;
+		obj.maxRangeNum	= celSilhouette->m_hierarchy.maxRangeNum;
+
+		m_objFrames[i].edgeBase = m_edgeNum;
+
+		m_edgeNum	+= obj.edgeNum;
+		maxRangeNum	+= obj.maxRangeNum;
+	}
+
+	if( !this->initSceneBuffer(maxRangeNum) )
+		return false;
+
+	//Every object goes into the depth buffer, whichever test its own silhouettes get
+	const HiZPyramid* hiz = NULL;
+
+	if(useDepthBuffer)
+	{
+		if( !rasterizeDepthBuffer(&m_depthBuffer, m_batchObjects, objNum, projMat) )
+			return false;
+
+		hiz = &m_depthBuffer.pyramid;
+	}
+
+	//The exact test and the quantitative invisibility look at the other objects too: the instance
+	//hierarchy is only rebuilt when the objects change, moving ones just have their boxes refit
+	const InstanceBVH* instanceBVH = NULL;
+
+	if(g_sceneOcclusion)
+	{
+		if(m_instanceBVH.instanceNum != objNum)
+		{
+			if( !buildInstanceBVH(&m_instanceBVH, m_batchObjects, objNum) )
+				return false;
+		}
+		else
+		{
+			refitInstanceBVH(&m_instanceBVH, m_batchObjects);
+		}
+
+		instanceBVH = &m_instanceBVH;
+	}
+
+	if( !this->passDataToGPU(m_batchObjects, objNum, projMat, hiz, instanceBVH) )
+		return false;
+
+	//Follow last frame's silhouette while the view changes little, with a full rescan now and then
+	//to pick up loops that appeared away from it. All other objects share one detection pass.
+	m_edgeRangeNum = 0;
+	m_trackedEdgeNum = 0;
+
+	for(int i=0; i<objNum; ++i)
+	{
+		CelSilhouette* celSilhouette = celSilhouettes[i];
+		SilhouetteTracker& tracker = celSilhouette->m_tracker;
+
+		const D3DXVECTOR3& eyePos = m_batchObjects[i].eyePos;
+
+		m_objFrames[i].isTracked = g_incrementalSilhouette &&
+								   tracker.framesSinceRescan < g_fullRescanPeriod &&
+								   updateSilhouetteTracker(&tracker, celSilhouette->m_edges, celSilhouette->m_facePlanes, eyePos);
+
+		m_objTrackedNum[i] = 0;
+
+		//Only the clusters that may hold a silhouette from here go on to the per-edge test
+		if(!m_objFrames[i].isTracked)
+		{
+			m_edgeRangeNum += collectEdgeRanges(&celSilhouette->m_hierarchy, eyePos, g_useEdgeHierarchy, i, m_edgeRanges + m_edgeRangeNum);
+			continue;
+		}
+
+		for(int j=0; j<tracker.silEdgeNum; ++j)
+		{
+			m_trackedEdges[m_trackedEdgeNum].edge	= tracker.silEdges[j];
+			m_trackedEdges[m_trackedEdgeNum].objIdx	= i;
+
+			++m_trackedEdgeNum;
+		}
+
+		m_objTrackedNum[i] = tracker.silEdgeNum;
+	}
+
+	StageTicket passTicket = 0;
+
+	if( !this->runKernel(objNum, &passTicket) )
+		return false;
+
+	bool readEdges = g_incrementalSilhouette || useQuantitative;
+
+	m_pendingProj			= *projMat;
+	m_pendingReadEdges		= readEdges;
+	m_pendingQuantitative	= useQuantitative;
+
+	StageTicket ticket = 0;
+
+	if(g_pipelineFrames)
+	{
+		StageTicket passStage = passTicket;
+
+		LARGE_INTEGER chainStart, chainFinish;
+
+		QueryPerformanceCounter(&chainStart);
+
+		if( !this->chainFrame(celSilhouettes, chainNum, &passTicket, objNum) )
+			return false;
+
+		QueryPerformanceCounter(&chainFinish);
+
+		if(passTicket && !this->readBackPass(passTicket, objNum, &ticket))
+			return false;
+
+		//How much of the pass the chaining hid, only the task queue knows when a pass ran
+		LONGLONG passStart, passFinish;
+
+		if(chainNum > 0 && g_useCPUBackend && cpuStageTimes(passStage, &passStart, &passFinish) && passFinish > passStart)
+		{
+			LONGLONG overlap = min(passFinish, chainFinish.QuadPart) - max(passStart, chainStart.QuadPart);
+
+			m_passOverlap = overlap > 0 ? float(overlap) / float(passFinish - passStart) : 0.0f;
+		}
+
+		this->swapSceneStrokes();
+
+		//Its strokes are still coming back, the next call or flushPendingFrame chains them
+		memcpy(m_pendingSilhouettes, celSilhouettes, objNum * sizeof(CelSilhouette*));
+		m_pendingNum = objNum;
+
+		return true;
+	}
+
+	if( !this->readBackPass(passTicket, objNum, &ticket) )
+		return false;
+
+	this->swapSceneStrokes();
+
+	//Stroke buffers are locked while the strokes come back, unless the quantitative invisibility
+	//still changes how many there are
+	if(!useQuantitative)
+	{
+		for(int i=0; i<objNum; ++i)
+		{
+			if( !this->lockStrokeBuffers(celSilhouettes[i], i) )
+				return false;
+		}
+	}
+
+	if( !this->waitStage(ticket) )
+		return false;
+
+	if( !this->finishFrame(celSilhouettes, objNum, projMat, readEdges, useQuantitative) )
+		return false;
+
+	return this->chainFrame(celSilhouettes, objNum, NULL, 0);
+}
+
+bool CelShadingHandler::finishFrame(CelSilhouette** celSilhouettes, int objNum, const D3DXMATRIX* projMat, bool readEdges, bool useQuantitative)
+{
+	if(readEdges)
+		this->localizeDetectedEdges(objNum);
+
+	if(useQuantitative && !this->propagateVisibility(objNum, projMat))
+		return false;
+
+	if(g_incrementalSilhouette)
+		this->resetTrackers(celSilhouettes, objNum);
+
+	return true;
+}
+
+bool CelShadingHandler::chainFrame(CelSilhouette** celSilhouettes, int objNum, StageTicket* passTicket, int passObjNum)
+{
+	for(int i=0; i<objNum; ++i)
+	{
+		CelSilhouette* celSilhouette = celSilhouettes[i];
+
+		int strokeNum = m_objStrokeStart[i + 1] - m_objStrokeStart[i];
+
+		//The stroke buffer is dynamic and write only, slow to read back: the quads are chained in
+		//a scratch copy and written into it from there, simplified or thinned out when asked for
+		bool rewrite = (g_strokeSimplifyPixels > 0.0f || g_strokeMinPixels > 0.0f || g_chainMinPixels > 0.0f ||
+						celSilhouette->m_maxStrokes > 0) && m_viewportWidth > 0 && m_viewportHeight > 0;
+
+		if( !m_objFrames[i].strokeData && !this->lockStrokeBuffers(celSilhouette, i) )
+			return false;
+
+		if( !this->initChainBuffer(strokeNum) )
+			return false;
+
+		if( !this->generateQuads(i, m_chainQuads) )
+			return false;
+
+		if(g_topologyChaining && !this->weldStrokeEnds(celSilhouette, i))
+			return false;
+
+		if( !this->connectSegments(m_chainQuads) )
+			return false;
+
+		bool instanced = celSilhouette->m_strokes.instanced;
+
+		//Quads go straight into the stroke buffer, or are packed into instances on the way
+		EdgeVertex* quads = instanced ? m_keptQuads : (EdgeVertex*)m_objFrames[i].strokeData;
+
+		if(rewrite)
+			celSilhouette->m_silhouetteNum = this->writeChains(m_chainQuads, quads, celSilhouette->m_maxStrokes);
+		else if(instanced)
+			quads = m_chainQuads;
+		else
+			memcpy(quads, m_chainQuads, strokeNum * 4 * sizeof(EdgeVertex));
+
+		if(instanced)
+			packStrokeInstances(quads, celSilhouette->m_silhouetteNum, (StrokeInstance*)m_objFrames[i].strokeData);
+
+		unlockStrokeBuffer(&celSilhouette->m_strokes, celSilhouette->m_silhouetteNum);
+
+		m_objFrames[i].strokeData = NULL;
+
+		//The strokes of the pass come back while the rest is chained
+		if(passTicket && *passTicket && this->isStageDone(*passTicket))
+		{
+			StageTicket ticket = 0;
+
+			if( !this->readBackPass(*passTicket, passObjNum, &ticket) )
+				return false;
+
+			*passTicket = 0;
+		}
+	}
+	
+	return true;
+}
+
+//Detected silhouettes come back object after object, leaving out the tracked objects: back
+//from scene edges to the edge table of every object
+void CelShadingHandler::localizeDetectedEdges(int objNum)
+{
+	int detectedIdx = 0;
+
+	for(int i=0; i<objNum; ++i)
+	{
+		m_objFrames[i].firstDetected = detectedIdx;
+
+		if(!m_objFrames[i].isTracked)
+		{
+			int edgeEnd = m_objFrames[i].edgeBase + m_batchObjects[i].edgeNum;
+
+			while(detectedIdx < m_silEdgeNum && m_silEdges[detectedIdx] < edgeEnd)
+				m_silEdges[detectedIdx++] -= m_objFrames[i].edgeBase;
+		}
+
+		m_objFrames[i].detectedNum = detectedIdx - m_objFrames[i].firstDetected;
+	}
 }
 
+//Every object not tracked this frame starts its tracker over from what was detected
+bool CelShadingHandler::resetTrackers(CelSilhouette** celSilhouettes, int objNum)
+{
+	for(int i=0; i<objNum; ++i)
+	{
+		if(m_objFrames[i].isTracked)
+			continue;
+
+		resetSilhouetteTracker(&celSilhouettes[i]->m_tracker, m_batchObjects[i].facePlanes, m_batchObjects[i].eyePos,
+							   m_silEdges + m_objFrames[i].firstDetected, m_objFrames[i].detectedNum);
+	}
+
+	return true;
+}
+
+//The backends kept every silhouette of the objects using quantitative invisibility: their strokes
+//are replaced by the visible spans the propagation cuts out of them, the strokes after them moved
+bool CelShadingHandler::propagateVisibility(int objNum, const D3DXMATRIX* projMat)
+{
+	//The objects follow each other in the vertex cache of either backend
+	const D3DXVECTOR3* viewVertices = g_useCPUBackend ? cpuViewVertices(0) : cudaViewVertices(0);
+
+	if( !setQIScene(&m_qiChains, m_batchObjects, objNum, g_sceneOcclusion ? &m_instanceBVH : NULL, viewVertices) )
+		return false;
+
+	int firstTracked = 0;
+
+	for(int i=0; i<objNum; ++i)
+	{
+		int trackedNum = m_objTrackedNum[i];
+
+		firstTracked += trackedNum;
+
+		if(m_batchObjects[i].visibility != VISIBILITY_QUANTITATIVE)
+			continue;
+
+		if( !propagateQuantitativeInvisibility(&m_qiChains, i, projMat,
+											   m_silEdges + m_objFrames[i].firstDetected, m_objFrames[i].detectedNum,
+											   m_trackedEdges + firstTracked - trackedNum, trackedNum) )
+		{
+			return false;
+		}
+
+		int strokeNum = m_qiChains.strokeNum;
+		int oldStrokeNum = m_objStrokeStart[i + 1] - m_objStrokeStart[i];
+
+		if( !this->reserveSceneStrokes(m_sceneSilNum - oldStrokeNum + strokeNum) )
+			return false;
+
+		int tailNum = m_sceneSilNum - m_objStrokeStart[i + 1];
+		int first = m_objStrokeStart[i];
+
+		memmove(m_sceneSilVertex + 2 * (first + strokeNum), m_sceneSilVertex + 2 * m_objStrokeStart[i + 1], tailNum * 2 * sizeof(D3DXVECTOR3));
+		memmove(m_sceneSilNormal + 2 * (first + strokeNum), m_sceneSilNormal + 2 * m_objStrokeStart[i + 1], tailNum * 2 * sizeof(D3DXVECTOR3));
+		memmove(m_sceneSilProj + 2 * (first + strokeNum), m_sceneSilProj + 2 * m_objStrokeStart[i + 1], tailNum * 2 * sizeof(D3DXVECTOR3));
+
+		memcpy(m_sceneSilVertex + 2 * first, m_qiChains.strokeVertex, strokeNum * 2 * sizeof(D3DXVECTOR3));
+		memcpy(m_sceneSilNormal + 2 * first, m_qiChains.strokeNormal, strokeNum * 2 * sizeof(D3DXVECTOR3));
+		memcpy(m_sceneSilProj + 2 * first, m_qiChains.strokeProj, strokeNum * 2 * sizeof(D3DXVECTOR3));
+
+		for(int j=i + 1; j<=objNum; ++j)
+			m_objStrokeStart[j] += strokeNum - oldStrokeNum;
+
+		m_sceneSilNum += strokeNum - oldStrokeNum;
+	}
+
+	return true;
+}
+
+//Grows the scene strokes keeping what they hold: cut into visible spans, the strokes of an object
+//may outnumber its edges
+bool CelShadingHandler::reserveSceneStrokes(int strokeNum)
+{
+	if(strokeNum <= m_sceneSilSize)
+		return true;
+
+	int strokeSize = max(strokeNum, m_sceneSilSize * 2);
+
+	D3DXVECTOR3* sceneSilVertex = new D3DXVECTOR3[strokeSize * 2];
+	D3DXVECTOR3* sceneSilNormal = new D3DXVECTOR3[strokeSize * 2];
+	D3DXVECTOR3* sceneSilProj	= new D3DXVECTOR3[strokeSize * 2];
+
+	memcpy(sceneSilVertex, m_sceneSilVertex, m_sceneSilNum * 2 * sizeof(D3DXVECTOR3));
+	memcpy(sceneSilNormal, m_sceneSilNormal, m_sceneSilNum * 2 * sizeof(D3DXVECTOR3));
+	memcpy(sceneSilProj, m_sceneSilProj, m_sceneSilNum * 2 * sizeof(D3DXVECTOR3));
+
+	delete [] m_sceneSilVertex;
+	delete [] m_sceneSilNormal;
+	delete [] m_sceneSilProj;
+
+	m_sceneSilVertex	= sceneSilVertex;
+	m_sceneSilNormal	= sceneSilNormal;
+	m_sceneSilProj		= sceneSilProj;
+	m_sceneSilSize		= strokeSize;
+
+	return true;
+}
+
+bool CelShadingHandler::lockStrokeBuffers(CelSilhouette* celSihouette, int objIdx)
+{
+	int strokeNum = m_objStrokeStart[objIdx + 1] - m_objStrokeStart[objIdx];
+
+	m_objFrames[objIdx].strokeData = lockStrokeBuffer(&celSihouette->m_strokes, strokeNum);
+
+	//Nothing is drawn from a stroke buffer that could not be locked
+	celSihouette->m_silhouetteNum = m_objFrames[objIdx].strokeData ? strokeNum : 0;
+
+	return m_objFrames[objIdx].strokeData != NULL;
+}
+
+bool CelShadingHandler::generateQuads(int objIdx, EdgeVertex* edgeVertices)
+{	
+	int firstStroke = m_objStrokeStart[objIdx];
+
+	//This object's share of the scene wide strokes
+	m_silNum = m_objStrokeStart[objIdx + 1] - firstStroke;
+
+	if( !this->initMeshVertexBuffer() )
+		return false;
+
+	memcpy(m_candidateSilhouetteVertex, m_sceneSilVertex + 2 * firstStroke, m_silNum * 2 * sizeof(D3DXVECTOR3));
+	memcpy(m_candidateSilhouetteVertexNormal, m_sceneSilNormal + 2 * firstStroke, m_silNum * 2 * sizeof(D3DXVECTOR3));
+
+	if( !this->generateSilhouettes(edgeVertices) )
+		return false;
+
+	//Chaining goes by the projected end points
+	memcpy(m_candidateSilhouetteVertex, m_sceneSilProj + 2 * firstStroke, m_silNum * 2 * sizeof(D3DXVECTOR3));
+	
+	return true;
+}
+
+float CelShadingHandler::generateWeight() const
+{
+	int randFactor = rand() % 100;
+
+	return float(randFactor / 100.0);
+}
+
+//Expects the projected end points of the strokes in m_candidateSilhouetteVertex
+bool CelShadingHandler::connectSegments(EdgeVertex* edgeVerticesHead)
+{
+	memset(m_segGroup,		0, sizeof(SegmentGroup) * m_silNum);
+	memset(m_segGroupInfo,	0, sizeof(SegmentGroupInfo) * (m_silNum+1));
+
+	if( !this->initEndPntGrid() )
+		return false;
+
+	//Fixed links between the end points, chained on all cores
+	if(g_topologyChaining)
+	{
+		this->linkEndPnts();
+
+		if( !chainStrokes(&m_strokeChains, m_endPntPartner, m_silNum, m_segGroup, m_segGroupInfo) )
+			return false;
+
+		//The vertex lists go back to empty for the next object
+		for(int i=0; i<m_silNum * 2; ++i)
+		{
+			int vertex = m_strokeEndVertex[i];
+
+			if(vertex >= 0)
+			{
+				m_vertexEndHead[vertex] = -1;
+				m_vertexEndNum[vertex] = 0;
+			}
+		}
+	}
+	else
+	{
+		int segGroupId = 1;
+
+		for(int i=0; i<m_silNum; ++i)
+		{
+			if(m_segGroup[i].groupIdx == 0)
+			{
+				m_segGroup[i].groupIdx = segGroupId;
+				++m_segGroupInfo[segGroupId].total;
+
+				this->removeFromEndPntGrid(i);
+				
+				dfs(2*i, 2*i+1);
+				
+				++segGroupId;
+			}
+		}
+	}
+
+	this->adjustSilouette(edgeVerticesHead);
+
+	return true;
+}
+
+bool CelShadingHandler::initChainBuffer(int strokeNum)
+{
+	//Chain starts have a slot more than there are strokes, needed even when an object has none
+	if(strokeNum > m_simplifySize || !m_chainStart)
+	{
+		delete [] m_chainQuads;
+		delete [] m_keptQuads;
+		delete [] m_chainStrokes;
+		delete [] m_chainStart;
+		delete [] m_strokeEntry;
+		delete [] m_polyline;
+		delete [] m_keepPoint;
+		delete [] m_simplifyStack;
+		delete [] m_chainRanks;
+		delete [] m_keepChain;
+
+		m_simplifySize = strokeNum;
+
+		//A chain has one point more than strokes, there are no more chains than strokes
+		m_chainQuads	= new EdgeVertex[strokeNum * 4];
+		m_keptQuads		= new EdgeVertex[strokeNum * 4];
+		m_chainStrokes	= new int[strokeNum];
+		m_chainStart	= new int[strokeNum + 1];
+		m_strokeEntry	= new int[strokeNum];
+		m_polyline		= new D3DXVECTOR3[strokeNum * 2];
+		m_keepPoint		= new bool[strokeNum * 2];
+		m_simplifyStack	= new int[strokeNum * 4];
+		m_chainRanks	= new ChainRank[strokeNum];
+		m_keepChain		= new bool[strokeNum];
+
+		//The quads leave the width direction and the unused alpha channels alone, zero in there
+		memset(m_chainQuads, 0, strokeNum * 4 * sizeof(EdgeVertex));
+	}
+
+	return true;
+}
+
+//Strokes chain after chain by their offsets, groups being numbered from 1 on without a gap
+int CelShadingHandler::orderChains()
+{
+	int chainNum = 0;
+
+	m_chainStart[0] = 0;
+
+	while(chainNum < m_silNum && m_segGroupInfo[chainNum + 1].total > 0)
+	{
+		m_chainStart[chainNum + 1] = m_chainStart[chainNum] + m_segGroupInfo[chainNum + 1].total;
+		++chainNum;
+	}
+
+	for(int i=0; i<m_silNum; ++i)
+	{
+		int groupIdx = m_segGroup[i].groupIdx;
+
+		m_chainStrokes[m_chainStart[groupIdx - 1] + m_segGroup[i].offsetIdx - m_segGroupInfo[groupIdx].minIdx] = i;
+	}
+
+	return chainNum;
+}
+
+//Which end point every stroke of a chain comes in by: the first one leaves by the end point
+//closer to the second stroke, every other one comes in by the end point closer to where the
+//one before left
+void CelShadingHandler::orientChain(int firstStroke, int strokeNum)
+{
+	const D3DXVECTOR3* endPnt = m_candidateSilhouetteVertex;
+	const int* strokes = m_chainStrokes + firstStroke;
+	int* entry = m_strokeEntry + firstStroke;
+
+	entry[0] = 0;
+
+	if(strokeNum > 1)
+	{
+		const D3DXVECTOR3& next0 = endPnt[2*strokes[1]];
+		const D3DXVECTOR3& next1 = endPnt[2*strokes[1]+1];
+
+		float dis0 = min(screenDistance2(endPnt[2*strokes[0]], next0), screenDistance2(endPnt[2*strokes[0]], next1));
+		float dis1 = min(screenDistance2(endPnt[2*strokes[0]+1], next0), screenDistance2(endPnt[2*strokes[0]+1], next1));
+
+		entry[0] = dis0 < dis1 ? 1 : 0;
+	}
+
+	for(int k=1; k<strokeNum; ++k)
+	{
+		const D3DXVECTOR3& exitPnt = endPnt[2*strokes[k-1] + 1 - entry[k-1]];
+
+		entry[k] = screenDistance2(endPnt[2*strokes[k]], exitPnt) <= screenDistance2(endPnt[2*strokes[k]+1], exitPnt) ? 0 : 1;
+	}
+}
+
+//Distance in pixels of a projected point to a projected segment
+float CelShadingHandler::pixelDistanceToSegment(const D3DXVECTOR3& p, const D3DXVECTOR3& a, const D3DXVECTOR3& b) const
+{
+	float scaleX = m_viewportWidth * 0.5f;
+	float scaleY = m_viewportHeight * 0.5f;
+
+	float segX = (b.x - a.x) * scaleX;
+	float segY = (b.y - a.y) * scaleY;
+	float pntX = (p.x - a.x) * scaleX;
+	float pntY = (p.y - a.y) * scaleY;
+
+	float segLength2 = segX * segX + segY * segY;
+	float t = segLength2 > 0.0f ? (pntX * segX + pntY * segY) / segLength2 : 0.0f;
+
+	t = min(max(t, 0.0f), 1.0f);
+
+	float disX = pntX - t * segX;
+	float disY = pntY - t * segY;
+
+	return sqrt(disX * disX + disY * disY);
+}
+
+//Douglas-Peucker over one polyline, its points kept so far splitting it into the runs to thin out.
+//A point too far out, or not a number, is kept and splits its run in two.
+void CelShadingHandler::simplifyChain(int firstPoint, int pointNum)
+{
+	const D3DXVECTOR3* points = m_polyline + firstPoint;
+	bool* keep = m_keepPoint + firstPoint;
+
+	int stackNum = 0;
+	int runStart = 0;
+
+	for(int i=1; i<pointNum; ++i)
+	{
+		if(!keep[i])
+			continue;
+
+		m_simplifyStack[stackNum++] = runStart;
+		m_simplifyStack[stackNum++] = i;
+
+		runStart = i;
+	}
+
+	while(stackNum > 0)
+	{
+		int last = m_simplifyStack[--stackNum];
+		int first = m_simplifyStack[--stackNum];
+
+		float maxDis = 0.0f;
+		int	  maxIdx = -1;
+
+		for(int i=first+1; i<last; ++i)
+		{
+			float dis = this->pixelDistanceToSegment(points[i], points[first], points[last]);
+
+			if(!(dis <= g_strokeSimplifyPixels))
+				dis = FLT_MAX;
+
+			if(dis > maxDis)
+			{
+				maxDis = dis;
+				maxIdx = i;
+			}
+		}
+
+		if(maxIdx < 0 || maxDis <= g_strokeSimplifyPixels)
+			continue;
+
+		keep[maxIdx] = true;
+
+		m_simplifyStack[stackNum++] = first;
+		m_simplifyStack[stackNum++] = maxIdx;
+		m_simplifyStack[stackNum++] = maxIdx;
+		m_simplifyStack[stackNum++] = last;
+	}
+}
+
+//Pixel length of the quad for strokes first to last of a chain, from where the first one comes
+//in to where the last one leaves
+float CelShadingHandler::runPixelLength(int firstStroke, int lastStroke) const
+{
+	const D3DXVECTOR3* endPnt = m_candidateSilhouetteVertex;
+
+	const D3DXVECTOR3& entryPnt = endPnt[2*m_chainStrokes[firstStroke] + m_strokeEntry[firstStroke]];
+	const D3DXVECTOR3& exitPnt = endPnt[2*m_chainStrokes[lastStroke] + 1 - m_strokeEntry[lastStroke]];
+
+	return this->pixelDistanceToSegment(exitPnt, entryPnt, entryPnt);
+}
+
+//Runs of every chain, the strokes the simplification left no point within, and the chain's
+//quads and length on the screen. Without simplification every stroke is a run of its own. A run
+//shorter than g_strokeMinPixels goes on into the next one, the last one back into the one before,
+//so strokes too short for a quad of their own still draw as part of a longer one.
+void CelShadingHandler::splitChains(int chainNum)
+{
+	const D3DXVECTOR3* endPnt = m_candidateSilhouetteVertex;
+
+	bool simplify = g_strokeSimplifyPixels > 0.0f;
+
+	for(int c=0; c<chainNum; ++c)
+	{
+		int firstStroke = m_chainStart[c];
+		int strokeNum = m_chainStart[c + 1] - firstStroke;
+
+		const int* strokes = m_chainStrokes + firstStroke;
+		const int* entry = m_strokeEntry + firstStroke;
+
+		this->orientChain(firstStroke, strokeNum);
+
+		//Point k is where stroke k comes in, the last one where the last stroke leaves. A gap
+		//wider than the tolerance between one stroke's exit and the next one's entry is kept.
+		D3DXVECTOR3* points = m_polyline + firstStroke + c;
+		bool* keep = m_keepPoint + firstStroke + c;
+
+		for(int k=0; k<strokeNum; ++k)
+		{
+			points[k] = endPnt[2*strokes[k] + entry[k]];
+			keep[k] = k == 0 || !simplify;
+
+			if(k > 0 && simplify)
+			{
+				const D3DXVECTOR3& exitPnt = endPnt[2*strokes[k-1] + 1 - entry[k-1]];
+
+				keep[k] = !(this->pixelDistanceToSegment(points[k], exitPnt, exitPnt) <= g_strokeSimplifyPixels);
+			}
+		}
+
+		points[strokeNum] = endPnt[2*strokes[strokeNum-1] + 1 - entry[strokeNum-1]];
+		keep[strokeNum] = true;
+
+		if(simplify)
+			this->simplifyChain(firstStroke + c, strokeNum + 1);
+
+		ChainRank& rank = m_chainRanks[c];
+
+		rank.chain = c;
+		rank.length = 0.0f;
+		rank.quadNum = 0;
+
+		int runStart = 0;
+
+		for(int k=1; k<=strokeNum; ++k)
+		{
+			if(!keep[k])
+				continue;
+
+			rank.length += this->runPixelLength(firstStroke + runStart, firstStroke + k - 1);
 
-bool CelShadingHandler::passDataToGPU(MeshVertex* h_meshVertex, 
-									  WORD* h_indices, 
-									  DWORD* h_adjBuffer, 
-									  D3DXMATRIX* h_matrixWorldView,
-									  D3DXMATRIX* h_matrixWorldProj,
-									  int h_indicesNum,
-									  int h_vertexNum)
-{
-	return cudaPassDataToGPU(h_meshVertex, h_indices, h_adjBuffer, h_matrixWorldView, h_matrixWorldProj, h_indicesNum, h_vertexNum);
-}
+			runStart = k;
+		}
 
-bool CelShadingHandler::getDataFromGPU()
-{
-	if(m_indicesNum > m_isSilhouetteSize)
-	{
-		if(m_isSilhouette)
+		if(g_strokeMinPixels <= 0.0f)
 		{
-			delete [] m_isSilhouette;
+			for(int k=1; k<=strokeNum; ++k)
+				rank.quadNum += keep[k] ? 1 : 0;
+
+			continue;
 		}
 
-		m_isSilhouette = new bool[m_indicesNum];
-	}
-	m_isSilhouetteSize = m_indicesNum;
+		runStart = 0;
+
+		for(int k=1; k<=strokeNum; ++k)
+		{
+			if(!keep[k])
+				continue;
+
+			if(this->runPixelLength(firstStroke + runStart, firstStroke + k - 1) < g_strokeMinPixels)
+			{
+				if(k < strokeNum)
+				{
+					keep[k] = false;
+					continue;
+				}
+
+				if(runStart > 0)
+				{
+					keep[runStart] = false;
+					continue;
+				}
+			}
+
+			++rank.quadNum;
 
-	return cudaGetDataFromGPU(m_isSilhouette, m_isSilhouetteSize);
+			runStart = k;
+		}
+	}
 }
 
-bool CelShadingHandler::runKernel(int indiceNum)
+//Longer chains first, on a tie the first chain
+static bool chainLonger(const ChainRank& a, const ChainRank& b)
 {
-	return cudaRunKernel(indiceNum);	
+	if(a.length != b.length)
+		return a.length > b.length;
+
+	return a.chain < b.chain;
 }
 
-bool CelShadingHandler::process(CelSilhouette* celSilhouette, D3DXMATRIX* worldViewMat, D3DXMATRIX* projMat)
+//Screen space level of detail of the chained strokes, then their quads into the stroke buffer:
+//chains shorter than g_chainMinPixels go, so do chains too short for a single quad of
+//g_strokeMinPixels, and with a budget only the longest chains whose quads still fit in it stay.
+//A run of strokes merged by the simplification or for its length makes one quad, from where the
+//first one comes in to where the last one leaves, its texture running along the chain from the
+//first stroke's start to the last one's end. Quads of single strokes stay as they were. Gives the
+//number of quads written.
+int CelShadingHandler::writeChains(const EdgeVertex* edgeVerticesHead, EdgeVertex* strokeVertices, int maxStrokes)
 {
-	if(!celSilhouette)
-		return false;
+	int chainNum = this->orderChains();
 
-	int indicesNum = celSilhouette->m_indicesNum;
-	int vertexNum = celSilhouette->m_vertexNum;
+	this->splitChains(chainNum);
 
-	m_indicesNum = indicesNum;
-	m_vertexNum = vertexNum;
+	for(int c=0; c<chainNum; ++c)
+		m_keepChain[c] = m_chainRanks[c].length >= max(g_chainMinPixels, g_strokeMinPixels);
 
-	ID3DXMesh* mesh = celSilhouette->m_mesh;
+	if(maxStrokes > 0)
+	{
+		std::sort(m_chainRanks, m_chainRanks + chainNum, chainLonger);
 
-	WORD* celIndices = 0;
-	mesh->LockIndexBuffer(0, (void**)&celIndices);
+		int budget = maxStrokes;
 
-	MeshVertex* meshVertices = 0;
-	mesh->LockVertexBuffer(0, (void**)&meshVertices);
+		for(int i=0; i<chainNum; ++i)
+		{
+			int c = m_chainRanks[i].chain;
 
-	DWORD* adjPointer = (DWORD*)celSilhouette->m_adjBuffer->GetBufferPointer();
-	
-	this->passDataToGPU(meshVertices, celIndices, adjPointer, worldViewMat, projMat, m_indicesNum, m_vertexNum);
+			if(!m_keepChain[c])
+				continue;
 
-	this->runKernel(m_indicesNum);
+			m_keepChain[c] = m_chainRanks[i].quadNum <= budget;
 
-	this->getDataFromGPU();
+			if(m_keepChain[c])
+				budget -= m_chainRanks[i].quadNum;
+		}
+	}
 
-	this->generateQuads(celSilhouette,meshVertices, celIndices);
+	int quadNum = 0;
 
-	mesh->UnlockVertexBuffer();
-	mesh->UnlockIndexBuffer();
-	
-	return true;
-}
+	for(int c=0; c<chainNum; ++c)
+	{
+		if(!m_keepChain[c])
+			continue;
 
-bool CelShadingHandler::generateQuads(CelSilhouette* celSihouette, MeshVertex* meshVertices, WORD* celIndices)
-{	
-	if ( !this->generateSilhouetteCandidates(meshVertices, celIndices))
-		return false;
+		int firstStroke = m_chainStart[c];
+		int strokeNum = m_chainStart[c + 1] - firstStroke;
 
-	celSihouette->createBuffer(m_silNum);
-	WORD* edgeIndices = 0;
-	celSihouette->m_ib->Lock(0, 0, (void**)&edgeIndices, 0);
+		const int* strokes = m_chainStrokes + firstStroke;
+		const int* entry = m_strokeEntry + firstStroke;
+		const bool* keep = m_keepPoint + firstStroke + c;
 
-	EdgeVertex* edgeVertices = 0;
-	celSihouette->m_vb->Lock(0, 0, (void**)&edgeVertices, 0);
-	EdgeVertex* edgeVerticesHead = edgeVertices;
+		int runStart = 0;
 
-	if( !this->generateSilhouettes(celSihouette, celIndices, edgeVerticesHead, edgeIndices))
-		return false;
+		for(int k=1; k<=strokeNum; ++k)
+		{
+			if(!keep[k])
+				continue;
 
-	if( !this->connectSegments(edgeVerticesHead) )
-		return false;
-	
-	celSihouette->m_ib->Unlock();
-	celSihouette->m_vb->Unlock();
-	
-	return true;
-}
+			int first = runStart;
+			runStart = k;
 
-float CelShadingHandler::generateWeight() const
-{
-	int randFactor = rand() % 100;
+			const EdgeVertex* firstQuad = edgeVerticesHead + 4 * strokes[first];
+			const EdgeVertex* lastQuad = edgeVerticesHead + 4 * strokes[k-1];
 
-	return float(randFactor / 100.0);
-}
+			EdgeVertex* quad = strokeVertices + 4 * quadNum;
 
-bool CelShadingHandler::connectSegments(EdgeVertex* edgeVerticesHead)
-{
-	if( !this->vertexProjTransform(edgeVerticesHead))
-		return false;
+			if(k - first == 1)
+			{
+				memcpy(quad, firstQuad, 4 * sizeof(EdgeVertex));
+			}
+			else
+			{
+				int firstEntry = entry[first];
+				int lastExit = 1 - entry[k-1];
 
-	memset(m_segGroup,		0, sizeof(SegmentGroup) * m_silNum);
-	memset(m_segGroupInfo,	0, sizeof(SegmentGroupInfo) * (m_silNum+1));
-	
-	int segGroupId = 1;
+				quad[0] = firstQuad[firstEntry];
+				quad[1] = lastQuad[lastExit];
+				quad[2] = firstQuad[2 + firstEntry];
+				quad[3] = lastQuad[2 + lastExit];
 
-	for(int i=0; i<m_silNum; ++i)
-	{
-		if(m_segGroup[i].groupIdx == 0)
-		{
-			m_segGroup[i].groupIdx = segGroupId;
-			++m_segGroupInfo[segGroupId].total;
-			
-			dfs(2*i, 2*i+1);
-			
-			++segGroupId;
+				float headPos = firstQuad[0].texCoord.x;
+				float tailPos = lastQuad[1].texCoord.x;
+
+				quad[0].texCoord.x = headPos;
+				quad[2].texCoord.x = headPos;
+				quad[1].texCoord.x = tailPos;
+				quad[3].texCoord.x = tailPos;
+			}
+
+			++quadNum;
 		}
 	}
 
-	this->adjustSilouette(edgeVerticesHead);
-
-	return true;
+	return quadNum;
 }
 
-bool CelShadingHandler::connectivityTest( const D3DXVECTOR3& a, const D3DXVECTOR3& b, float& dis )
+bool CelShadingHandler::connectivityTest( const D3DXVECTOR3& a, const D3DXVECTOR3& b, float& dis ) const
 {
 	float disSquare= (a.x - b.x)*(a.x - b.x) + (a.y - b.y)*(a.y - b.y);// + (a.z - b.z)*(a.z - b.z);
 
@@ -250,122 +1344,417 @@ void CelShadingHandler::adjustSilouette( EdgeVertex* edgeVerticesHead )
 	}
 }
 
+//First end point of the stroke within reach, trying left to left, right to left, right to right
+//and left to right. Gives the end point that takes the place of the chain end and its side.
+bool CelShadingHandler::reachSegment( int segIdx, const D3DXVECTOR3& leftEndPnt, const D3DXVECTOR3& rightEndPnt,
+									  float& dis, int& endPntIdx, int& expiredSide )
+{
+	if(this->connectivityTest(m_candidateSilhouetteVertex[2*segIdx], leftEndPnt, dis))
+	{
+		endPntIdx = 2*segIdx+1; //my brother connects with someone else, so it's me who should substitutes that guy.
+		expiredSide = 1;
+	}
+	else if(this->connectivityTest(m_candidateSilhouetteVertex[2*segIdx+1], leftEndPnt, dis))
+	{
+		endPntIdx = 2*segIdx;
+		expiredSide = 1;
+	}
+	else if(this->connectivityTest(m_candidateSilhouetteVertex[2*segIdx+1], rightEndPnt, dis))
+	{
+		endPntIdx = 2*segIdx;
+		expiredSide = 2;
+	}
+	else if(this->connectivityTest(m_candidateSilhouetteVertex[2*segIdx], rightEndPnt, dis))
+	{
+		endPntIdx = 2*segIdx+1;
+		expiredSide = 2;
+	}
+	else
+		return false;
+
+	return true;
+}
+
 void CelShadingHandler::dfs( int leftEndPntIdx, int rightEndPntIdx )
 {
 	while(true)
 	{
 		float minDis		= 1000000.0f;
-		float curDis		= 0;
 		int   minIdx		= -1;
 		int	  expiredSide	= 0;
 
 		const D3DXVECTOR3& leftEndPnt	= m_candidateSilhouetteVertex[leftEndPntIdx];
 		const D3DXVECTOR3& rightEndPnt	= m_candidateSilhouetteVertex[rightEndPntIdx];
 
-		for(int i=0; i<m_silNum; ++i)
+		//Only strokes with an end point around either end of the chain can be in reach. They
+		//are tested whole as in a scan over all of them, on a tie the first stroke wins.
+		for(int side=0; side<2; ++side)
 		{
-			if(m_segGroup[i].groupIdx!=0)
+			int cellX, cellY;
+
+			if( !this->endPntCell(side == 0 ? leftEndPnt : rightEndPnt, cellX, cellY) )
 				continue;
 
-			if(this->connectivityTest(m_candidateSilhouetteVertex[2*i], leftEndPnt, curDis))
+			for(int dy=-1; dy<=1; ++dy)
 			{
-				if(curDis < minDis)
+				for(int dx=-1; dx<=1; ++dx)
 				{
-					minDis = curDis;
-					minIdx = 2*i+1; //my brother connects with someone else, so it's me who should substitutes that guy.
-					expiredSide = 1;
+					int bucket = this->endPntBucket(cellX + dx, cellY + dy);
+					int first = m_endPntBucketStart[bucket];
+					int last = first + m_endPntBucketCount[bucket];
+
+					for(int j=first; j<last; ++j)
+					{
+						int segIdx = m_endPntBucket[j] / 2;
+
+						float curDis = 0;
+						int endPntIdx = -1;
+						int side = 0;
+
+						if( !this->reachSegment(segIdx, leftEndPnt, rightEndPnt, curDis, endPntIdx, side) )
+							continue;
+
+						if(curDis < minDis || (curDis == minDis && segIdx < minIdx / 2))
+						{
+							minDis = curDis;
+							minIdx = endPntIdx;
+							expiredSide = side;
+						}
+					}
 				}
 			}
-			else if(this->connectivityTest(m_candidateSilhouetteVertex[2*i+1], leftEndPnt, curDis))
+		}
+
+		//found a connective point
+		if(minIdx != -1)
+			this->attachSegment(minIdx, expiredSide, leftEndPntIdx, rightEndPntIdx);
+		else
+			break;
+	}
+}
+
+//Puts the stroke of newEndPntIdx at the left (expiredSide 1) or right (2) end of the chain,
+//newEndPntIdx becoming that end
+void CelShadingHandler::attachSegment( int newEndPntIdx, int expiredSide, int& leftEndPntIdx, int& rightEndPntIdx )
+{
+	//set group ID
+	int curIdx = newEndPntIdx / 2;
+
+	this->removeFromEndPntGrid(curIdx);
+
+	if(expiredSide == 1)
+	{
+		int groupIdx = m_segGroup[leftEndPntIdx / 2].groupIdx;
+		m_segGroup[curIdx].groupIdx = groupIdx;
+
+		int offsetIdx = m_segGroup[leftEndPntIdx / 2].offsetIdx - 1;
+		m_segGroup[curIdx].offsetIdx = offsetIdx;
+
+		m_segGroupInfo[groupIdx].minIdx = offsetIdx;
+		++(m_segGroupInfo[groupIdx].total);
+
+		leftEndPntIdx = newEndPntIdx;
+	}
+	else if(expiredSide == 2)
+	{
+		int groupIdx = m_segGroup[rightEndPntIdx / 2].groupIdx;
+		m_segGroup[curIdx].groupIdx = m_segGroup[rightEndPntIdx / 2].groupIdx;
+
+		int offsetIdx = m_segGroup[rightEndPntIdx / 2].offsetIdx + 1;
+		m_segGroup[curIdx].offsetIdx = offsetIdx;
+
+		++(m_segGroupInfo[groupIdx].total);
+
+		rightEndPntIdx = newEndPntIdx;
+	}
+}
+
+//No other stroke end at the welded vertex of the end point, or no vertex at all
+bool CelShadingHandler::isDanglingEndPnt( int endPntIdx ) const
+{
+	int vertex = m_strokeEndVertex[endPntIdx];
+
+	return vertex < 0 || m_vertexEndNum[vertex] < 2;
+}
+
+//Closest dangling end point of another stroke within reach on the screen, -1 when there is none.
+//On a tie the first end point wins.
+int CelShadingHandler::findNearestDanglingEndPnt( int endPntIdx ) const
+{
+	const D3DXVECTOR3& endPnt = m_candidateSilhouetteVertex[endPntIdx];
+
+	int cellX, cellY;
+
+	if( !this->endPntCell(endPnt, cellX, cellY) )
+		return -1;
+
+	float minDis = 1000000.0f;
+	int	  minIdx = -1;
+
+	for(int dy=-1; dy<=1; ++dy)
+	{
+		for(int dx=-1; dx<=1; ++dx)
+		{
+			int bucket = this->endPntBucket(cellX + dx, cellY + dy);
+			int first = m_endPntBucketStart[bucket];
+			int last = first + m_endPntBucketCount[bucket];
+
+			for(int j=first; j<last; ++j)
 			{
-				if(curDis < minDis)
+				int candidate = m_endPntBucket[j];
+				float curDis = 0;
+
+				if(candidate / 2 == endPntIdx / 2 || !this->isDanglingEndPnt(candidate))
+					continue;
+
+				if( !connectivityTest(m_candidateSilhouetteVertex[candidate], endPnt, curDis) )
+					continue;
+
+				if(curDis < minDis || (curDis == minDis && candidate < minIdx))
 				{
 					minDis = curDis;
-					minIdx = 2*i;
-					expiredSide = 1;
+					minIdx = candidate;
 				}
 			}
-			else if(this->connectivityTest(m_candidateSilhouetteVertex[2*i+1], rightEndPnt, curDis))
+		}
+	}
+
+	return minIdx;
+}
+
+//Links of the topology chaining, the same seen from either end point so that no order between
+//the end points matters. The end points meeting at a vertex pair up in the order of their list,
+//a dangling one goes with the closest dangling end point on the screen if that one's closest is
+//the first one too.
+void CelShadingHandler::linkEndPnts()
+{
+	int endPntNum = m_silNum * 2;
+
+	#pragma omp parallel for schedule(dynamic, 64)
+	for(int e=0; e<endPntNum; ++e)
+		m_endPntNearest[e] = this->isDanglingEndPnt(e) ? this->findNearestDanglingEndPnt(e) : -1;
+
+	#pragma omp parallel for schedule(static)
+	for(int e=0; e<endPntNum; ++e)
+	{
+		int partner = -1;
+
+		if(this->isDanglingEndPnt(e))
+		{
+			int nearest = m_endPntNearest[e];
+
+			if(nearest >= 0 && m_endPntNearest[nearest] == e)
+				partner = nearest;
+		}
+		else
+		{
+			int rank = 0;
+			int i = m_vertexEndHead[m_strokeEndVertex[e]];
+
+			while(i != e)
 			{
-				if(curDis < minDis)
-				{
-					minDis = curDis;
-					minIdx = 2*i;
-					expiredSide = 2;
-				}
+				++rank;
+				i = m_strokeEndNext[i];
 			}
-			else if(this->connectivityTest(m_candidateSilhouetteVertex[2*i], rightEndPnt, curDis))
+
+			//The one after on an even rank, the one before on an odd rank
+			if(rank & 1)
 			{
-				if(curDis < minDis)
-				{
-					minDis = curDis;
-					minIdx = 2*i+1;
-					expiredSide = 2;
-				}
+				partner = m_vertexEndHead[m_strokeEndVertex[e]];
+
+				for(int j=0; j<rank-1; ++j)
+					partner = m_strokeEndNext[partner];
 			}
+			else
+				partner = m_strokeEndNext[e];
+
+			//Both ends of one stroke at one vertex, nothing to chain
+			if(partner >= 0 && partner / 2 == e / 2)
+				partner = -1;
 		}
 
-		//found a connective point
-		if(minIdx != -1)
-		{
-			//set group ID
-			int curIdx = minIdx / 2;
+		m_endPntPartner[e] = partner;
+	}
+}
 
-			int newLeftEndPntIdx(leftEndPntIdx);
-			int newRightEndPntIdx(rightEndPntIdx);
+//Welded vertex of every end point of the object's strokes, from their object space positions:
+//the backends keep those of the ends they did not cut bit for bit. Then the end points meeting
+//at every vertex, lowest first.
+bool CelShadingHandler::weldStrokeEnds( const CelSilhouette* celSilhouette, int objIdx )
+{
+	int endPntNum = m_silNum * 2;
 
-			if(expiredSide == 1)
-			{
-				newLeftEndPntIdx = minIdx;
+	if(endPntNum > m_strokeEndSize)
+	{
+		delete [] m_strokeEndVertex;
+		delete [] m_strokeEndNext;
+		delete [] m_endPntPartner;
+		delete [] m_endPntNearest;
 
-				int groupIdx = m_segGroup[leftEndPntIdx / 2].groupIdx;
-				m_segGroup[curIdx].groupIdx = groupIdx;
+		m_strokeEndSize = endPntNum;
 
-				int offsetIdx = m_segGroup[leftEndPntIdx / 2].offsetIdx - 1;
-				m_segGroup[curIdx].offsetIdx = offsetIdx;
+		m_strokeEndVertex	= new int[m_strokeEndSize];
+		m_strokeEndNext		= new int[m_strokeEndSize];
+		m_endPntPartner		= new int[m_strokeEndSize];
+		m_endPntNearest		= new int[m_strokeEndSize];
+	}
 
-				m_segGroupInfo[groupIdx].minIdx = offsetIdx;
-				++(m_segGroupInfo[groupIdx].total);
-			}
-			else if(expiredSide == 2)
-			{
-				newRightEndPntIdx = minIdx;
+	if(celSilhouette->m_vertexNum > m_vertexEndSize)
+	{
+		delete [] m_vertexEndHead;
+		delete [] m_vertexEndNum;
 
-				int groupIdx = m_segGroup[rightEndPntIdx / 2].groupIdx;
-				m_segGroup[curIdx].groupIdx = m_segGroup[rightEndPntIdx / 2].groupIdx;
+		m_vertexEndSize = celSilhouette->m_vertexNum;
 
-				int offsetIdx = m_segGroup[rightEndPntIdx / 2].offsetIdx + 1;
-				m_segGroup[curIdx].offsetIdx = offsetIdx;
+		m_vertexEndHead	= new int[m_vertexEndSize];
+		m_vertexEndNum	= new int[m_vertexEndSize];
 
-				++(m_segGroupInfo[groupIdx].total);
-			}
+		memset(m_vertexEndHead, 0xFF, m_vertexEndSize * sizeof(int));
+		memset(m_vertexEndNum, 0, m_vertexEndSize * sizeof(int));
+	}
 
-			leftEndPntIdx  = newLeftEndPntIdx;
-			rightEndPntIdx = newRightEndPntIdx;
-		}
-		else
-			break;
+	const D3DXVECTOR3* strokeVertex = m_sceneSilVertex + 2 * m_objStrokeStart[objIdx];
+	const MeshVertex* vertices = m_batchObjects[objIdx].vertices;
+
+	for(int i=endPntNum-1; i>=0; --i)
+	{
+		int vertex = celSilhouette->findWeldedVertex(vertices, strokeVertex[i]);
+
+		m_strokeEndVertex[i] = vertex;
+		m_strokeEndNext[i] = -1;
+
+		if(vertex < 0)
+			continue;
+
+		m_strokeEndNext[i] = m_vertexEndHead[vertex];
+		m_vertexEndHead[vertex] = i;
+		++m_vertexEndNum[vertex];
 	}
-}                                                                                                                                                             
 
-bool CelShadingHandler::vertexProjTransform( EdgeVertex* edgeVertices )
+	return true;
+}
+
+//Buckets of the projected end points of the current object's strokes, all of them in the grid
+bool CelShadingHandler::initEndPntGrid()
 {
-	for(int i=0; i<m_silNum; ++i)
+	int endPntNum = m_silNum * 2;
+
+	int bucketNum = 64;
+	while(bucketNum < endPntNum)
+		bucketNum *= 2;
+
+	if(bucketNum > m_endPntBucketSize)
+	{
+		delete [] m_endPntBucketStart;
+		delete [] m_endPntBucketCount;
+
+		m_endPntBucketSize = bucketNum;
+
+		m_endPntBucketStart = new int[m_endPntBucketSize + 1];
+		m_endPntBucketCount = new int[m_endPntBucketSize];
+	}
+
+	if(endPntNum > m_endPntSize)
+	{
+		delete [] m_endPntBucket;
+		delete [] m_endPntSlot;
+
+		m_endPntSize = endPntNum;
+
+		m_endPntBucket	= new int[m_endPntSize];
+		m_endPntSlot	= new int[m_endPntSize];
+	}
+
+	m_endPntBucketNum = bucketNum;
+	//A hair wider than the connect distance, rounding must not push a point in reach two cells away
+	m_endPntCellSize = max(sqrt(s_ConnectDisThreshold) * 1.001f, 1e-6f);
+
+	memset(m_endPntBucketCount, 0, sizeof(int) * bucketNum);
+
+	//Count, scan, then fill with the counts as cursors
+	for(int i=0; i<endPntNum; ++i)
+	{
+		int cellX, cellY;
+
+		if(this->endPntCell(m_candidateSilhouetteVertex[i], cellX, cellY))
+			++m_endPntBucketCount[this->endPntBucket(cellX, cellY)];
+	}
+
+	m_endPntBucketStart[0] = 0;
+
+	for(int i=0; i<bucketNum; ++i)
 	{
-		m_candidateSilhouetteVertex[2*i] = edgeVertices[4*i].position;
-		m_candidateSilhouetteVertex[2*i+1] = edgeVertices[4*i+1].position;
+		m_endPntBucketStart[i + 1] = m_endPntBucketStart[i] + m_endPntBucketCount[i];
+		m_endPntBucketCount[i] = 0;
+	}
+
+	for(int i=0; i<endPntNum; ++i)
+	{
+		int cellX, cellY;
+
+		m_endPntSlot[i] = -1;
+
+		if( !this->endPntCell(m_candidateSilhouetteVertex[i], cellX, cellY) )
+			continue;
+
+		int bucket = this->endPntBucket(cellX, cellY);
+		int slot = m_endPntBucketStart[bucket] + m_endPntBucketCount[bucket]++;
+
+		m_endPntBucket[slot] = i;
+		m_endPntSlot[i] = slot;
 	}
 
-	if( !cudaPassProjVerticesDataToGPU(m_candidateSilhouetteVertex, m_silNum))
+	return true;
+}
+
+//No cell for an end point that is not a number, it never is in reach of anything
+bool CelShadingHandler::endPntCell(const D3DXVECTOR3& p, int& cellX, int& cellY) const
+{
+	if(p.x != p.x || p.y != p.y)
 		return false;
 
-	cudaRunProjKernel(m_silNum);
+	//Far away points share the border cells, still next to the ones they are close to
+	const float cellLimit = 1048576.0f;
 
-	cudaGetProjDataFromGPU(m_candidateSilhouetteVertex, m_silNum);
+	float x = min(max(p.x / m_endPntCellSize, -cellLimit), cellLimit);
+	float y = min(max(p.y / m_endPntCellSize, -cellLimit), cellLimit);
+
+	cellX = (int)floor(x);
+	cellY = (int)floor(y);
 
 	return true;
 }
 
+int CelShadingHandler::endPntBucket(int cellX, int cellY) const
+{
+	unsigned int hash = ((unsigned int)cellX * 73856093u) ^ ((unsigned int)cellY * 19349663u);
+
+	return (int)(hash & (m_endPntBucketNum - 1));
+}
+
+//Both end points of a stroke leave the grid once it is chained, swapped with the last one of their bucket
+void CelShadingHandler::removeFromEndPntGrid(int segIdx)
+{
+	for(int i=2*segIdx; i<2*segIdx+2; ++i)
+	{
+		int slot = m_endPntSlot[i];
+
+		if(slot < 0)
+			continue;
+
+		int cellX, cellY;
+		this->endPntCell(m_candidateSilhouetteVertex[i], cellX, cellY);
+
+		int bucket = this->endPntBucket(cellX, cellY);
+		int lastSlot = m_endPntBucketStart[bucket] + --m_endPntBucketCount[bucket];
+		int lastEndPnt = m_endPntBucket[lastSlot];
+
+		m_endPntBucket[slot] = lastEndPnt;
+		m_endPntSlot[lastEndPnt] = slot;
+		m_endPntSlot[i] = -1;
+	}
+}
+
 void CelShadingHandler::calPerpendicularUnitVector(EdgeVertex* edgeVerticesHead)
 {
 	//Calculate the 2D vector is perpendicular to current silhouette after projection.
@@ -383,7 +1772,8 @@ bool CelShadingHandler::initMeshVertexBuffer()
 {
 	int silVerticesNum = m_silNum * 2;
 
-	if(silVerticesNum > m_candidateSilhouetteVertexNum)
+	//Group info has a slot more than there are strokes, needed even when an object has none
+	if(silVerticesNum > m_candidateSilhouetteVertexNum || !m_segGroupInfo)
 	{
 		if(m_candidateSilhouetteVertex)
 		{
@@ -412,111 +1802,114 @@ bool CelShadingHandler::initMeshVertexBuffer()
 		}
 
 		m_segGroupInfo = new SegmentGroupInfo[m_silNum +1];
-	}
 
-	m_candidateSilhouetteVertexNum = silVerticesNum;
+		m_candidateSilhouetteVertexNum = silVerticesNum;
+	}
 
 	return true;
 }
 
-bool CelShadingHandler::cullInvisibleSilouette()
+bool CelShadingHandler::initBatchBuffer(int objNum)
 {
-	if( !cudaPassCullDataToGPU(m_candidateSilhouetteVertex, m_silNum))
-		return false;
-
-	cudaRunCullKernel(m_silNum, m_indicesNum);
-
-	cudaGetCulledDataFromGPU(m_isSilhouette, m_silNum);
+	if(objNum > m_batchObjectSize)
+	{
+		delete [] m_batchObjects;
+		delete [] m_objFrames;
+		delete [] m_objTrackedNum;
+		delete [] m_objStrokeStart;
+		delete [] m_backStrokeStart;
+		delete [] m_pendingSilhouettes;
+
+		m_batchObjectSize = objNum;
+
+		m_batchObjects		= new BatchObject[objNum];
+		m_objFrames			= new ObjectFrame[objNum];
+		m_objTrackedNum		= new int[objNum];
+		m_objStrokeStart	= new int[objNum + 1];
+		m_backStrokeStart	= new int[objNum + 1];
+		m_pendingSilhouettes	= new CelSilhouette*[objNum];
+	}
 
 	return true;
 }
 
-bool CelShadingHandler::generateSilhouetteCandidates( MeshVertex* meshVertices, WORD* celIndices )
+//Sized for the whole scene: a silhouette list never outgrows the edge table
+bool CelShadingHandler::initSceneBuffer(int maxRangeNum)
 {
-	m_silNum = 0;
-	
-	for(int i=0; i<m_isSilhouetteSize; ++i)
+	if(maxRangeNum > m_edgeRangeSize)
 	{
-		if(m_isSilhouette[i])
-			++m_silNum;
-	}
+		delete [] m_edgeRanges;
 
-	if( !this->initMeshVertexBuffer() )
-		return false;
-
-	int silCandidateIdx = 0;
+		m_edgeRangeSize = maxRangeNum;
+		m_edgeRanges = new EdgeRange[m_edgeRangeSize];
+	}
 
-	for(int i=0; i<m_isSilhouetteSize; ++i)
+	if(m_edgeNum > m_silEdgeSize)
 	{
-		if(m_isSilhouette[i])
-		{
-			int idxTriangle = i / 3;
-			int idxMod = i % 3;
-
-			int idxStart	= celIndices[3 * idxTriangle + idxMod];
-			int idxEnd		= celIndices[3 * idxTriangle + (idxMod+1)%3];
+		delete [] m_silEdges;
+		delete [] m_trackedEdges;
 
-			m_candidateSilhouetteVertex[silCandidateIdx] = meshVertices[idxStart].position;
-			m_candidateSilhouetteVertexNormal[silCandidateIdx] = meshVertices[idxStart].normal;
-			++silCandidateIdx;
+		m_silEdgeSize = m_edgeNum;
 
-			m_candidateSilhouetteVertex[silCandidateIdx] = meshVertices[idxEnd].position;
-			m_candidateSilhouetteVertexNormal[silCandidateIdx] = meshVertices[idxEnd].normal;
-			++silCandidateIdx;
-		}
+		m_silEdges			= new int[m_silEdgeSize];
+		m_trackedEdges		= new TrackedEdge[m_silEdgeSize];
 	}
 
-	if( !this->cullInvisibleSilouette() )
-		return false;
+	if(m_edgeNum > m_sceneSilSize)
+	{
+		delete [] m_sceneSilVertex;
+		delete [] m_sceneSilNormal;
+		delete [] m_sceneSilProj;
 
-	return true;
-}
+		m_sceneSilSize = m_edgeNum;
 
-bool CelShadingHandler::generateSilhouettes( CelSilhouette* celSihouette, WORD* celIndices, EdgeVertex* edgeVertices, WORD* edgeIndices )
-{
-	//Recaculate the silhouette num after culling.
-	int realSilNum = 0;
+		m_sceneSilVertex	= new D3DXVECTOR3[m_sceneSilSize * 2];
+		m_sceneSilNormal	= new D3DXVECTOR3[m_sceneSilSize * 2];
+		m_sceneSilProj		= new D3DXVECTOR3[m_sceneSilSize * 2];
+	}
 
-	for(int i=0; i<m_silNum; ++i)
+	if(m_edgeNum > m_backSilSize)
 	{
-		if(m_isSilhouette[i])
-		{
-			++realSilNum;
-
-			edgeVertices->position = m_candidateSilhouetteVertex[2*i];
-			edgeVertices->normal = m_candidateSilhouetteVertexNormal[2*i];
-			edgeVertices->silhouetteWidth.z = -1;
-			++edgeVertices;
+		delete [] m_backSilVertex;
+		delete [] m_backSilNormal;
+		delete [] m_backSilProj;
 
-			edgeVertices->position = m_candidateSilhouetteVertex[2*i+1];
-			edgeVertices->normal = m_candidateSilhouetteVertexNormal[2*i+1];
-			edgeVertices->silhouetteWidth.z = -1;
-			++edgeVertices;
+		m_backSilSize = m_edgeNum;
 
-			edgeVertices->position = m_candidateSilhouetteVertex[2*i];
-			edgeVertices->normal = m_candidateSilhouetteVertexNormal[2*i];
-			edgeVertices->silhouetteWidth.z = 1;
-			++edgeVertices;
-
-			edgeVertices->position = m_candidateSilhouetteVertex[2*i+1];
-			edgeVertices->normal = m_candidateSilhouetteVertexNormal[2*i+1];
-			edgeVertices->silhouetteWidth.z = 1;
-			++edgeVertices;
-		}
+		m_backSilVertex		= new D3DXVECTOR3[m_backSilSize * 2];
+		m_backSilNormal		= new D3DXVECTOR3[m_backSilSize * 2];
+		m_backSilProj		= new D3DXVECTOR3[m_backSilSize * 2];
 	}
 
-	for(int i = 0; i<realSilNum; ++i)
+	return true;
+}
+
+bool CelShadingHandler::generateSilhouettes( EdgeVertex* edgeVertices )
+{
+	//Culled on the backend already, every one of them makes a stroke
+	for(int i=0; i<m_silNum; ++i)
 	{
-		edgeIndices[i * 6 + 0] = i * 4;
-		edgeIndices[i * 6 + 1] = i * 4 + 1;                           
-		edgeIndices[i * 6 + 2] = i * 4 + 2;
-		edgeIndices[i * 6 + 3] = i * 4 + 1;
-		edgeIndices[i * 6 + 4] = i * 4 + 3;
-		edgeIndices[i * 6 + 5] = i * 4 + 2;
+		edgeVertices->position = m_candidateSilhouetteVertex[2*i];
+		edgeVertices->normal = m_candidateSilhouetteVertexNormal[2*i];
+		edgeVertices->silhouetteWidth.z = -1;
+		++edgeVertices;
+
+		edgeVertices->position = m_candidateSilhouetteVertex[2*i+1];
+		edgeVertices->normal = m_candidateSilhouetteVertexNormal[2*i+1];
+		edgeVertices->silhouetteWidth.z = -1;
+		++edgeVertices;
+
+		edgeVertices->position = m_candidateSilhouetteVertex[2*i];
+		edgeVertices->normal = m_candidateSilhouetteVertexNormal[2*i];
+		edgeVertices->silhouetteWidth.z = 1;
+		++edgeVertices;
+
+		edgeVertices->position = m_candidateSilhouetteVertex[2*i+1];
+		edgeVertices->normal = m_candidateSilhouetteVertexNormal[2*i+1];
+		edgeVertices->silhouetteWidth.z = 1;
+		++edgeVertices;
 	}
 	
-	m_silNum = realSilNum;
-	
 	return true;
 }
 
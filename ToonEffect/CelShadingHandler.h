@@ -2,13 +2,14 @@
 #define CEL_SHADING_HANDLER_H_
 
 #include "StdHeader.h"
-
-struct MeshVertex;
-struct EdgeVertex;
-struct SegmentGroup;
-struct SegmentGroupInfo;
+#include "CUDADataStructure.h"
+#include "DepthBuffer.h"
+#include "TriangleBVH.h"
+#include "QuantitativeInvisibility.h"
+#include "StrokeChaining.h"
 
 class CelSilhouette;
+struct ChainRank;
 
 class CelShadingHandler
 {
@@ -21,45 +22,113 @@ public:
 				 D3DXMATRIX* worldViewMat, 
 				 D3DXMATRIX* projMat);
 
+	// Silhouettes of all objects at once: every backend stage runs a single time for the
+	// whole scene. worldViewMats holds one matrix per object. When frames are pipelined the
+	// strokes of the last call are chained while the silhouette pass of this one runs, the
+	// stroke buffers lagging one call behind.
+	bool processScene(CelSilhouette** celSilhouettes, 
+					  D3DXMATRIX* worldViewMats, 
+					  int objNum,
+					  D3DXMATRIX* projMat);
+
+	// Chains the frame the pipeline still holds into its stroke buffers, nothing to do when
+	// frames are not pipelined. Its objects must still be alive.
+	bool flushPendingFrame();
+
+	// Share of the last silhouette pass spent while the frame before was being chained, from the
+	// times the task queue takes. -1 unless frames are pipelined on the CPU backend.
+	float lastPassOverlap() const;
+
+	// Size of the screen in pixels, for the stroke simplification and level of detail
+	void setViewport(int width, int height);
+
 protected:
 
-	bool	passDataToGPU(	MeshVertex* h_meshVertex, 
-							WORD*		h_indices,
-							DWORD*		h_adjBuffer, 
-							D3DXMATRIX* h_matrixWorldView,
-							D3DXMATRIX* h_matrixWorldProj,
-							int			h_indicesNum,
-							int			h_vertexNum);
+	bool	passDataToGPU(	BatchObject* h_objects,
+							int			 objNum,
+							D3DXMATRIX*	 h_matrixProj,
+							const HiZPyramid* h_hiz,
+							const InstanceBVH* h_instanceBVH);
+
+	//Stages go to the backend asynchronously, the ticket says when their results are in
+
+	bool	runKernel(int objNum, StageTicket* ticket);
+
+	bool	getDataFromGPU(bool readEdges, bool readViewVertices, StageTicket* ticket);
+
+	bool	waitStage(StageTicket ticket);
+
+	bool	isStageDone(StageTicket ticket);
+
+	//Waits for the pass and reads its strokes back into the back stroke set
+	bool	readBackPass(StageTicket passTicket, int objNum, StageTicket* ticket);
+
+	void	swapSceneStrokes();
+
+	//Locks the mesh vertex buffers into the batch objects, returns how many it could lock
+	int		lockScene(CelSilhouette** celSilhouettes, int objNum);
+
+	//Unlocks what lockScene and the chaining locked. After a failure the stroke buffers still
+	//locked draw nothing.
+	void	unlockScene(CelSilhouette** celSilhouettes, int lockedNum, bool succeeded);
+
+	bool	isPendingScene(CelSilhouette** celSilhouettes, int objNum) const;
 
-	bool	runKernel(int indiceNum);
+	//processScene once every mesh vertex buffer is locked, the stroke buffers it locks are
+	//left to processScene to unlock when it fails
+	bool	processLockedScene(CelSilhouette** celSilhouettes, D3DXMATRIX* worldViewMats, int objNum, D3DXMATRIX* projMat);
 
-	bool	getDataFromGPU();
+	//Host work on the strokes of a frame once they are back: the detected edges to the objects,
+	//quantitative invisibility and the trackers
+	bool	finishFrame(CelSilhouette** celSilhouettes, int objNum, const D3DXMATRIX* projMat, bool readEdges, bool useQuantitative);
 
-	bool	generateQuads(	CelSilhouette* celSihouette, 
-							MeshVertex* edgeVertices, 
-							WORD* celIndices);
+	//Chains the strokes of the front set into the stroke buffers. A pass still running is read
+	//back as soon as it is done, between two objects, and *passTicket cleared.
+	bool	chainFrame(CelSilhouette** celSilhouettes, int objNum, StageTicket* passTicket, int passObjNum);
 
-	bool	generateSilhouetteCandidates(MeshVertex* meshVertices, 
-										 WORD* celIndices);
+	void	localizeDetectedEdges(int objNum);
 
-	bool	generateSilhouettes(CelSilhouette* celSihouette, 
-								WORD* celIndices, 
-								EdgeVertex* edgeVertices, 
-								WORD* edgeIndices);
+	bool	resetTrackers(CelSilhouette** celSilhouettes, int objNum);
+
+	bool	propagateVisibility(int objNum, const D3DXMATRIX* projMat);
+
+	bool	reserveSceneStrokes(int strokeNum);
+
+	bool	lockStrokeBuffers(CelSilhouette* celSihouette, int objIdx);
+
+	bool	generateQuads(int objIdx, EdgeVertex* edgeVertices);
+
+	bool	generateSilhouettes(EdgeVertex* edgeVertices);
 
 	bool	initMeshVertexBuffer();
-	
-	bool	vertexProjTransform(EdgeVertex* edgeVertices);
 
-	bool	cullInvisibleSilouette();
+	bool	initBatchBuffer(int objNum);
+
+	bool	initSceneBuffer(int maxRangeNum);
 
 	bool	connectSegments(EdgeVertex* edgeVerticesHead);
 
+	bool	initChainBuffer(int strokeNum);
+
+	int		orderChains();
+
+	void	orientChain(int firstStroke, int strokeNum);
+
+	float	pixelDistanceToSegment(const D3DXVECTOR3& p, const D3DXVECTOR3& a, const D3DXVECTOR3& b) const;
+
+	void	simplifyChain(int firstVertex, int vertexNum);
+
+	float	runPixelLength(int firstStroke, int lastStroke) const;
+
+	void	splitChains(int chainNum);
+
+	int		writeChains(const EdgeVertex* edgeVerticesHead, EdgeVertex* strokeVertices, int maxStrokes);
+
 	void	adjustSilouette(EdgeVertex* edgeVerticesHead);
 
 	float	generateWeight() const;
 
-	bool	connectivityTest(const D3DXVECTOR3& a, const D3DXVECTOR3& b, float& dis);
+	bool	connectivityTest(const D3DXVECTOR3& a, const D3DXVECTOR3& b, float& dis) const;
 
 	void	setSegmentRandomBias(EdgeVertex* edgeVerticesHead, int idx);
 
@@ -67,17 +136,108 @@ protected:
 
 	void	dfs( int leftEndPntIdx, int rightEndPntIdx );
 
+	void	attachSegment( int newEndPntIdx, int expiredSide, int& leftEndPntIdx, int& rightEndPntIdx );
+
+	bool	isDanglingEndPnt( int endPntIdx ) const;
+
+	int		findNearestDanglingEndPnt( int endPntIdx ) const;
+
+	void	linkEndPnts();
+
+	bool	weldStrokeEnds( const CelSilhouette* celSilhouette, int objIdx );
+
+	bool	initEndPntGrid();
+
+	bool	endPntCell(const D3DXVECTOR3& p, int& cellX, int& cellY) const;
+
+	int		endPntBucket(int cellX, int cellY) const;
+
+	void	removeFromEndPntGrid(int segIdx);
+
+	bool	reachSegment(int segIdx, const D3DXVECTOR3& leftEndPnt, const D3DXVECTOR3& rightEndPnt,
+						 float& dis, int& endPntIdx, int& expiredSide);
+
 private:
 
+	//Per object state of the current processScene call
+	struct ObjectFrame
+	{
+		int			edgeBase;		//first scene edge
+		bool		isTracked;
+		int			firstDetected;	//its detected silhouettes in m_silEdges, once localized
+		int			detectedNum;
+		void*		strokeData;		//locked stroke buffer, quads or instances
+	};
+
 	static float s_ConnectDisThreshold;
 	static float s_ConnectAngleThreshold;
 
-	int		m_indicesNum;
-	int		m_vertexNum;
+	int		m_edgeNum;
 	int		m_silNum;
 
-	bool*	m_isSilhouette;
-	int		m_isSilhouetteSize;
+	//Last stage submitted, nothing may be resized under it
+	StageTicket	m_lastStage;
+
+	//Edge table ranges left after the hierarchy test
+	EdgeRange*	m_edgeRanges;
+	int			m_edgeRangeNum;
+	int			m_edgeRangeSize;
+
+	//Edge indices of this frame's detected silhouettes, before visibility culling. Scene edges
+	//as they come back from the backend, then per object edges for the trackers.
+	int*		m_silEdges;
+	int			m_silEdgeNum;
+	int			m_silEdgeSize;
+
+	//Silhouettes the trackers carried over, object after object
+	TrackedEdge*	m_trackedEdges;
+	int				m_trackedEdgeNum;
+
+	//Objects of the current batch as handed to the backends
+	BatchObject*	m_batchObjects;
+	ObjectFrame*	m_objFrames;
+	int*			m_objTrackedNum;
+	int*			m_objStrokeStart;	//first stroke of every object, objNum + 1 entries
+	int*			m_backStrokeStart;	//same for the back stroke set
+	int				m_batchObjectSize;
+
+	//Visible strokes of the whole scene, object after object: end points, their normals and
+	//their projections
+	D3DXVECTOR3*	m_sceneSilVertex;
+	D3DXVECTOR3*	m_sceneSilNormal;
+	D3DXVECTOR3*	m_sceneSilProj;
+	int				m_sceneSilNum;
+	int				m_sceneSilSize;
+
+	//Back set of the scene strokes: the pass and the read back of a frame fill it while the front
+	//set above is still being chained, then the two swap
+	D3DXVECTOR3*	m_backSilVertex;
+	D3DXVECTOR3*	m_backSilNormal;
+	D3DXVECTOR3*	m_backSilProj;
+	int				m_backSilNum;
+	int				m_backSilSize;
+
+	//Frame whose strokes are read back but not chained yet, pipelined frames only: its objects,
+	//projection and what it read back. No objects when there is none.
+	CelSilhouette**	m_pendingSilhouettes;
+	int				m_pendingNum;
+	D3DXMATRIX		m_pendingProj;
+	bool			m_pendingReadEdges;
+	bool			m_pendingQuantitative;
+
+	float			m_passOverlap;
+
+	//Scratch of the quantitative invisibility, one object after the other
+	QIChains		m_qiChains;
+
+	//Scratch of the parallel topology chaining
+	StrokeChains	m_strokeChains;
+
+	//Scene depth for the objects using the depth buffer visibility mode
+	DepthBuffer		m_depthBuffer;
+
+	//Objects of the batch in view space, so that they hide each other's strokes
+	InstanceBVH		m_instanceBVH;
 
 	SegmentGroup*		m_segGroup;
 	SegmentGroupInfo*	m_segGroupInfo;
@@ -85,6 +245,46 @@ private:
 	D3DXVECTOR3*		m_candidateSilhouetteVertex;
 	int					m_candidateSilhouetteVertexNum;
 	D3DXVECTOR3*		m_candidateSilhouetteVertexNormal;
+
+	//Stroke simplification and level of detail: the quads as chained, the strokes in chain order
+	//with the end point each enters by, and a polyline per chain of its entry points and last
+	//exit point, which Douglas-Peucker thins out. Then the chains by length on the screen.
+	int					m_viewportWidth;
+	int					m_viewportHeight;
+
+	EdgeVertex*			m_chainQuads;
+	EdgeVertex*			m_keptQuads;	//quads that made it through, before they are packed
+	int*				m_chainStrokes;
+	int*				m_chainStart;		//chainNum + 1 of them
+	int*				m_strokeEntry;		//0 or 1, end point of the stroke the chain comes in by
+	D3DXVECTOR3*		m_polyline;			//strokeNum + chainNum points, chain after chain
+	bool*				m_keepPoint;
+	int*				m_simplifyStack;
+	ChainRank*			m_chainRanks;
+	bool*				m_keepChain;
+	int					m_simplifySize;
+
+	//Hash grid over the projected end points of the strokes not chained yet. Cells are as wide
+	//as the connect distance, so an end point only has to look at the 3x3 cells around it.
+	int*				m_endPntBucketStart;	//bucketNum + 1 of them
+	int*				m_endPntBucketCount;	//end points left in every bucket
+	int*				m_endPntBucket;			//end points, bucket after bucket
+	int*				m_endPntSlot;			//where every end point is in m_endPntBucket, -1 once gone
+	int					m_endPntBucketNum;		//power of two
+	int					m_endPntBucketSize;
+	int					m_endPntSize;
+	float				m_endPntCellSize;
+
+	//Topology chaining: welded mesh vertex of every end point, -1 off the mesh vertices, and the
+	//end points meeting at every vertex as lists. The vertex lists are empty between objects.
+	int*				m_strokeEndVertex;
+	int*				m_strokeEndNext;
+	int*				m_endPntPartner;	//end point linked to, -1 for none
+	int*				m_endPntNearest;	//closest dangling end point, dangling ones only
+	int					m_strokeEndSize;
+	int*				m_vertexEndHead;
+	int*				m_vertexEndNum;
+	int					m_vertexEndSize;
 };
 
 #endif
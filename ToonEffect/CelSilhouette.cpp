@@ -10,17 +10,45 @@
 
 #include "CelSilhouette.h"
 #include "CUDADataStructure.h"
+#include "CUDASilhouetteFinding.h"
+#include "SilhouetteCommon.h"
 #include "d3dUtility.h"
 
+extern bool g_instancedStrokes;
+
 CelSilhouette::CelSilhouette(IDirect3DDevice9* device, 
 							 ID3DXMesh* d3dMesh, 
 							 ID3DXBuffer* adjBuffer) 
 : 
 m_device(device), 
+m_indicesNum(0),
+m_vertexNum(0),
+m_silhouetteNum(0),
 m_adjBuffer(adjBuffer), 
-m_vb(NULL), 
-m_ib(NULL)
+m_indices(NULL),
+m_edges(NULL),
+m_edgeNum(0),
+m_facePlanes(NULL),
+m_vertexFaceStart(NULL),
+m_vertexFaces(NULL),
+m_weldTable(NULL),
+m_weldTableSize(0),
+m_visibility(VISIBILITY_EXACT),
+m_maxStrokes(0),
+m_mesh(NULL),
+m_decl(NULL)
 {
+	memset(&m_soa, 0, sizeof(SilhouetteSoA));
+	memset(&m_hierarchy, 0, sizeof(EdgeHierarchy));
+	memset(&m_bvh, 0, sizeof(TriangleBVH));
+	memset(&m_tracker, 0, sizeof(SilhouetteTracker));
+	memset(&m_resident, 0, sizeof(ResidentMesh));
+
+	if(m_device)
+		initStrokeBuffer(&m_strokes, new D3DStrokeBufferBackend(m_device), g_instancedStrokes);
+	else
+		initStrokeBuffer(&m_strokes, new MemoryStrokeBufferBackend(), g_instancedStrokes);
+
 	this->init(d3dMesh);
 }
 
@@ -33,6 +61,39 @@ bool CelSilhouette::init(ID3DXMesh* d3dMesh)
 
 		m_mesh = d3dMesh;
 
+		if( !this->copyIndices() )
+			return false;
+
+		if( !this->buildEdgeTable() )
+			return false;
+
+		if( !this->buildFacePlanes() )
+			return false;
+
+		if( !this->buildHierarchy() )
+			return false;
+
+		if( !this->buildBVH() )
+			return false;
+
+		if( !this->buildVertexFaces() )
+			return false;
+
+		if( !this->buildWeldMap() )
+			return false;
+
+		if( !buildSilhouetteSoA(&m_soa, m_edges, m_edgeNum, m_facePlanes, m_indicesNum / 3) )
+			return false;
+
+		if( !buildSilhouetteTracker(&m_tracker, m_edges, m_edgeNum, m_indicesNum / 3) )
+			return false;
+
+		m_resident.dirty = true;
+
+		//Without a device the strokes are still made, there is just nothing to draw them with
+		if(!m_device)
+			return true;
+
 		return this->createVertexDeclaration();
 	}
 
@@ -41,19 +102,33 @@ bool CelSilhouette::init(ID3DXMesh* d3dMesh)
 
 CelSilhouette::~CelSilhouette()
 {
-	d3d::Release<IDirect3DVertexBuffer9*>(m_vb);
-	d3d::Release<IDirect3DIndexBuffer9*>(m_ib);
 	d3d::Release<IDirect3DVertexDeclaration9*>(m_decl);
 	d3d::Release<ID3DXBuffer*>(m_adjBuffer);
+
+	delete [] m_indices;
+	delete [] m_edges;
+	delete [] m_facePlanes;
+	delete [] m_vertexFaceStart;
+	delete [] m_vertexFaces;
+	delete [] m_weldTable;
+
+	releaseSilhouetteSoA(&m_soa);
+	releaseEdgeHierarchy(&m_hierarchy);
+	releaseTriangleBVH(&m_bvh);
+	releaseSilhouetteTracker(&m_tracker);
+	releaseStrokeBuffer(&m_strokes);
+
+	cudaReleaseResidentMesh(&m_resident);
 }
 
 void CelSilhouette::render()
 {
+	if(!m_device || m_silhouetteNum == 0)
+		return;
+
 	m_device->SetVertexDeclaration(m_decl);
-	m_device->SetStreamSource(0, m_vb, 0, sizeof(EdgeVertex));
-	m_device->SetIndices(m_ib);
-	
-	m_device->DrawIndexedPrimitive(D3DPT_TRIANGLELIST, 0, 0, m_silhouetteNum * 4, 0, m_silhouetteNum * 2);// !!!!!!!!!!!!!!!!
+
+	drawStrokeBuffer(&m_strokes, m_device, m_silhouetteNum);
 }
 
 bool CelSilhouette::createVertexDeclaration()
@@ -71,7 +146,19 @@ bool CelSilhouette::createVertexDeclaration()
 		D3DDECL_END()
 	};
 
-	hr = m_device->CreateVertexDeclaration(decl, &m_decl);
+	//Corners of the quad in stream 0, a StrokeInstance per quad in stream 1
+	D3DVERTEXELEMENT9 instanceDecl[] = 
+	{
+		{0,  0, D3DDECLTYPE_FLOAT2,    D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_TEXCOORD, 0},
+		{1,  0, D3DDECLTYPE_FLOAT3,    D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_POSITION, 0},
+		{1, 12, D3DDECLTYPE_FLOAT3,    D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_POSITION, 1},
+		{1, 24, D3DDECLTYPE_UBYTE4N,   D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_NORMAL,   0},
+		{1, 28, D3DDECLTYPE_UBYTE4N,   D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_NORMAL,   1},
+		{1, 32, D3DDECLTYPE_FLOAT16_4, D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_TEXCOORD, 1},
+		D3DDECL_END()
+	};
+
+	hr = m_device->CreateVertexDeclaration(m_strokes.instanced ? instanceDecl : decl, &m_decl);
 
 	if(FAILED(hr))
 	{
@@ -82,30 +169,227 @@ bool CelSilhouette::createVertexDeclaration()
 	return true;
 }
 
-void CelSilhouette::createBuffer(int size)
+bool CelSilhouette::copyIndices()
+{
+	delete [] m_indices;
+
+	m_indices = new DWORD[m_indicesNum];
+
+	void* indices = 0;
+
+	if(FAILED(m_mesh->LockIndexBuffer(D3DLOCK_READONLY, &indices)))
+		return false;
+
+	if(m_mesh->GetOptions() & D3DXMESH_32BIT)
+	{
+		memcpy(m_indices, indices, m_indicesNum * sizeof(DWORD));
+	}
+	else
+	{
+		for(int i=0; i<m_indicesNum; ++i)
+			m_indices[i] = ((WORD*)indices)[i];
+	}
+
+	m_mesh->UnlockIndexBuffer();
+
+	return true;
+}
+
+bool CelSilhouette::buildEdgeTable()
+{
+	if(!m_adjBuffer)
+		return false;
+
+	delete [] m_edges;
+
+	//Every interior edge shows up as two half-edges, one in each adjacent triangle.
+	//Keep the one owned by the lower numbered triangle, plus every boundary half-edge.
+	m_edges = new MeshEdge[m_indicesNum];
+	m_edgeNum = 0;
+
+	const DWORD* indices = m_indices;
+
+	DWORD* adj = (DWORD*)m_adjBuffer->GetBufferPointer();
+
+	for(int i=0; i<m_indicesNum; ++i)
+	{
+		int idxTriangle = i / 3;
+		int idxMod = i % 3;
+		int idxAdjTriangle = (int)adj[i];
+
+		if(idxAdjTriangle != -1 && idxAdjTriangle < idxTriangle)
+		{
+			//Only skip it when the neighbour really links back, otherwise nobody emits the edge
+			if(adj[3 * idxAdjTriangle] == (DWORD)idxTriangle ||
+			   adj[3 * idxAdjTriangle + 1] == (DWORD)idxTriangle ||
+			   adj[3 * idxAdjTriangle + 2] == (DWORD)idxTriangle)
+				continue;
+		}
+
+		MeshEdge& edge = m_edges[m_edgeNum++];
+
+		edge.v0		= indices[3 * idxTriangle + idxMod];
+		edge.v1		= indices[3 * idxTriangle + (idxMod+1)%3];
+		edge.face0	= idxTriangle;
+		edge.face1	= idxAdjTriangle;
+	}
+
+	return true;
+}
+
+bool CelSilhouette::buildFacePlanes()
+{
+	delete [] m_facePlanes;
+
+	int faceNum = m_indicesNum / 3;
+
+	m_facePlanes = new D3DXVECTOR4[faceNum];
+
+	const DWORD* indices = m_indices;
+
+	MeshVertex* vertices = 0;
+
+	if(FAILED(m_mesh->LockVertexBuffer(D3DLOCK_READONLY, (void**)&vertices)))
+		return false;
+
+	for(int i=0; i<faceNum; ++i)
+	{
+		const D3DXVECTOR3& posV0 = vertices[indices[3 * i]].position;
+		const D3DXVECTOR3& posV1 = vertices[indices[3 * i + 1]].position;
+		const D3DXVECTOR3& posV2 = vertices[indices[3 * i + 2]].position;
+
+		//Only the sign matters to the silhouette test, so the normal is left unnormalized
+		D3DXVECTOR3 normal = crossProduct(posV1 - posV0, posV2 - posV0);
+
+		m_facePlanes[i] = D3DXVECTOR4(normal.x, normal.y, normal.z, -dotProduct(normal, posV0));
+	}
+
+	m_mesh->UnlockVertexBuffer();
+
+	return true;
+}
+
+bool CelSilhouette::buildHierarchy()
+{
+	MeshVertex* vertices = 0;
+
+	if(FAILED(m_mesh->LockVertexBuffer(D3DLOCK_READONLY, (void**)&vertices)))
+		return false;
+
+	//Reorders m_edges, so it has to run before anything else copies the edge table
+	bool result = buildEdgeHierarchy(&m_hierarchy, m_edges, m_edgeNum, m_facePlanes, vertices, m_indices);
+
+	m_mesh->UnlockVertexBuffer();
+
+	return result;
+}
+
+void CelSilhouette::setVisibility(VisibilityMode visibility)
 {
-	m_silhouetteNum = size;
+	m_visibility = visibility;
+}
+
+void CelSilhouette::setStrokeBudget(int maxStrokes)
+{
+	m_maxStrokes = maxStrokes;
+}
+
+bool CelSilhouette::buildBVH()
+{
+	MeshVertex* vertices = 0;
+
+	if(FAILED(m_mesh->LockVertexBuffer(D3DLOCK_READONLY, (void**)&vertices)))
+		return false;
+
+	bool result = buildTriangleBVH(&m_bvh, vertices, m_indices, m_indicesNum / 3);
+
+	m_mesh->UnlockVertexBuffer();
+
+	return result;
+}
+
+bool CelSilhouette::buildVertexFaces()
+{
+	delete [] m_vertexFaceStart;
+	delete [] m_vertexFaces;
+
+	m_vertexFaceStart = new int[m_vertexNum + 1];
+	m_vertexFaces = new int[m_indicesNum];
+
+	memset(m_vertexFaceStart, 0, (m_vertexNum + 1) * sizeof(int));
 
-	if(m_vb)
-		d3d::Release<IDirect3DVertexBuffer9*>(m_vb);
-	
-	if(m_ib)
-		d3d::Release<IDirect3DIndexBuffer9*>(m_ib);
+	for(int i=0; i<m_indicesNum; ++i)
+		++m_vertexFaceStart[m_indices[i] + 1];
+
+	for(int v=0; v<m_vertexNum; ++v)
+		m_vertexFaceStart[v + 1] += m_vertexFaceStart[v];
+
+	//Filled with the starts as cursors, then moved back by one vertex
+	for(int i=0; i<m_indicesNum; ++i)
+		m_vertexFaces[m_vertexFaceStart[m_indices[i]]++] = i / 3;
+
+	for(int v=m_vertexNum; v>0; --v)
+		m_vertexFaceStart[v] = m_vertexFaceStart[v - 1];
+
+	m_vertexFaceStart[0] = 0;
+
+	return true;
+}
+
+static unsigned int hashPosition(const D3DXVECTOR3& position)
+{
+	//Plus zero so that -0 hashes as 0, they compare equal
+	float coords[3] = { position.x + 0.0f, position.y + 0.0f, position.z + 0.0f };
+
+	unsigned int bits[3];
+	memcpy(bits, coords, sizeof(bits));
+
+	return (bits[0] * 73856093u) ^ (bits[1] * 19349663u) ^ (bits[2] * 83492791u);
+}
+
+bool CelSilhouette::buildWeldMap()
+{
+	delete [] m_weldTable;
+
+	m_weldTableSize = 64;
+	while(m_weldTableSize < 2 * m_vertexNum)
+		m_weldTableSize *= 2;
+
+	m_weldTable = new int[m_weldTableSize];
+
+	memset(m_weldTable, 0xFF, m_weldTableSize * sizeof(int));
+
+	MeshVertex* vertices = 0;
+
+	if(FAILED(m_mesh->LockVertexBuffer(D3DLOCK_READONLY, (void**)&vertices)))
+		return false;
+
+	for(int v=0; v<m_vertexNum; ++v)
+	{
+		unsigned int slot = hashPosition(vertices[v].position) & (m_weldTableSize - 1);
+
+		while(m_weldTable[slot] >= 0 && vertices[m_weldTable[slot]].position != vertices[v].position)
+			slot = (slot + 1) & (m_weldTableSize - 1);
+
+		if(m_weldTable[slot] < 0)
+			m_weldTable[slot] = v;
+	}
+
+	m_mesh->UnlockVertexBuffer();
+
+	return true;
+}
+
+//Welded vertex exactly at the position, -1 when there is none. Takes the locked vertex buffer.
+int CelSilhouette::findWeldedVertex(const MeshVertex* vertices, const D3DXVECTOR3& position) const
+{
+	if(!m_weldTable)
+		return -1;
 
-	int edgeSize = 4 * size;
-	int indexSize = 6 * size;
+	unsigned int slot = hashPosition(position) & (m_weldTableSize - 1);
 
-	m_device->CreateVertexBuffer(	edgeSize * sizeof(EdgeVertex),
-									D3DUSAGE_WRITEONLY,
-									0, // using vertex declaration
-									D3DPOOL_MANAGED,
-									&m_vb,
-									0);
+	while(m_weldTable[slot] >= 0 && vertices[m_weldTable[slot]].position != position)
+		slot = (slot + 1) & (m_weldTableSize - 1);
 
-	m_device->CreateIndexBuffer(	indexSize * sizeof(WORD), // 2 triangles per edge
-									D3DUSAGE_WRITEONLY,
-									D3DFMT_INDEX16,
-									D3DPOOL_MANAGED,
-									&m_ib,
-									0);
+	return m_weldTable[slot];
 }
\ No newline at end of file
@@ -2,12 +2,19 @@
 #define CEL_SILHOUETTE_H_
 
 #include "StdHeader.h"
+#include "SIMDSilhouetteClassifier.h"
+#include "EdgeHierarchy.h"
+#include "TriangleBVH.h"
+#include "SilhouetteTracker.h"
+#include "StrokeBuffer.h"
+#include "CUDADataStructure.h"
 
 class CelSilhouette
 {
 public:
 
 	friend class CelShadingHandler;
+	friend class CelSilhouetteTestAccess;
 
 	CelSilhouette(IDirect3DDevice9* device = NULL, 
 				  ID3DXMesh* d3dMesh = NULL, 
@@ -19,12 +26,30 @@ public:
 
 	void render();
 
-	void createBuffer(int size);
+	void setVisibility(VisibilityMode visibility);
+
+	void setStrokeBudget(int maxStrokes);
 
 protected:
 
 	bool createVertexDeclaration();
 
+	bool copyIndices();
+
+	bool buildEdgeTable();
+
+	bool buildFacePlanes();
+
+	bool buildHierarchy();
+
+	bool buildBVH();
+
+	bool buildVertexFaces();
+
+	bool buildWeldMap();
+
+	int	 findWeldedVertex(const MeshVertex* vertices, const D3DXVECTOR3& position) const;
+
 private:
 
 	int	m_indicesNum;
@@ -34,12 +59,52 @@ private:
 
 	ID3DXBuffer* m_adjBuffer;
 
+	//Mesh indices widened to 32 bit, whatever the format of the mesh index buffer
+	DWORD*		m_indices;
+
+	MeshEdge*	m_edges;
+	int			m_edgeNum;
+
+	//Object space plane (normal, offset) of every face, fixed for rigid meshes
+	D3DXVECTOR4* m_facePlanes;
+
+	//The same planes and the edge to face mapping laid out for the SIMD classifier
+	SilhouetteSoA m_soa;
+
+	//Normal cone clusters over m_edges, which is sorted to match
+	EdgeHierarchy m_hierarchy;
+
+	//Triangles of the mesh for the occlusion test of the silhouettes
+	TriangleBVH m_bvh;
+
+	//Faces around every vertex, m_vertexNum + 1 starts into m_vertexFaces
+	int*		m_vertexFaceStart;
+	int*		m_vertexFaces;
+
+	//Lowest index of the vertices at every position, the seams of the mesh welded, in a hash
+	//table by position for the end points of the strokes
+	int*		m_weldTable;		//vertex or -1, open addressing
+	int			m_weldTableSize;	//power of two
+
+	//Occlusion test of this object's silhouettes
+	VisibilityMode m_visibility;
+
+	//Most stroke quads drawn for this object, the longest chains first, 0 for no limit
+	int m_maxStrokes;
+
+	//Facing and silhouette of the last frame, for incremental extraction
+	SilhouetteTracker m_tracker;
+
+	//Device copy of the mesh for the CUDA backend, uploaded again only when init rebuilt it
+	ResidentMesh m_resident;
+
 	IDirect3DDevice9*			 m_device;
 
 	ID3DXMesh*					 m_mesh;
 
-	IDirect3DVertexBuffer9*      m_vb;
-	IDirect3DIndexBuffer9*       m_ib;
+	//Stroke quads, kept and grown over the frames, in system memory without a device
+	StrokeBuffer				 m_strokes;
+
 	IDirect3DVertexDeclaration9* m_decl;
 };
 
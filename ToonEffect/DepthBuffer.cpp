@@ -0,0 +1,391 @@
+//////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// File: DepthBuffer.cpp
+//
+// Author: Ren Yifei, yfren@cs.hku.hk
+//
+// Desc: Tiled SSE2 software rasterizer filling a low resolution depth buffer of the scene,
+//		 and the HiZ pyramid the depth buffer visibility mode samples
+//
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "DepthBuffer.h"
+#include "SilhouetteCommon.h"
+
+#include <float.h>
+#include <emmintrin.h>
+
+const int g_DEPTH_TILE_X_NUM = g_DEPTH_BUFFER_WIDTH / g_DEPTH_TILE_SIZE;
+const int g_DEPTH_TILE_Y_NUM = g_DEPTH_BUFFER_HEIGHT / g_DEPTH_TILE_SIZE;
+const int g_DEPTH_TILE_NUM = g_DEPTH_TILE_X_NUM * g_DEPTH_TILE_Y_NUM;
+
+// Triangle set up for rasterization: a pixel center (x, y) is covered when every
+// edgeA * x + edgeB * y + edgeC >= 0, its depth is depthA * x + depthB * y + depthC.
+struct ScreenTriangle
+{
+	float	edgeA[3];
+	float	edgeB[3];
+	float	edgeC[3];
+
+	float	depthA;
+	float	depthB;
+	float	depthC;
+
+	int		minX;	// covered pixels, clamped to the buffer
+	int		minY;
+	int		maxX;
+	int		maxY;
+};
+
+bool initDepthBuffer(DepthBuffer* buffer)
+{
+	memset(buffer, 0, sizeof(DepthBuffer));
+
+	HiZPyramid& pyramid = buffer->pyramid;
+
+	int width	= g_DEPTH_BUFFER_WIDTH;
+	int height	= g_DEPTH_BUFFER_HEIGHT;
+
+	while(pyramid.levelNum < g_HIZ_MAX_LEVELS)
+	{
+		pyramid.levelOffset[pyramid.levelNum]	= pyramid.depthNum;
+		pyramid.levelWidth[pyramid.levelNum]	= width;
+		pyramid.levelHeight[pyramid.levelNum]	= height;
+
+		pyramid.depthNum += width * height;
+		++pyramid.levelNum;
+
+		if(width == 1 && height == 1)
+			break;
+
+		width	= (width + 1) / 2;
+		height	= (height + 1) / 2;
+	}
+
+	pyramid.depth = new float[pyramid.depthNum];
+
+	buffer->tileStart	= new int[g_DEPTH_TILE_NUM + 1];
+	buffer->tileCursor	= new int[g_DEPTH_TILE_NUM];
+
+	return true;
+}
+
+void releaseDepthBuffer(DepthBuffer* buffer)
+{
+	delete [] buffer->pyramid.depth;
+	delete [] buffer->clipVertices;
+	delete [] buffer->triangles;
+	delete [] buffer->tileStart;
+	delete [] buffer->tileCursor;
+	delete [] buffer->tileTriangles;
+
+	memset(buffer, 0, sizeof(DepthBuffer));
+}
+
+static void setupTriangle(DepthBuffer* buffer, const D3DXVECTOR3& v0, const D3DXVECTOR3& v1, const D3DXVECTOR3& v2)
+{
+	float area = (v1.x - v0.x) * (v2.y - v0.y) - (v1.y - v0.y) * (v2.x - v0.x);
+
+	if(area == 0.0f)
+		return;
+
+	//Counter clockwise on the screen either way, no face is culled
+	const D3DXVECTOR3* pnts[3] = { &v0, area > 0.0f ? &v1 : &v2, area > 0.0f ? &v2 : &v1 };
+
+	float minX = v0.x < v1.x ? (v0.x < v2.x ? v0.x : v2.x) : (v1.x < v2.x ? v1.x : v2.x);
+	float minY = v0.y < v1.y ? (v0.y < v2.y ? v0.y : v2.y) : (v1.y < v2.y ? v1.y : v2.y);
+	float maxX = v0.x > v1.x ? (v0.x > v2.x ? v0.x : v2.x) : (v1.x > v2.x ? v1.x : v2.x);
+	float maxY = v0.y > v1.y ? (v0.y > v2.y ? v0.y : v2.y) : (v1.y > v2.y ? v1.y : v2.y);
+
+	//Pixel centers inside the bounds
+	minX = ceil(minX - 0.5f);
+	minY = ceil(minY - 0.5f);
+	maxX = floor(maxX - 0.5f);
+	maxY = floor(maxY - 0.5f);
+
+	if(maxX < 0.0f || maxY < 0.0f || minX > g_DEPTH_BUFFER_WIDTH - 1 || minY > g_DEPTH_BUFFER_HEIGHT - 1 || minX > maxX || minY > maxY)
+		return;
+
+	ScreenTriangle& tri = buffer->triangles[buffer->triangleNum++];
+
+	tri.minX = minX < 0.0f ? 0 : (int)minX;
+	tri.minY = minY < 0.0f ? 0 : (int)minY;
+	tri.maxX = maxX > g_DEPTH_BUFFER_WIDTH - 1 ? g_DEPTH_BUFFER_WIDTH - 1 : (int)maxX;
+	tri.maxY = maxY > g_DEPTH_BUFFER_HEIGHT - 1 ? g_DEPTH_BUFFER_HEIGHT - 1 : (int)maxY;
+
+	for(int i=0; i<3; ++i)
+	{
+		const D3DXVECTOR3& a = *pnts[i];
+		const D3DXVECTOR3& b = *pnts[(i + 1) % 3];
+
+		tri.edgeA[i] = a.y - b.y;
+		tri.edgeB[i] = b.x - a.x;
+		tri.edgeC[i] = -(tri.edgeA[i] * a.x + tri.edgeB[i] * a.y);
+	}
+
+	float dx1 = v1.x - v0.x;
+	float dy1 = v1.y - v0.y;
+	float dz1 = v1.z - v0.z;
+	float dx2 = v2.x - v0.x;
+	float dy2 = v2.y - v0.y;
+	float dz2 = v2.z - v0.z;
+
+	tri.depthA = (dz1 * dy2 - dz2 * dy1) / area;
+	tri.depthB = (dx1 * dz2 - dx2 * dz1) / area;
+	tri.depthC = v0.z - tri.depthA * v0.x - tri.depthB * v0.y;
+}
+
+static D3DXVECTOR3 toScreen(const D3DXVECTOR4& clip)
+{
+	return D3DXVECTOR3((clip.x / clip.w + 1.0f) * 0.5f * g_DEPTH_BUFFER_WIDTH,
+					   (1.0f - clip.y / clip.w) * 0.5f * g_DEPTH_BUFFER_HEIGHT,
+					   clip.z / clip.w);
+}
+
+//Clips against the near plane, which leaves 4 corners at most, and sets up the fan over them
+static void clipTriangle(DepthBuffer* buffer, const D3DXVECTOR4& c0, const D3DXVECTOR4& c1, const D3DXVECTOR4& c2)
+{
+	//Beyond the far plane altogether, nothing there hides a visible silhouette
+	if(c0.z > c0.w && c1.z > c1.w && c2.z > c2.w)
+		return;
+
+	const D3DXVECTOR4* corners[3] = { &c0, &c1, &c2 };
+
+	D3DXVECTOR3 polygon[4];
+	int cornerNum = 0;
+
+	for(int i=0; i<3; ++i)
+	{
+		const D3DXVECTOR4& a = *corners[i];
+		const D3DXVECTOR4& b = *corners[(i + 1) % 3];
+
+		if(a.z >= 0.0f)
+			polygon[cornerNum++] = toScreen(a);
+
+		if((a.z >= 0.0f) != (b.z >= 0.0f))
+			polygon[cornerNum++] = toScreen(lerpHomogeneous(a, b, a.z / (a.z - b.z)));
+	}
+
+	for(int i=1; i+1<cornerNum; ++i)
+		setupTriangle(buffer, polygon[0], polygon[i], polygon[i + 1]);
+}
+
+static bool setupTriangles(DepthBuffer* buffer, const BatchObject* objects, int objNum, const D3DXMATRIX* matrixProj)
+{
+	int faceNum = 0;
+	int maxVertexNum = 0;
+
+	for(int i=0; i<objNum; ++i)
+	{
+		faceNum += objects[i].indicesNum / 3;
+		maxVertexNum = objects[i].vertexNum > maxVertexNum ? objects[i].vertexNum : maxVertexNum;
+	}
+
+	if(maxVertexNum > buffer->clipVertexSize)
+	{
+		delete [] buffer->clipVertices;
+
+		buffer->clipVertices = new D3DXVECTOR4[maxVertexNum];
+		buffer->clipVertexSize = maxVertexNum;
+	}
+
+	//Near clipping turns a triangle into two at most
+	if(2 * faceNum > buffer->triangleSize)
+	{
+		delete [] buffer->triangles;
+
+		buffer->triangles = new ScreenTriangle[2 * faceNum];
+		buffer->triangleSize = 2 * faceNum;
+	}
+
+	buffer->triangleNum = 0;
+
+	for(int i=0; i<objNum; ++i)
+	{
+		const BatchObject& obj = objects[i];
+
+		D3DXMATRIX worldViewProj = obj.worldView * (*matrixProj);
+
+		#pragma omp parallel for schedule(static)
+		for(int v=0; v<obj.vertexNum; ++v)
+			buffer->clipVertices[v] = matrixPntMulHomogeneous(obj.vertices[v].position, &worldViewProj);
+
+		for(int f=0; f<obj.indicesNum / 3; ++f)
+		{
+			clipTriangle(buffer, buffer->clipVertices[obj.indices[3 * f]],
+						 buffer->clipVertices[obj.indices[3 * f + 1]],
+						 buffer->clipVertices[obj.indices[3 * f + 2]]);
+		}
+	}
+
+	return true;
+}
+
+//Lists every triangle in the tiles its bounds overlap
+static bool binTriangles(DepthBuffer* buffer)
+{
+	memset(buffer->tileStart, 0, (g_DEPTH_TILE_NUM + 1) * sizeof(int));
+
+	for(int i=0; i<buffer->triangleNum; ++i)
+	{
+		const ScreenTriangle& tri = buffer->triangles[i];
+
+		for(int tileY=tri.minY / g_DEPTH_TILE_SIZE; tileY<=tri.maxY / g_DEPTH_TILE_SIZE; ++tileY)
+		{
+			for(int tileX=tri.minX / g_DEPTH_TILE_SIZE; tileX<=tri.maxX / g_DEPTH_TILE_SIZE; ++tileX)
+				++buffer->tileStart[tileY * g_DEPTH_TILE_X_NUM + tileX + 1];
+		}
+	}
+
+	for(int i=0; i<g_DEPTH_TILE_NUM; ++i)
+	{
+		buffer->tileStart[i + 1] += buffer->tileStart[i];
+		buffer->tileCursor[i] = buffer->tileStart[i];
+	}
+
+	int entryNum = buffer->tileStart[g_DEPTH_TILE_NUM];
+
+	if(entryNum > buffer->tileTriangleSize)
+	{
+		delete [] buffer->tileTriangles;
+
+		buffer->tileTriangles = new int[entryNum];
+		buffer->tileTriangleSize = entryNum;
+	}
+
+	for(int i=0; i<buffer->triangleNum; ++i)
+	{
+		const ScreenTriangle& tri = buffer->triangles[i];
+
+		for(int tileY=tri.minY / g_DEPTH_TILE_SIZE; tileY<=tri.maxY / g_DEPTH_TILE_SIZE; ++tileY)
+		{
+			for(int tileX=tri.minX / g_DEPTH_TILE_SIZE; tileX<=tri.maxX / g_DEPTH_TILE_SIZE; ++tileX)
+				buffer->tileTriangles[buffer->tileCursor[tileY * g_DEPTH_TILE_X_NUM + tileX]++] = i;
+		}
+	}
+
+	return true;
+}
+
+//Rows of the tile 4 pixels at a time, the nearest depth stays
+static void rasterizeTile(DepthBuffer* buffer, int tileIdx)
+{
+	const int tileX = tileIdx % g_DEPTH_TILE_X_NUM * g_DEPTH_TILE_SIZE;
+	const int tileY = tileIdx / g_DEPTH_TILE_X_NUM * g_DEPTH_TILE_SIZE;
+
+	float* depth = buffer->pyramid.depth;
+
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 pixelCenter = _mm_set_ps(3.5f, 2.5f, 1.5f, 0.5f);
+
+	for(int y=tileY; y<tileY+g_DEPTH_TILE_SIZE; ++y)
+	{
+		for(int x=tileX; x<tileX+g_DEPTH_TILE_SIZE; x+=4)
+			_mm_storeu_ps(depth + y * g_DEPTH_BUFFER_WIDTH + x, _mm_set1_ps(FLT_MAX));
+	}
+
+	for(int entry=buffer->tileStart[tileIdx]; entry<buffer->tileStart[tileIdx + 1]; ++entry)
+	{
+		const ScreenTriangle& tri = buffer->triangles[buffer->tileTriangles[entry]];
+
+		int minX = tri.minX > tileX ? tri.minX : tileX;
+		int minY = tri.minY > tileY ? tri.minY : tileY;
+		int maxX = tri.maxX < tileX + g_DEPTH_TILE_SIZE - 1 ? tri.maxX : tileX + g_DEPTH_TILE_SIZE - 1;
+		int maxY = tri.maxY < tileY + g_DEPTH_TILE_SIZE - 1 ? tri.maxY : tileY + g_DEPTH_TILE_SIZE - 1;
+
+		//Quads stay aligned to the tile, the edge test masks what lies outside the triangle
+		int firstX = tileX + ((minX - tileX) & ~3);
+
+		const __m128 edgeA0 = _mm_set1_ps(tri.edgeA[0]);
+		const __m128 edgeA1 = _mm_set1_ps(tri.edgeA[1]);
+		const __m128 edgeA2 = _mm_set1_ps(tri.edgeA[2]);
+		const __m128 depthA = _mm_set1_ps(tri.depthA);
+
+		for(int y=minY; y<=maxY; ++y)
+		{
+			float centerY = y + 0.5f;
+
+			const __m128 row0 = _mm_set1_ps(tri.edgeB[0] * centerY + tri.edgeC[0]);
+			const __m128 row1 = _mm_set1_ps(tri.edgeB[1] * centerY + tri.edgeC[1]);
+			const __m128 row2 = _mm_set1_ps(tri.edgeB[2] * centerY + tri.edgeC[2]);
+			const __m128 rowDepth = _mm_set1_ps(tri.depthB * centerY + tri.depthC);
+
+			for(int x=firstX; x<=maxX; x+=4)
+			{
+				__m128 centerX = _mm_add_ps(_mm_set1_ps((float)x), pixelCenter);
+
+				__m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(edgeA0, centerX), row0), zero),
+													  _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(edgeA1, centerX), row1), zero)),
+										   _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(edgeA2, centerX), row2), zero));
+
+				__m128 z = _mm_add_ps(_mm_mul_ps(depthA, centerX), rowDepth);
+
+				float* dst = depth + y * g_DEPTH_BUFFER_WIDTH + x;
+				__m128 current = _mm_loadu_ps(dst);
+
+				__m128 mask = _mm_and_ps(inside, _mm_cmplt_ps(z, current));
+
+				_mm_storeu_ps(dst, _mm_or_ps(_mm_and_ps(mask, z), _mm_andnot_ps(mask, current)));
+			}
+		}
+	}
+}
+
+//Every level the farthest of the 2x2 cells under it, an odd last row or column on its own
+static void buildPyramid(HiZPyramid* pyramid)
+{
+	for(int level=1; level<pyramid->levelNum; ++level)
+	{
+		const float* below	= pyramid->depth + pyramid->levelOffset[level - 1];
+		float* depth		= pyramid->depth + pyramid->levelOffset[level];
+
+		int belowWidth	= pyramid->levelWidth[level - 1];
+		int belowHeight	= pyramid->levelHeight[level - 1];
+		int width		= pyramid->levelWidth[level];
+		int height		= pyramid->levelHeight[level];
+
+		#pragma omp parallel for schedule(static)
+		for(int y=0; y<height; ++y)
+		{
+			int y0 = 2 * y;
+			int y1 = 2 * y + 1 < belowHeight ? 2 * y + 1 : y0;
+
+			for(int x=0; x<width; ++x)
+			{
+				int x0 = 2 * x;
+				int x1 = 2 * x + 1 < belowWidth ? 2 * x + 1 : x0;
+
+				float farthest = below[y0 * belowWidth + x0];
+
+				farthest = below[y0 * belowWidth + x1] > farthest ? below[y0 * belowWidth + x1] : farthest;
+				farthest = below[y1 * belowWidth + x0] > farthest ? below[y1 * belowWidth + x0] : farthest;
+				farthest = below[y1 * belowWidth + x1] > farthest ? below[y1 * belowWidth + x1] : farthest;
+
+				depth[y * width + x] = farthest;
+			}
+		}
+	}
+}
+
+bool rasterizeDepthBuffer(DepthBuffer* buffer,
+						  const BatchObject* objects, int objNum,
+						  const D3DXMATRIX* matrixProj)
+{
+	if(!buffer->pyramid.depth && !initDepthBuffer(buffer))
+		return false;
+
+	if(!setupTriangles(buffer, objects, objNum, matrixProj))
+		return false;
+
+	if(!binTriangles(buffer))
+		return false;
+
+	//Tiles own their pixels, the cost per tile follows the triangles in it
+	#pragma omp parallel for schedule(dynamic, 4)
+	for(int tileIdx=0; tileIdx<g_DEPTH_TILE_NUM; ++tileIdx)
+		rasterizeTile(buffer, tileIdx);
+
+	buildPyramid(&buffer->pyramid);
+
+	return true;
+}
@@ -0,0 +1,39 @@
+#ifndef DEPTH_BUFFER_H_
+#define DEPTH_BUFFER_H_
+
+#include "StdHeader.h"
+#include "CUDADataStructure.h"
+
+struct ScreenTriangle;
+
+// Low resolution depth buffer of the whole scene, rasterized on the host once per frame for
+// the depth buffer visibility mode, and the HiZ pyramid on top of it. Both backends read
+// the pyramid, the rest is scratch of the rasterizer.
+struct DepthBuffer
+{
+	HiZPyramid		pyramid;
+
+	D3DXVECTOR4*	clipVertices;	// clip space vertices of the object being set up
+	int				clipVertexSize;
+
+	ScreenTriangle*	triangles;		// near clipped, in pixels
+	int				triangleNum;
+	int				triangleSize;
+
+	int*			tileStart;		// first entry of every tile in tileTriangles, tileNum + 1 of them
+	int*			tileCursor;
+	int*			tileTriangles;
+	int				tileTriangleSize;
+};
+
+bool initDepthBuffer(DepthBuffer* buffer);
+
+// Rasterizes every triangle of every object, 4 pixels per instruction and one tile per task,
+// then builds the pyramid. The objects' vertices have to be locked.
+bool rasterizeDepthBuffer(DepthBuffer* buffer,
+						  const BatchObject* objects, int objNum,
+						  const D3DXMATRIX* matrixProj);
+
+void releaseDepthBuffer(DepthBuffer* buffer);
+
+#endif
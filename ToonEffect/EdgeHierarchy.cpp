@@ -0,0 +1,396 @@
+//////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// File: EdgeHierarchy.cpp
+//
+// Author: Ren Yifei, yfren@cs.hku.hk
+//
+// Desc: Normal cone hierarchy over the edge table, rejecting whole clusters
+//		 of edges that cannot hold a silhouette from the current eye
+//
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "EdgeHierarchy.h"
+#include "CUDADataStructure.h"
+#include "SilhouetteCommon.h"
+#include <float.h>
+#include <algorithm>
+
+const float g_HALF_PI = 1.5707963f;
+const float g_PI = 3.1415927f;
+
+//Angular margin keeping faces that are edge-on to within rounding out of a rejected cluster
+const float g_CONE_EPSILON = 1e-3f;
+
+//Position and scaled normal of every edge, the key the clusters are split on
+const int g_EDGE_KEY_SIZE = 6;
+
+struct EdgeKeyLess
+{
+	const float*	keys;
+	int				axis;
+
+	bool operator()(int lhs, int rhs) const
+	{
+		return keys[g_EDGE_KEY_SIZE * lhs + axis] < keys[g_EDGE_KEY_SIZE * rhs + axis];
+	}
+};
+
+struct HierarchyBuilder
+{
+	const MeshEdge*		edges;
+	const D3DXVECTOR4*	facePlanes;
+	const MeshVertex*	vertices;
+	const DWORD*			indices;
+
+	int*				order;	//original index of the edge at each position of the new table
+	float*				keys;
+
+	EdgeClusterNode*	nodes;
+	int					nodeNum;
+	int					leafNum;
+};
+
+static float clampUnit(float x)
+{
+	return x < -1.0f ? -1.0f : (x > 1.0f ? 1.0f : x);
+}
+
+static bool unitFaceNormal(const D3DXVECTOR4& plane, D3DXVECTOR3& normal)
+{
+	normal = D3DXVECTOR3(plane.x, plane.y, plane.z);
+
+	float len = length(normal);
+
+	//Degenerate faces give a zero plane, they never take part in a silhouette
+	if(len <= 0.0f)
+		return false;
+
+	normal /= len;
+
+	return true;
+}
+
+static void computeClusterBound(const HierarchyBuilder& builder, int first, int num, EdgeClusterNode& node)
+{
+	D3DXVECTOR3 axisSum(0.0f, 0.0f, 0.0f);
+	D3DXVECTOR3 minPnt(FLT_MAX, FLT_MAX, FLT_MAX);
+	D3DXVECTOR3 maxPnt(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+
+	bool hasNormal = false;
+
+	for(int i=first; i<first+num; ++i)
+	{
+		const MeshEdge& edge = builder.edges[builder.order[i]];
+		int faces[2] = { edge.face0, edge.face1 };
+
+		for(int j=0; j<2; ++j)
+		{
+			if(faces[j] < 0)
+				continue;
+
+			D3DXVECTOR3 normal;
+			if(unitFaceNormal(builder.facePlanes[faces[j]], normal))
+			{
+				axisSum += normal;
+				hasNormal = true;
+			}
+
+			for(int k=0; k<3; ++k)
+			{
+				const D3DXVECTOR3& pos = builder.vertices[builder.indices[3 * faces[j] + k]].position;
+
+				minPnt.x = pos.x < minPnt.x ? pos.x : minPnt.x;
+				minPnt.y = pos.y < minPnt.y ? pos.y : minPnt.y;
+				minPnt.z = pos.z < minPnt.z ? pos.z : minPnt.z;
+				maxPnt.x = pos.x > maxPnt.x ? pos.x : maxPnt.x;
+				maxPnt.y = pos.y > maxPnt.y ? pos.y : maxPnt.y;
+				maxPnt.z = pos.z > maxPnt.z ? pos.z : maxPnt.z;
+			}
+		}
+	}
+
+	node.center = (minPnt + maxPnt) * 0.5f;
+	node.radius = 0.0f;
+
+	float axisLen = length(axisSum);
+
+	//Normals that (nearly) cancel out bound no useful cone
+	if(!hasNormal || axisLen < 1e-3f)
+	{
+		node.coneAxis  = D3DXVECTOR3(0.0f, 0.0f, 1.0f);
+		node.coneAngle = g_PI;
+	}
+	else
+	{
+		node.coneAxis  = axisSum / axisLen;
+		node.coneAngle = 0.0f;
+	}
+
+	for(int i=first; i<first+num; ++i)
+	{
+		const MeshEdge& edge = builder.edges[builder.order[i]];
+		int faces[2] = { edge.face0, edge.face1 };
+
+		for(int j=0; j<2; ++j)
+		{
+			if(faces[j] < 0)
+				continue;
+
+			D3DXVECTOR3 normal;
+			if(unitFaceNormal(builder.facePlanes[faces[j]], normal))
+			{
+				float angle = acosf(clampUnit(dotProduct(normal, node.coneAxis)));
+				node.coneAngle = angle > node.coneAngle ? angle : node.coneAngle;
+			}
+
+			for(int k=0; k<3; ++k)
+			{
+				const D3DXVECTOR3& pos = builder.vertices[builder.indices[3 * faces[j] + k]].position;
+
+				float dis = length(pos - node.center);
+				node.radius = dis > node.radius ? dis : node.radius;
+			}
+		}
+	}
+}
+
+static void buildNode(HierarchyBuilder& builder, int first, int num)
+{
+	int nodeIdx = builder.nodeNum++;
+
+	EdgeClusterNode& node = builder.nodes[nodeIdx];
+
+	computeClusterBound(builder, first, num, node);
+
+	node.firstEdge = first;
+	node.edgeNum = num;
+
+	if(num <= g_EDGE_CLUSTER_SIZE)
+	{
+		node.skipNode = nodeIdx + 1;
+		++builder.leafNum;
+		return;
+	}
+
+	//Split at the median of the widest key axis, so clusters stay both compact and of one orientation
+	float minKey[g_EDGE_KEY_SIZE];
+	float maxKey[g_EDGE_KEY_SIZE];
+
+	for(int k=0; k<g_EDGE_KEY_SIZE; ++k)
+	{
+		minKey[k] = FLT_MAX;
+		maxKey[k] = -FLT_MAX;
+	}
+
+	for(int i=first; i<first+num; ++i)
+	{
+		const float* key = builder.keys + g_EDGE_KEY_SIZE * builder.order[i];
+
+		for(int k=0; k<g_EDGE_KEY_SIZE; ++k)
+		{
+			minKey[k] = key[k] < minKey[k] ? key[k] : minKey[k];
+			maxKey[k] = key[k] > maxKey[k] ? key[k] : maxKey[k];
+		}
+	}
+
+	EdgeKeyLess keyLess;
+	keyLess.keys = builder.keys;
+	keyLess.axis = 0;
+
+	for(int k=1; k<g_EDGE_KEY_SIZE; ++k)
+	{
+		if(maxKey[k] - minKey[k] > maxKey[keyLess.axis] - minKey[keyLess.axis])
+			keyLess.axis = k;
+	}
+
+	int half = num / 2;
+
+	std::nth_element(builder.order + first, builder.order + first + half, builder.order + first + num, keyLess);
+
+	buildNode(builder, first, half);
+	buildNode(builder, first + half, num - half);
+
+	node.skipNode = builder.nodeNum;
+}
+
+bool buildEdgeHierarchy(EdgeHierarchy* hierarchy,
+						MeshEdge* edges, int edgeNum,
+						const D3DXVECTOR4* facePlanes,
+						const MeshVertex* vertices, const DWORD* indices)
+{
+	releaseEdgeHierarchy(hierarchy);
+
+	HierarchyBuilder builder;
+
+	builder.edges		= edges;
+	builder.facePlanes	= facePlanes;
+	builder.vertices	= vertices;
+	builder.indices		= indices;
+	builder.order		= new int[edgeNum];
+	builder.keys		= new float[g_EDGE_KEY_SIZE * edgeNum];
+	builder.nodeNum		= 0;
+	builder.leafNum		= 0;
+
+	//Boundary edges go first, the rest is handed to the tree
+	int boundaryEdgeNum = 0;
+
+	for(int i=0; i<edgeNum; ++i)
+	{
+		if(edges[i].face1 < 0)
+			builder.order[boundaryEdgeNum++] = i;
+	}
+
+	int interiorIdx = boundaryEdgeNum;
+
+	for(int i=0; i<edgeNum; ++i)
+	{
+		if(edges[i].face1 >= 0)
+			builder.order[interiorIdx++] = i;
+	}
+
+	//Scale the normals to the size of the mesh so neither half of the key dominates the splits
+	D3DXVECTOR3 minPnt(FLT_MAX, FLT_MAX, FLT_MAX);
+	D3DXVECTOR3 maxPnt(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+
+	for(int i=0; i<edgeNum; ++i)
+	{
+		const D3DXVECTOR3& pos = vertices[edges[i].v0].position;
+
+		minPnt.x = pos.x < minPnt.x ? pos.x : minPnt.x;
+		minPnt.y = pos.y < minPnt.y ? pos.y : minPnt.y;
+		minPnt.z = pos.z < minPnt.z ? pos.z : minPnt.z;
+		maxPnt.x = pos.x > maxPnt.x ? pos.x : maxPnt.x;
+		maxPnt.y = pos.y > maxPnt.y ? pos.y : maxPnt.y;
+		maxPnt.z = pos.z > maxPnt.z ? pos.z : maxPnt.z;
+	}
+
+	float normalScale = edgeNum > 0 ? length(maxPnt - minPnt) : 0.0f;
+
+	for(int i=0; i<edgeNum; ++i)
+	{
+		const MeshEdge& edge = edges[i];
+		float* key = builder.keys + g_EDGE_KEY_SIZE * i;
+
+		D3DXVECTOR3 midPnt = (vertices[edge.v0].position + vertices[edge.v1].position) * 0.5f;
+		D3DXVECTOR3 normalSum(0.0f, 0.0f, 0.0f);
+		D3DXVECTOR3 normal;
+
+		if(unitFaceNormal(facePlanes[edge.face0], normal))
+			normalSum += normal;
+
+		if(edge.face1 >= 0 && unitFaceNormal(facePlanes[edge.face1], normal))
+			normalSum += normal;
+
+		float normalLen = length(normalSum);
+
+		if(normalLen > 0.0f)
+			normalSum *= normalScale / normalLen;
+
+		key[0] = midPnt.x;
+		key[1] = midPnt.y;
+		key[2] = midPnt.z;
+		key[3] = normalSum.x;
+		key[4] = normalSum.y;
+		key[5] = normalSum.z;
+	}
+
+	//Median splits of more than g_EDGE_CLUSTER_SIZE edges leave at least half of that in every leaf
+	int interiorEdgeNum = edgeNum - boundaryEdgeNum;
+	int maxLeafNum = interiorEdgeNum / (g_EDGE_CLUSTER_SIZE / 2) + 1;
+
+	builder.nodes = new EdgeClusterNode[2 * maxLeafNum];
+
+	if(interiorEdgeNum > 0)
+		buildNode(builder, boundaryEdgeNum, interiorEdgeNum);
+
+	//Reorder the edge table to match the clusters
+	MeshEdge* sortedEdges = new MeshEdge[edgeNum];
+
+	for(int i=0; i<edgeNum; ++i)
+		sortedEdges[i] = edges[builder.order[i]];
+
+	memcpy(edges, sortedEdges, edgeNum * sizeof(MeshEdge));
+
+	delete [] sortedEdges;
+	delete [] builder.order;
+	delete [] builder.keys;
+
+	hierarchy->nodes			= builder.nodes;
+	hierarchy->nodeNum			= builder.nodeNum;
+	hierarchy->boundaryEdgeNum	= boundaryEdgeNum;
+	hierarchy->edgeNum			= edgeNum;
+	hierarchy->maxRangeNum		= (boundaryEdgeNum + g_EDGE_CLUSTER_SIZE - 1) / g_EDGE_CLUSTER_SIZE + builder.leafNum;
+
+	return true;
+}
+
+void releaseEdgeHierarchy(EdgeHierarchy* hierarchy)
+{
+	delete [] hierarchy->nodes;
+
+	memset(hierarchy, 0, sizeof(EdgeHierarchy));
+}
+
+//Every face of the cluster has its unit normal within coneAngle of coneAxis and lies inside the
+//bounding sphere, so seen from the eye its normal makes an angle within coneAngle + asin(r/d) of
+//the direction psi towards the center. All front facing below 90 degrees, all back facing above.
+static bool clusterHasNoSilhouette(const EdgeClusterNode& node, const D3DXVECTOR3& eye)
+{
+	if(node.coneAngle >= g_HALF_PI)
+		return false;
+
+	D3DXVECTOR3 toEye = eye - node.center;
+
+	float dis = length(toEye);
+
+	if(dis <= node.radius)
+		return false;
+
+	float psi = acosf(clampUnit(dotProduct(node.coneAxis, toEye) / dis));
+	float spread = node.coneAngle + asinf(node.radius / dis) + g_CONE_EPSILON;
+
+	return psi + spread < g_HALF_PI || psi - spread > g_HALF_PI;
+}
+
+int collectEdgeRanges(const EdgeHierarchy* hierarchy,
+					  const D3DXVECTOR3& eye,
+					  bool cull,
+					  int objIdx,
+					  EdgeRange* ranges)
+{
+	int rangeNum = 0;
+
+	for(int first=0; first<hierarchy->boundaryEdgeNum; first+=g_EDGE_CLUSTER_SIZE)
+	{
+		ranges[rangeNum].firstEdge = first;
+		ranges[rangeNum].edgeNum = min(g_EDGE_CLUSTER_SIZE, hierarchy->boundaryEdgeNum - first);
+		ranges[rangeNum].objIdx = objIdx;
+		++rangeNum;
+	}
+
+	int nodeIdx = 0;
+
+	while(nodeIdx < hierarchy->nodeNum)
+	{
+		const EdgeClusterNode& node = hierarchy->nodes[nodeIdx];
+
+		if(cull && clusterHasNoSilhouette(node, eye))
+		{
+			nodeIdx = node.skipNode;
+			continue;
+		}
+
+		//A leaf's subtree is just itself
+		if(node.skipNode == nodeIdx + 1)
+		{
+			ranges[rangeNum].firstEdge = node.firstEdge;
+			ranges[rangeNum].edgeNum = node.edgeNum;
+			ranges[rangeNum].objIdx = objIdx;
+			++rangeNum;
+		}
+
+		++nodeIdx;
+	}
+
+	return rangeNum;
+}
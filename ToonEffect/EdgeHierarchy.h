@@ -0,0 +1,57 @@
+#ifndef EDGE_HIERARCHY_H_
+#define EDGE_HIERARCHY_H_
+
+#include "StdHeader.h"
+
+struct MeshVertex;
+struct MeshEdge;
+struct EdgeRange;
+
+// One cluster of edges with a cone bounding the normals of their faces and a
+// sphere bounding the faces themselves. Nodes are stored depth first, so the
+// left child is the next node and skipNode is the first node after the subtree.
+struct EdgeClusterNode
+{
+	D3DXVECTOR3 coneAxis;
+	float		coneAngle;	// half angle, >= PI/2 when the cluster can never be rejected
+
+	D3DXVECTOR3	center;
+	float		radius;
+
+	int			firstEdge;
+	int			edgeNum;
+	int			skipNode;
+};
+
+struct EdgeHierarchy
+{
+	EdgeClusterNode*	nodes;
+	int					nodeNum;
+
+	// Edges [0, boundaryEdgeNum) lie on a boundary: they are silhouettes from everywhere and sit outside the tree
+	int					boundaryEdgeNum;
+
+	int					edgeNum;
+
+	// Upper bound of the ranges collectEdgeRanges can return
+	int					maxRangeNum;
+};
+
+// Builds the hierarchy and reorders edges so that every cluster covers a contiguous range of them.
+bool buildEdgeHierarchy(EdgeHierarchy* hierarchy,
+						MeshEdge* edges, int edgeNum,
+						const D3DXVECTOR4* facePlanes,
+						const MeshVertex* vertices, const DWORD* indices);
+
+void releaseEdgeHierarchy(EdgeHierarchy* hierarchy);
+
+// Collects the edge ranges, at most g_EDGE_CLUSTER_SIZE edges each, that may hold a silhouette seen
+// from the object space eye. With cull == false every edge is returned. The ranges are tagged
+// with objIdx, the position of the mesh in the batch.
+int collectEdgeRanges(const EdgeHierarchy* hierarchy,
+					  const D3DXVECTOR3& eye,
+					  bool cull,
+					  int objIdx,
+					  EdgeRange* ranges);
+
+#endif
@@ -12,6 +12,8 @@
 #include "d3dUtility.h"
 #include "CelShadingHandler.h"
 #include "CelSilhouette.h"
+#include "CUDASilhouetteFinding.h"
+#include "CPUTaskQueue.h"
 
 // Globals
 
@@ -53,6 +55,41 @@ bool g_randomWiggling = false;
 bool g_alphaTransition = true;
 bool g_widthTransition = true;
 
+//Run the silhouette stages on the CPU instead of CUDA, read from config.ini
+bool g_useCPUBackend = false;
+
+//Chain the strokes of a frame while the silhouette pass of the next one runs, drawing them a frame late, read from config.ini
+bool g_pipelineFrames = false;
+
+//Skip edge clusters whose normal cone rules out a silhouette, read from config.ini
+bool g_useEdgeHierarchy = true;
+
+//Track silhouettes from frame to frame, with a full rescan after g_fullRescanPeriod tracked frames, read from config.ini
+bool g_incrementalSilhouette = false;
+int  g_fullRescanPeriod = 30;
+
+//Let objects hide each other's strokes in the exact visibility test, read from config.ini
+bool g_sceneOcclusion = true;
+
+//Ray test every silhouette at least once in this many frames, not all of them every frame, read from config.ini
+int  g_visibilityRefreshPeriod = 1;
+
+//Most ray tests of the amortized silhouettes in one frame, 0 for no limit, read from config.ini
+int  g_visibilityRetestLimit = 0;
+
+//Chain strokes through the mesh vertices they share instead of by screen distance alone, read from config.ini
+bool g_topologyChaining = false;
+
+//Merge the strokes of a chain as long as none of them strays further than this from a straight line, in pixels, 0 keeps them all, read from config.ini
+float g_strokeSimplifyPixels = 0.0f;
+
+//Drop stroke quads and whole chains shorter than this on the screen, in pixels, 0 keeps them all, read from config.ini
+float g_strokeMinPixels = 0.0f;
+float g_chainMinPixels = 0.0f;
+
+//Draw every stroke as an instance of one quad, expanded in a vs_3_0 shader, where the device can, read from config.ini
+bool g_instancedStrokes = false;
+
 //total number of objs, read from config.ini
 int  g_ObjNum;
 
@@ -69,7 +106,10 @@ IDirect3DDevice9* Device = 0;
 ID3DXMesh**		g_meshes = NULL;
 ID3DXBuffer**	g_adjBuffer = NULL;
 D3DXMATRIX*		g_worldMatrices = NULL;
+D3DXMATRIX*		g_worldViewMatrices = NULL;	// this frame's, for the batched silhouette pass
 D3DXVECTOR4*	g_meshColors = NULL;
+VisibilityMode*	g_objVisibility = NULL;		// occlusion test of every object's silhouettes, read from config.ini
+int*			g_objMaxStrokes = NULL;		// stroke budget of every object, 0 for none, read from config.ini
 ID3DXFont*		g_font = NULL;
 
 // variables for shaders
@@ -87,6 +127,7 @@ D3DXHANDLE ToonColorHandle    = 0;
 D3DXHANDLE ToonLightDirHandle = 0;
 
 IDirect3DVertexShader9* OutlineShader = 0;
+IDirect3DPixelShader9* OutlinePixelShader = 0;	// shader model 3 takes no fixed function pixels, instanced strokes only
 ID3DXConstantTable* OutlineConstTable = 0;
 
 D3DXHANDLE OutlineWorldViewHandle = 0;
@@ -100,8 +141,10 @@ CelShadingHandler*	celShadingHandler;
 CelSilhouette**		celSilhouettes;
 
 // Global functions
-void LoadConfigFile();
+bool LoadConfigFile();
+bool LoadMeshFile(const char* fileName, ID3DXMesh** mesh, ID3DXBuffer** adjBuffer);
 bool SetupFont();
+bool InstancingSupported();
 void RenderFont(const char* str, RECT rect);
 bool Setup();
 void Cleanup();
@@ -204,6 +247,20 @@ void RenderFont(const char* str, RECT rect)
 						0xFF000000); //Color
 }
 
+//Instanced strokes take shader model 3, the packed types of StrokeInstance and instances read
+//from an offset into the stroke buffer
+bool InstancingSupported()
+{
+	D3DCAPS9 caps;
+	Device->GetDeviceCaps(&caps);
+
+	return caps.VertexShaderVersion >= D3DVS_VERSION(3, 0) &&
+		   caps.PixelShaderVersion >= D3DPS_VERSION(3, 0) &&
+		   (caps.DeclTypes & D3DDTCAPS_UBYTE4N) &&
+		   (caps.DeclTypes & D3DDTCAPS_FLOAT16_4) &&
+		   (caps.DevCaps2 & D3DDEVCAPS2_STREAMOFFSET);
+}
+
 //
 // Framework functions
 //
@@ -211,15 +268,29 @@ bool Setup()
 {
 	HRESULT hr = 0;
 
-	LoadConfigFile();
+	if(!LoadConfigFile())
+		return false;
+
+	//No CUDA device on this machine, fall back to the CPU backend
+	if(!g_useCPUBackend && !cudaDeviceAvailable())
+		g_useCPUBackend = true;
+
+	//Without shader model 3 the strokes go out as quads of 4 vertices
+	if(g_instancedStrokes && !InstancingSupported())
+		g_instancedStrokes = false;
 
 	SetupFont();
 
 	celSilhouettes		= new CelSilhouette*[g_ObjNum];
 	celShadingHandler	= new CelShadingHandler(Device);
+	celShadingHandler->setViewport(WIDTH, HEIGHT);
 	
 	for(int i=0; i<g_ObjNum; ++i)
+	{
 		celSilhouettes[i] = new CelSilhouette(Device, g_meshes[i], g_adjBuffer[i]);
+		celSilhouettes[i]->setVisibility(g_objVisibility[i]);
+		celSilhouettes[i]->setStrokeBudget(g_objMaxStrokes[i]);
+	}
 
 	// toon shader
 	ID3DXBuffer* toonCompiledCode = 0;
@@ -265,11 +336,11 @@ bool Setup()
 	ID3DXBuffer* outlineErrorBuffer  = 0;
 
 	hr = D3DXCompileShaderFromFile(
-		"myOutline.txt",
+		g_instancedStrokes ? "myOutlineInstanced.txt" : "myOutline.txt",
 		0,
 		0,
 		"Main",
-		"vs_1_1",
+		g_instancedStrokes ? "vs_3_0" : "vs_1_1",
 		D3DXSHADER_DEBUG, 
 		&outlineCompiledCode,
 		&outlineErrorBuffer,
@@ -299,6 +370,44 @@ bool Setup()
 
 	d3d::Release<ID3DXBuffer*>(outlineCompiledCode);
 
+	if(g_instancedStrokes)
+	{
+		hr = D3DXCompileShaderFromFile(
+			"myOutlineInstanced.txt",
+			0,
+			0,
+			"PixelMain",
+			"ps_3_0",
+			D3DXSHADER_DEBUG, 
+			&outlineCompiledCode,
+			&outlineErrorBuffer,
+			0);
+
+		if( outlineErrorBuffer )
+		{
+			::MessageBox(0, (char*)outlineErrorBuffer->GetBufferPointer(), 0, 0);
+			d3d::Release<ID3DXBuffer*>(outlineErrorBuffer);
+		}
+
+		if(FAILED(hr))
+		{
+			::MessageBox(0, "D3DXCompileShaderFromFile() - FAILED", 0, 0);
+			return false;
+		}
+
+		hr = Device->CreatePixelShader(
+			(DWORD*)outlineCompiledCode->GetBufferPointer(),
+			&OutlinePixelShader);
+
+		if(FAILED(hr))
+		{
+			::MessageBox(0, "CreatePixelShader - FAILED", 0, 0);
+			return false;
+		}
+
+		d3d::Release<ID3DXBuffer*>(outlineCompiledCode);
+	}
+
 
 	D3DXCreateTextureFromFile(Device, "toonshade.bmp", &ShadeTex);
 	D3DXCreateTextureFromFile(Device, g_strokeTexFileName, &SilhouetteTex);
@@ -351,11 +460,15 @@ void Cleanup()
 
 	delete [] g_meshes;
 	delete [] g_adjBuffer;
+	delete [] g_worldViewMatrices;
+	delete [] g_objVisibility;
+	delete [] g_objMaxStrokes;
 
 	d3d::Release<IDirect3DTexture9*>(ShadeTex);
 	d3d::Release<IDirect3DVertexShader9*>(ToonShader);
 	d3d::Release<ID3DXConstantTable*>(ToonConstTable);
 	d3d::Release<IDirect3DVertexShader9*>(OutlineShader);
+	d3d::Release<IDirect3DPixelShader9*>(OutlinePixelShader);
 	d3d::Release<ID3DXConstantTable*>(OutlineConstTable);
 
 	for(int i=0; i<g_ObjNum; ++i)
@@ -370,6 +483,9 @@ void Cleanup()
 	if(celShadingHandler)
 		delete celShadingHandler;
 
+	//Worker thread of the CPU backend, if it ever ran
+	cpuReleaseTaskQueue();
+
 	if(g_font)
 	{
 		g_font->Release();
@@ -467,6 +583,7 @@ bool Display(float timeDelta)
 		if(g_renderNPR)
 		{
 			Device->SetVertexShader(OutlineShader);
+			Device->SetPixelShader(OutlinePixelShader);
 			Device->SetTexture(0, SilhouetteTex);
 			Device->SetRenderState(D3DRS_CULLMODE, D3DCULL_NONE);
 			
@@ -474,12 +591,16 @@ bool Display(float timeDelta)
 			Device->SetRenderState(D3DRS_ZENABLE, D3DZB_FALSE);
 		}
 
+		//Silhouettes of all objects in one go
 		for(int i = 0; i < g_ObjNum; i++)
-		{
-			worldView = g_worldMatrices[i] * view;
+			g_worldViewMatrices[i] = g_worldMatrices[i] * view;
 
-			if(g_renderNPR)
-				celShadingHandler->process(celSilhouettes[i], &worldView, &ProjMatrix);
+		if(g_renderNPR)
+			celShadingHandler->processScene(celSilhouettes, g_worldViewMatrices, g_ObjNum, &ProjMatrix);
+
+		for(int i = 0; i < g_ObjNum; i++)
+		{
+			worldView = g_worldViewMatrices[i];
 
 			OutlineConstTable->SetMatrix(
 				Device, 
@@ -504,6 +625,7 @@ bool Display(float timeDelta)
 		{
 			Device->SetRenderState(D3DRS_ZENABLE, D3DZB_TRUE);
 			Device->SetRenderState(D3DRS_CULLMODE, D3DCULL_CCW);
+			Device->SetPixelShader(0);
 		}
 
 		Device->SetRenderState(D3DRS_ALPHABLENDENABLE,FALSE);   
@@ -517,22 +639,65 @@ bool Display(float timeDelta)
 	return true;
 }
 
-void LoadConfigFile()
+bool LoadConfigFile()
 {
 	::GetPrivateProfileString("Config", "StrokeTexture", "", g_strokeTexFileName, 256, CONFIG_FILE_NAME);
 
 	g_ObjNum = ::GetPrivateProfileInt("Config", "ObjNum", 0, CONFIG_FILE_NAME);
 
+	char backend[32];
+	::GetPrivateProfileString("Config", "Backend", "CUDA", backend, 32, CONFIG_FILE_NAME);
+	g_useCPUBackend = (strcmp(backend, "CPU") == 0);
+
+	g_pipelineFrames = (::GetPrivateProfileInt("Config", "PipelineFrames", 0, CONFIG_FILE_NAME) != 0);
+
+	g_useEdgeHierarchy = (::GetPrivateProfileInt("Config", "EdgeHierarchy", 1, CONFIG_FILE_NAME) != 0);
+
+	g_incrementalSilhouette = (::GetPrivateProfileInt("Config", "IncrementalSilhouette", 0, CONFIG_FILE_NAME) != 0);
+	g_fullRescanPeriod = ::GetPrivateProfileInt("Config", "FullRescanPeriod", 30, CONFIG_FILE_NAME);
+
+	g_sceneOcclusion = (::GetPrivateProfileInt("Config", "SceneOcclusion", 1, CONFIG_FILE_NAME) != 0);
+
+	g_visibilityRefreshPeriod = ::GetPrivateProfileInt("Config", "VisibilityRefreshPeriod", 1, CONFIG_FILE_NAME);
+	g_visibilityRetestLimit = ::GetPrivateProfileInt("Config", "VisibilityRetestLimit", 0, CONFIG_FILE_NAME);
+
+	char chaining[32];
+	::GetPrivateProfileString("Config", "ChainingMode", "ScreenSpace", chaining, 32, CONFIG_FILE_NAME);
+	g_topologyChaining = (strcmp(chaining, "Topology") == 0);
+
+	char simplify[32];
+	::GetPrivateProfileString("Config", "StrokeSimplifyPixels", "0", simplify, 32, CONFIG_FILE_NAME);
+	g_strokeSimplifyPixels = atof(simplify);
+
+	char minPixels[32];
+	::GetPrivateProfileString("Config", "StrokeMinPixels", "0", minPixels, 32, CONFIG_FILE_NAME);
+	g_strokeMinPixels = atof(minPixels);
+
+	::GetPrivateProfileString("Config", "ChainMinPixels", "0", minPixels, 32, CONFIG_FILE_NAME);
+	g_chainMinPixels = atof(minPixels);
+
+	char strokeFormat[32];
+	::GetPrivateProfileString("Config", "StrokeFormat", "Quads", strokeFormat, 32, CONFIG_FILE_NAME);
+	g_instancedStrokes = (strcmp(strokeFormat, "Instanced") == 0);
+
 	// Create geometry and compute corresponding world matrix and color
 	// for each mesh.
 	g_meshes		= new ID3DXMesh*[g_ObjNum];
 	g_adjBuffer		= new ID3DXBuffer*[g_ObjNum];
 	g_worldMatrices	= new D3DXMATRIX[g_ObjNum];
+	g_worldViewMatrices	= new D3DXMATRIX[g_ObjNum];
 	g_meshColors	= new D3DXVECTOR4[g_ObjNum];
+	g_objVisibility	= new VisibilityMode[g_ObjNum];
+	g_objMaxStrokes	= new int[g_ObjNum];
 
 	for(int i=0; i<g_ObjNum; ++i)
+	{
 		g_meshColors[i] = D3DXVECTOR4(1.0, 1.0, 0, 1.0);// default Color for mesh
 
+		g_meshes[i] = NULL;
+		g_adjBuffer[i] = NULL;
+	}
+
 	for(int i=0; i<g_ObjNum; ++i)
 	{
 		float offsetX,  offsetY, offsetZ;
@@ -615,6 +780,24 @@ void LoadConfigFile()
 		{
 			D3DXCreateTeapot(Device, &g_meshes[i], &g_adjBuffer[i]);
 		}
+		else if(strcmp(objType, "File") == 0)
+		{
+			char fileName[256];
+			::GetPrivateProfileString(objIdx, "Path", "", fileName, 256, CONFIG_FILE_NAME);
+
+			if(!LoadMeshFile(fileName, &g_meshes[i], &g_adjBuffer[i]))
+			{
+				::MessageBox(0, "LoadMeshFile() - FAILED", 0, 0);
+				return false;
+			}
+		}
+
+		//An unknown geometry, or one D3DX could not make, leaves nothing to draw
+		if(!g_meshes[i] || !g_adjBuffer[i])
+		{
+			::MessageBox(0, "Creating the mesh - FAILED", 0, 0);
+			return false;
+		}
 
 		//Translations
 		::GetPrivateProfileString(objIdx, "PosX", "", tmp, 32, CONFIG_FILE_NAME);
@@ -627,5 +810,72 @@ void LoadConfigFile()
 		offsetZ = atof(tmp);
 
 		D3DXMatrixTranslation(&(g_worldMatrices[i]), offsetX,  offsetY, offsetZ);
+
+		//Exact ray test unless the object asks for the software depth buffer or quantitative invisibility
+		char visibility[32];
+		::GetPrivateProfileString(objIdx, "Visibility", "Exact", visibility, 32, CONFIG_FILE_NAME);
+
+		if(strcmp(visibility, "DepthBuffer") == 0)
+			g_objVisibility[i] = VISIBILITY_DEPTH_BUFFER;
+		else if(strcmp(visibility, "Quantitative") == 0)
+			g_objVisibility[i] = VISIBILITY_QUANTITATIVE;
+		else
+			g_objVisibility[i] = VISIBILITY_EXACT;
+
+		//Longest chains first up to this many strokes, all of them by default
+		g_objMaxStrokes[i] = ::GetPrivateProfileInt(objIdx, "MaxStrokes", 0, CONFIG_FILE_NAME);
 	}
-}
\ No newline at end of file
+
+	return true;
+}
+
+//Loads an .x file as a single subset, position + normal mesh with 32 bit indices
+bool LoadMeshFile(const char* fileName, ID3DXMesh** mesh, ID3DXBuffer** adjBuffer)
+{
+	*mesh = NULL;
+	*adjBuffer = NULL;
+
+	ID3DXMesh* fileMesh = NULL;
+
+	if(FAILED(D3DXLoadMeshFromX(fileName, D3DXMESH_32BIT | D3DXMESH_MANAGED, Device, 0, 0, 0, 0, &fileMesh)))
+		return false;
+
+	bool hasNormals = (fileMesh->GetFVF() & D3DFVF_NORMAL) != 0;
+
+	HRESULT hr = fileMesh->CloneMeshFVF(D3DXMESH_32BIT | D3DXMESH_MANAGED, D3DFVF_XYZ | D3DFVF_NORMAL, Device, mesh);
+	d3d::Release<ID3DXMesh*>(fileMesh);
+
+	if(FAILED(hr))
+		return false;
+
+	if(!hasNormals)
+		D3DXComputeNormals(*mesh, 0);
+
+	//Everything is drawn with DrawSubset(0)
+	DWORD* attributes = 0;
+	hr = (*mesh)->LockAttributeBuffer(0, &attributes);
+
+	if(SUCCEEDED(hr))
+	{
+		memset(attributes, 0, (*mesh)->GetNumFaces() * sizeof(DWORD));
+		(*mesh)->UnlockAttributeBuffer();
+
+		hr = D3DXCreateBuffer((*mesh)->GetNumFaces() * 3 * sizeof(DWORD), adjBuffer);
+	}
+
+	if(SUCCEEDED(hr))
+		hr = (*mesh)->GenerateAdjacency(0.0001f, (DWORD*)(*adjBuffer)->GetBufferPointer());
+
+	if(FAILED(hr))
+	{
+		d3d::Release<ID3DXMesh*>(*mesh);
+		d3d::Release<ID3DXBuffer*>(*adjBuffer);
+
+		*mesh = NULL;
+		*adjBuffer = NULL;
+
+		return false;
+	}
+
+	return true;
+}
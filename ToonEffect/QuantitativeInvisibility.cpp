@@ -0,0 +1,935 @@
+//////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// File: QuantitativeInvisibility.cpp
+//
+// Author: Ren Yifei, yfren@cs.hku.hk
+//
+// Desc: Appel's quantitative invisibility along chains of silhouettes: one ray cast per chain,
+//		 the count of surfaces in front carried on through the crossings on the screen
+//
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "QuantitativeInvisibility.h"
+#include "SilhouetteCommon.h"
+#include "TriangleBVH.h"
+
+#include <float.h>
+#include <algorithm>
+
+//Cells of the crossing grid per side at most
+const int g_QI_GRID_SIZE = 64;
+
+//A crossing this close to an end of either edge, in edge parameter, is left to the exact test
+const float g_QI_PARAM_EPSILON = 1e-4f;
+
+//Same for an occluder this close in depth to the silhouette it crosses, relative to the depth
+const float g_QI_DEPTH_EPSILON = 1e-4f;
+
+//Edges closer than this to parallel on the screen, relative to their lengths, do not cross
+const float g_QI_PARALLEL_EPSILON = 1e-6f;
+
+// One silhouette set up for the propagation, on the screen in x / w, y / w
+struct QISilhouette
+{
+	int			edge;
+	DWORD		v0;
+	DWORD		v1;
+
+	D3DXVECTOR3	proj0;			// as the backends project the end points
+	D3DXVECTOR3	proj1;
+	float		invW0;			// 1 / w, linear on the screen
+	float		invW1;
+
+	int			surfaceSide;	// side of proj0 -> proj1 its faces lie on: 1 left, -1 right, 0 when unsure
+	int			surfaceNum;		// surfaces starting at the edge: 2 at a fold, 1 at a boundary
+
+	bool		isUnsure;		// a crossing on it could not be told, left to the exact test
+	bool		isChained;
+
+	int			cellMinX;
+	int			cellMinY;
+	int			cellMaxX;
+	int			cellMaxY;
+};
+
+// Where a silhouette passes behind an occluding one, at t from v0 to v1 on the screen
+struct QICrossing
+{
+	float	t;
+	int		delta;	// change of the count going from v0 to v1
+};
+
+static bool crossingLess(const QICrossing& a, const QICrossing& b)
+{
+	return a.t < b.t;
+}
+
+void releaseQIChains(QIChains* chains)
+{
+	delete [] chains->objVertexStart;
+	delete [] chains->objViewWorld;
+	delete [] chains->objEyePos;
+	delete [] chains->vertexSilNum;
+	delete [] chains->vertexSils;
+	delete [] chains->silhouettes;
+	delete [] chains->chainSils;
+	delete [] chains->chainStart;
+	delete [] chains->cellStart;
+	delete [] chains->cellSils;
+	delete [] chains->crossingStart;
+	delete [] chains->crossings;
+	delete [] chains->pieces;
+	delete [] chains->pieceNum;
+	delete [] chains->strokeVertex;
+	delete [] chains->strokeNormal;
+	delete [] chains->strokeProj;
+
+	memset(chains, 0, sizeof(QIChains));
+}
+
+//Which side of the screen line a -> b the point p is on: 1 left, -1 right, 0 too close to tell
+static int screenSide(const D3DXVECTOR3& a, const D3DXVECTOR3& b, const D3DXVECTOR3& p)
+{
+	float abX = b.x - a.x;
+	float abY = b.y - a.y;
+	float apX = p.x - a.x;
+	float apY = p.y - a.y;
+
+	float cross = abX * apY - abY * apX;
+	float scale = sqrt(abX * abX + abY * abY) * sqrt(apX * apX + apY * apY);
+
+	if(fabs(cross) <= g_QI_PARALLEL_EPSILON * scale)
+		return 0;
+
+	return cross > 0.0f ? 1 : -1;
+}
+
+//Vertex of face faceIdx that is not on the edge v0 - v1
+static DWORD oppositeVertex(const DWORD* indices, int faceIdx, DWORD v0, DWORD v1)
+{
+	for(int i=0; i<2; ++i)
+	{
+		DWORD v = indices[3 * faceIdx + i];
+
+		if(v != v0 && v != v1)
+			return v;
+	}
+
+	return indices[3 * faceIdx + 2];
+}
+
+static void setupSilhouette(QISilhouette& sil, const BatchObject& obj, const D3DXVECTOR3* viewVertices, const D3DXMATRIX* matrixProj)
+{
+	const MeshEdge& edge = obj.edges[sil.edge];
+
+	sil.v0 = edge.v0;
+	sil.v1 = edge.v1;
+
+	sil.proj0 = projTransformElement(viewVertices[edge.v0], matrixProj);
+	sil.proj1 = projTransformElement(viewVertices[edge.v1], matrixProj);
+	sil.invW0 = 1.0f / matrixPntMulHomogeneous(viewVertices[edge.v0], matrixProj).w;
+	sil.invW1 = 1.0f / matrixPntMulHomogeneous(viewVertices[edge.v1], matrixProj).w;
+
+	DWORD opposite0 = oppositeVertex(obj.indices, edge.face0, edge.v0, edge.v1);
+
+	sil.surfaceSide = screenSide(sil.proj0, sil.proj1, projTransformElement(viewVertices[opposite0], matrixProj));
+	sil.surfaceNum = 1;
+
+	//At a fold both faces go off to the same side, when they do not it is too close to tell
+	if(edge.face1 != -1)
+	{
+		DWORD opposite1 = oppositeVertex(obj.indices, edge.face1, edge.v0, edge.v1);
+
+		if(screenSide(sil.proj0, sil.proj1, projTransformElement(viewVertices[opposite1], matrixProj)) != sil.surfaceSide)
+			sil.surfaceSide = 0;
+
+		sil.surfaceNum = 2;
+	}
+
+	sil.isUnsure = false;
+	sil.isChained = false;
+}
+
+static bool samePoint(const D3DXVECTOR3& a, const D3DXVECTOR3& b)
+{
+	return a.x == b.x && a.y == b.y;
+}
+
+//Whether occluder hides a part of sil starting at the crossing of the two on the screen:
+//1 when it does, 0 when it does not, -1 when that cannot be told for sure
+static int findCrossing(const QISilhouette& sil, const QISilhouette& occluder, QICrossing* crossing)
+{
+	//Neighbours only touch at the end point they share, welded or not
+	if(sil.v0 == occluder.v0 || sil.v0 == occluder.v1 || sil.v1 == occluder.v0 || sil.v1 == occluder.v1)
+		return 0;
+
+	if(samePoint(sil.proj0, occluder.proj0) || samePoint(sil.proj0, occluder.proj1) ||
+	   samePoint(sil.proj1, occluder.proj0) || samePoint(sil.proj1, occluder.proj1))
+	{
+		return 0;
+	}
+
+	float rX = sil.proj1.x - sil.proj0.x;
+	float rY = sil.proj1.y - sil.proj0.y;
+	float qX = occluder.proj1.x - occluder.proj0.x;
+	float qY = occluder.proj1.y - occluder.proj0.y;
+	float dX = occluder.proj0.x - sil.proj0.x;
+	float dY = occluder.proj0.y - sil.proj0.y;
+
+	float rLength = sqrt(rX * rX + rY * rY);
+	float qLength = sqrt(qX * qX + qY * qY);
+
+	//Seen end on, it covers nothing
+	if(qLength == 0.0f)
+		return 0;
+
+	float denom = rX * qY - rY * qX;
+
+	if(fabs(denom) <= g_QI_PARALLEL_EPSILON * rLength * qLength)
+	{
+		float dLength = sqrt(dX * dX + dY * dY);
+
+		if(fabs(rX * dY - rY * dX) > g_QI_PARALLEL_EPSILON * rLength * dLength)
+			return 0;
+
+		//On one line: where they overlap nobody knows which one passes behind
+		float silMinX = min(sil.proj0.x, sil.proj1.x);
+		float silMaxX = max(sil.proj0.x, sil.proj1.x);
+		float silMinY = min(sil.proj0.y, sil.proj1.y);
+		float silMaxY = max(sil.proj0.y, sil.proj1.y);
+
+		if(max(occluder.proj0.x, occluder.proj1.x) < silMinX || min(occluder.proj0.x, occluder.proj1.x) > silMaxX ||
+		   max(occluder.proj0.y, occluder.proj1.y) < silMinY || min(occluder.proj0.y, occluder.proj1.y) > silMaxY)
+		{
+			return 0;
+		}
+
+		return -1;
+	}
+
+	float t = (dX * qY - dY * qX) / denom;
+	float u = (dX * rY - dY * rX) / denom;
+
+	if(t < -g_QI_PARAM_EPSILON || t > 1.0f + g_QI_PARAM_EPSILON || u < -g_QI_PARAM_EPSILON || u > 1.0f + g_QI_PARAM_EPSILON)
+		return 0;
+
+	if(t < g_QI_PARAM_EPSILON || t > 1.0f - g_QI_PARAM_EPSILON || u < g_QI_PARAM_EPSILON || u > 1.0f - g_QI_PARAM_EPSILON)
+		return -1;
+
+	//Depths at the crossing, 1 / w being linear on the screen
+	float silW		= 1.0f / (sil.invW0 + (sil.invW1 - sil.invW0) * t);
+	float occluderW	= 1.0f / (occluder.invW0 + (occluder.invW1 - occluder.invW0) * u);
+
+	if(occluderW > silW * (1.0f + g_QI_DEPTH_EPSILON))
+		return 0;
+
+	if(occluderW >= silW * (1.0f - g_QI_DEPTH_EPSILON) || occluder.surfaceSide == 0)
+		return -1;
+
+	//Its surfaces go off to one side of the occluder: the count goes up going into that side
+	int startSide = screenSide(occluder.proj0, occluder.proj1, sil.proj0);
+
+	if(startSide == 0)
+		return -1;
+
+	crossing->t		= t;
+	crossing->delta	= startSide == occluder.surfaceSide ? -occluder.surfaceNum : occluder.surfaceNum;
+
+	return 1;
+}
+
+//Crossings of silhouette silIdx into crossings, just counted when that is NULL
+static int collectCrossings(const QIChains* chains, int silIdx, int gridSize, QICrossing* crossings, bool* isUnsure)
+{
+	const QISilhouette& sil = chains->silhouettes[silIdx];
+
+	int crossingNum = 0;
+
+	for(int y=sil.cellMinY; y<=sil.cellMaxY; ++y)
+	{
+		for(int x=sil.cellMinX; x<=sil.cellMaxX; ++x)
+		{
+			int cell = y * gridSize + x;
+
+			for(int i=chains->cellStart[cell]; i<chains->cellStart[cell + 1]; ++i)
+			{
+				int occluderIdx = chains->cellSils[i];
+				const QISilhouette& occluder = chains->silhouettes[occluderIdx];
+
+				//A pair sharing several cells is looked at in the first of them only
+				if(occluderIdx == silIdx || x != max(sil.cellMinX, occluder.cellMinX) || y != max(sil.cellMinY, occluder.cellMinY))
+					continue;
+
+				QICrossing crossing;
+
+				int result = findCrossing(sil, occluder, &crossing);
+
+				if(result < 0)
+				{
+					*isUnsure = true;
+				}
+				else if(result > 0)
+				{
+					if(crossings)
+						crossings[crossingNum] = crossing;
+
+					++crossingNum;
+				}
+			}
+		}
+	}
+
+	return crossingNum;
+}
+
+//Uniform grid over the screen bounds of the silhouettes, every silhouette in the cells its bounds cover
+static int buildCrossingGrid(QIChains* chains)
+{
+	int silNum = chains->silNum;
+
+	float minX = FLT_MAX;
+	float minY = FLT_MAX;
+	float maxX = -FLT_MAX;
+	float maxY = -FLT_MAX;
+
+	for(int i=0; i<silNum; ++i)
+	{
+		const QISilhouette& sil = chains->silhouettes[i];
+
+		minX = min(minX, min(sil.proj0.x, sil.proj1.x));
+		minY = min(minY, min(sil.proj0.y, sil.proj1.y));
+		maxX = max(maxX, max(sil.proj0.x, sil.proj1.x));
+		maxY = max(maxY, max(sil.proj0.y, sil.proj1.y));
+	}
+
+	int gridSize = (int)sqrt((float)silNum) / 2;
+	gridSize = gridSize < 1 ? 1 : (gridSize > g_QI_GRID_SIZE ? g_QI_GRID_SIZE : gridSize);
+
+	float scaleX = gridSize / max(maxX - minX, FLT_MIN);
+	float scaleY = gridSize / max(maxY - minY, FLT_MIN);
+
+	int cellNum = gridSize * gridSize;
+
+	memset(chains->cellStart, 0, (cellNum + 1) * sizeof(int));
+
+	int cellSilNum = 0;
+
+	for(int i=0; i<silNum; ++i)
+	{
+		QISilhouette& sil = chains->silhouettes[i];
+
+		sil.cellMinX = min(gridSize - 1, (int)((min(sil.proj0.x, sil.proj1.x) - minX) * scaleX));
+		sil.cellMinY = min(gridSize - 1, (int)((min(sil.proj0.y, sil.proj1.y) - minY) * scaleY));
+		sil.cellMaxX = min(gridSize - 1, (int)((max(sil.proj0.x, sil.proj1.x) - minX) * scaleX));
+		sil.cellMaxY = min(gridSize - 1, (int)((max(sil.proj0.y, sil.proj1.y) - minY) * scaleY));
+
+		for(int y=sil.cellMinY; y<=sil.cellMaxY; ++y)
+		{
+			for(int x=sil.cellMinX; x<=sil.cellMaxX; ++x)
+				++chains->cellStart[y * gridSize + x];
+		}
+
+		cellSilNum += (sil.cellMaxX - sil.cellMinX + 1) * (sil.cellMaxY - sil.cellMinY + 1);
+	}
+
+	for(int cell=0, start=0; cell<=cellNum; ++cell)
+	{
+		int num = chains->cellStart[cell];
+		chains->cellStart[cell] = start;
+		start += num;
+	}
+
+	if(cellSilNum > chains->cellSilSize)
+	{
+		delete [] chains->cellSils;
+
+		chains->cellSilSize = cellSilNum;
+		chains->cellSils = new int[cellSilNum];
+	}
+
+	//Filled with the starts as cursors, each ends up at the start of the next cell
+	for(int i=0; i<silNum; ++i)
+	{
+		const QISilhouette& sil = chains->silhouettes[i];
+
+		for(int y=sil.cellMinY; y<=sil.cellMaxY; ++y)
+		{
+			for(int x=sil.cellMinX; x<=sil.cellMaxX; ++x)
+				chains->cellSils[chains->cellStart[y * gridSize + x]++] = i;
+		}
+	}
+
+	for(int cell=cellNum - 1; cell>0; --cell)
+		chains->cellStart[cell] = chains->cellStart[cell - 1];
+
+	chains->cellStart[0] = 0;
+
+	return gridSize;
+}
+
+//Whether the screen angle of a face at its corner center, between corner0 and corner1, takes in
+//the direction to pnt. Too close to tell counts as taking it in.
+static bool cornerCovers(const D3DXVECTOR3& center, const D3DXVECTOR3& corner0, const D3DXVECTOR3& corner1, const D3DXVECTOR3& pnt)
+{
+	int faceSide = screenSide(center, corner0, corner1);
+
+	//Seen edge on, the face covers nothing
+	if(faceSide == 0)
+		return false;
+
+	int side0 = screenSide(center, corner0, pnt);
+	int side1 = screenSide(corner1, center, pnt);
+
+	return (side0 == faceSide || side0 == 0) && (side1 == faceSide || side1 == 0);
+}
+
+//Whether a face around v reaches over one of the two silhouettes meeting there, on the screen:
+//the count may change at v then, with no crossing to tell
+static bool isFanOverChain(const QIChains* chains, const BatchObject& obj, const D3DXMATRIX* matrixProj,
+						   const QISilhouette& sil, const QISilhouette& other, DWORD v)
+{
+	const MeshEdge& edge = obj.edges[sil.edge];
+	const MeshEdge& otherEdge = obj.edges[other.edge];
+
+	const D3DXVECTOR3& center	= sil.v0 == v ? sil.proj0 : sil.proj1;
+	const D3DXVECTOR3& silEnd	= sil.v0 == v ? sil.proj1 : sil.proj0;
+	const D3DXVECTOR3& otherEnd	= other.v0 == v ? other.proj1 : other.proj0;
+
+	for(int i=obj.vertexFaceStart[v]; i<obj.vertexFaceStart[v + 1]; ++i)
+	{
+		int faceIdx = obj.vertexFaces[i];
+
+		bool isSilFace = faceIdx == edge.face0 || faceIdx == edge.face1;
+		bool isOtherFace = faceIdx == otherEdge.face0 || faceIdx == otherEdge.face1;
+
+		if(isSilFace && isOtherFace)
+			continue;
+
+		//The two other corners in winding order
+		int corner = 0;
+		while(obj.indices[3 * faceIdx + corner] != v)
+			++corner;
+
+		D3DXVECTOR3 corner0 = projTransformElement(chains->viewVertices[obj.indices[3 * faceIdx + (corner + 1) % 3]], matrixProj);
+		D3DXVECTOR3 corner1 = projTransformElement(chains->viewVertices[obj.indices[3 * faceIdx + (corner + 2) % 3]], matrixProj);
+
+		if(!isSilFace && cornerCovers(center, corner0, corner1, silEnd))
+			return true;
+
+		if(!isOtherFace && cornerCovers(center, corner0, corner1, otherEnd))
+			return true;
+	}
+
+	return false;
+}
+
+//Silhouette going on from silIdx through vertex v, -1 when the chain ends there: anything but two
+//silhouettes meeting, a cusp where the surface flips over to the other side of the chain, or faces
+//around v over the chain, where the count may change without a crossing
+static int linkedSilhouette(const QIChains* chains, const BatchObject& obj, const D3DXMATRIX* matrixProj, int silIdx, DWORD v)
+{
+	if(chains->vertexSilNum[v] != 2)
+		return -1;
+
+	int otherIdx = chains->vertexSils[2 * v] == silIdx ? chains->vertexSils[2 * v + 1] : chains->vertexSils[2 * v];
+
+	const QISilhouette& sil = chains->silhouettes[silIdx];
+	const QISilhouette& other = chains->silhouettes[otherIdx];
+
+	//Sides as seen walking into v on the one and out of v on the other
+	int side		= sil.v1 == v ? sil.surfaceSide : -sil.surfaceSide;
+	int otherSide	= other.v0 == v ? other.surfaceSide : -other.surfaceSide;
+
+	if(side == 0 || side != otherSide || isFanOverChain(chains, obj, matrixProj, sil, other, v))
+		return -1;
+
+	return otherIdx;
+}
+
+static void walkChain(QIChains* chains, const BatchObject& obj, const D3DXMATRIX* matrixProj, int silIdx, bool isReversed, int* cursor)
+{
+	chains->chainStart[chains->chainNum++] = *cursor;
+
+	while(silIdx >= 0 && !chains->silhouettes[silIdx].isChained)
+	{
+		QISilhouette& sil = chains->silhouettes[silIdx];
+
+		sil.isChained = true;
+		chains->chainSils[(*cursor)++] = isReversed ? ~silIdx : silIdx;
+
+		DWORD v = isReversed ? sil.v0 : sil.v1;
+
+		silIdx = linkedSilhouette(chains, obj, matrixProj, silIdx, v);
+
+		if(silIdx >= 0)
+			isReversed = chains->silhouettes[silIdx].v1 == v;
+	}
+}
+
+//Open chains from their ends first, what is left over are closed loops
+static void buildChains(QIChains* chains, const BatchObject& obj, const D3DXMATRIX* matrixProj)
+{
+	int silNum = chains->silNum;
+
+	for(int i=0; i<silNum; ++i)
+	{
+		const QISilhouette& sil = chains->silhouettes[i];
+
+		for(int end=0; end<2; ++end)
+		{
+			DWORD v = end == 0 ? sil.v0 : sil.v1;
+			int n = chains->vertexSilNum[v]++;
+
+			if(n < 2)
+				chains->vertexSils[2 * v + n] = i;
+		}
+	}
+
+	chains->chainNum = 0;
+
+	int cursor = 0;
+
+	for(int i=0; i<silNum; ++i)
+	{
+		if(!chains->silhouettes[i].isChained && linkedSilhouette(chains, obj, matrixProj, i, chains->silhouettes[i].v0) < 0)
+			walkChain(chains, obj, matrixProj, i, false, &cursor);
+	}
+
+	for(int i=0; i<silNum; ++i)
+	{
+		if(!chains->silhouettes[i].isChained && linkedSilhouette(chains, obj, matrixProj, i, chains->silhouettes[i].v1) < 0)
+			walkChain(chains, obj, matrixProj, i, true, &cursor);
+	}
+
+	for(int i=0; i<silNum; ++i)
+	{
+		if(!chains->silhouettes[i].isChained)
+			walkChain(chains, obj, matrixProj, i, false, &cursor);
+	}
+
+	chains->chainStart[chains->chainNum] = cursor;
+}
+
+//Surfaces of the object between the eye and the view space point pnt, the faces of the silhouette
+//it lies on left out
+static int countHiddenBy(const QIChains* chains, const BatchObject& obj, const D3DXVECTOR3& pnt, const D3DXVECTOR3& objPnt,
+						 int face0, int face1)
+{
+	int hitNum = 0;
+	int nodeIdx = 0;
+
+	while(nodeIdx < obj.bvhNodeNum)
+	{
+		const BVHNode& node = obj.bvhNodes[nodeIdx];
+
+		if(!segmentIntersectBox(obj.eyePos, objPnt, node.boxMin, node.boxMax))
+		{
+			nodeIdx = node.skipNode;
+			continue;
+		}
+
+		if(node.skipNode == nodeIdx + 1)
+		{
+			for(int i=node.firstTriangle; i<node.firstTriangle+node.triangleNum; ++i)
+			{
+				int triangleIdx = obj.bvhTriangles[i];
+
+				if(triangleIdx != face0 && triangleIdx != face1 &&
+				   triangleHidesPoint(pnt, triangleIdx, chains->viewVertices, obj.indices, true))
+				{
+					++hitNum;
+				}
+			}
+		}
+
+		++nodeIdx;
+	}
+
+	return hitNum;
+}
+
+//The test of the other visibility modes for the whole silhouette at its middle
+static void testSilhouetteExactly(QIChains* chains, const BatchObject& obj, int silIdx, float* pieces)
+{
+	const QISilhouette& sil = chains->silhouettes[silIdx];
+
+	D3DXVECTOR3 viewMidPnt	= (chains->viewVertices[sil.v0] + chains->viewVertices[sil.v1]) / 2.0f;
+	D3DXVECTOR3 objMidPnt	= (obj.vertices[sil.v0].position + obj.vertices[sil.v1].position) / 2.0f;
+
+	bool isHidden = hierarchyHidesPoint(viewMidPnt, objMidPnt, obj.eyePos, false, obj.bvhNodes, obj.bvhNodeNum,
+										obj.bvhTriangles, chains->viewVertices, obj.indices);
+
+	pieces[0] = 0.0f;
+	pieces[1] = 1.0f;
+
+	chains->pieceNum[silIdx] = isHidden ? 0 : 1;
+}
+
+//One ray cast where the chain starts or had to start over, then the count along the chain
+static void propagateChain(QIChains* chains, const BatchObject& obj, int chainIdx)
+{
+	bool isSeeded = false;
+	int count = 0;
+
+	for(int i=chains->chainStart[chainIdx]; i<chains->chainStart[chainIdx + 1]; ++i)
+	{
+		bool isReversed = chains->chainSils[i] < 0;
+		int silIdx = isReversed ? ~chains->chainSils[i] : chains->chainSils[i];
+
+		const QISilhouette& sil = chains->silhouettes[silIdx];
+
+		const QICrossing* crossings = chains->crossings + chains->crossingStart[silIdx];
+		int crossingNum = chains->crossingStart[silIdx + 1] - chains->crossingStart[silIdx];
+
+		float* pieces = chains->pieces + 2 * (chains->crossingStart[silIdx] + silIdx);
+
+		if(sil.isUnsure)
+		{
+			testSilhouetteExactly(chains, obj, silIdx, pieces);
+			isSeeded = false;
+			continue;
+		}
+
+		//Counted at the middle, then taken back to the start over the crossings before it
+		if(!isSeeded)
+		{
+			const MeshEdge& edge = obj.edges[sil.edge];
+
+			D3DXVECTOR3 viewMidPnt	= (chains->viewVertices[sil.v0] + chains->viewVertices[sil.v1]) / 2.0f;
+			D3DXVECTOR3 objMidPnt	= (obj.vertices[sil.v0].position + obj.vertices[sil.v1].position) / 2.0f;
+
+			count = countHiddenBy(chains, obj, viewMidPnt, objMidPnt, edge.face0, edge.face1);
+
+			for(int j=0; j<crossingNum; ++j)
+			{
+				if(isReversed ? crossings[j].t > 0.5f : crossings[j].t < 0.5f)
+					count -= isReversed ? -crossings[j].delta : crossings[j].delta;
+			}
+
+			isSeeded = true;
+		}
+
+		//Visible spans are where nothing is in front, walked in the direction of the chain
+		int pieceNum = 0;
+		float spanStart = 0.0f;
+		bool isConsistent = count >= 0;
+
+		for(int j=0; j<crossingNum; ++j)
+		{
+			const QICrossing& crossing = crossings[isReversed ? crossingNum - 1 - j : j];
+
+			float spanEnd = isReversed ? 1.0f - crossing.t : crossing.t;
+
+			if(count == 0)
+			{
+				pieces[2 * pieceNum]		= isReversed ? 1.0f - spanEnd : spanStart;
+				pieces[2 * pieceNum + 1]	= isReversed ? 1.0f - spanStart : spanEnd;
+				++pieceNum;
+			}
+
+			count += isReversed ? -crossing.delta : crossing.delta;
+			spanStart = spanEnd;
+
+			isConsistent = isConsistent && count >= 0;
+		}
+
+		if(count == 0)
+		{
+			pieces[2 * pieceNum]		= isReversed ? 0.0f : spanStart;
+			pieces[2 * pieceNum + 1]	= isReversed ? 1.0f - spanStart : 1.0f;
+			++pieceNum;
+		}
+
+		chains->pieceNum[silIdx] = pieceNum;
+
+		//More surfaces left than came in: the count went wrong somewhere, start over
+		if(!isConsistent)
+		{
+			testSilhouetteExactly(chains, obj, silIdx, pieces);
+			isSeeded = false;
+		}
+	}
+}
+
+//Back from screen parameter t of the silhouette to the parameter along the edge, 1 / w being linear
+//on the screen
+static float edgeParameter(const QISilhouette& sil, float t)
+{
+	return t * sil.invW1 / ((1.0f - t) * sil.invW0 + t * sil.invW1);
+}
+
+//Drops the visible spans of a silhouette that the other objects hide at their middle
+static void cullPiecesByScene(QIChains* chains, int objIdx, int silIdx, float* pieces)
+{
+	const QISilhouette& sil = chains->silhouettes[silIdx];
+	const InstanceBVH* instanceBVH = chains->instanceBVH;
+
+	const D3DXVECTOR3& viewVertex0 = chains->viewVertices[sil.v0];
+	const D3DXVECTOR3& viewVertex1 = chains->viewVertices[sil.v1];
+
+	int pieceNum = 0;
+
+	for(int j=0; j<chains->pieceNum[silIdx]; ++j)
+	{
+		float a = edgeParameter(sil, (pieces[2 * j] + pieces[2 * j + 1]) / 2.0f);
+
+		D3DXVECTOR3 viewPnt = viewVertex0 + (viewVertex1 - viewVertex0) * a;
+
+		//Its own surface was counted already, the point in object space is never needed
+		if(sceneHidesPoint(viewPnt, viewPnt, objIdx, true, chains->objects, instanceBVH->nodes, instanceBVH->nodeNum,
+						   instanceBVH->instances, chains->sceneViewVertices, chains->objVertexStart,
+						   chains->objViewWorld, chains->objEyePos))
+		{
+			continue;
+		}
+
+		pieces[2 * pieceNum]		= pieces[2 * j];
+		pieces[2 * pieceNum + 1]	= pieces[2 * j + 1];
+		++pieceNum;
+	}
+
+	chains->pieceNum[silIdx] = pieceNum;
+}
+
+//End point of a visible span at screen parameter t of the silhouette
+static void writeStrokeEnd(QIChains* chains, const BatchObject& obj, const QISilhouette& sil, float t, int endIdx)
+{
+	const MeshVertex& vertex0 = obj.vertices[sil.v0];
+	const MeshVertex& vertex1 = obj.vertices[sil.v1];
+
+	//The ends of the silhouette stay exactly where they were, so that the strokes connect there
+	if(t <= 0.0f || t >= 1.0f)
+	{
+		chains->strokeVertex[endIdx]	= t <= 0.0f ? vertex0.position : vertex1.position;
+		chains->strokeNormal[endIdx]	= t <= 0.0f ? vertex0.normal : vertex1.normal;
+		chains->strokeProj[endIdx]		= t <= 0.0f ? sil.proj0 : sil.proj1;
+		return;
+	}
+
+	float a = edgeParameter(sil, t);
+
+	chains->strokeVertex[endIdx]	= vertex0.position + (vertex1.position - vertex0.position) * a;
+	chains->strokeNormal[endIdx]	= normalize(vertex0.normal + (vertex1.normal - vertex0.normal) * a);
+	chains->strokeProj[endIdx]		= sil.proj0 + (sil.proj1 - sil.proj0) * t;
+}
+
+bool setQIScene(QIChains* chains, const BatchObject* objects, int objNum, const InstanceBVH* instanceBVH,
+				const D3DXVECTOR3* viewVertices)
+{
+	if(objNum > chains->objSize)
+	{
+		delete [] chains->objVertexStart;
+		delete [] chains->objViewWorld;
+		delete [] chains->objEyePos;
+
+		chains->objSize = objNum;
+
+		chains->objVertexStart	= new int[objNum + 1];
+		chains->objViewWorld	= new D3DXMATRIX[objNum];
+		chains->objEyePos		= new D3DXVECTOR3[objNum];
+	}
+
+	chains->objects				= objects;
+	chains->instanceBVH			= instanceBVH && instanceBVH->nodeNum > 0 ? instanceBVH : NULL;
+	chains->sceneViewVertices	= viewVertices;
+
+	int vertexNum = 0;
+
+	for(int i=0; i<objNum; ++i)
+	{
+		chains->objVertexStart[i]	= vertexNum;
+		chains->objViewWorld[i]		= objects[i].viewWorld;
+		chains->objEyePos[i]		= objects[i].eyePos;
+
+		vertexNum += objects[i].vertexNum;
+	}
+
+	chains->objVertexStart[objNum] = vertexNum;
+
+	return true;
+}
+
+bool propagateQuantitativeInvisibility(QIChains* chains,
+									   int objIdx,
+									   const D3DXMATRIX* matrixProj,
+									   const int* detectedEdges, int detectedNum,
+									   const TrackedEdge* trackedEdges, int trackedNum)
+{
+	const BatchObject& obj = chains->objects[objIdx];
+
+	int silNum = detectedNum + trackedNum;
+
+	if(obj.vertexNum > chains->vertexSize)
+	{
+		delete [] chains->vertexSilNum;
+		delete [] chains->vertexSils;
+
+		chains->vertexSize = obj.vertexNum;
+
+		chains->vertexSilNum	= new int[obj.vertexNum];
+		chains->vertexSils		= new int[obj.vertexNum * 2];
+	}
+
+	if(silNum > chains->silSize)
+	{
+		delete [] chains->silhouettes;
+		delete [] chains->chainSils;
+		delete [] chains->chainStart;
+		delete [] chains->crossingStart;
+		delete [] chains->pieceNum;
+
+		chains->silSize = silNum;
+
+		chains->silhouettes		= new QISilhouette[silNum];
+		chains->chainSils		= new int[silNum];
+		chains->chainStart		= new int[silNum + 1];
+		chains->crossingStart	= new int[silNum + 1];
+		chains->pieceNum		= new int[silNum];
+	}
+
+	if(!chains->cellStart)
+		chains->cellStart = new int[g_QI_GRID_SIZE * g_QI_GRID_SIZE + 1];
+
+	chains->silNum = silNum;
+
+	//The object in view space as the backend cached it, checked against the near plane
+	chains->viewVertices = chains->sceneViewVertices + chains->objVertexStart[objIdx];
+
+	int behindNum = 0;
+
+	#pragma omp parallel for schedule(static) reduction(+:behindNum)
+	for(int v=0; v<obj.vertexNum; ++v)
+	{
+		D3DXVECTOR4 clip = matrixPntMulHomogeneous(chains->viewVertices[v], matrixProj);
+
+		if(clip.z < 0.0f || clip.w <= 0.0f)
+			++behindNum;
+	}
+
+	memset(chains->vertexSilNum, 0, obj.vertexNum * sizeof(int));
+
+	#pragma omp parallel for schedule(static)
+	for(int i=0; i<silNum; ++i)
+	{
+		QISilhouette& sil = chains->silhouettes[i];
+
+		sil.edge = i < detectedNum ? detectedEdges[i] : trackedEdges[i - detectedNum].edge;
+
+		setupSilhouette(sil, obj, chains->viewVertices, matrixProj);
+	}
+
+	int crossingNum = 0;
+
+	//Cut by the near plane the outline on the screen is not made of silhouettes alone: every
+	//silhouette gets the exact test then
+	if(behindNum == 0)
+	{
+		int gridSize = buildCrossingGrid(chains);
+
+		#pragma omp parallel for schedule(dynamic, 64)
+		for(int i=0; i<silNum; ++i)
+			chains->crossingStart[i] = collectCrossings(chains, i, gridSize, NULL, &chains->silhouettes[i].isUnsure);
+
+		for(int i=0; i<silNum; ++i)
+		{
+			int num = chains->crossingStart[i];
+			chains->crossingStart[i] = crossingNum;
+			crossingNum += num;
+		}
+
+		chains->crossingStart[silNum] = crossingNum;
+
+		if(crossingNum > chains->crossingSize)
+		{
+			delete [] chains->crossings;
+
+			chains->crossingSize = crossingNum;
+			chains->crossings = new QICrossing[crossingNum];
+		}
+
+		if(crossingNum + silNum > chains->pieceSize)
+		{
+			delete [] chains->pieces;
+
+			chains->pieceSize = crossingNum + silNum;
+			chains->pieces = new float[chains->pieceSize * 2];
+		}
+
+		#pragma omp parallel for schedule(dynamic, 64)
+		for(int i=0; i<silNum; ++i)
+		{
+			QICrossing* crossings = chains->crossings + chains->crossingStart[i];
+			bool isUnsure = false;
+
+			int num = collectCrossings(chains, i, gridSize, crossings, &isUnsure);
+
+			std::sort(crossings, crossings + num, crossingLess);
+		}
+
+		buildChains(chains, obj, matrixProj);
+
+		//Chains are as long as they are, hence the dynamic schedule
+		#pragma omp parallel for schedule(dynamic, 1)
+		for(int c=0; c<chains->chainNum; ++c)
+			propagateChain(chains, obj, c);
+	}
+	else
+	{
+		memset(chains->crossingStart, 0, (silNum + 1) * sizeof(int));
+
+		if(silNum > chains->pieceSize)
+		{
+			delete [] chains->pieces;
+
+			chains->pieceSize = silNum;
+			chains->pieces = new float[silNum * 2];
+		}
+
+		#pragma omp parallel for schedule(dynamic, 16)
+		for(int i=0; i<silNum; ++i)
+			testSilhouetteExactly(chains, obj, i, chains->pieces + 2 * i);
+	}
+
+	if(chains->instanceBVH)
+	{
+		#pragma omp parallel for schedule(dynamic, 16)
+		for(int i=0; i<silNum; ++i)
+			cullPiecesByScene(chains, objIdx, i, chains->pieces + 2 * (chains->crossingStart[i] + i));
+	}
+
+	//Visible spans to strokes, silhouette after silhouette
+	int strokeNum = 0;
+
+	for(int i=0; i<silNum; ++i)
+		strokeNum += chains->pieceNum[i];
+
+	if(strokeNum > chains->strokeSize)
+	{
+		delete [] chains->strokeVertex;
+		delete [] chains->strokeNormal;
+		delete [] chains->strokeProj;
+
+		chains->strokeSize = strokeNum;
+
+		chains->strokeVertex	= new D3DXVECTOR3[strokeNum * 2];
+		chains->strokeNormal	= new D3DXVECTOR3[strokeNum * 2];
+		chains->strokeProj		= new D3DXVECTOR3[strokeNum * 2];
+	}
+
+	chains->strokeNum = 0;
+
+	for(int i=0; i<silNum; ++i)
+	{
+		const float* pieces = chains->pieces + 2 * (chains->crossingStart[i] + i);
+
+		for(int j=0; j<chains->pieceNum[i]; ++j)
+		{
+			writeStrokeEnd(chains, obj, chains->silhouettes[i], pieces[2 * j], 2 * chains->strokeNum);
+			writeStrokeEnd(chains, obj, chains->silhouettes[i], pieces[2 * j + 1], 2 * chains->strokeNum + 1);
+
+			++chains->strokeNum;
+		}
+	}
+
+	return true;
+}
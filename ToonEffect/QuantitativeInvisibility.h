@@ -0,0 +1,77 @@
+#ifndef QUANTITATIVE_INVISIBILITY_H_
+#define QUANTITATIVE_INVISIBILITY_H_
+
+#include "StdHeader.h"
+#include "CUDADataStructure.h"
+
+struct QISilhouette;
+struct QICrossing;
+struct InstanceBVH;
+
+// Appel's quantitative invisibility over the silhouettes of one object: the number of surfaces
+// between the eye and a point of a silhouette, ray cast once per chain of silhouettes and then
+// carried along it, changing only where the chain passes behind another silhouette or boundary
+// edge on the screen. The other objects of the scene only hide the visible spans that come out of
+// it, each tested at its middle as the exact test does. Kept from frame to frame, everything in
+// here is scratch but the strokes.
+struct QIChains
+{
+	// The frame's objects, see setQIScene
+	const BatchObject*	objects;
+	const InstanceBVH*	instanceBVH;	// NULL when objects only hide their own strokes
+	const D3DXVECTOR3*	sceneViewVertices;
+	int*			objVertexStart;		// objNum + 1 of them
+	D3DXMATRIX*		objViewWorld;
+	D3DXVECTOR3*	objEyePos;
+	int				objSize;
+
+	const D3DXVECTOR3* viewVertices;	// the current object in view space
+	int*			vertexSilNum;	// silhouettes meeting at every vertex
+	int*			vertexSils;		// the first two of them
+	int				vertexSize;
+
+	QISilhouette*	silhouettes;
+	int				silNum;
+	int				silSize;
+
+	int*			chainSils;		// silhouettes in chain order, ~silIdx when walked from v1 to v0
+	int*			chainStart;		// chainNum + 1 of them
+	int				chainNum;
+
+	int*			cellStart;		// screen grid over the silhouettes, for the crossings
+	int*			cellSils;
+	int				cellSilSize;
+
+	int*			crossingStart;	// silNum + 1 of them
+	QICrossing*		crossings;
+	int				crossingSize;
+
+	float*			pieces;			// visible spans of every silhouette, crossings + 1 at most
+	int*			pieceNum;
+	int				pieceSize;
+
+	// Visible strokes: the spans cut out of the silhouettes, in the order the silhouettes came
+	D3DXVECTOR3*	strokeVertex;
+	D3DXVECTOR3*	strokeNormal;
+	D3DXVECTOR3*	strokeProj;
+	int				strokeNum;
+	int				strokeSize;
+};
+
+// The objects of the frame, referenced until the next call: viewVertices holds all of them in view
+// space, object after object, as the backend cached them for the pass. With an instance hierarchy
+// over them the other objects hide an object's strokes too, without one only its own surface does.
+bool setQIScene(QIChains* chains, const BatchObject* objects, int objNum, const InstanceBVH* instanceBVH,
+				const D3DXVECTOR3* viewVertices);
+
+// Visible strokes of object objIdx of the scene out of all its silhouettes this frame, detected ones
+// (edge ids of the object) first and tracked ones after them. The object's vertices have to be locked.
+bool propagateQuantitativeInvisibility(QIChains* chains,
+									   int objIdx,
+									   const D3DXMATRIX* matrixProj,
+									   const int* detectedEdges, int detectedNum,
+									   const TrackedEdge* trackedEdges, int trackedNum);
+
+void releaseQIChains(QIChains* chains);
+
+#endif
@@ -0,0 +1,328 @@
+//////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// File: SIMDSilhouetteClassifier.cpp
+//
+// Author: Ren Yifei, yfren@cs.hku.hk
+//
+// Desc: Host silhouette classification, 4/8/16 edges per instruction with SSE2/AVX2/AVX-512
+//
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "SIMDSilhouetteClassifier.h"
+#include "CUDADataStructure.h"
+
+#include <intrin.h>
+#include <emmintrin.h>
+
+// The wider paths need a compiler that knows the intrinsics: AVX2 came with VS2013, AVX-512 with VS2017.
+#ifndef SIL_COMPILE_AVX2
+#if defined(_MSC_VER) && _MSC_VER >= 1800
+#define SIL_COMPILE_AVX2 1
+#else
+#define SIL_COMPILE_AVX2 0
+#endif
+#endif
+
+#ifndef SIL_COMPILE_AVX512
+#if defined(_MSC_VER) && _MSC_VER >= 1910
+#define SIL_COMPILE_AVX512 1
+#else
+#define SIL_COMPILE_AVX512 0
+#endif
+#endif
+
+#if SIL_COMPILE_AVX2 || SIL_COMPILE_AVX512
+#include <immintrin.h>
+#endif
+
+bool buildSilhouetteSoA(SilhouetteSoA* soa,
+						const MeshEdge* edges, int edgeNum,
+						const D3DXVECTOR4* facePlanes, int faceNum)
+{
+	soa->planeX = new float[faceNum];
+	soa->planeY = new float[faceNum];
+	soa->planeZ = new float[faceNum];
+	soa->planeW = new float[faceNum];
+
+	soa->face0 = new int[edgeNum];
+	soa->face1 = new int[edgeNum];
+
+	soa->faceNum = faceNum;
+	soa->edgeNum = edgeNum;
+
+	for(int i=0; i<faceNum; ++i)
+	{
+		soa->planeX[i] = facePlanes[i].x;
+		soa->planeY[i] = facePlanes[i].y;
+		soa->planeZ[i] = facePlanes[i].z;
+		soa->planeW[i] = facePlanes[i].w;
+	}
+
+	for(int i=0; i<edgeNum; ++i)
+	{
+		soa->face0[i] = edges[i].face0;
+		soa->face1[i] = edges[i].face1 != -1 ? edges[i].face1 : ~edges[i].face0;
+	}
+
+	return true;
+}
+
+void releaseSilhouetteSoA(SilhouetteSoA* soa)
+{
+	delete [] soa->planeX;
+	delete [] soa->planeY;
+	delete [] soa->planeZ;
+	delete [] soa->planeW;
+	delete [] soa->face0;
+	delete [] soa->face1;
+
+	memset(soa, 0, sizeof(SilhouetteSoA));
+}
+
+SilhouetteISA detectSilhouetteISA()
+{
+	int info[4];
+
+	__cpuid(info, 0);
+	int maxLeaf = info[0];
+
+	__cpuid(info, 1);
+
+	bool hasSSE2	= (info[3] & (1 << 26)) != 0;
+	bool hasOSXSave = (info[2] & (1 << 27)) != 0;
+	bool hasAVX		= (info[2] & (1 << 28)) != 0;
+
+	bool hasAVX2	= false;
+	bool hasAVX512	= false;
+
+#if SIL_COMPILE_AVX2 || SIL_COMPILE_AVX512
+	if(maxLeaf >= 7 && hasOSXSave && hasAVX)
+	{
+		//The OS has to save the YMM (and for AVX-512 the ZMM/opmask) state as well
+		unsigned long long xcr0 = _xgetbv(0);
+
+		__cpuidex(info, 7, 0);
+
+		hasAVX2		= (xcr0 & 0x06) == 0x06 && (info[1] & (1 << 5)) != 0;
+		hasAVX512	= (xcr0 & 0xE6) == 0xE6 && (info[1] & (1 << 16)) != 0;
+	}
+#endif
+
+#if SIL_COMPILE_AVX512
+	if(hasAVX512)
+		return SIL_ISA_AVX512;
+#endif
+
+#if SIL_COMPILE_AVX2
+	if(hasAVX2)
+		return SIL_ISA_AVX2;
+#endif
+
+	if(hasSSE2)
+		return SIL_ISA_SSE2;
+
+	return SIL_ISA_SCALAR;
+}
+
+//Same expression, in the same order, as facePlaneDistance / findSilhouetteElement
+static inline bool classifyEdgeScalar(const SilhouetteSoA* soa, const D3DXVECTOR3& eye, int edgeIdx)
+{
+	int face0 = soa->face0[edgeIdx];
+	int face1 = soa->face1[edgeIdx];
+
+	float dot1 = soa->planeX[face0] * eye.x + soa->planeY[face0] * eye.y + soa->planeZ[face0] * eye.z + soa->planeW[face0];
+	float dot2;
+
+	if(face1 >= 0)
+		dot2 = soa->planeX[face1] * eye.x + soa->planeY[face1] * eye.y + soa->planeZ[face1] * eye.z + soa->planeW[face1];
+	else
+		dot2 = -dot1;
+
+	return dot1 * dot2 < 0.0f;
+}
+
+static unsigned int classifyWordScalar(const SilhouetteSoA* soa, const D3DXVECTOR3& eye, int firstEdge, int edgeNum)
+{
+	unsigned int bits = 0;
+
+	for(int i=0; i<edgeNum; ++i)
+	{
+		if(classifyEdgeScalar(soa, eye, firstEdge + i))
+			bits |= 1u << i;
+	}
+
+	return bits;
+}
+
+//4 edges at a time, SSE2 has no gather so the plane components are picked up one by one
+static unsigned int classifyWordSSE2(const SilhouetteSoA* soa, const D3DXVECTOR3& eye, int firstEdge)
+{
+	const __m128 ex = _mm_set1_ps(eye.x);
+	const __m128 ey = _mm_set1_ps(eye.y);
+	const __m128 ez = _mm_set1_ps(eye.z);
+	const __m128 zero = _mm_setzero_ps();
+
+	unsigned int bits = 0;
+
+	for(int k=0; k<32; k+=4)
+	{
+		const int* f0 = soa->face0 + firstEdge + k;
+		const int* f1 = soa->face1 + firstEdge + k;
+
+		int g0[4], g1[4], neg[4];
+
+		for(int j=0; j<4; ++j)
+		{
+			g0[j]  = f0[j];
+			neg[j] = f1[j] >> 31;
+			g1[j]  = f1[j] >= 0 ? f1[j] : f0[j];
+		}
+
+		__m128 dot1 = _mm_add_ps(_mm_add_ps(_mm_add_ps(
+						_mm_mul_ps(_mm_set_ps(soa->planeX[g0[3]], soa->planeX[g0[2]], soa->planeX[g0[1]], soa->planeX[g0[0]]), ex),
+						_mm_mul_ps(_mm_set_ps(soa->planeY[g0[3]], soa->planeY[g0[2]], soa->planeY[g0[1]], soa->planeY[g0[0]]), ey)),
+						_mm_mul_ps(_mm_set_ps(soa->planeZ[g0[3]], soa->planeZ[g0[2]], soa->planeZ[g0[1]], soa->planeZ[g0[0]]), ez)),
+						_mm_set_ps(soa->planeW[g0[3]], soa->planeW[g0[2]], soa->planeW[g0[1]], soa->planeW[g0[0]]));
+
+		__m128 dot2 = _mm_add_ps(_mm_add_ps(_mm_add_ps(
+						_mm_mul_ps(_mm_set_ps(soa->planeX[g1[3]], soa->planeX[g1[2]], soa->planeX[g1[1]], soa->planeX[g1[0]]), ex),
+						_mm_mul_ps(_mm_set_ps(soa->planeY[g1[3]], soa->planeY[g1[2]], soa->planeY[g1[1]], soa->planeY[g1[0]]), ey)),
+						_mm_mul_ps(_mm_set_ps(soa->planeZ[g1[3]], soa->planeZ[g1[2]], soa->planeZ[g1[1]], soa->planeZ[g1[0]]), ez)),
+						_mm_set_ps(soa->planeW[g1[3]], soa->planeW[g1[2]], soa->planeW[g1[1]], soa->planeW[g1[0]]));
+
+		//boundary edges: dot2 = -dot1, an exact sign flip
+		__m128 signFlip = _mm_castsi128_ps(_mm_slli_epi32(_mm_set_epi32(neg[3], neg[2], neg[1], neg[0]), 31));
+		dot2 = _mm_xor_ps(dot2, signFlip);
+
+		bits |= (unsigned int)_mm_movemask_ps(_mm_cmplt_ps(_mm_mul_ps(dot1, dot2), zero)) << k;
+	}
+
+	return bits;
+}
+
+#if SIL_COMPILE_AVX2
+static unsigned int classifyWordAVX2(const SilhouetteSoA* soa, const D3DXVECTOR3& eye, int firstEdge)
+{
+	const __m256 ex = _mm256_set1_ps(eye.x);
+	const __m256 ey = _mm256_set1_ps(eye.y);
+	const __m256 ez = _mm256_set1_ps(eye.z);
+	const __m256 zero = _mm256_setzero_ps();
+
+	unsigned int bits = 0;
+
+	for(int k=0; k<32; k+=8)
+	{
+		__m256i f0 = _mm256_loadu_si256((const __m256i*)(soa->face0 + firstEdge + k));
+		__m256i f1 = _mm256_loadu_si256((const __m256i*)(soa->face1 + firstEdge + k));
+
+		__m256i neg = _mm256_srai_epi32(f1, 31);
+		f1 = _mm256_blendv_epi8(f1, f0, neg);
+
+		//no fused multiply-add on purpose, the rounding has to match the scalar test
+		__m256 dot1 = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(
+						_mm256_mul_ps(_mm256_i32gather_ps(soa->planeX, f0, 4), ex),
+						_mm256_mul_ps(_mm256_i32gather_ps(soa->planeY, f0, 4), ey)),
+						_mm256_mul_ps(_mm256_i32gather_ps(soa->planeZ, f0, 4), ez)),
+						_mm256_i32gather_ps(soa->planeW, f0, 4));
+
+		__m256 dot2 = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(
+						_mm256_mul_ps(_mm256_i32gather_ps(soa->planeX, f1, 4), ex),
+						_mm256_mul_ps(_mm256_i32gather_ps(soa->planeY, f1, 4), ey)),
+						_mm256_mul_ps(_mm256_i32gather_ps(soa->planeZ, f1, 4), ez)),
+						_mm256_i32gather_ps(soa->planeW, f1, 4));
+
+		dot2 = _mm256_xor_ps(dot2, _mm256_castsi256_ps(_mm256_slli_epi32(neg, 31)));
+
+		__m256 isSilhouette = _mm256_cmp_ps(_mm256_mul_ps(dot1, dot2), zero, _CMP_LT_OQ);
+
+		bits |= (unsigned int)_mm256_movemask_ps(isSilhouette) << k;
+	}
+
+	return bits;
+}
+#endif
+
+#if SIL_COMPILE_AVX512
+static unsigned int classifyWordAVX512(const SilhouetteSoA* soa, const D3DXVECTOR3& eye, int firstEdge)
+{
+	const __m512 ex = _mm512_set1_ps(eye.x);
+	const __m512 ey = _mm512_set1_ps(eye.y);
+	const __m512 ez = _mm512_set1_ps(eye.z);
+	const __m512 zero = _mm512_setzero_ps();
+	const __m512i signBit = _mm512_set1_epi32((int)0x80000000);
+
+	unsigned int bits = 0;
+
+	for(int k=0; k<32; k+=16)
+	{
+		__m512i f0 = _mm512_loadu_si512((const void*)(soa->face0 + firstEdge + k));
+		__m512i f1 = _mm512_loadu_si512((const void*)(soa->face1 + firstEdge + k));
+
+		__mmask16 boundary = _mm512_cmplt_epi32_mask(f1, _mm512_setzero_si512());
+		f1 = _mm512_mask_blend_epi32(boundary, f1, f0);
+
+		__m512 dot1 = _mm512_add_ps(_mm512_add_ps(_mm512_add_ps(
+						_mm512_mul_ps(_mm512_i32gather_ps(f0, soa->planeX, 4), ex),
+						_mm512_mul_ps(_mm512_i32gather_ps(f0, soa->planeY, 4), ey)),
+						_mm512_mul_ps(_mm512_i32gather_ps(f0, soa->planeZ, 4), ez)),
+						_mm512_i32gather_ps(f0, soa->planeW, 4));
+
+		__m512 dot2 = _mm512_add_ps(_mm512_add_ps(_mm512_add_ps(
+						_mm512_mul_ps(_mm512_i32gather_ps(f1, soa->planeX, 4), ex),
+						_mm512_mul_ps(_mm512_i32gather_ps(f1, soa->planeY, 4), ey)),
+						_mm512_mul_ps(_mm512_i32gather_ps(f1, soa->planeZ, 4), ez)),
+						_mm512_i32gather_ps(f1, soa->planeW, 4));
+
+		__m512i dot2Bits = _mm512_castps_si512(dot2);
+		dot2 = _mm512_castsi512_ps(_mm512_mask_xor_epi32(dot2Bits, boundary, dot2Bits, signBit));
+
+		__mmask16 isSilhouette = _mm512_cmp_ps_mask(_mm512_mul_ps(dot1, dot2), zero, _CMP_LT_OQ);
+
+		bits |= (unsigned int)isSilhouette << k;
+	}
+
+	return bits;
+}
+#endif
+
+void classifySilhouettes(SilhouetteISA isa,
+						 const SilhouetteSoA* soa,
+						 const D3DXVECTOR3& eye,
+						 unsigned int* mask,
+						 int firstEdge, int edgeNum)
+{
+	int lastEdge = firstEdge + edgeNum;
+
+	for(int edgeIdx = firstEdge; edgeIdx < lastEdge; edgeIdx += 32)
+	{
+		unsigned int& bits = mask[(edgeIdx - firstEdge) / 32];
+
+		//the vector paths always read whole words, the tail goes through the scalar test
+		if(lastEdge - edgeIdx < 32)
+		{
+			bits = classifyWordScalar(soa, eye, edgeIdx, lastEdge - edgeIdx);
+			continue;
+		}
+
+		switch(isa)
+		{
+#if SIL_COMPILE_AVX512
+		case SIL_ISA_AVX512:
+			bits = classifyWordAVX512(soa, eye, edgeIdx);
+			break;
+#endif
+#if SIL_COMPILE_AVX2
+		case SIL_ISA_AVX2:
+			bits = classifyWordAVX2(soa, eye, edgeIdx);
+			break;
+#endif
+		case SIL_ISA_SSE2:
+			bits = classifyWordSSE2(soa, eye, edgeIdx);
+			break;
+
+		default:
+			bits = classifyWordScalar(soa, eye, edgeIdx, 32);
+			break;
+		}
+	}
+}
@@ -0,0 +1,50 @@
+#ifndef SIMD_SILHOUETTE_CLASSIFIER_H_
+#define SIMD_SILHOUETTE_CLASSIFIER_H_
+
+#include "StdHeader.h"
+
+struct MeshEdge;
+
+enum SilhouetteISA
+{
+	SIL_ISA_SCALAR = 0,
+	SIL_ISA_SSE2,
+	SIL_ISA_AVX2,
+	SIL_ISA_AVX512
+};
+
+// Structure-of-arrays copy of a mesh's face planes and edge-to-face mapping,
+// laid out for gathers. A boundary edge stores ~face0 in face1.
+struct SilhouetteSoA
+{
+	float*	planeX;
+	float*	planeY;
+	float*	planeZ;
+	float*	planeW;
+
+	int*	face0;
+	int*	face1;
+
+	int		faceNum;
+	int		edgeNum;
+};
+
+bool buildSilhouetteSoA(SilhouetteSoA* soa,
+						const MeshEdge* edges, int edgeNum,
+						const D3DXVECTOR4* facePlanes, int faceNum);
+
+void releaseSilhouetteSoA(SilhouetteSoA* soa);
+
+// Widest instruction set both compiled in and supported by this CPU
+SilhouetteISA detectSilhouetteISA();
+
+// Classifies edges [firstEdge, firstEdge + edgeNum) against the object space eye, bit i of
+// mask[w] being edge firstEdge + 32*w + i. Gives the same bits as findSilhouetteElement
+// for every ISA.
+void classifySilhouettes(SilhouetteISA isa,
+						 const SilhouetteSoA* soa,
+						 const D3DXVECTOR3& eye,
+						 unsigned int* mask,
+						 int firstEdge, int edgeNum);
+
+#endif
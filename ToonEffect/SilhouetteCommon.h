@@ -0,0 +1,705 @@
+//////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// File: SilhouetteCommon.h
+//
+// Author: Ren Yifei, yfren@cs.hku.hk
+//
+// Desc: Per-element silhouette routines shared by the CUDA kernels and the CPU backend,
+//		 so both backends run exactly the same arithmetic
+//
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef SILHOUETTE_COMMON_H_
+#define SILHOUETTE_COMMON_H_
+
+#include <math.h>
+#include "StdHeader.h"
+#include "CUDADataStructure.h"
+
+#ifdef __CUDACC__
+#define SIL_FUNC __host__ __device__ inline
+#else
+#define SIL_FUNC inline
+#endif
+
+SIL_FUNC D3DXVECTOR3 crossProduct(const D3DXVECTOR3& m1, const D3DXVECTOR3& m2)
+{
+	D3DXVECTOR3 ret;
+
+	ret.x = m1.y * m2.z - m1.z * m2.y;
+	ret.y = m1.z * m2.x - m1.x * m2.z;
+	ret.z = m1.x * m2.y - m1.y * m2.x;
+
+	return ret;
+}
+
+SIL_FUNC float dotProduct(const D3DXVECTOR3& m1, const D3DXVECTOR3& m2)
+{
+	float ret = m1.x * m2.x + m1.y * m2.y + m1.z * m2.z;
+
+	return ret;
+}
+
+SIL_FUNC float length(const D3DXVECTOR3& vec)
+{
+	return sqrt(vec.x*vec.x + vec.y*vec.y + vec.z*vec.z);
+}
+
+SIL_FUNC D3DXVECTOR3 normalize(const D3DXVECTOR3& vec)
+{
+	D3DXVECTOR3 ret = vec;
+
+	float len = length(ret);
+
+	ret.x /= len;
+	ret.y /= len;
+	ret.z /= len;
+
+	return ret;
+}
+
+SIL_FUNC D3DXVECTOR3 matrixPntMul(const D3DXVECTOR3& pnt, const D3DXMATRIX* mat)
+{
+
+	D3DXVECTOR3 ret;
+
+	ret.x = mat->m[0][0] * pnt.x + mat->m[1][0] * pnt.y + mat->m[2][0] * pnt.z + mat->m[3][0];
+	ret.y = mat->m[0][1] * pnt.x + mat->m[1][1] * pnt.y + mat->m[2][1] * pnt.z + mat->m[3][1];
+	ret.z = mat->m[0][2] * pnt.x + mat->m[1][2] * pnt.y + mat->m[2][2] * pnt.z + mat->m[3][2];
+
+	float w = mat->m[0][3] * pnt.x + mat->m[1][3] * pnt.y + mat->m[2][3] * pnt.z + mat->m[3][3];
+
+	ret.x /= w;
+	ret.y /= w;
+	ret.z /= w;
+
+	return ret;
+}
+
+//Same as matrixPntMul, but keeps w instead of dividing by it
+SIL_FUNC D3DXVECTOR4 matrixPntMulHomogeneous(const D3DXVECTOR3& pnt, const D3DXMATRIX* mat)
+{
+	D3DXVECTOR4 ret;
+
+	ret.x = mat->m[0][0] * pnt.x + mat->m[1][0] * pnt.y + mat->m[2][0] * pnt.z + mat->m[3][0];
+	ret.y = mat->m[0][1] * pnt.x + mat->m[1][1] * pnt.y + mat->m[2][1] * pnt.z + mat->m[3][1];
+	ret.z = mat->m[0][2] * pnt.x + mat->m[1][2] * pnt.y + mat->m[2][2] * pnt.z + mat->m[3][2];
+	ret.w = mat->m[0][3] * pnt.x + mat->m[1][3] * pnt.y + mat->m[2][3] * pnt.z + mat->m[3][3];
+
+	return ret;
+}
+
+SIL_FUNC D3DXVECTOR4 lerpHomogeneous(const D3DXVECTOR4& a, const D3DXVECTOR4& b, float t)
+{
+	D3DXVECTOR4 ret;
+
+	ret.x = a.x + (b.x - a.x) * t;
+	ret.y = a.y + (b.y - a.y) * t;
+	ret.z = a.z + (b.z - a.z) * t;
+	ret.w = a.w + (b.w - a.w) * t;
+
+	return ret;
+}
+
+SIL_FUNC D3DXVECTOR3 matrixVecMul(const D3DXVECTOR3& vec, const D3DXMATRIX* mat)
+{
+
+	D3DXVECTOR3 ret;
+
+	ret.x = mat->m[0][0] * vec.x + mat->m[1][0] * vec.y + mat->m[2][0] * vec.z;
+	ret.y = mat->m[0][1] * vec.x + mat->m[1][1] * vec.y + mat->m[2][1] * vec.z;
+	ret.z = mat->m[0][2] * vec.x + mat->m[1][2] * vec.y + mat->m[2][2] * vec.z;
+
+	return ret;
+}
+
+//Segment / Triangle crossing testing
+SIL_FUNC bool segmentIntersectTriangle(const D3DXVECTOR3& orig,
+									   const D3DXVECTOR3& des,
+									   const D3DXVECTOR3& v0,
+									   const D3DXVECTOR3& v1,
+									   const D3DXVECTOR3& v2,
+									   bool frontOnly = false)
+{
+	float t,u,v;
+	const D3DXVECTOR3 tmpDir = des - orig;
+
+	D3DXVECTOR3 dir = normalize(tmpDir);
+
+	// Find vectors for two edges sharing vert0
+	D3DXVECTOR3 edge1 = v1 - v0;
+	D3DXVECTOR3 edge2 = v2 - v0;
+
+	// Begin calculating determinant - also used to calculate U parameter
+	D3DXVECTOR3 pvec;
+	pvec = crossProduct(dir, edge2);
+
+	// If determinant is near zero, ray lies in plane of triangle
+	float det = dotProduct(edge1, pvec);
+
+	D3DXVECTOR3 tvec;
+	if( det > 0 )
+	{
+		tvec = orig - v0;
+	}
+	else
+	{
+		tvec = v0 - orig;
+		det = -det;
+	}
+
+	if( det < 0.0001f )
+		return false;
+
+	// Calculate U parameter and test bounds
+	u = dotProduct(tvec, pvec);
+
+	if( u < 0.0f || u > det )
+		return false;
+
+	// Prepare to test V parameter
+	D3DXVECTOR3 qvec;
+	qvec = crossProduct(tvec, edge1);
+
+	// Calculate V parameter and test bounds
+	v = dotProduct(dir, qvec);
+
+	if( v < 0.0f || u + v > det )
+		return false;
+
+	// Calculate t, scale parameters, ray intersects triangle
+	t = dotProduct(edge2, qvec);
+	FLOAT fInvDet = 1.0f / det;
+	t *= fInvDet;
+	u *= fInvDet;
+	v *= fInvDet;
+
+	if( frontOnly && t < 0.0f )
+		return false;
+
+	if( length(orig + t * dir) > length(des - orig) )
+		return false;
+	else if( fabs(length(orig + t * dir) - length(des - orig)) < 0.0001 )
+		return false;
+
+	return true;
+}
+
+//Signed distance (unnormalized) of the eye to a face plane, positive when the face is front facing
+SIL_FUNC float facePlaneDistance(const D3DXVECTOR4& plane, const D3DXVECTOR3& eye)
+{
+	return plane.x * eye.x + plane.y * eye.y + plane.z * eye.z + plane.w;
+}
+
+//Silhouette test of one mesh edge, one kernel thread / one CPU iteration each.
+//The face planes and the eye are both in object space.
+SIL_FUNC bool findSilhouetteElement(const MeshEdge& edge,
+									const D3DXVECTOR4* facePlanes,
+									const D3DXVECTOR3& eye)
+{
+	float dot1 = facePlaneDistance(facePlanes[edge.face0], eye);
+	float dot2;
+
+	if(edge.face1 != -1)
+		dot2 = facePlaneDistance(facePlanes[edge.face1], eye);
+	else
+		dot2 = -dot1; //a boundary edge faces both ways
+
+	//It's a silhouette
+	return dot1 * dot2 < 0.0f;
+}
+
+//Whether the segment p0 -> p1 passes through the box, slab by slab
+SIL_FUNC bool segmentIntersectBox(const D3DXVECTOR3& p0,
+								  const D3DXVECTOR3& p1,
+								  const D3DXVECTOR3& boxMin,
+								  const D3DXVECTOR3& boxMax)
+{
+	float tMin = 0.0f;
+	float tMax = 1.0f;
+
+	for(int axis=0; axis<3; ++axis)
+	{
+		float start = (&p0.x)[axis];
+		float dir	= (&p1.x)[axis] - start;
+		float low	= (&boxMin.x)[axis];
+		float high	= (&boxMax.x)[axis];
+
+		//Parallel to the slab: inside it all along or never
+		if(dir == 0.0f)
+		{
+			if(start < low || start > high)
+				return false;
+
+			continue;
+		}
+
+		float t0 = (low - start) / dir;
+		float t1 = (high - start) / dir;
+
+		if(t0 > t1)
+		{
+			float tmp = t0;
+			t0 = t1;
+			t1 = tmp;
+		}
+
+		tMin = t0 > tMin ? t0 : tMin;
+		tMax = t1 < tMax ? t1 : tMax;
+
+		if(tMin > tMax)
+			return false;
+	}
+
+	return true;
+}
+
+//View space position of a mesh vertex, what the vertex cache of a frame holds for every vertex
+SIL_FUNC D3DXVECTOR3 viewTransformElement(const MeshVertex& vertex, const D3DXMATRIX* matrixWorldView)
+{
+	return matrixPntMul(vertex.position, matrixWorldView);
+}
+
+//Whether triangle triangleIdx hides the view space point from the eye. Unless frontOnly, a
+//triangle behind the eye no farther away than the point counts as well. viewVertex is the
+//vertex cache of the triangle's object.
+SIL_FUNC bool triangleHidesPoint(const D3DXVECTOR3& pnt,
+								 int triangleIdx,
+								 const D3DXVECTOR3* viewVertex,
+								 const DWORD* indices,
+								 bool frontOnly)
+{
+	const D3DXVECTOR3& v0Pos = viewVertex[indices[3*triangleIdx]];
+	const D3DXVECTOR3& v1Pos = viewVertex[indices[3*triangleIdx+1]];
+	const D3DXVECTOR3& v2Pos = viewVertex[indices[3*triangleIdx+2]];
+
+	D3DXVECTOR3 origin = D3DXVECTOR3(0,0,0);
+
+	return segmentIntersectTriangle(origin, pnt, v0Pos, v1Pos, v2Pos, frontOnly);
+}
+
+//Walks the triangle hierarchy of one object and stops at the first triangle hiding the view space
+//point pnt. objPnt and eye are the point and the eye in the space of that object.
+SIL_FUNC bool hierarchyHidesPoint(const D3DXVECTOR3& pnt,
+								  const D3DXVECTOR3& objPnt,
+								  const D3DXVECTOR3& eye,
+								  bool frontOnly,
+								  const BVHNode* bvhNodes,
+								  int bvhNodeNum,
+								  const int* bvhTriangles,
+								  const D3DXVECTOR3* viewVertex,
+								  const DWORD* indices)
+{
+	//The triangle test takes hits behind the eye up to the same distance as well,
+	//so the boxes are tested against the segment mirrored through the eye too
+	D3DXVECTOR3 objStartPnt = frontOnly ? eye : eye * 2.0f - objPnt;
+
+	int nodeIdx = 0;
+
+	while(nodeIdx < bvhNodeNum)
+	{
+		const BVHNode& node = bvhNodes[nodeIdx];
+
+		if(!segmentIntersectBox(objStartPnt, objPnt, node.boxMin, node.boxMax))
+		{
+			nodeIdx = node.skipNode;
+			continue;
+		}
+
+		//A leaf's subtree is just itself
+		if(node.skipNode == nodeIdx + 1)
+		{
+			for(int i=node.firstTriangle; i<node.firstTriangle+node.triangleNum; ++i)
+			{
+				if(triangleHidesPoint(pnt, bvhTriangles[i], viewVertex, indices, frontOnly))
+					return true;
+			}
+		}
+
+		++nodeIdx;
+	}
+
+	return false;
+}
+
+//Occlusion test of silhouette silIdx against the triangles of its own object, true when one of
+//them hides it. Walks the triangle hierarchy with the object space eye and stops at the first hit.
+//candidateSilhouetteViewVertex holds the end points out of the vertex cache.
+SIL_FUNC bool cullSilhouetteElement(int silIdx,
+									const BVHNode* bvhNodes,
+									int bvhNodeNum,
+									const int* bvhTriangles,
+									const D3DXVECTOR3* viewVertex,
+									const DWORD* indices,
+									const D3DXVECTOR3* candidateSilhouetteVertex,
+									const D3DXVECTOR3* candidateSilhouetteViewVertex,
+									const D3DXVECTOR3& eye)
+{
+	const D3DXVECTOR3& pnt1 = candidateSilhouetteVertex[2*silIdx];
+	const D3DXVECTOR3& pnt2 = candidateSilhouetteVertex[2*silIdx+1];
+
+	D3DXVECTOR3 silMidPnt = (candidateSilhouetteViewVertex[2*silIdx] + candidateSilhouetteViewVertex[2*silIdx+1]) / 2.0f;
+	D3DXVECTOR3 objMidPnt = (pnt1 + pnt2) / 2.0f;
+
+	return hierarchyHidesPoint(silMidPnt, objMidPnt, eye, false, bvhNodes, bvhNodeNum, bvhTriangles,
+							   viewVertex, indices);
+}
+
+//Whether the triangles of the whole scene hide the view space point pnt on object objIdx, through
+//the view space instance hierarchy down to the hierarchies of the objects. objPnt is the point in
+//the space of its own object, the only one that may hide it from behind the eye. With isOwnSkipped
+//that object is left out, for a caller that counts its surfaces itself. ObjectType is whatever the
+//backend keeps its meshes in, the cache of object i starts at viewVertex + objVertexStart[i].
+template<typename ObjectType>
+SIL_FUNC bool sceneHidesPoint(const D3DXVECTOR3& pnt,
+							  const D3DXVECTOR3& objPnt,
+							  int objIdx,
+							  bool isOwnSkipped,
+							  const ObjectType* objects,
+							  const BVHNode* instanceNodes,
+							  int instanceNodeNum,
+							  const int* instances,
+							  const D3DXVECTOR3* viewVertex,
+							  const int* objVertexStart,
+							  const D3DXMATRIX* matrixViewWorld,
+							  const D3DXVECTOR3* eyePos)
+{
+	//The eye is the origin of view space
+	D3DXVECTOR3 backPnt = D3DXVECTOR3(0,0,0) - pnt;
+
+	int nodeIdx = 0;
+
+	while(nodeIdx < instanceNodeNum)
+	{
+		const BVHNode& node = instanceNodes[nodeIdx];
+
+		if(!segmentIntersectBox(backPnt, pnt, node.boxMin, node.boxMax))
+		{
+			nodeIdx = node.skipNode;
+			continue;
+		}
+
+		if(node.skipNode == nodeIdx + 1)
+		{
+			for(int i=node.firstTriangle; i<node.firstTriangle+node.triangleNum; ++i)
+			{
+				int instanceIdx = instances[i];
+				bool isOwn = instanceIdx == objIdx;
+
+				if(isOwn && isOwnSkipped)
+					continue;
+
+				const ObjectType& obj = objects[instanceIdx];
+
+				D3DXVECTOR3 instancePnt = isOwn ? objPnt : matrixPntMul(pnt, &matrixViewWorld[instanceIdx]);
+
+				if(hierarchyHidesPoint(pnt, instancePnt, eyePos[instanceIdx], !isOwn, obj.bvhNodes, obj.bvhNodeNum,
+									   obj.bvhTriangles, viewVertex + objVertexStart[instanceIdx], obj.indices))
+				{
+					return true;
+				}
+			}
+		}
+
+		++nodeIdx;
+	}
+
+	return false;
+}
+
+//Occlusion test of silhouette silIdx of object objIdx against the triangles of the whole scene,
+//see sceneHidesPoint. Its own object gets exactly the point cullSilhouetteElement tests.
+template<typename ObjectType>
+SIL_FUNC bool cullSilhouetteSceneElement(int silIdx,
+										 int objIdx,
+										 const ObjectType* objects,
+										 const BVHNode* instanceNodes,
+										 int instanceNodeNum,
+										 const int* instances,
+										 const D3DXVECTOR3* candidateSilhouetteVertex,
+										 const D3DXVECTOR3* candidateSilhouetteViewVertex,
+										 const D3DXVECTOR3* viewVertex,
+										 const int* objVertexStart,
+										 const D3DXMATRIX* matrixViewWorld,
+										 const D3DXVECTOR3* eyePos)
+{
+	const D3DXVECTOR3& pnt1 = candidateSilhouetteVertex[2*silIdx];
+	const D3DXVECTOR3& pnt2 = candidateSilhouetteVertex[2*silIdx+1];
+
+	D3DXVECTOR3 silMidPnt = (candidateSilhouetteViewVertex[2*silIdx] + candidateSilhouetteViewVertex[2*silIdx+1]) / 2.0f;
+	D3DXVECTOR3 objMidPnt = (pnt1 + pnt2) / 2.0f;
+
+	return sceneHidesPoint(silMidPnt, objMidPnt, objIdx, false, objects, instanceNodes, instanceNodeNum, instances,
+						   viewVertex, objVertexStart, matrixViewWorld, eyePos);
+}
+
+//Whether the silhouette on scene edge sceneEdge needs the ray test in this pass, and how urgently:
+//-1 when it may keep the result cached for the edge, else its priority under the retest limit, the
+//lowest first. New silhouettes come first, then those at a visibility transition of the last pass,
+//then the slice of the rest that goes round every refreshPeriod passes. The first two are ordered
+//by the same slice, so that none of them waits longer than refreshPeriod passes. mark0 and mark1
+//are the last pass's marks of its end points, 0 when that pass left none.
+SIL_FUNC int visibilityTestPriority(const EdgeVisibility& cached, int pass, int sceneEdge, int refreshPeriod, int mark0, int mark1)
+{
+	const int transition = g_VERTEX_MARK_VISIBLE | g_VERTEX_MARK_HIDDEN;
+
+	int slice = (sceneEdge + pass) % refreshPeriod;
+
+	if(cached.pass != pass - 1)
+		return slice;
+
+	if(mark0 == transition || mark1 == transition)
+		return refreshPeriod + slice;
+
+	return slice == 0 ? 2 * refreshPeriod : -1;
+}
+
+//Priorities visibilityTestPriority hands out
+SIL_FUNC int visibilityPriorityNum(int refreshPeriod)
+{
+	return 2 * refreshPeriod + 1;
+}
+
+//Splits the retest limit of a pass over the priorities, priorityNum[p] silhouettes wanting the ray
+//test with priority p: all those below *lastPriority get it, and the first *lastNum of
+//*lastPriority in candidate order
+SIL_FUNC void splitRetestLimit(const int* priorityNum, int priorityCount, int retestLimit, int* lastPriority, int* lastNum)
+{
+	int budget = retestLimit;
+
+	for(int p=0; p<priorityCount; ++p)
+	{
+		if(priorityNum[p] > budget)
+		{
+			*lastPriority	= p;
+			*lastNum		= budget;
+			return;
+		}
+
+		budget -= priorityNum[p];
+	}
+
+	*lastPriority	= priorityCount;
+	*lastNum		= 0;
+}
+
+//Result for a silhouette that needed the ray test but is past the retest limit of the pass: the one
+//cached for its edge, else the one the silhouettes at its end points agreed on in the last pass.
+//False when there is neither, the silhouette is then drawn untested and stays new for the next pass.
+SIL_FUNC bool reuseEdgeVisibility(const EdgeVisibility& cached, int pass, int mark0, int mark1, bool* isVisible)
+{
+	if(cached.pass == pass - 1)
+	{
+		*isVisible = cached.isVisible != 0;
+		return true;
+	}
+
+	int mark = mark0 | mark1;
+
+	if(mark != g_VERTEX_MARK_VISIBLE && mark != g_VERTEX_MARK_HIDDEN)
+		return false;
+
+	*isVisible = mark == g_VERTEX_MARK_VISIBLE;
+
+	return true;
+}
+
+//Stores the visibility of a silhouette for the next pass, returns the mark for its end points. A
+//silhouette that just changed is a transition of its own.
+SIL_FUNC int updateEdgeVisibility(EdgeVisibility* cached, int pass, bool isVisible)
+{
+	int mark = isVisible ? g_VERTEX_MARK_VISIBLE : g_VERTEX_MARK_HIDDEN;
+
+	if(cached->pass == pass - 1 && (cached->isVisible != 0) != isVisible)
+		mark = g_VERTEX_MARK_VISIBLE | g_VERTEX_MARK_HIDDEN;
+
+	cached->pass		= pass;
+	cached->isVisible	= isVisible ? 1 : 0;
+
+	return mark;
+}
+
+//Samples along a segment for the depth buffer test at most, one per pixel below that
+const int g_DEPTH_MAX_SAMPLES = 32;
+
+//A sample is visible when it is no farther than the depth buffer around it, this much
+//of z / w allowed for the rounding of the rasterizer
+const float g_DEPTH_BIAS = 1e-5f;
+
+//Farthest depth over the pixels [x0, x1] x [y0, y1], read from the lowest level of the
+//pyramid on which they fall into 2x2 cells at most
+SIL_FUNC float hizFarthestDepth(const HiZPyramid& hiz, int x0, int y0, int x1, int y1)
+{
+	int level = 0;
+
+	while(level + 1 < hiz.levelNum && ((x1 >> level) - (x0 >> level) > 1 || (y1 >> level) - (y0 >> level) > 1))
+		++level;
+
+	int width	= hiz.levelWidth[level];
+	int height	= hiz.levelHeight[level];
+
+	int cellX0 = x0 >> level;
+	int cellY0 = y0 >> level;
+	int cellX1 = x1 >> level;
+	int cellY1 = y1 >> level;
+
+	cellX0 = cellX0 < 0 ? 0 : cellX0;
+	cellY0 = cellY0 < 0 ? 0 : cellY0;
+	cellX1 = cellX1 >= width ? width - 1 : cellX1;
+	cellY1 = cellY1 >= height ? height - 1 : cellY1;
+
+	const float* depth = hiz.depth + hiz.levelOffset[level];
+
+	float farthest = 0.0f;
+
+	for(int y=cellY0; y<=cellY1; ++y)
+	{
+		for(int x=cellX0; x<=cellX1; ++x)
+			farthest = depth[y * width + x] > farthest ? depth[y * width + x] : farthest;
+	}
+
+	return farthest;
+}
+
+//Depth buffer test of silhouette silIdx, true when it is hidden altogether. Every sample along the
+//projected segment is checked against the farthest depth of the pixels around it, which keeps the
+//surface right behind a silhouette from hiding it. A partly hidden silhouette is trimmed in place
+//to the span from its first to its last visible sample, view space end points included.
+SIL_FUNC bool cullSilhouetteDepthElement(int silIdx,
+										 D3DXVECTOR3* candidateSilhouetteVertex,
+										 D3DXVECTOR3* candidateSilhouetteNormal,
+										 D3DXVECTOR3* candidateSilhouetteViewVertex,
+										 const D3DXMATRIX* matrixProj,
+										 const HiZPyramid& hiz)
+{
+	D3DXVECTOR3 pnt1 = candidateSilhouetteVertex[2*silIdx];
+	D3DXVECTOR3 pnt2 = candidateSilhouetteVertex[2*silIdx+1];
+
+	D3DXVECTOR3 viewPnt1 = candidateSilhouetteViewVertex[2*silIdx];
+	D3DXVECTOR3 viewPnt2 = candidateSilhouetteViewVertex[2*silIdx+1];
+
+	D3DXVECTOR4 clip1 = matrixPntMulHomogeneous(viewPnt1, matrixProj);
+	D3DXVECTOR4 clip2 = matrixPntMulHomogeneous(viewPnt2, matrixProj);
+
+	//Behind the near plane altogether, the rasterizer clipped whatever might be there
+	if(clip1.z < 0.0f && clip2.z < 0.0f)
+		return false;
+
+	//Clip space is linear along the segment: clip it to the near plane there
+	float start = 0.0f;
+	float end	= 1.0f;
+
+	if(clip1.z < 0.0f)
+		start = clip1.z / (clip1.z - clip2.z);
+	else if(clip2.z < 0.0f)
+		end = clip1.z / (clip1.z - clip2.z);
+
+	D3DXVECTOR4 clipStart	= lerpHomogeneous(clip1, clip2, start);
+	D3DXVECTOR4 clipEnd		= lerpHomogeneous(clip1, clip2, end);
+
+	float startX = (clipStart.x / clipStart.w + 1.0f) * 0.5f * g_DEPTH_BUFFER_WIDTH;
+	float startY = (1.0f - clipStart.y / clipStart.w) * 0.5f * g_DEPTH_BUFFER_HEIGHT;
+	float endX	 = (clipEnd.x / clipEnd.w + 1.0f) * 0.5f * g_DEPTH_BUFFER_WIDTH;
+	float endY	 = (1.0f - clipEnd.y / clipEnd.w) * 0.5f * g_DEPTH_BUFFER_HEIGHT;
+
+	//Whole segment behind the farthest depth of the pixels it spans: hidden, no need to sample
+	float minX = startX < endX ? startX : endX;
+	float minY = startY < endY ? startY : endY;
+	float maxX = startX > endX ? startX : endX;
+	float maxY = startY > endY ? startY : endY;
+
+	float nearest = clipStart.z / clipStart.w < clipEnd.z / clipEnd.w ? clipStart.z / clipStart.w : clipEnd.z / clipEnd.w;
+
+	if(minX >= 0.0f && minY >= 0.0f && maxX < g_DEPTH_BUFFER_WIDTH && maxY < g_DEPTH_BUFFER_HEIGHT &&
+	   nearest > hizFarthestDepth(hiz, (int)minX - 1, (int)minY - 1, (int)maxX + 1, (int)maxY + 1) + g_DEPTH_BIAS)
+	{
+		return true;
+	}
+
+	float pixelLength = sqrt((endX - startX) * (endX - startX) + (endY - startY) * (endY - startY));
+
+	int sampleNum = (int)ceil(pixelLength);
+	sampleNum = sampleNum < 1 ? 1 : (sampleNum > g_DEPTH_MAX_SAMPLES ? g_DEPTH_MAX_SAMPLES : sampleNum);
+
+	int firstVisible = -1;
+	int lastVisible = -1;
+
+	for(int i=0; i<sampleNum; ++i)
+	{
+		float t = start + (end - start) * (i + 0.5f) / sampleNum;
+
+		D3DXVECTOR4 clip = lerpHomogeneous(clip1, clip2, t);
+
+		float x = (clip.x / clip.w + 1.0f) * 0.5f * g_DEPTH_BUFFER_WIDTH;
+		float y = (1.0f - clip.y / clip.w) * 0.5f * g_DEPTH_BUFFER_HEIGHT;
+
+		//Nothing was rasterized off the buffer
+		bool isVisible = x < 0.0f || y < 0.0f || x >= g_DEPTH_BUFFER_WIDTH || y >= g_DEPTH_BUFFER_HEIGHT;
+
+		if(!isVisible)
+		{
+			int pixelX = (int)x;
+			int pixelY = (int)y;
+
+			isVisible = clip.z / clip.w <= hizFarthestDepth(hiz, pixelX - 1, pixelY - 1, pixelX + 1, pixelY + 1) + g_DEPTH_BIAS;
+		}
+
+		if(isVisible)
+		{
+			firstVisible = firstVisible < 0 ? i : firstVisible;
+			lastVisible = i;
+		}
+	}
+
+	if(firstVisible < 0)
+		return true;
+
+	//Ends that made it keep their exact position, so that the strokes still connect there
+	float visibleStart	= firstVisible == 0 ? start : start + (end - start) * firstVisible / sampleNum;
+	float visibleEnd	= lastVisible == sampleNum - 1 ? end : start + (end - start) * (lastVisible + 1) / sampleNum;
+
+	if(visibleStart > 0.0f || visibleEnd < 1.0f)
+	{
+		D3DXVECTOR3 normal1 = candidateSilhouetteNormal[2*silIdx];
+		D3DXVECTOR3 normal2 = candidateSilhouetteNormal[2*silIdx+1];
+
+		candidateSilhouetteVertex[2*silIdx]		= pnt1 + (pnt2 - pnt1) * visibleStart;
+		candidateSilhouetteVertex[2*silIdx+1]	= pnt1 + (pnt2 - pnt1) * visibleEnd;
+		candidateSilhouetteViewVertex[2*silIdx]		= viewPnt1 + (viewPnt2 - viewPnt1) * visibleStart;
+		candidateSilhouetteViewVertex[2*silIdx+1]	= viewPnt1 + (viewPnt2 - viewPnt1) * visibleEnd;
+		candidateSilhouetteNormal[2*silIdx]		= normalize(normal1 + (normal2 - normal1) * visibleStart);
+		candidateSilhouetteNormal[2*silIdx+1]	= normalize(normal1 + (normal2 - normal1) * visibleEnd);
+	}
+
+	return false;
+}
+
+//Object of a batch that item idx belongs to, starts[i] being the first item of object i.
+//Objects without items share their start with the next one and are skipped.
+template<typename T>
+SIL_FUNC int findBatchObject(const T* starts, int objNum, T idx)
+{
+	int low = 0;
+	int high = objNum - 1;
+
+	while(low < high)
+	{
+		int mid = (low + high + 1) / 2;
+
+		if(starts[mid] <= idx)
+			low = mid;
+		else
+			high = mid - 1;
+	}
+
+	return low;
+}
+
+//Projection Transformation of one silhouette end point, taken from view space
+SIL_FUNC D3DXVECTOR3 projTransformElement(const D3DXVECTOR3& viewPnt,
+										  const D3DXMATRIX* matrixProj)
+{
+	return matrixPntMul(viewPnt, matrixProj);
+}
+
+#endif
@@ -0,0 +1,216 @@
+//////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// File: SilhouetteTracker.cpp
+//
+// Author: Ren Yifei, yfren@cs.hku.hk
+//
+// Desc: Frame to frame silhouette tracking over the mesh adjacency
+//
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "SilhouetteTracker.h"
+#include "CUDADataStructure.h"
+#include "SilhouetteCommon.h"
+
+//Past this share of flipped faces the view changed too much, a full rescan is cheaper
+const int g_MAX_FLIPPED_FACE_DIVISOR = 8;
+
+static char facingSign(const D3DXVECTOR4& plane, const D3DXVECTOR3& eye)
+{
+	float dis = facePlaneDistance(plane, eye);
+
+	return dis > 0.0f ? 1 : (dis < 0.0f ? -1 : 0);
+}
+
+//Same outcome as findSilhouetteElement, from the cached facing of both faces
+static bool edgeIsSilhouette(const SilhouetteTracker* tracker, const MeshEdge& edge)
+{
+	int sign0 = tracker->faceSign[edge.face0];
+	int sign1 = edge.face1 >= 0 ? tracker->faceSign[edge.face1] : -sign0;
+
+	return sign0 * sign1 < 0;
+}
+
+bool buildSilhouetteTracker(SilhouetteTracker* tracker,
+							const MeshEdge* edges, int edgeNum, int faceNum)
+{
+	releaseSilhouetteTracker(tracker);
+
+	tracker->faceEdges		= new int[3 * faceNum];
+	tracker->faceSign		= new char[faceNum];
+	tracker->isSilhouette	= new bool[edgeNum];
+	tracker->silEdges		= new int[edgeNum];
+	tracker->faceQueue		= new int[faceNum];
+	tracker->faceStamp		= new int[faceNum];
+	tracker->dirtyEdges		= new int[edgeNum];
+	tracker->edgeStamp		= new int[edgeNum];
+
+	tracker->faceNum = faceNum;
+	tracker->edgeNum = edgeNum;
+
+	memset(tracker->faceStamp, 0, faceNum * sizeof(int));
+	memset(tracker->edgeStamp, 0, edgeNum * sizeof(int));
+
+	//Every face owns three half-edges, each of them is one entry of the edge table
+	int* faceEdgeNum = new int[faceNum];
+	memset(faceEdgeNum, 0, faceNum * sizeof(int));
+
+	for(int i=0; i<3*faceNum; ++i)
+		tracker->faceEdges[i] = -1;
+
+	for(int i=0; i<edgeNum; ++i)
+	{
+		int faces[2] = { edges[i].face0, edges[i].face1 };
+
+		for(int j=0; j<2; ++j)
+		{
+			if(faces[j] >= 0 && faceEdgeNum[faces[j]] < 3)
+				tracker->faceEdges[3 * faces[j] + faceEdgeNum[faces[j]]++] = i;
+		}
+	}
+
+	delete [] faceEdgeNum;
+
+	return true;
+}
+
+void releaseSilhouetteTracker(SilhouetteTracker* tracker)
+{
+	delete [] tracker->faceEdges;
+	delete [] tracker->faceSign;
+	delete [] tracker->isSilhouette;
+	delete [] tracker->silEdges;
+	delete [] tracker->faceQueue;
+	delete [] tracker->faceStamp;
+	delete [] tracker->dirtyEdges;
+	delete [] tracker->edgeStamp;
+
+	memset(tracker, 0, sizeof(SilhouetteTracker));
+}
+
+void resetSilhouetteTracker(SilhouetteTracker* tracker,
+							const D3DXVECTOR4* facePlanes,
+							const D3DXVECTOR3& eye,
+							const int* silEdges, int silEdgeNum)
+{
+	#pragma omp parallel for schedule(static)
+	for(int i=0; i<tracker->faceNum; ++i)
+	{
+		tracker->faceSign[i] = facingSign(facePlanes[i], eye);
+	}
+
+	memset(tracker->isSilhouette, 0, tracker->edgeNum * sizeof(bool));
+
+	for(int i=0; i<silEdgeNum; ++i)
+		tracker->isSilhouette[silEdges[i]] = true;
+
+	memcpy(tracker->silEdges, silEdges, silEdgeNum * sizeof(int));
+	tracker->silEdgeNum = silEdgeNum;
+
+	tracker->framesSinceRescan = 0;
+	tracker->valid = true;
+}
+
+bool updateSilhouetteTracker(SilhouetteTracker* tracker,
+							 const MeshEdge* edges,
+							 const D3DXVECTOR4* facePlanes,
+							 const D3DXVECTOR3& eye)
+{
+	//With nothing to seed from the flood finds nothing either
+	if(!tracker->valid || tracker->silEdgeNum == 0)
+		return false;
+
+	int stamp = ++tracker->stamp;
+
+	int queueTail = 0;
+	int dirtyEdgeNum = 0;
+	int flippedFaceNum = 0;
+	int maxFlippedFaceNum = tracker->faceNum / g_MAX_FLIPPED_FACE_DIVISOR + 1;
+
+	//Seed from both faces of every silhouette edge of the previous frame
+	for(int i=0; i<tracker->silEdgeNum; ++i)
+	{
+		const MeshEdge& edge = edges[tracker->silEdges[i]];
+		int faces[2] = { edge.face0, edge.face1 };
+
+		for(int j=0; j<2; ++j)
+		{
+			if(faces[j] >= 0 && tracker->faceStamp[faces[j]] != stamp)
+			{
+				tracker->faceStamp[faces[j]] = stamp;
+				tracker->faceQueue[queueTail++] = faces[j];
+			}
+		}
+	}
+
+	//Spread only through faces whose facing flipped: a region of flipped faces touching the
+	//old silhouette is bounded by edges that changed state, so all of it is reached this way
+	for(int queueHead=0; queueHead<queueTail; ++queueHead)
+	{
+		int face = tracker->faceQueue[queueHead];
+		char sign = facingSign(facePlanes[face], eye);
+
+		if(sign == tracker->faceSign[face])
+			continue;
+
+		tracker->faceSign[face] = sign;
+
+		if(++flippedFaceNum > maxFlippedFaceNum)
+		{
+			tracker->valid = false;
+			return false;
+		}
+
+		for(int k=0; k<3; ++k)
+		{
+			int edgeIdx = tracker->faceEdges[3 * face + k];
+
+			if(edgeIdx < 0)
+				continue;
+
+			if(tracker->edgeStamp[edgeIdx] != stamp)
+			{
+				tracker->edgeStamp[edgeIdx] = stamp;
+				tracker->dirtyEdges[dirtyEdgeNum++] = edgeIdx;
+			}
+
+			const MeshEdge& edge = edges[edgeIdx];
+			int neighbour = edge.face0 == face ? edge.face1 : edge.face0;
+
+			if(neighbour >= 0 && tracker->faceStamp[neighbour] != stamp)
+			{
+				tracker->faceStamp[neighbour] = stamp;
+				tracker->faceQueue[queueTail++] = neighbour;
+			}
+		}
+	}
+
+	//Re-evaluate the edges next to a flipped face, keeping the ones that just became silhouettes
+	int addedEdgeNum = 0;
+
+	for(int i=0; i<dirtyEdgeNum; ++i)
+	{
+		int edgeIdx = tracker->dirtyEdges[i];
+		bool isSilhouette = edgeIsSilhouette(tracker, edges[edgeIdx]);
+
+		if(isSilhouette && !tracker->isSilhouette[edgeIdx])
+			tracker->dirtyEdges[addedEdgeNum++] = edgeIdx;
+
+		tracker->isSilhouette[edgeIdx] = isSilhouette;
+	}
+
+	int silEdgeNum = 0;
+
+	for(int i=0; i<tracker->silEdgeNum; ++i)
+	{
+		if(tracker->isSilhouette[tracker->silEdges[i]])
+			tracker->silEdges[silEdgeNum++] = tracker->silEdges[i];
+	}
+
+	memcpy(tracker->silEdges + silEdgeNum, tracker->dirtyEdges, addedEdgeNum * sizeof(int));
+	tracker->silEdgeNum = silEdgeNum + addedEdgeNum;
+
+	++tracker->framesSinceRescan;
+
+	return true;
+}
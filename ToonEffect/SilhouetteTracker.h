@@ -0,0 +1,52 @@
+#ifndef SILHOUETTE_TRACKER_H_
+#define SILHOUETTE_TRACKER_H_
+
+#include "StdHeader.h"
+
+struct MeshEdge;
+
+// Per mesh state carried from one frame to the next for incremental silhouette
+// extraction. Edge indices refer to the (reordered) edge table of the mesh.
+struct SilhouetteTracker
+{
+	int*	faceEdges;		// 3 edges per face
+	char*	faceSign;		// facing of every face at the last update: 1 front, -1 back, 0 edge-on
+	bool*	isSilhouette;	// per edge
+
+	int*	silEdges;		// current silhouette, unordered
+	int		silEdgeNum;
+
+	int*	faceQueue;
+	int*	faceStamp;
+	int*	dirtyEdges;
+	int*	edgeStamp;
+	int		stamp;
+
+	int		faceNum;
+	int		edgeNum;
+
+	int		framesSinceRescan;
+	bool	valid;			// false until the first full rescan
+};
+
+bool buildSilhouetteTracker(SilhouetteTracker* tracker,
+							const MeshEdge* edges, int edgeNum, int faceNum);
+
+void releaseSilhouetteTracker(SilhouetteTracker* tracker);
+
+// Takes over the result of a full detection and re-reads the facing of every face.
+void resetSilhouetteTracker(SilhouetteTracker* tracker,
+							const D3DXVECTOR4* facePlanes,
+							const D3DXVECTOR3& eye,
+							const int* silEdges, int silEdgeNum);
+
+// Updates the silhouette by walking out from the previous one through the faces that
+// flipped. Returns false, leaving the tracker invalid, when more faces flipped than is
+// worth tracking: the caller should do a full rescan instead. Loops that appear away
+// from the previous silhouette are only picked up by the next full rescan.
+bool updateSilhouetteTracker(SilhouetteTracker* tracker,
+							 const MeshEdge* edges,
+							 const D3DXVECTOR4* facePlanes,
+							 const D3DXVECTOR3& eye);
+
+#endif
@@ -0,0 +1,420 @@
+//////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// File: StrokeBuffer.cpp
+//
+// Author: Ren Yifei, yfren@cs.hku.hk
+//
+// Desc: Grow-only stroke storage reused over the frames, device and system memory backends
+//
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "StrokeBuffer.h"
+#include "d3dUtility.h"
+
+//Fewest strokes the storage is made for, small objects do not grow it a few quads at a time
+static const int MIN_STROKE_SIZE = 64;
+
+//4 vertices per stroke, 16 bit indices run out past 16384 strokes
+static const int MAX_STROKE_INDEX16 = 0x10000 / 4;
+
+D3DStrokeBufferBackend::D3DStrokeBufferBackend(IDirect3DDevice9* device)
+:
+m_device(device),
+m_vb(NULL),
+m_ib(NULL),
+m_corners(NULL)
+{
+}
+
+D3DStrokeBufferBackend::~D3DStrokeBufferBackend()
+{
+	d3d::Release<IDirect3DVertexBuffer9*>(m_vb);
+	d3d::Release<IDirect3DIndexBuffer9*>(m_ib);
+	d3d::Release<IDirect3DVertexBuffer9*>(m_corners);
+}
+
+bool D3DStrokeBufferBackend::allocateVertices(UINT bytes)
+{
+	d3d::Release<IDirect3DVertexBuffer9*>(m_vb);
+	m_vb = NULL;
+
+	return SUCCEEDED(m_device->CreateVertexBuffer(	bytes,
+													D3DUSAGE_DYNAMIC | D3DUSAGE_WRITEONLY,
+													0, // using vertex declaration
+													D3DPOOL_DEFAULT,
+													&m_vb,
+													0));
+}
+
+bool D3DStrokeBufferBackend::allocateIndices(UINT bytes, bool index32)
+{
+	d3d::Release<IDirect3DIndexBuffer9*>(m_ib);
+	m_ib = NULL;
+
+	return SUCCEEDED(m_device->CreateIndexBuffer(	bytes,
+													D3DUSAGE_WRITEONLY,
+													index32 ? D3DFMT_INDEX32 : D3DFMT_INDEX16,
+													D3DPOOL_MANAGED,
+													&m_ib,
+													0));
+}
+
+bool D3DStrokeBufferBackend::allocateCorners(UINT bytes)
+{
+	d3d::Release<IDirect3DVertexBuffer9*>(m_corners);
+	m_corners = NULL;
+
+	return SUCCEEDED(m_device->CreateVertexBuffer(	bytes,
+													D3DUSAGE_WRITEONLY,
+													0, // using vertex declaration
+													D3DPOOL_MANAGED,
+													&m_corners,
+													0));
+}
+
+void* D3DStrokeBufferBackend::lockVertices(UINT offset, UINT bytes, bool discard)
+{
+	void* vertices = NULL;
+
+	if(FAILED(m_vb->Lock(offset, bytes, &vertices, discard ? D3DLOCK_DISCARD : D3DLOCK_NOOVERWRITE)))
+		return NULL;
+
+	return vertices;
+}
+
+void D3DStrokeBufferBackend::unlockVertices()
+{
+	m_vb->Unlock();
+}
+
+void* D3DStrokeBufferBackend::lockIndices()
+{
+	void* indices = NULL;
+
+	if(FAILED(m_ib->Lock(0, 0, &indices, 0)))
+		return NULL;
+
+	return indices;
+}
+
+void D3DStrokeBufferBackend::unlockIndices()
+{
+	m_ib->Unlock();
+}
+
+void* D3DStrokeBufferBackend::lockCorners()
+{
+	void* corners = NULL;
+
+	if(FAILED(m_corners->Lock(0, 0, &corners, 0)))
+		return NULL;
+
+	return corners;
+}
+
+void D3DStrokeBufferBackend::unlockCorners()
+{
+	m_corners->Unlock();
+}
+
+void D3DStrokeBufferBackend::draw(IDirect3DDevice9* device, int firstStroke, int strokeNum, bool instanced)
+{
+	device->SetIndices(m_ib);
+
+	if(!instanced)
+	{
+		device->SetStreamSource(0, m_vb, 0, sizeof(EdgeVertex));
+
+		//The frame's quads start at firstStroke, the indices count from there
+		device->DrawIndexedPrimitive(D3DPT_TRIANGLELIST, firstStroke * 4, 0, strokeNum * 4, 0, strokeNum * 2);
+
+		return;
+	}
+
+	//The quad strokeNum times over, every time with the next stroke of the frame
+	device->SetStreamSource(0, m_corners, 0, sizeof(D3DXVECTOR2));
+	device->SetStreamSourceFreq(0, D3DSTREAMSOURCE_INDEXEDDATA | strokeNum);
+
+	device->SetStreamSource(1, m_vb, firstStroke * sizeof(StrokeInstance), sizeof(StrokeInstance));
+	device->SetStreamSourceFreq(1, D3DSTREAMSOURCE_INSTANCEDATA | 1);
+
+	device->DrawIndexedPrimitive(D3DPT_TRIANGLELIST, 0, 0, 4, 0, 2);
+
+	device->SetStreamSourceFreq(0, 1);
+	device->SetStreamSourceFreq(1, 1);
+	device->SetStreamSource(1, NULL, 0, 0);
+}
+
+MemoryStrokeBufferBackend::MemoryStrokeBufferBackend()
+:
+m_vertices(NULL),
+m_indices(NULL),
+m_corners(NULL),
+m_indexBytes(0),
+m_cornerBytes(0),
+m_allocationNum(0),
+m_discardNum(0),
+m_bytesWritten(0.0)
+{
+}
+
+MemoryStrokeBufferBackend::~MemoryStrokeBufferBackend()
+{
+	delete [] m_vertices;
+	delete [] m_indices;
+	delete [] m_corners;
+}
+
+bool MemoryStrokeBufferBackend::allocateVertices(UINT bytes)
+{
+	delete [] m_vertices;
+	m_vertices = new char[bytes];
+
+	++m_allocationNum;
+
+	return true;
+}
+
+bool MemoryStrokeBufferBackend::allocateIndices(UINT bytes, bool index32)
+{
+	delete [] m_indices;
+	m_indices = new char[bytes];
+	m_indexBytes = bytes;
+
+	++m_allocationNum;
+
+	return true;
+}
+
+bool MemoryStrokeBufferBackend::allocateCorners(UINT bytes)
+{
+	delete [] m_corners;
+	m_corners = new char[bytes];
+	m_cornerBytes = bytes;
+
+	++m_allocationNum;
+
+	return true;
+}
+
+void* MemoryStrokeBufferBackend::lockVertices(UINT offset, UINT bytes, bool discard)
+{
+	if(discard)
+		++m_discardNum;
+
+	m_bytesWritten += bytes;
+
+	return m_vertices + offset;
+}
+
+void MemoryStrokeBufferBackend::unlockVertices()
+{
+}
+
+void* MemoryStrokeBufferBackend::lockIndices()
+{
+	m_bytesWritten += m_indexBytes;
+
+	return m_indices;
+}
+
+void MemoryStrokeBufferBackend::unlockIndices()
+{
+}
+
+void* MemoryStrokeBufferBackend::lockCorners()
+{
+	m_bytesWritten += m_cornerBytes;
+
+	return m_corners;
+}
+
+void MemoryStrokeBufferBackend::unlockCorners()
+{
+}
+
+void MemoryStrokeBufferBackend::draw(IDirect3DDevice9* device, int firstStroke, int strokeNum, bool instanced)
+{
+}
+
+//Two triangles per stroke quad, in whichever index format the stroke buffer was made with
+template<typename IndexType>
+static void writeStrokeIndices(IndexType* edgeIndices, int strokeNum)
+{
+	for(int i = 0; i<strokeNum; ++i)
+	{
+		edgeIndices[i * 6 + 0] = (IndexType)(i * 4);
+		edgeIndices[i * 6 + 1] = (IndexType)(i * 4 + 1);
+		edgeIndices[i * 6 + 2] = (IndexType)(i * 4 + 2);
+		edgeIndices[i * 6 + 3] = (IndexType)(i * 4 + 1);
+		edgeIndices[i * 6 + 4] = (IndexType)(i * 4 + 3);
+		edgeIndices[i * 6 + 5] = (IndexType)(i * 4 + 2);
+	}
+}
+
+//The one quad of the instances: the end of the stroke in x, the side in y, in the corner order
+//of the EdgeVertex quads
+static bool writeInstanceQuad(StrokeBuffer* buffer)
+{
+	if( !buffer->backend->allocateIndices(6 * sizeof(WORD), false) )
+		return false;
+
+	if( !buffer->backend->allocateCorners(4 * sizeof(D3DXVECTOR2)) )
+		return false;
+
+	WORD* edgeIndices = (WORD*)buffer->backend->lockIndices();
+
+	if(!edgeIndices)
+		return false;
+
+	writeStrokeIndices(edgeIndices, 1);
+
+	buffer->backend->unlockIndices();
+
+	D3DXVECTOR2* corners = (D3DXVECTOR2*)buffer->backend->lockCorners();
+
+	if(!corners)
+		return false;
+
+	corners[0] = D3DXVECTOR2(0.0f, -1.0f);
+	corners[1] = D3DXVECTOR2(1.0f, -1.0f);
+	corners[2] = D3DXVECTOR2(0.0f, 1.0f);
+	corners[3] = D3DXVECTOR2(1.0f, 1.0f);
+
+	buffer->backend->unlockCorners();
+
+	buffer->indexSize = 1;
+	buffer->index32 = false;
+
+	return true;
+}
+
+//Indices are the same for every frame, written once for as many strokes as they cover
+static bool growStrokeIndices(StrokeBuffer* buffer, int strokeNum)
+{
+	int indexSize = max(strokeNum, max(buffer->indexSize * 2, MIN_STROKE_SIZE));
+
+	//Doubling does not get to switch to 32 bit indices, only a frame that needs them does
+	if(strokeNum <= MAX_STROKE_INDEX16)
+		indexSize = min(indexSize, MAX_STROKE_INDEX16);
+
+	bool index32 = indexSize > MAX_STROKE_INDEX16;
+
+	if( !buffer->backend->allocateIndices(indexSize * 6 * (index32 ? sizeof(DWORD) : sizeof(WORD)), index32) )
+		return false;
+
+	void* edgeIndices = buffer->backend->lockIndices();
+
+	if(!edgeIndices)
+		return false;
+
+	if(index32)
+		writeStrokeIndices((DWORD*)edgeIndices, indexSize);
+	else
+		writeStrokeIndices((WORD*)edgeIndices, indexSize);
+
+	buffer->backend->unlockIndices();
+
+	buffer->indexSize = indexSize;
+	buffer->index32 = index32;
+
+	return true;
+}
+
+void initStrokeBuffer(StrokeBuffer* buffer, StrokeBufferBackend* backend, bool instanced)
+{
+	memset(buffer, 0, sizeof(StrokeBuffer));
+
+	buffer->backend = backend;
+	buffer->instanced = instanced;
+	buffer->strokeBytes = instanced ? sizeof(StrokeInstance) : 4 * sizeof(EdgeVertex);
+}
+
+void* lockStrokeBuffer(StrokeBuffer* buffer, int strokeNum)
+{
+	if(buffer->instanced)
+	{
+		if(buffer->indexSize == 0 && !writeInstanceQuad(buffer))
+			return NULL;
+	}
+	else if(strokeNum > buffer->indexSize && !growStrokeIndices(buffer, strokeNum))
+	{
+		return NULL;
+	}
+
+	//An empty frame still locks a stroke's worth, a lock of 0 bytes takes the whole buffer
+	int lockNum = max(strokeNum, 1);
+
+	bool discard = buffer->writeOffset + lockNum > buffer->vertexSize;
+
+	//Room for two frames at least, one drawn while the other is written
+	if(2 * lockNum > buffer->vertexSize)
+	{
+		int vertexSize = max(2 * lockNum, max(buffer->vertexSize * 2, MIN_STROKE_SIZE));
+
+		if( !buffer->backend->allocateVertices(vertexSize * buffer->strokeBytes) )
+			return NULL;
+
+		buffer->vertexSize = vertexSize;
+
+		discard = true;
+	}
+
+	if(discard)
+		buffer->writeOffset = 0;
+
+	buffer->drawOffset = buffer->writeOffset;
+
+	return buffer->backend->lockVertices(buffer->writeOffset * buffer->strokeBytes, lockNum * buffer->strokeBytes, discard);
+}
+
+void unlockStrokeBuffer(StrokeBuffer* buffer, int strokeNum)
+{
+	buffer->backend->unlockVertices();
+
+	buffer->writeOffset = buffer->drawOffset + strokeNum;
+}
+
+void drawStrokeBuffer(StrokeBuffer* buffer, IDirect3DDevice9* device, int strokeNum)
+{
+	buffer->backend->draw(device, buffer->drawOffset, strokeNum, buffer->instanced);
+}
+
+void releaseStrokeBuffer(StrokeBuffer* buffer)
+{
+	delete buffer->backend;
+
+	memset(buffer, 0, sizeof(StrokeBuffer));
+}
+
+//Unit vector to 8 bit unsigned normalized, x in the lowest byte, with w in [0, 1]
+static DWORD packNormal(const D3DXVECTOR3& normal, float w)
+{
+	DWORD x = (DWORD)(min(max(normal.x * 0.5f + 0.5f, 0.0f), 1.0f) * 255.0f + 0.5f);
+	DWORD y = (DWORD)(min(max(normal.y * 0.5f + 0.5f, 0.0f), 1.0f) * 255.0f + 0.5f);
+	DWORD z = (DWORD)(min(max(normal.z * 0.5f + 0.5f, 0.0f), 1.0f) * 255.0f + 0.5f);
+	DWORD a = (DWORD)(min(max(w, 0.0f), 1.0f) * 255.0f + 0.5f);
+
+	return x | (y << 8) | (z << 16) | (a << 24);
+}
+
+void packStrokeInstances(const EdgeVertex* quads, int strokeNum, StrokeInstance* instances)
+{
+	for(int i=0; i<strokeNum; ++i)
+	{
+		const EdgeVertex* quad = quads + 4 * i;
+		StrokeInstance& instance = instances[i];
+
+		float width[2] = { quad[2].silhouetteWidth.z, quad[3].silhouetteWidth.z };
+		float texCoord[2] = { quad[0].texCoord.x, quad[1].texCoord.x };
+
+		instance.position[0] = quad[0].position;
+		instance.position[1] = quad[1].position;
+
+		instance.normal[0] = packNormal(quad[0].normal, quad[0].silhouetteAlpha.x);
+		instance.normal[1] = packNormal(quad[1].normal, quad[1].silhouetteAlpha.x);
+
+		D3DXFloat32To16Array(instance.width, width, 2);
+		D3DXFloat32To16Array(instance.texCoord, texCoord, 2);
+	}
+}
@@ -0,0 +1,137 @@
+#ifndef STROKE_BUFFER_H_
+#define STROKE_BUFFER_H_
+
+#include "StdHeader.h"
+#include "CUDADataStructure.h"
+
+// Storage the strokes of an object are written into and drawn from. Strokes are rewritten
+// every frame, locked with discard for fresh storage or with no overwrite past what the draws
+// still queued read. Indices, and the corners instances are expanded from, only change when
+// the storage grows.
+class StrokeBufferBackend
+{
+public:
+
+	virtual ~StrokeBufferBackend() {}
+
+	// New storage replacing the old one, sizes in bytes
+	virtual bool allocateVertices(UINT bytes) = 0;
+	virtual bool allocateIndices(UINT bytes, bool index32) = 0;
+	virtual bool allocateCorners(UINT bytes) = 0;
+
+	virtual void* lockVertices(UINT offset, UINT bytes, bool discard) = 0;
+	virtual void  unlockVertices() = 0;
+
+	virtual void* lockIndices() = 0;
+	virtual void  unlockIndices() = 0;
+
+	virtual void* lockCorners() = 0;
+	virtual void  unlockCorners() = 0;
+
+	// strokeNum quads from firstStroke on, as EdgeVertex quads or as instances of the corners
+	virtual void draw(IDirect3DDevice9* device, int firstStroke, int strokeNum, bool instanced) = 0;
+};
+
+// Dynamic vertex buffer in the default pool, static index and corner buffers in the managed one
+class D3DStrokeBufferBackend : public StrokeBufferBackend
+{
+public:
+
+	D3DStrokeBufferBackend(IDirect3DDevice9* device);
+	virtual ~D3DStrokeBufferBackend();
+
+	virtual bool allocateVertices(UINT bytes);
+	virtual bool allocateIndices(UINT bytes, bool index32);
+	virtual bool allocateCorners(UINT bytes);
+
+	virtual void* lockVertices(UINT offset, UINT bytes, bool discard);
+	virtual void  unlockVertices();
+
+	virtual void* lockIndices();
+	virtual void  unlockIndices();
+
+	virtual void* lockCorners();
+	virtual void  unlockCorners();
+
+	virtual void draw(IDirect3DDevice9* device, int firstStroke, int strokeNum, bool instanced);
+
+private:
+
+	IDirect3DDevice9*		m_device;
+
+	IDirect3DVertexBuffer9*	m_vb;
+	IDirect3DIndexBuffer9*	m_ib;
+	IDirect3DVertexBuffer9*	m_corners;
+};
+
+// System memory and nothing to draw, for running without a device. Counts what a device
+// backend would have cost.
+class MemoryStrokeBufferBackend : public StrokeBufferBackend
+{
+public:
+
+	MemoryStrokeBufferBackend();
+	virtual ~MemoryStrokeBufferBackend();
+
+	virtual bool allocateVertices(UINT bytes);
+	virtual bool allocateIndices(UINT bytes, bool index32);
+	virtual bool allocateCorners(UINT bytes);
+
+	virtual void* lockVertices(UINT offset, UINT bytes, bool discard);
+	virtual void  unlockVertices();
+
+	virtual void* lockIndices();
+	virtual void  unlockIndices();
+
+	virtual void* lockCorners();
+	virtual void  unlockCorners();
+
+	virtual void draw(IDirect3DDevice9* device, int firstStroke, int strokeNum, bool instanced);
+
+	char*	m_vertices;
+	char*	m_indices;
+	char*	m_corners;
+	UINT	m_indexBytes;
+	UINT	m_cornerBytes;
+
+	int		m_allocationNum;	// vertex, index and corner storage made
+	int		m_discardNum;		// vertex locks that asked for fresh storage
+	double	m_bytesWritten;		// bytes handed out by the locks
+};
+
+// Grow-only strokes of one object, EdgeVertex quads or StrokeInstances. Vertex storage holds a
+// couple of frames, a frame goes behind the one before it as long as it fits and starts over
+// at the front with a discard when not. Quads are indexed from the frame's first vertex on,
+// instances all expand the same 4 corners with 6 indices.
+struct StrokeBuffer
+{
+	StrokeBufferBackend* backend;
+
+	bool	instanced;
+	UINT	strokeBytes;	// of one stroke, 4 EdgeVertex or a StrokeInstance
+
+	int		vertexSize;		// strokes the vertex storage holds
+	int		indexSize;		// strokes the indices cover, 1 for the quad of the instances
+	bool	index32;
+
+	int		drawOffset;		// first stroke of the frame last written
+	int		writeOffset;	// where the next frame goes
+};
+
+// Takes the backend over
+void initStrokeBuffer(StrokeBuffer* buffer, StrokeBufferBackend* backend, bool instanced);
+
+// Storage for strokeNum strokes of the coming frame, growing it when needed, locked for writing
+void* lockStrokeBuffer(StrokeBuffer* buffer, int strokeNum);
+
+// The first strokeNum strokes locked hold the frame
+void unlockStrokeBuffer(StrokeBuffer* buffer, int strokeNum);
+
+void drawStrokeBuffer(StrokeBuffer* buffer, IDirect3DDevice9* device, int strokeNum);
+
+void releaseStrokeBuffer(StrokeBuffer* buffer);
+
+// Quads folded into instances, the corners of either end being alike but for their side
+void packStrokeInstances(const EdgeVertex* quads, int strokeNum, StrokeInstance* instances);
+
+#endif
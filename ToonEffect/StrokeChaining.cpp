@@ -0,0 +1,266 @@
+//////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// File: StrokeChaining.cpp
+//
+// Author: Ren Yifei, yfren@cs.hku.hk
+//
+// Desc: Parallel chaining of linked strokes, lock free union-find and list ranking
+//
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "StrokeChaining.h"
+
+static bool initStrokeChains(StrokeChains* chains, int strokeNum)
+{
+	if(strokeNum <= chains->strokeSize)
+		return true;
+
+	releaseStrokeChains(chains);
+
+	chains->strokeSize = strokeNum;
+
+	chains->root	= new int[strokeNum];
+	chains->parent	= new int[strokeNum];
+	chains->isOpen	= new int[strokeNum];
+
+	for(int i=0; i<2; ++i)
+	{
+		chains->next[i] = new int[2 * strokeNum];
+		chains->dist[i] = new int[2 * strokeNum];
+		chains->last[i] = new int[2 * strokeNum];
+	}
+
+	return true;
+}
+
+//Parents are only ever set from a root to a lower stroke, so a walk up always ends
+static int findRoot(volatile int* parent, int stroke)
+{
+	int up = parent[stroke];
+
+	while(up != stroke)
+	{
+		stroke = up;
+		up = parent[stroke];
+	}
+
+	return stroke;
+}
+
+//The higher root goes under the lower one, as long as nobody else hooked it meanwhile
+static void unite(volatile int* parent, int stroke0, int stroke1)
+{
+	while(true)
+	{
+		int root0 = findRoot(parent, stroke0);
+		int root1 = findRoot(parent, stroke1);
+
+		if(root0 == root1)
+			return;
+
+		int high = max(root0, root1);
+		int low = min(root0, root1);
+
+		if(InterlockedCompareExchange((volatile LONG*)&parent[high], low, high) == high)
+			return;
+	}
+}
+
+bool chainStrokes(StrokeChains* chains, const int* endPntPartner, int strokeNum,
+				  SegmentGroup* segGroup, SegmentGroupInfo* segGroupInfo)
+{
+	if( !initStrokeChains(chains, strokeNum) )
+		return false;
+
+	int endPntNum = 2 * strokeNum;
+
+	int* parent = chains->parent;
+	int* root = chains->root;
+	int* isOpen = chains->isOpen;
+
+	#pragma omp parallel for schedule(static)
+	for(int i=0; i<strokeNum; ++i)
+	{
+		parent[i] = i;
+		isOpen[i] = 0;
+	}
+
+	//Every link once, from its lower end point
+	#pragma omp parallel for schedule(static)
+	for(int e=0; e<endPntNum; ++e)
+	{
+		if(endPntPartner[e] > e)
+			unite(parent, e / 2, endPntPartner[e] / 2);
+	}
+
+	#pragma omp parallel for schedule(static)
+	for(int i=0; i<strokeNum; ++i)
+		root[i] = findRoot(parent, i);
+
+	#pragma omp parallel for schedule(static)
+	for(int e=0; e<endPntNum; ++e)
+	{
+		if(endPntPartner[e] < 0)
+		{
+			#pragma omp atomic
+			isOpen[root[e / 2]] |= 1;
+		}
+	}
+
+	//Leaving a stroke by e, the walk enters the partner stroke and leaves it by its other end
+	//point. A loop is cut right of its lowest stroke, where the walk from there would come back.
+	int* next = chains->next[0];
+	int* dist = chains->dist[0];
+	int* last = chains->last[0];
+
+	#pragma omp parallel for schedule(static)
+	for(int e=0; e<endPntNum; ++e)
+	{
+		int partner = endPntPartner[e];
+		int rootRight = 2 * root[e / 2] + 1;
+
+		if(partner >= 0 && !isOpen[root[e / 2]] && (e == rootRight || partner == rootRight))
+			partner = -1;
+
+		next[e] = partner >= 0 ? partner ^ 1 : -1;
+		dist[e] = partner >= 0 ? 1 : 0;
+		last[e] = e;
+	}
+
+	//Pointer jumping: every round doubles the span of the jumps, until all walks are at their end
+	int cur = 0;
+	int activeNum = 1;
+
+	while(activeNum > 0)
+	{
+		const int* curNext = chains->next[cur];
+		const int* curDist = chains->dist[cur];
+		const int* curLast = chains->last[cur];
+
+		int* newNext = chains->next[cur ^ 1];
+		int* newDist = chains->dist[cur ^ 1];
+		int* newLast = chains->last[cur ^ 1];
+
+		activeNum = 0;
+
+		#pragma omp parallel for schedule(static) reduction(+:activeNum)
+		for(int e=0; e<endPntNum; ++e)
+		{
+			int jump = curNext[e];
+
+			if(jump >= 0)
+			{
+				newNext[e] = curNext[jump];
+				newDist[e] = curDist[e] + curDist[jump];
+				newLast[e] = curLast[jump];
+
+				activeNum += newNext[e] >= 0 ? 1 : 0;
+			}
+			else
+			{
+				newNext[e] = -1;
+				newDist[e] = curDist[e];
+				newLast[e] = curLast[e];
+			}
+		}
+
+		cur ^= 1;
+	}
+
+	dist = chains->dist[cur];
+	last = chains->last[cur];
+
+	//Groups in the order of their lowest strokes, a plain scan (a prefix sum on the device)
+	int groupNum = 0;
+
+	for(int i=0; i<strokeNum; ++i)
+	{
+		if(root[i] == i)
+			parent[i] = ++groupNum;
+	}
+
+	//Offset from the lowest stroke along the walk leaving it to the right, which the end point
+	//of a stroke on the same walk says
+	#pragma omp parallel for schedule(static)
+	for(int i=0; i<strokeNum; ++i)
+	{
+		int rootRight = 2 * root[i] + 1;
+		int endPnt = last[2 * i + 1] == last[rootRight] ? 2 * i + 1 : 2 * i;
+
+		int groupIdx = parent[root[i]];
+
+		segGroup[i].groupIdx = groupIdx;
+		segGroup[i].offsetIdx = dist[rootRight] - dist[endPnt];
+
+		if(root[i] == i)
+		{
+			segGroupInfo[groupIdx].total = dist[2 * i] + dist[2 * i + 1] + 1;
+			segGroupInfo[groupIdx].minIdx = -dist[2 * i];
+		}
+	}
+
+	return true;
+}
+
+//Strokes from endPnt on get the offsets step, 2*step, ... until the walk ends or comes back
+//into the group, returning how many did
+static int walkChain(const int* endPntPartner, int endPnt, int groupIdx, int step, SegmentGroup* segGroup)
+{
+	int strokeNum = 0;
+
+	for(int partner = endPntPartner[endPnt]; partner >= 0; partner = endPntPartner[partner ^ 1])
+	{
+		SegmentGroup& group = segGroup[partner / 2];
+
+		if(group.groupIdx == groupIdx)
+			break;
+
+		++strokeNum;
+
+		group.groupIdx = groupIdx;
+		group.offsetIdx = step * strokeNum;
+	}
+
+	return strokeNum;
+}
+
+void chainStrokesSerial(const int* endPntPartner, int strokeNum,
+						SegmentGroup* segGroup, SegmentGroupInfo* segGroupInfo)
+{
+	memset(segGroup, 0, strokeNum * sizeof(SegmentGroup));
+
+	int groupNum = 0;
+
+	for(int i=0; i<strokeNum; ++i)
+	{
+		if(segGroup[i].groupIdx != 0)
+			continue;
+
+		int groupIdx = ++groupNum;
+
+		segGroup[i].groupIdx = groupIdx;
+		segGroup[i].offsetIdx = 0;
+
+		int left = walkChain(endPntPartner, 2 * i, groupIdx, -1, segGroup);
+		int right = walkChain(endPntPartner, 2 * i + 1, groupIdx, 1, segGroup);
+
+		segGroupInfo[groupIdx].total = left + right + 1;
+		segGroupInfo[groupIdx].minIdx = -left;
+	}
+}
+
+void releaseStrokeChains(StrokeChains* chains)
+{
+	delete [] chains->root;
+	delete [] chains->parent;
+	delete [] chains->isOpen;
+
+	for(int i=0; i<2; ++i)
+	{
+		delete [] chains->next[i];
+		delete [] chains->dist[i];
+		delete [] chains->last[i];
+	}
+
+	memset(chains, 0, sizeof(StrokeChains));
+}
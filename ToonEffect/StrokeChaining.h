@@ -0,0 +1,43 @@
+#ifndef STROKE_CHAINING_H_
+#define STROKE_CHAINING_H_
+
+#include "StdHeader.h"
+#include "CUDADataStructure.h"
+
+// Chains of strokes out of links between their end points, every stage one element per
+// iteration with no order between them, so that it spreads over all cores (and maps on kernels
+// one to one): union-find over the strokes, then list ranking by pointer jumping over the
+// directed walks through them. Everything in here is scratch.
+struct StrokeChains
+{
+	int*	parent;			// union-find over the strokes, group ids of the roots in the end
+	int*	root;			// lowest stroke of the chain of every stroke
+	int*	isOpen;			// per root, the chain has a free end and is no loop
+
+	int*	next[2];		// walk leaving a stroke through end point e: next end point to leave by,
+	int*	dist[2];		// end points left to go and the last one, double buffered for the jumps
+	int*	last[2];
+
+	int		strokeSize;
+};
+
+// Strokes linked at their end points, endPntPartner holding the end point every one of them is
+// linked to or -1, both ways. Groups and offsets come out as a walk from the lowest stroke of
+// every chain would give them: its left end point first, then its right one, groups numbered
+// in the order of those strokes. A loop goes all the way round from the left end point.
+bool chainStrokes(StrokeChains* chains,
+				  const int* endPntPartner,
+				  int strokeNum,
+				  SegmentGroup* segGroup,
+				  SegmentGroupInfo* segGroupInfo);
+
+// The same groups and offsets walking one chain after the other, chainStrokes is checked
+// against it
+void chainStrokesSerial(const int* endPntPartner,
+						int strokeNum,
+						SegmentGroup* segGroup,
+						SegmentGroupInfo* segGroupInfo);
+
+void releaseStrokeChains(StrokeChains* chains);
+
+#endif
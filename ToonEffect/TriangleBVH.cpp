@@ -0,0 +1,286 @@
+//////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// File: TriangleBVH.cpp
+//
+// Author: Ren Yifei, yfren@cs.hku.hk
+//
+// Desc: Bounding box hierarchy over the mesh triangles, so that a silhouette is only
+//		 tested against the triangles near its eye ray
+//
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "TriangleBVH.h"
+#include "SilhouetteCommon.h"
+#include <float.h>
+#include <algorithm>
+
+//Boxes grow by this much of their size: the occlusion test runs in view space, the
+//traversal in object space, and a hit on a box face must not get lost to rounding
+const float g_BVH_BOX_EPSILON = 1e-4f;
+
+struct CentroidLess
+{
+	const D3DXVECTOR3*	centroids;
+	int					axis;
+
+	bool operator()(int lhs, int rhs) const
+	{
+		return (&centroids[lhs].x)[axis] < (&centroids[rhs].x)[axis];
+	}
+};
+
+struct BVHBuilder
+{
+	const MeshVertex*	vertices;
+	const DWORD*		indices;
+
+	int*				order;	//face id at each position of the leaf order
+	D3DXVECTOR3*		centroids;
+
+	BVHNode*			nodes;
+	int					nodeNum;
+};
+
+static void growBox(D3DXVECTOR3& minPnt, D3DXVECTOR3& maxPnt, const D3DXVECTOR3& pos)
+{
+	minPnt.x = pos.x < minPnt.x ? pos.x : minPnt.x;
+	minPnt.y = pos.y < minPnt.y ? pos.y : minPnt.y;
+	minPnt.z = pos.z < minPnt.z ? pos.z : minPnt.z;
+	maxPnt.x = pos.x > maxPnt.x ? pos.x : maxPnt.x;
+	maxPnt.y = pos.y > maxPnt.y ? pos.y : maxPnt.y;
+	maxPnt.z = pos.z > maxPnt.z ? pos.z : maxPnt.z;
+}
+
+static void buildNode(BVHBuilder& builder, int first, int num)
+{
+	int nodeIdx = builder.nodeNum++;
+
+	BVHNode& node = builder.nodes[nodeIdx];
+
+	D3DXVECTOR3 minPnt(FLT_MAX, FLT_MAX, FLT_MAX);
+	D3DXVECTOR3 maxPnt(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+
+	for(int i=first; i<first+num; ++i)
+	{
+		int face = builder.order[i];
+
+		for(int k=0; k<3; ++k)
+			growBox(minPnt, maxPnt, builder.vertices[builder.indices[3 * face + k]].position);
+	}
+
+	//Rounding grows with the coordinates as well as with the box
+	float margin = (length(maxPnt - minPnt) + length(maxPnt + minPnt) * 0.5f) * g_BVH_BOX_EPSILON;
+
+	node.boxMin = minPnt - D3DXVECTOR3(margin, margin, margin);
+	node.boxMax = maxPnt + D3DXVECTOR3(margin, margin, margin);
+
+	node.firstTriangle = first;
+	node.triangleNum = num;
+
+	if(num <= g_BVH_LEAF_SIZE)
+	{
+		node.skipNode = nodeIdx + 1;
+		return;
+	}
+
+	//Median split along the widest spread of the centroids
+	D3DXVECTOR3 minCentroid(FLT_MAX, FLT_MAX, FLT_MAX);
+	D3DXVECTOR3 maxCentroid(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+
+	for(int i=first; i<first+num; ++i)
+		growBox(minCentroid, maxCentroid, builder.centroids[builder.order[i]]);
+
+	D3DXVECTOR3 spread = maxCentroid - minCentroid;
+
+	CentroidLess centroidLess;
+	centroidLess.centroids = builder.centroids;
+	centroidLess.axis = spread.x >= spread.y ? (spread.x >= spread.z ? 0 : 2) : (spread.y >= spread.z ? 1 : 2);
+
+	int half = num / 2;
+
+	std::nth_element(builder.order + first, builder.order + first + half, builder.order + first + num, centroidLess);
+
+	buildNode(builder, first, half);
+	buildNode(builder, first + half, num - half);
+
+	node.skipNode = builder.nodeNum;
+}
+
+bool buildTriangleBVH(TriangleBVH* bvh,
+					  const MeshVertex* vertices,
+					  const DWORD* indices, int faceNum)
+{
+	releaseTriangleBVH(bvh);
+
+	BVHBuilder builder;
+
+	builder.vertices	= vertices;
+	builder.indices		= indices;
+	builder.order		= new int[faceNum];
+	builder.centroids	= new D3DXVECTOR3[faceNum];
+	builder.nodeNum		= 0;
+
+	for(int i=0; i<faceNum; ++i)
+	{
+		builder.order[i] = i;
+		builder.centroids[i] = (vertices[indices[3 * i]].position +
+								vertices[indices[3 * i + 1]].position +
+								vertices[indices[3 * i + 2]].position) / 3.0f;
+	}
+
+	//Median splits of more than g_BVH_LEAF_SIZE triangles leave at least half of that in every leaf
+	int maxLeafNum = faceNum / (g_BVH_LEAF_SIZE / 2) + 1;
+
+	builder.nodes = new BVHNode[2 * maxLeafNum];
+
+	if(faceNum > 0)
+		buildNode(builder, 0, faceNum);
+
+	delete [] builder.centroids;
+
+	bvh->nodes			= builder.nodes;
+	bvh->nodeNum		= builder.nodeNum;
+	bvh->triangles		= builder.order;
+	bvh->triangleNum	= faceNum;
+
+	return true;
+}
+
+void releaseTriangleBVH(TriangleBVH* bvh)
+{
+	delete [] bvh->nodes;
+	delete [] bvh->triangles;
+
+	memset(bvh, 0, sizeof(TriangleBVH));
+}
+
+//View space box around the triangle hierarchy of an object, from the corners of its root box
+static void instanceBox(const BatchObject& obj, D3DXVECTOR3& minPnt, D3DXVECTOR3& maxPnt)
+{
+	minPnt = D3DXVECTOR3(FLT_MAX, FLT_MAX, FLT_MAX);
+	maxPnt = D3DXVECTOR3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+
+	if(obj.bvhNodeNum == 0)
+		return;
+
+	const BVHNode& root = obj.bvhNodes[0];
+
+	for(int corner=0; corner<8; ++corner)
+	{
+		D3DXVECTOR3 pnt((corner & 1) ? root.boxMax.x : root.boxMin.x,
+						(corner & 2) ? root.boxMax.y : root.boxMin.y,
+						(corner & 4) ? root.boxMax.z : root.boxMin.z);
+
+		growBox(minPnt, maxPnt, matrixPntMul(pnt, &obj.worldView));
+	}
+}
+
+static void buildInstanceNode(InstanceBVH* bvh, const D3DXVECTOR3* centroids, int first, int num)
+{
+	int nodeIdx = bvh->nodeNum++;
+
+	BVHNode& node = bvh->nodes[nodeIdx];
+
+	node.firstTriangle = first;
+	node.triangleNum = num;
+
+	if(num == 1)
+	{
+		node.skipNode = nodeIdx + 1;
+		return;
+	}
+
+	D3DXVECTOR3 minCentroid(FLT_MAX, FLT_MAX, FLT_MAX);
+	D3DXVECTOR3 maxCentroid(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+
+	for(int i=first; i<first+num; ++i)
+		growBox(minCentroid, maxCentroid, centroids[bvh->instances[i]]);
+
+	D3DXVECTOR3 spread = maxCentroid - minCentroid;
+
+	CentroidLess centroidLess;
+	centroidLess.centroids = centroids;
+	centroidLess.axis = spread.x >= spread.y ? (spread.x >= spread.z ? 0 : 2) : (spread.y >= spread.z ? 1 : 2);
+
+	int half = num / 2;
+
+	std::nth_element(bvh->instances + first, bvh->instances + first + half, bvh->instances + first + num, centroidLess);
+
+	buildInstanceNode(bvh, centroids, first, half);
+	buildInstanceNode(bvh, centroids, first + half, num - half);
+
+	node.skipNode = bvh->nodeNum;
+}
+
+bool buildInstanceBVH(InstanceBVH* bvh, const BatchObject* objects, int objNum)
+{
+	releaseInstanceBVH(bvh);
+
+	if(objNum <= 0)
+		return true;
+
+	D3DXVECTOR3* centroids = new D3DXVECTOR3[objNum];
+
+	bvh->instances		= new int[objNum];
+	bvh->instanceNum	= objNum;
+	bvh->nodes			= new BVHNode[2 * objNum - 1];
+
+	for(int i=0; i<objNum; ++i)
+	{
+		D3DXVECTOR3 minPnt, maxPnt;
+		instanceBox(objects[i], minPnt, maxPnt);
+
+		bvh->instances[i] = i;
+		centroids[i] = objects[i].bvhNodeNum > 0 ? (minPnt + maxPnt) / 2.0f : D3DXVECTOR3(0, 0, 0);
+	}
+
+	buildInstanceNode(bvh, centroids, 0, objNum);
+
+	delete [] centroids;
+
+	refitInstanceBVH(bvh, objects);
+
+	return true;
+}
+
+void refitInstanceBVH(InstanceBVH* bvh, const BatchObject* objects)
+{
+	//Children follow their parent, so going backwards every child is done before its parent
+	for(int nodeIdx=bvh->nodeNum - 1; nodeIdx>=0; --nodeIdx)
+	{
+		BVHNode& node = bvh->nodes[nodeIdx];
+
+		if(node.skipNode == nodeIdx + 1)
+		{
+			instanceBox(objects[bvh->instances[node.firstTriangle]], node.boxMin, node.boxMax);
+			continue;
+		}
+
+		const BVHNode& left		= bvh->nodes[nodeIdx + 1];
+		const BVHNode& right	= bvh->nodes[left.skipNode];
+
+		node.boxMin = D3DXVECTOR3(FLT_MAX, FLT_MAX, FLT_MAX);
+		node.boxMax = D3DXVECTOR3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+
+		//An object without triangles leaves its box empty
+		if(left.boxMin.x <= left.boxMax.x)
+		{
+			growBox(node.boxMin, node.boxMax, left.boxMin);
+			growBox(node.boxMin, node.boxMax, left.boxMax);
+		}
+
+		if(right.boxMin.x <= right.boxMax.x)
+		{
+			growBox(node.boxMin, node.boxMax, right.boxMin);
+			growBox(node.boxMin, node.boxMax, right.boxMax);
+		}
+	}
+}
+
+void releaseInstanceBVH(InstanceBVH* bvh)
+{
+	delete [] bvh->nodes;
+	delete [] bvh->instances;
+
+	memset(bvh, 0, sizeof(InstanceBVH));
+}
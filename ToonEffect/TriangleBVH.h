@@ -0,0 +1,45 @@
+#ifndef TRIANGLE_BVH_H_
+#define TRIANGLE_BVH_H_
+
+#include "StdHeader.h"
+#include "CUDADataStructure.h"
+
+// Bounding volume hierarchy over the triangles of a mesh, object space, for the occlusion
+// test of the silhouettes. Built once per mesh, the face order of the mesh is left alone.
+struct TriangleBVH
+{
+	BVHNode*	nodes;
+	int			nodeNum;
+
+	// Face ids in leaf order, every leaf covers a contiguous run of them
+	int*		triangles;
+	int			triangleNum;
+};
+
+bool buildTriangleBVH(TriangleBVH* bvh,
+					  const MeshVertex* vertices,
+					  const DWORD* indices, int faceNum);
+
+void releaseTriangleBVH(TriangleBVH* bvh);
+
+// Top level hierarchy over the objects of a batch: view space boxes around the roots of their
+// TriangleBVHs, one object per leaf. Built when the objects change, refit to every frame's
+// matrices after that.
+struct InstanceBVH
+{
+	BVHNode*	nodes;		// firstTriangle and triangleNum count instances here
+	int			nodeNum;
+
+	// Object ids in leaf order
+	int*		instances;
+	int			instanceNum;
+};
+
+bool buildInstanceBVH(InstanceBVH* bvh, const BatchObject* objects, int objNum);
+
+// New boxes for the same objects, the tree is left as it was built
+void refitInstanceBVH(InstanceBVH* bvh, const BatchObject* objects);
+
+void releaseInstanceBVH(InstanceBVH* bvh);
+
+#endif
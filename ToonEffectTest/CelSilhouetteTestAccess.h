@@ -0,0 +1,43 @@
+#ifndef CEL_SILHOUETTE_TEST_ACCESS_H_
+#define CEL_SILHOUETTE_TEST_ACCESS_H_
+
+#include "CelSilhouette.h"
+
+//What the classifier reads of a CelSilhouette
+struct ClassifierInput
+{
+	const SilhouetteSoA*	soa;
+	const MeshEdge*			edges;
+	const D3DXVECTOR4*		facePlanes;
+	int						edgeNum;
+	int						faceNum;
+};
+
+//The tests' way into a CelSilhouette
+class CelSilhouetteTestAccess
+{
+public:
+
+	static ClassifierInput classifierInput(const CelSilhouette& silhouette)
+	{
+		ClassifierInput input;
+
+		input.soa		 = &silhouette.m_soa;
+		input.edges		 = silhouette.m_edges;
+		input.facePlanes = silhouette.m_facePlanes;
+		input.edgeNum	 = silhouette.m_edgeNum;
+		input.faceNum	 = silhouette.m_indicesNum / 3;
+
+		return input;
+	}
+
+	//The strokes it draws, strokeBytes each from the buffer's draw offset
+	static const StrokeBuffer& strokes(const CelSilhouette& silhouette, int* strokeNum)
+	{
+		*strokeNum = silhouette.m_silhouetteNum;
+
+		return silhouette.m_strokes;
+	}
+};
+
+#endif
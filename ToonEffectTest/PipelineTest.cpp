@@ -0,0 +1,210 @@
+//////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// File: PipelineTest.cpp
+//
+// Author: Ren Yifei, yfren@cs.hku.hk
+//
+// Desc: Frames pipelined through CelShadingHandler on the CPU backend draw what the frame before
+//		 drew run synchronously, and the task queue times its tasks for the overlap
+//
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "TestCommon.h"
+#include "CelSilhouetteTestAccess.h"
+#include "CelShadingHandler.h"
+#include "CPUTaskQueue.h"
+#include "d3dUtility.h"
+
+#include <vector>
+
+extern bool g_useCPUBackend;
+extern bool g_pipelineFrames;
+
+static const int s_objNum = 3;
+static const int s_frameNum = 24;
+
+static int s_taskRunNum = 0;
+
+static void countTask(const CpuTask& task)
+{
+	++s_taskRunNum;
+}
+
+//Times are there from a task's end until its slot is taken again
+static void checkTaskTimes()
+{
+	CpuTask task;
+	memset(&task, 0, sizeof(CpuTask));
+
+	task.run = countTask;
+
+	StageTicket first = 0;
+	StageTicket ticket = 0;
+
+	TEST_CHECK(cpuSubmitTask(task, &first));
+	TEST_CHECK(cpuWaitTask(first));
+	TEST_CHECK(cpuTaskDone(first));
+
+	LONGLONG start = 0, finish = 0;
+
+	TEST_CHECK(cpuTaskTimes(first, &start, &finish));
+	TEST_CHECK(start > 0 && start <= finish);
+
+	LONGLONG lastFinish = finish;
+
+	for(int i=1; i<g_MAX_STAGES_IN_FLIGHT; ++i)
+		TEST_CHECK(cpuSubmitTask(task, &ticket));
+
+	TEST_CHECK(cpuWaitTask(ticket));
+	TEST_CHECK(s_taskRunNum == g_MAX_STAGES_IN_FLIGHT);
+
+	//In order, one after the other
+	TEST_CHECK(cpuTaskTimes(ticket, &start, &finish));
+	TEST_CHECK(start >= lastFinish && start <= finish);
+	TEST_CHECK(cpuTaskTimes(first, &start, &finish));
+
+	TEST_CHECK(cpuSubmitTask(task, &ticket));
+	TEST_CHECK(cpuWaitTask(ticket));
+	TEST_CHECK(!cpuTaskTimes(first, &start, &finish));
+	TEST_CHECK(!cpuTaskTimes(ticket + 1, &start, &finish));
+}
+
+//Stroke count then strokes of every object, as it would draw them
+static void recordStrokes(CelSilhouette** silhouettes, std::vector<char>& frame)
+{
+	for(int i=0; i<s_objNum; ++i)
+	{
+		int strokeNum = 0;
+		const StrokeBuffer& strokes = CelSilhouetteTestAccess::strokes(*silhouettes[i], &strokeNum);
+
+		frame.insert(frame.end(), (const char*)&strokeNum, (const char*)(&strokeNum + 1));
+
+		if(strokeNum == 0)
+			continue;
+
+		const char* first = ((MemoryStrokeBufferBackend*)strokes.backend)->m_vertices + strokes.drawOffset * strokes.strokeBytes;
+
+		frame.insert(frame.end(), first, first + strokeNum * strokes.strokeBytes);
+	}
+}
+
+//The objects in a row, the eye going round them
+static void runFrames(IDirect3DDevice9* device, bool pipelined, std::vector< std::vector<char> >& frames)
+{
+	ID3DXMesh*	 meshes[s_objNum];
+	ID3DXBuffer* adjBuffers[s_objNum];
+
+	bool created = SUCCEEDED(D3DXCreateTeapot(device, &meshes[0], &adjBuffers[0])) &&
+				   SUCCEEDED(D3DXCreateSphere(device, 1.0f, 20, 20, &meshes[1], &adjBuffers[1])) &&
+				   SUCCEEDED(D3DXCreateTorus(device, 0.5f, 1.0f, 20, 20, &meshes[2], &adjBuffers[2]));
+
+	TEST_CHECK(created);
+
+	if(!created)
+		return;
+
+	CelShadingHandler handler;
+	CelSilhouette* silhouettes[s_objNum];
+
+	//The adjacency goes to the silhouette, the mesh stays ours
+	for(int i=0; i<s_objNum; ++i)
+		silhouettes[i] = new CelSilhouette(NULL, meshes[i], adjBuffers[i]);
+
+	D3DXMATRIX proj;
+	D3DXMatrixPerspectiveFovLH(&proj, D3DX_PI * 0.25f, 4.0f / 3.0f, 1.0f, 1000.0f);
+
+	g_pipelineFrames = pipelined;
+
+	int overlapNum = 0;
+
+	for(int f=0; f<s_frameNum; ++f)
+	{
+		float angle = f * 0.15f;
+
+		D3DXVECTOR3 eye(cosf(angle) * 12.0f, 4.0f, sinf(angle) * 12.0f);
+		D3DXVECTOR3 at(0.0f, 0.0f, 0.0f);
+		D3DXVECTOR3 up(0.0f, 1.0f, 0.0f);
+
+		D3DXMATRIX view;
+		D3DXMatrixLookAtLH(&view, &eye, &at, &up);
+
+		D3DXMATRIX worldViews[s_objNum];
+
+		for(int i=0; i<s_objNum; ++i)
+		{
+			D3DXMATRIX world;
+			D3DXMatrixTranslation(&world, 3.0f * (i - 1), 0.0f, 0.0f);
+
+			worldViews[i] = world * view;
+		}
+
+		TEST_CHECK(handler.processScene(silhouettes, worldViews, s_objNum, &proj));
+
+		frames.push_back(std::vector<char>());
+		recordStrokes(silhouettes, frames.back());
+
+		//Measured whenever a frame was chained while a pass ran
+		float overlap = handler.lastPassOverlap();
+
+		if(pipelined && f > 0)
+		{
+			TEST_CHECK(overlap >= 0.0f && overlap <= 1.0f);
+			overlapNum += overlap >= 0.0f;
+		}
+		else
+			TEST_CHECK(overlap == -1.0f);
+	}
+
+	TEST_CHECK(handler.flushPendingFrame());
+
+	//Whatever the pipeline held is drawn now, nothing is left the second time
+	if(pipelined)
+	{
+		frames.push_back(std::vector<char>());
+		recordStrokes(silhouettes, frames.back());
+
+		TEST_CHECK(overlapNum == s_frameNum - 1);
+	}
+
+	TEST_CHECK(handler.flushPendingFrame());
+
+	for(int i=0; i<s_objNum; ++i)
+	{
+		delete silhouettes[i];
+		d3d::Release<ID3DXMesh*>(meshes[i]);
+	}
+
+	g_pipelineFrames = false;
+}
+
+void testPipeline(IDirect3DDevice9* device)
+{
+	checkTaskTimes();
+
+	bool useCPUBackend = g_useCPUBackend;
+	g_useCPUBackend = true;
+
+	std::vector< std::vector<char> > syncFrames;
+	std::vector< std::vector<char> > pipelinedFrames;
+
+	runFrames(device, false, syncFrames);
+	runFrames(device, true, pipelinedFrames);
+
+	g_useCPUBackend = useCPUBackend;
+
+	//Nothing drawn before the first frame comes through, then every frame a call late
+	TEST_CHECK(pipelinedFrames.size() == syncFrames.size() + 1);
+	TEST_CHECK(pipelinedFrames[0] == std::vector<char>(s_objNum * sizeof(int), 0));
+
+	int mismatchNum = 0;
+
+	for(size_t f=0; f<syncFrames.size() && f + 1<pipelinedFrames.size(); ++f)
+		mismatchNum += syncFrames[f] != pipelinedFrames[f + 1];
+
+	if(mismatchNum)
+		printf("Pipeline: %d frames differ from the frame before run synchronously\n", mismatchNum);
+
+	TEST_CHECK(mismatchNum == 0);
+
+	cpuReleaseTaskQueue();
+}
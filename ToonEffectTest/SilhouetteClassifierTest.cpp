@@ -0,0 +1,176 @@
+//////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// File: SilhouetteClassifierTest.cpp
+//
+// Author: Ren Yifei, yfren@cs.hku.hk
+//
+// Desc: classifySilhouettes against findSilhouetteElement, bit for bit, for every instruction
+//		 set this build and CPU have, over the sample meshes of config.ini
+//
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "TestCommon.h"
+#include "CelSilhouetteTestAccess.h"
+#include "SilhouetteCommon.h"
+#include "d3dUtility.h"
+
+#include <vector>
+
+static const unsigned int MASK_GUARD = 0xDEADBEEF;
+
+//Edges [firstEdge, firstEdge + edgeNum) through one ISA, the words past the range kept as they were
+static int compareRange(SilhouetteISA isa, const ClassifierInput& mesh,
+						const D3DXVECTOR3& eye, int firstEdge, int edgeNum)
+{
+	int wordNum = (edgeNum + 31) / 32;
+
+	std::vector<unsigned int> mask(wordNum + 1, MASK_GUARD);
+
+	classifySilhouettes(isa, mesh.soa, eye, &mask[0], firstEdge, edgeNum);
+
+	int mismatchNum = 0;
+
+	for(int word=0; word<wordNum; ++word)
+	{
+		unsigned int expected = 0;
+
+		for(int bit=0; bit<32 && word*32 + bit<edgeNum; ++bit)
+		{
+			const MeshEdge& edge = mesh.edges[firstEdge + word*32 + bit];
+
+			if(findSilhouetteElement(edge, mesh.facePlanes, eye))
+				expected |= 1u << bit;
+		}
+
+		if(mask[word] != expected)
+			++mismatchNum;
+	}
+
+	if(mask[wordNum] != MASK_GUARD)
+		++mismatchNum;
+
+	return mismatchNum;
+}
+
+//Eyes all around the mesh, inside it and on its face planes, where the two faces of an edge tie
+static void buildEyes(const ClassifierInput& mesh, std::vector<D3DXVECTOR3>& eyes)
+{
+	const float distances[] = { 0.5f, 2.0f, 8.0f, 50.0f };
+
+	for(int d=0; d<4; ++d)
+	{
+		for(int i=0; i<12; ++i)
+		{
+			for(int j=0; j<7; ++j)
+			{
+				float theta = D3DX_PI * 2.0f * i / 12.0f + 0.1f;
+				float phi	= D3DX_PI * (j + 0.5f) / 7.0f;
+
+				eyes.push_back(distances[d] * D3DXVECTOR3(sinf(phi) * cosf(theta), cosf(phi), sinf(phi) * sinf(theta)));
+			}
+		}
+	}
+
+	eyes.push_back(D3DXVECTOR3(0.0f, 0.0f, 0.0f));
+
+	for(int face=0; face<mesh.faceNum && face<64; ++face)
+	{
+		const D3DXVECTOR4& plane = mesh.facePlanes[face];
+
+		D3DXVECTOR3 normal(plane.x, plane.y, plane.z);
+
+		eyes.push_back(normal * (-plane.w / D3DXVec3Dot(&normal, &normal)));
+	}
+}
+
+static void compareMesh(const char* name, ID3DXMesh* d3dMesh, ID3DXBuffer* adjBuffer)
+{
+	//Without a device the strokes go to system memory, nothing here draws them
+	CelSilhouette silhouette(NULL, d3dMesh, adjBuffer);
+
+	ClassifierInput mesh = CelSilhouetteTestAccess::classifierInput(silhouette);
+
+	TEST_CHECK(mesh.edgeNum > 0);
+
+	if(mesh.edgeNum == 0)
+		return;
+
+	std::vector<D3DXVECTOR3> eyes;
+	buildEyes(mesh, eyes);
+
+	//Whole words, short tails, and ranges starting off a word
+	const int firsts[] = { 0, 1, 7, 31, 32, 33, mesh.edgeNum / 2 + 5 };
+	const int counts[] = { 1, 31, 32, 33, 100, 1 << 30 };
+
+	SilhouetteISA widest = detectSilhouetteISA();
+
+	for(int isa=SIL_ISA_SCALAR; isa<=widest; ++isa)
+	{
+		int mismatchNum = 0;
+
+		for(size_t e=0; e<eyes.size(); ++e)
+		{
+			for(int f=0; f<7; ++f)
+			{
+				for(int c=0; c<6; ++c)
+				{
+					int firstEdge = min(firsts[f], mesh.edgeNum - 1);
+					int edgeNum	  = min(counts[c], mesh.edgeNum - firstEdge);
+
+					mismatchNum += compareRange((SilhouetteISA)isa, mesh, eyes[e], firstEdge, edgeNum);
+				}
+			}
+		}
+
+		if(mismatchNum)
+			printf("%s, ISA %d: %d words differ from findSilhouetteElement\n", name, isa, mismatchNum);
+
+		TEST_CHECK(mismatchNum == 0);
+	}
+}
+
+void testSilhouetteClassifier(IDirect3DDevice9* device)
+{
+	ID3DXMesh*	 d3dMesh;
+	ID3DXBuffer* adjBuffer;
+
+	if(SUCCEEDED(D3DXCreateTeapot(device, &d3dMesh, &adjBuffer)))
+	{
+		compareMesh("TeaPot", d3dMesh, adjBuffer);
+		d3d::Release<ID3DXMesh*>(d3dMesh);
+	}
+	else
+		TEST_CHECK(!"D3DXCreateTeapot");
+
+	if(SUCCEEDED(D3DXCreateCylinder(device, 0.5f, 0.5f, 2.0f, 20, 20, &d3dMesh, &adjBuffer)))
+	{
+		compareMesh("Cylinder", d3dMesh, adjBuffer);
+		d3d::Release<ID3DXMesh*>(d3dMesh);
+	}
+	else
+		TEST_CHECK(!"D3DXCreateCylinder");
+
+	if(SUCCEEDED(D3DXCreateBox(device, 1.0f, 1.0f, 1.0f, &d3dMesh, &adjBuffer)))
+	{
+		compareMesh("Box", d3dMesh, adjBuffer);
+		d3d::Release<ID3DXMesh*>(d3dMesh);
+	}
+	else
+		TEST_CHECK(!"D3DXCreateBox");
+
+	if(SUCCEEDED(D3DXCreateSphere(device, 1.0f, 20, 20, &d3dMesh, &adjBuffer)))
+	{
+		compareMesh("Sphere", d3dMesh, adjBuffer);
+		d3d::Release<ID3DXMesh*>(d3dMesh);
+	}
+	else
+		TEST_CHECK(!"D3DXCreateSphere");
+
+	if(SUCCEEDED(D3DXCreateTorus(device, 1.0f, 3.0f, 20, 20, &d3dMesh, &adjBuffer)))
+	{
+		compareMesh("Torus", d3dMesh, adjBuffer);
+		d3d::Release<ID3DXMesh*>(d3dMesh);
+	}
+	else
+		TEST_CHECK(!"D3DXCreateTorus");
+}
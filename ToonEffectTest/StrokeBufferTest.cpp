@@ -0,0 +1,242 @@
+//////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// File: StrokeBufferTest.cpp
+//
+// Author: Ren Yifei, yfren@cs.hku.hk
+//
+// Desc: Storage a StrokeBuffer makes, discards and writes over frames growing and shrinking,
+//		 for quads and instances, and the strokes packed into instances
+//
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "TestCommon.h"
+#include "StrokeBuffer.h"
+
+//One frame, and what the backend should have counted up to its end
+struct StrokeFrame
+{
+	int		strokeNum;		// locked
+	int		writtenNum;		// unlocked, the simplification may have written fewer
+
+	int		allocationNum;
+	int		discardNum;
+	int		drawOffset;
+	UINT	staticBytes;	// indices and corners written in this frame
+};
+
+//Quads of 4 EdgeVertex, 224 bytes a stroke: indices grow to at least 64 strokes and double,
+//vertex storage holds twice the frame or doubles, a frame not fitting behind the last one
+//starts over at the front with a discard
+static const StrokeFrame s_quadFrames[] =
+{
+	{    10,    10,  2, 1,     0,  64 * 6 * sizeof(WORD) },
+	{    10,    10,  2, 1,    10,  0 },
+	{    30,    30,  2, 1,    20,  0 },
+	{     0,     0,  2, 1,    50,  0 },		// still locks a stroke
+	{   100,   100,  4, 2,     0,  128 * 6 * sizeof(WORD) },
+	{   100,    60,  4, 2,   100,  0 },
+	{    40,    40,  4, 2,   160,  0 },		// ends right at the end of the storage
+	{   300,   300,  6, 3,     0,  300 * 6 * sizeof(WORD) },
+	{     5,     5,  6, 3,   300,  0 },
+	{     5,     5,  6, 3,   305,  0 },
+	{ 20000, 20000,  8, 4,     0,  20000 * 6 * sizeof(DWORD) },
+	{    10,    10,  8, 4, 20000,  0 },
+	{ 17000, 17000,  8, 4, 20010,  0 },
+	{  5000,  5000,  8, 5,     0,  0 },
+};
+
+//Instances of 40 bytes: the one quad's indices and corners go in once, the vertex storage grows
+//and gets discarded as for the quads
+static const StrokeFrame s_instanceFrames[] =
+{
+	{    10,    10,  3, 1,     0,  6 * sizeof(WORD) + 4 * sizeof(D3DXVECTOR2) },
+	{    10,    10,  3, 1,    10,  0 },
+	{    30,    30,  3, 1,    20,  0 },
+	{     0,     0,  3, 1,    50,  0 },
+	{   100,   100,  4, 2,     0,  0 },
+	{   100,    60,  4, 2,   100,  0 },
+	{    40,    40,  4, 2,   160,  0 },
+	{   300,   300,  5, 3,     0,  0 },
+	{     5,     5,  5, 3,   300,  0 },
+	{     5,     5,  5, 3,   305,  0 },
+	{ 20000, 20000,  6, 4,     0,  0 },
+	{    10,    10,  6, 4, 20000,  0 },
+	{ 17000, 17000,  6, 4, 20010,  0 },
+	{  5000,  5000,  6, 5,     0,  0 },
+};
+
+//Doubling stops at the most strokes 16 bit indices reach, as long as the frame fits in them
+static const StrokeFrame s_index16Frames[] =
+{
+	{ 10000, 10000,  2, 1,     0,  10000 * 6 * sizeof(WORD) },
+	{ 16000, 16000,  4, 2,     0,  16384 * 6 * sizeof(WORD) },
+};
+
+//Gives the bytes the backend counted
+static double runFrames(const StrokeFrame* frames, int frameNum, bool instanced, StrokeBuffer* buffer)
+{
+	MemoryStrokeBufferBackend* backend = new MemoryStrokeBufferBackend();
+
+	initStrokeBuffer(buffer, backend, instanced);
+
+	double bytesWritten = 0.0;
+
+	for(int f=0; f<frameNum; ++f)
+	{
+		const StrokeFrame& frame = frames[f];
+
+		UINT lockBytes = max(frame.strokeNum, 1) * buffer->strokeBytes;
+
+		char* strokes = (char*)lockStrokeBuffer(buffer, frame.strokeNum);
+
+		TEST_CHECK(strokes != NULL);
+
+		if(!strokes)
+			return backend->m_bytesWritten;
+
+		//All of the lock is there to write
+		memset(strokes, 0xAB, lockBytes);
+
+		unlockStrokeBuffer(buffer, frame.writtenNum);
+
+		bytesWritten += lockBytes + frame.staticBytes;
+
+		TEST_CHECK(backend->m_allocationNum == frame.allocationNum);
+		TEST_CHECK(backend->m_discardNum == frame.discardNum);
+		TEST_CHECK(backend->m_bytesWritten == bytesWritten);
+		TEST_CHECK(buffer->drawOffset == frame.drawOffset);
+		TEST_CHECK(buffer->writeOffset == frame.drawOffset + frame.writtenNum);
+		TEST_CHECK(buffer->writeOffset <= buffer->vertexSize);
+	}
+
+	return backend->m_bytesWritten;
+}
+
+static float randomFloat(float lowBound, float highBound)
+{
+	return lowBound + (highBound - lowBound) * rand() / RAND_MAX;
+}
+
+//Quads as the silhouette passes make them, the corners of an end alike but for their side
+static void buildQuads(EdgeVertex* quads, int strokeNum)
+{
+	memset(quads, 0, 4 * strokeNum * sizeof(EdgeVertex));
+
+	for(int i=0; i<strokeNum; ++i)
+	{
+		EdgeVertex* quad = quads + 4 * i;
+
+		for(int end=0; end<2; ++end)
+		{
+			D3DXVECTOR3 normal(randomFloat(-1.0f, 1.0f), randomFloat(-1.0f, 1.0f), randomFloat(-1.0f, 1.0f));
+			D3DXVec3Normalize(&normal, &normal);
+
+			D3DXVECTOR3 position(randomFloat(-50.0f, 50.0f), randomFloat(-50.0f, 50.0f), randomFloat(-50.0f, 50.0f));
+
+			float width = randomFloat(0.0f, 2.0f);
+			float alpha = randomFloat(0.0f, 1.0f);
+			float u = randomFloat(0.0f, 100.0f);
+
+			for(int side=0; side<2; ++side)
+			{
+				EdgeVertex& vertex = quad[2 * side + end];
+
+				vertex.position = position;
+				vertex.normal = normal;
+				vertex.silhouetteWidth.z = side ? width : -width;
+				vertex.silhouetteAlpha.x = alpha;
+				vertex.texCoord = D3DXVECTOR2(u, (float)side);
+			}
+		}
+	}
+}
+
+//What myOutlineInstanced.txt reads back of every instance: positions exact, normals and alphas
+//to 8 bits, widths and u to half floats
+static void checkInstances(const EdgeVertex* quads, const StrokeInstance* instances, int strokeNum)
+{
+	int mismatchNum = 0;
+
+	for(int i=0; i<strokeNum; ++i)
+	{
+		const EdgeVertex* quad = quads + 4 * i;
+		const StrokeInstance& instance = instances[i];
+
+		float width[2];
+		float texCoord[2];
+
+		D3DXFloat16To32Array(width, instance.width, 2);
+		D3DXFloat16To32Array(texCoord, instance.texCoord, 2);
+
+		for(int end=0; end<2; ++end)
+		{
+			const EdgeVertex& vertex = quad[end];
+
+			bool match = instance.position[end] == vertex.position;
+
+			const float packed[4] = { vertex.normal.x, vertex.normal.y, vertex.normal.z, vertex.silhouetteAlpha.x };
+
+			for(int k=0; k<4; ++k)
+			{
+				float unpacked = ((instance.normal[end] >> (8 * k)) & 0xFF) / 255.0f;
+
+				if(k < 3)
+					match = match && fabs(unpacked * 2.0f - 1.0f - packed[k]) <= 1.0f / 255.0f + 1e-6f;
+				else
+					match = match && fabs(unpacked - packed[k]) <= 0.5f / 255.0f + 1e-6f;
+			}
+
+			//11 bits of mantissa
+			match = match && fabs(width[end] - quad[2 + end].silhouetteWidth.z) <= fabs(quad[2 + end].silhouetteWidth.z) / 2048.0f;
+			match = match && fabs(texCoord[end] - vertex.texCoord.x) <= fabs(vertex.texCoord.x) / 2048.0f;
+
+			mismatchNum += match ? 0 : 1;
+		}
+	}
+
+	if(mismatchNum)
+		printf("%d stroke ends do not come back out of their instances\n", mismatchNum);
+
+	TEST_CHECK(mismatchNum == 0);
+}
+
+void testStrokeBuffer()
+{
+	StrokeBuffer buffer;
+
+	double quadBytes = runFrames(s_quadFrames, sizeof(s_quadFrames) / sizeof(StrokeFrame), false, &buffer);
+
+	TEST_CHECK(buffer.vertexSize == 40000);
+	TEST_CHECK(buffer.indexSize == 20000 && buffer.index32);
+
+	releaseStrokeBuffer(&buffer);
+
+	runFrames(s_index16Frames, sizeof(s_index16Frames) / sizeof(StrokeFrame), false, &buffer);
+
+	TEST_CHECK(buffer.vertexSize == 40000);
+	TEST_CHECK(buffer.indexSize == 16384 && !buffer.index32);
+
+	releaseStrokeBuffer(&buffer);
+
+	double instanceBytes = runFrames(s_instanceFrames, sizeof(s_instanceFrames) / sizeof(StrokeFrame), true, &buffer);
+
+	TEST_CHECK(buffer.strokeBytes == sizeof(StrokeInstance));
+	TEST_CHECK(buffer.indexSize == 1 && !buffer.index32);
+	TEST_CHECK(instanceBytes < quadBytes);
+
+	releaseStrokeBuffer(&buffer);
+
+	const int strokeNum = 1000;
+
+	EdgeVertex* quads = new EdgeVertex[4 * strokeNum];
+	StrokeInstance* instances = new StrokeInstance[strokeNum];
+
+	srand(25);
+
+	buildQuads(quads, strokeNum);
+	packStrokeInstances(quads, strokeNum, instances);
+	checkInstances(quads, instances, strokeNum);
+
+	delete [] quads;
+	delete [] instances;
+}
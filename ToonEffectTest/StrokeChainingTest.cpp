@@ -0,0 +1,120 @@
+//////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// File: StrokeChainingTest.cpp
+//
+// Author: Ren Yifei, yfren@cs.hku.hk
+//
+// Desc: chainStrokes against the serial walk, stroke for stroke, over random chains and loops
+//
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "TestCommon.h"
+#include "StrokeChaining.h"
+
+#include <vector>
+#include <algorithm>
+
+static int randomInt(int range)
+{
+	return rand() % range;
+}
+
+//Strokes in random order cut into chains of random length, every stroke entered by a random end
+//point, some of the chains closed to loops (a single stroke closed on itself too)
+static void buildLinks(int strokeNum, std::vector<int>& endPntPartner)
+{
+	endPntPartner.assign(2 * strokeNum, -1);
+
+	std::vector<int> strokes(strokeNum);
+
+	for(int i=0; i<strokeNum; ++i)
+		strokes[i] = i;
+
+	std::random_shuffle(strokes.begin(), strokes.end(), randomInt);
+
+	for(int first=0; first<strokeNum; )
+	{
+		int length = min(1 + randomInt(randomInt(4) == 0 ? 40 : 8), strokeNum - first);
+
+		std::vector<int> inEnd(length);
+
+		for(int k=0; k<length; ++k)
+			inEnd[k] = 2 * strokes[first + k] + randomInt(2);
+
+		for(int k=0; k+1<length; ++k)
+		{
+			int out = inEnd[k] ^ 1;
+
+			endPntPartner[out] = inEnd[k + 1];
+			endPntPartner[inEnd[k + 1]] = out;
+		}
+
+		if(randomInt(3) == 0)
+		{
+			int out = inEnd[length - 1] ^ 1;
+
+			endPntPartner[out] = inEnd[0];
+			endPntPartner[inEnd[0]] = out;
+		}
+
+		first += length;
+	}
+}
+
+void testStrokeChaining()
+{
+	const int strokeNums[] = { 0, 1, 2, 3, 17, 100, 1000, 20000 };
+
+	StrokeChains chains;
+	memset(&chains, 0, sizeof(StrokeChains));
+
+	srand(21);
+
+	//The sizes go up and down again, the scratch of the chains only ever grows
+	for(int round=0; round<3; ++round)
+	{
+		for(int n=0; n<8; ++n)
+		{
+			int strokeNum = strokeNums[round == 1 ? 7 - n : n];
+
+			std::vector<int> endPntPartner;
+			buildLinks(strokeNum, endPntPartner);
+
+			std::vector<SegmentGroup> group(strokeNum + 1), serialGroup(strokeNum + 1);
+			std::vector<SegmentGroupInfo> info(strokeNum + 1), serialInfo(strokeNum + 1);
+
+			const int* partner = strokeNum ? &endPntPartner[0] : NULL;
+
+			TEST_CHECK(chainStrokes(&chains, partner, strokeNum, &group[0], &info[0]));
+			chainStrokesSerial(partner, strokeNum, &serialGroup[0], &serialInfo[0]);
+
+			int groupNum = 0;
+			int strokeMismatchNum = 0;
+
+			for(int i=0; i<strokeNum; ++i)
+			{
+				groupNum = max(groupNum, serialGroup[i].groupIdx);
+
+				if(group[i].groupIdx != serialGroup[i].groupIdx || group[i].offsetIdx != serialGroup[i].offsetIdx)
+					++strokeMismatchNum;
+			}
+
+			int groupMismatchNum = 0;
+
+			for(int g=1; g<=groupNum; ++g)
+			{
+				if(info[g].total != serialInfo[g].total || info[g].minIdx != serialInfo[g].minIdx)
+					++groupMismatchNum;
+			}
+
+			if(strokeMismatchNum || groupMismatchNum)
+				printf("%d strokes: %d strokes and %d of %d groups differ from the serial walk\n",
+					   strokeNum, strokeMismatchNum, groupMismatchNum, groupNum);
+
+			TEST_CHECK(strokeMismatchNum == 0);
+			TEST_CHECK(groupMismatchNum == 0);
+		}
+	}
+
+	releaseStrokeChains(&chains);
+}
@@ -0,0 +1,17 @@
+#ifndef TEST_COMMON_H_
+#define TEST_COMMON_H_
+
+#include "StdHeader.h"
+
+//Counts the check and reports it when it fails, the test going on with the rest
+void testCheck(bool passed, const char* expression, const char* file, int line);
+
+#define TEST_CHECK(expression) testCheck((expression) != 0, #expression, __FILE__, __LINE__)
+
+//The tests, run in this order by TestMain.cpp
+void testSilhouetteClassifier(IDirect3DDevice9* device);
+void testStrokeChaining();
+void testStrokeBuffer();
+void testPipeline(IDirect3DDevice9* device);
+
+#endif
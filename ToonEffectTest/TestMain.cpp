@@ -0,0 +1,95 @@
+//////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// File: TestMain.cpp
+//
+// Author: Ren Yifei, yfren@cs.hku.hk
+//
+// Desc: Headless checks of the silhouette and stroke modules, the exit code being the number
+//		 of checks that failed
+//
+//////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "TestCommon.h"
+#include "d3dUtility.h"
+
+//The settings Main.cpp reads from config.ini, at their defaults
+bool  g_randomWiggling = false;
+bool  g_alphaTransition = true;
+bool  g_widthTransition = true;
+bool  g_useCPUBackend = false;
+bool  g_pipelineFrames = false;
+bool  g_useEdgeHierarchy = true;
+bool  g_incrementalSilhouette = false;
+int   g_fullRescanPeriod = 30;
+bool  g_sceneOcclusion = true;
+int   g_visibilityRefreshPeriod = 1;
+int   g_visibilityRetestLimit = 0;
+bool  g_topologyChaining = false;
+float g_strokeSimplifyPixels = 0.0f;
+float g_strokeMinPixels = 0.0f;
+float g_chainMinPixels = 0.0f;
+bool  g_instancedStrokes = false;
+
+static int s_checkNum = 0;
+static int s_failedNum = 0;
+
+void testCheck(bool passed, const char* expression, const char* file, int line)
+{
+	++s_checkNum;
+
+	if(!passed)
+	{
+		++s_failedNum;
+		printf("%s(%d): check failed: %s\n", file, line, expression);
+	}
+}
+
+//Reference rasterizer without a window of its own, enough for D3DX to build the sample meshes
+static IDirect3DDevice9* createNullDevice()
+{
+	IDirect3D9* d3d9 = Direct3DCreate9(D3D_SDK_VERSION);
+
+	if(!d3d9)
+		return NULL;
+
+	D3DPRESENT_PARAMETERS d3dpp;
+	::ZeroMemory(&d3dpp, sizeof(D3DPRESENT_PARAMETERS));
+
+	d3dpp.BackBufferWidth	= 1;
+	d3dpp.BackBufferHeight	= 1;
+	d3dpp.BackBufferFormat	= D3DFMT_UNKNOWN;
+	d3dpp.SwapEffect		= D3DSWAPEFFECT_DISCARD;
+	d3dpp.hDeviceWindow		= ::GetDesktopWindow();
+	d3dpp.Windowed			= true;
+
+	IDirect3DDevice9* device = NULL;
+
+	HRESULT hr = d3d9->CreateDevice(D3DADAPTER_DEFAULT, D3DDEVTYPE_NULLREF, d3dpp.hDeviceWindow,
+									D3DCREATE_SOFTWARE_VERTEXPROCESSING, &d3dpp, &device);
+
+	d3d9->Release();
+
+	return FAILED(hr) ? NULL : device;
+}
+
+int main()
+{
+	IDirect3DDevice9* device = createNullDevice();
+
+	TEST_CHECK(device != NULL);
+
+	if(device)
+		testSilhouetteClassifier(device);
+
+	testStrokeChaining();
+	testStrokeBuffer();
+
+	if(device)
+		testPipeline(device);
+
+	d3d::Release<IDirect3DDevice9*>(device);
+
+	printf("%d checks, %d failed\n", s_checkNum, s_failedNum);
+
+	return s_failedNum;
+}